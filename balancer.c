@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "balancer.h"
+#include "mempool.h"
+#include "util.h"
+
+#define RTT_UNKNOWN_US 1        //an address never connected to looks fast, it is tried and measured
+#define RTT_WEIGHT 4            //a new sample moves the average by a quarter of the difference
+#define RTT_HALF_LIFE_MS 10000  //an average not refreshed for that long counts half, so slow addresses get tried again
+
+// FNV-1a over the address bytes and the port
+static uint32_t hash_backend(const dns_addr *addr, in_port_t port) {
+    const unsigned char *p = addr->family == AF_INET6 ? (const unsigned char *) &addr->v6 :
+                             (const unsigned char *) &addr->v4;
+    size_t len = addr->family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+    return fnv1a32(fnv1a32(FNV1A_INIT, p, len), &port, sizeof(port));
+}
+
+static int same_addr(const dns_addr *a, const dns_addr *b) {
+    if (a->family != b->family) {
+        return 0;
+    }
+    return a->family == AF_INET6 ? memcmp(&a->v6, &b->v6, sizeof(struct in6_addr)) == 0 :
+           a->v4.s_addr == b->v4.s_addr;
+}
+
+static backend* find_backend(balancer *b, const dns_addr *addr, in_port_t port, uint32_t hash) {
+    for (backend *be = b->buckets[hash % BALANCER_BUCKETS]; be != NULL; be = be->next) {
+        if (be->hash == hash && be->port == port && same_addr(&be->addr, addr)) {
+            return be;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(balancer *b, backend *be) {
+    if (be->lru_prev != NULL) {
+        be->lru_prev->lru_next = be->lru_next;
+    } else {
+        b->lru_head = be->lru_next;
+    }
+    if (be->lru_next != NULL) {
+        be->lru_next->lru_prev = be->lru_prev;
+    } else {
+        b->lru_tail = be->lru_prev;
+    }
+}
+
+static void lru_push(balancer *b, backend *be) {
+    be->lru_prev = NULL;
+    be->lru_next = b->lru_head;
+    if (b->lru_head != NULL) {
+        b->lru_head->lru_prev = be;
+    } else {
+        b->lru_tail = be;
+    }
+    b->lru_head = be;
+}
+
+// drop the least recently used backend nobody holds, 0 if every one of them is held
+static int evict(balancer *b) {
+    backend *be = b->lru_tail;
+    while (be != NULL && be->load > 0) {
+        be = be->lru_prev;
+    }
+    if (be == NULL) {
+        return 0;
+    }
+    lru_unlink(b, be);
+    backend **link = &b->buckets[be->hash % BALANCER_BUCKETS];
+    while (*link != be) {
+        link = &(*link)->next;
+    }
+    *link = be->next;
+    free(be);
+    b->count--;
+    return 1;
+}
+
+balancer* create_balancer(balance_policy policy, int eject_failures, int eject_ms) {
+    balancer *b = (balancer *) mem_calloc(1, sizeof(balancer));
+    if (b == NULL) {
+        return NULL;
+    }
+    b->policy = policy;
+    b->eject_failures = eject_failures;
+    b->eject_ms = eject_ms;
+    b->seed = ((uint32_t) monotonic_us() ^ (uint32_t) getpid() ^ (uint32_t) (uintptr_t) b) | 1;
+    return b;
+}
+
+// xorshift, the picks only have to be spread
+static uint32_t next_random(balancer *b) {
+    b->seed ^= b->seed << 13;
+    b->seed ^= b->seed >> 17;
+    b->seed ^= b->seed << 5;
+    return b->seed;
+}
+
+// what picking be costs: how long a connect to it takes, times the load it carries already
+static int64_t cost(const backend *be, int64_t now_ms) {
+    if (be == NULL || be->rtt_us == 0) {
+        return RTT_UNKNOWN_US * (be != NULL ? be->load + 1 : 1);
+    }
+    int64_t halvings = (now_ms - be->sampled_ms) / RTT_HALF_LIFE_MS;
+    int64_t rtt = halvings < 62 ? be->rtt_us >> halvings : 0;
+    return (rtt > RTT_UNKNOWN_US ? rtt : RTT_UNKNOWN_US) * (be->load + 1);
+}
+
+int balancer_order(balancer *b, const dns_result *dns, in_port_t port, int64_t now_ms, unsigned char *order) {
+    int n = dns->naddrs;
+    const backend *found[DNS_MAX_ADDRS];
+    int64_t costs[DNS_MAX_ADDRS];
+    unsigned char healthy[DNS_MAX_ADDRS];
+    unsigned char ejected[DNS_MAX_ADDRS];
+    int num_healthy = 0;
+    int num_ejected = 0;
+    for (int i = 0; i < n; ++i) {
+        found[i] = find_backend(b, &dns->addrs[i], port, hash_backend(&dns->addrs[i], port));
+        costs[i] = cost(found[i], now_ms);
+        if (found[i] != NULL && found[i]->ejected_until_ms > now_ms) {
+            ejected[num_ejected++] = (unsigned char) i;
+        } else {
+            healthy[num_healthy++] = (unsigned char) i;
+        }
+    }
+    // healthy ones by cost, the few addresses of a host are sorted by insertion
+    for (int i = 1; i < num_healthy; ++i) {
+        unsigned char index = healthy[i];
+        int j = i;
+        for (; j > 0 && costs[healthy[j - 1]] > costs[index]; --j) {
+            healthy[j] = healthy[j - 1];
+        }
+        healthy[j] = index;
+    }
+    if (b->policy == BALANCE_P2C && num_healthy > 1) {
+        int first = (int) (next_random(b) % (uint32_t) num_healthy);
+        int second = (int) (next_random(b) % (uint32_t) (num_healthy - 1));
+        second += second >= first;
+        int pick = costs[healthy[first]] <= costs[healthy[second]] ? first : second;
+        unsigned char index = healthy[pick];
+        memmove(healthy + 1, healthy, (size_t) pick);
+        healthy[0] = index;
+    }
+
+    // the first one, then the cheapest left of the other family, and so on
+    int count = 0;
+    if (num_healthy > 0) {
+        order[count++] = healthy[0];
+        healthy[0] = DNS_MAX_ADDRS;
+    }
+    for (int left = num_healthy - 1; left > 0; --left) {
+        sa_family_t wanted = dns->addrs[order[count - 1]].family == AF_INET ? AF_INET6 : AF_INET;
+        int pick = -1;
+        for (int i = 1; i < num_healthy; ++i) {
+            if (healthy[i] == DNS_MAX_ADDRS) {
+                continue;
+            }
+            if (pick == -1) {
+                pick = i;
+            }
+            if (dns->addrs[healthy[i]].family == wanted) {
+                pick = i;
+                break;
+            }
+        }
+        order[count++] = healthy[pick];
+        healthy[pick] = DNS_MAX_ADDRS;
+    }
+    // ejected ones last, the ones back soonest first
+    for (int i = 1; i < num_ejected; ++i) {
+        unsigned char index = ejected[i];
+        int j = i;
+        for (; j > 0 && found[ejected[j - 1]]->ejected_until_ms > found[index]->ejected_until_ms; --j) {
+            ejected[j] = ejected[j - 1];
+        }
+        ejected[j] = index;
+    }
+    memcpy(order + count, ejected, (size_t) num_ejected);
+    return count + num_ejected;
+}
+
+backend* balancer_get(balancer *b, const dns_addr *addr, in_port_t port) {
+    uint32_t hash = hash_backend(addr, port);
+    backend *be = find_backend(b, addr, port, hash);
+    if (be != NULL) {
+        lru_unlink(b, be);
+        lru_push(b, be);
+        return be;
+    }
+    if (b->count >= BALANCER_MAX_BACKENDS && !evict(b)) {
+        return NULL;
+    }
+    if ((be = (backend *) mem_calloc(1, sizeof(backend))) == NULL) {
+        return NULL;
+    }
+    be->addr = *addr;
+    be->port = port;
+    be->hash = hash;
+    backend **bucket = &b->buckets[hash % BALANCER_BUCKETS];
+    be->next = *bucket;
+    *bucket = be;
+    lru_push(b, be);
+    b->count++;
+    return be;
+}
+
+static void add_sample(backend *be, int64_t rtt_us, int64_t now_ms) {
+    be->rtt_us = be->rtt_us == 0 ? rtt_us : be->rtt_us + (rtt_us - be->rtt_us) / RTT_WEIGHT;
+    if (be->rtt_us < 1) {
+        be->rtt_us = 1;
+    }
+    be->sampled_ms = now_ms;
+}
+
+void balancer_connected(balancer *b, backend *be, int64_t rtt_us, int64_t now_ms) {
+    (void) b;
+    add_sample(be, rtt_us, now_ms);
+    be->failures = 0;
+    be->ejected_until_ms = 0;
+}
+
+void balancer_outrun(balancer *b, backend *be, int64_t elapsed_us, int64_t now_ms) {
+    (void) b;
+    add_sample(be, elapsed_us, now_ms);
+}
+
+int balancer_failed(balancer *b, backend *be, int64_t now_ms) {
+    if (++be->failures < b->eject_failures || be->ejected_until_ms > now_ms) {
+        return 0;
+    }
+    // past the threshold every failure, the first one after a cooldown included, ejects it again
+    be->ejected_until_ms = now_ms + b->eject_ms;
+    return 1;
+}
+
+void destroy_balancer(balancer *b) {
+    if (b == NULL) {
+        return;
+    }
+    backend *be = b->lru_head;
+    while (be != NULL) {
+        backend *next = be->lru_next;
+        free(be);
+        be = next;
+    }
+    free(b);
+}
@@ -0,0 +1,112 @@
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "resolver.h"
+
+/**
+ * balancer.h
+ *
+ * Picks the order in which the addresses of a host are tried for a new
+ * upstream connection, from what earlier connects to them told.
+ *
+ * every address (with its port) that was connected to has a backend: a
+ * moving average of its connect time, which counts half for every 10 s it
+ * was not refreshed so a slow address gets another chance, the connects
+ * to it that failed in a row, and its load, the connects in flight and
+ * requests under way on the connections opened to it. a connect outrun
+ * by a later one to another address counts as taking the time it had
+ * been in flight. eject_failures failures in a row take an address out of
+ * rotation for eject_ms; it is tried again after that, and one more
+ * failure takes it out again. an address is only tried while ejected once
+ * every other one of the host failed too.
+ *
+ * the first address is the cheapest one, the connect time times the load
+ * plus one, or the cheaper of two picked at random (power of two choices,
+ * which spreads the load over equal addresses). the others follow from
+ * the cheapest, alternating the families, so a connect racing a stalled
+ * one goes to the other family first.
+ *
+ * each reactor owns one balancer and is the only thread touching it, so
+ * there is no locking. backends are kept in LRU order and the least
+ * recently used one without load makes room past BALANCER_MAX_BACKENDS.
+ */
+
+#define BALANCER_BUCKETS 1024
+#define BALANCER_MAX_BACKENDS 4096
+
+typedef enum balance_policy {
+    BALANCE_P2C,                //the cheaper of two random healthy addresses first
+    BALANCE_LATENCY             //the cheapest healthy address first
+} balance_policy;
+
+typedef struct backend {
+    dns_addr addr;
+    in_port_t port;
+    uint32_t hash;
+    int64_t rtt_us;             //moving average of the connect time, 0 before the first connect
+    int64_t sampled_ms;         //when it was last refreshed
+    int failures;               //connects that failed in a row
+    int64_t ejected_until_ms;   //out of rotation until then, 0 if it is not
+    int load;                   //connects in flight and requests on the connections opened to it
+    struct backend *next;       //bucket chain
+    struct backend *lru_prev;   //most recently used first
+    struct backend *lru_next;
+} backend;
+
+typedef struct balancer {
+    balance_policy policy;
+    int eject_failures;
+    int eject_ms;
+    backend *buckets[BALANCER_BUCKETS];
+    backend *lru_head;
+    backend *lru_tail;
+    int count;
+    uint32_t seed;              //of the random picks
+} balancer;
+
+/**
+ * create_balancer returns a balancer that knows no address yet, NULL on
+ * failure.
+ */
+balancer* create_balancer(balance_policy policy, int eject_failures, int eject_ms);
+
+/**
+ * balancer_order writes into order the indexes of the addresses of dns in
+ * the order they should be tried on port, and returns how many there are.
+ */
+int balancer_order(balancer *b, const dns_result *dns, in_port_t port, int64_t now_ms, unsigned char *order);
+
+/**
+ * balancer_get returns the backend of addr and port, created if it is
+ * new, NULL if there is no room. the caller counts its use in load, and
+ * a backend with load is never dropped.
+ */
+backend* balancer_get(balancer *b, const dns_addr *addr, in_port_t port);
+
+/**
+ * balancer_connected records a connect to be that took rtt_us, it is back
+ * in rotation if it was ejected.
+ */
+void balancer_connected(balancer *b, backend *be, int64_t rtt_us, int64_t now_ms);
+
+/**
+ * balancer_outrun records a connect to be that was still in flight after
+ * elapsed_us, when one started later succeeded: it counts as taking that
+ * long, so the address is no longer tried first.
+ */
+void balancer_outrun(balancer *b, backend *be, int64_t elapsed_us, int64_t now_ms);
+
+/**
+ * balancer_failed records a connect to be that failed or timed out.
+ * returns 1 if that took it out of rotation.
+ */
+int balancer_failed(balancer *b, backend *be, int64_t now_ms);
+
+/**
+ * destroy_balancer frees every backend and the balancer.
+ */
+void destroy_balancer(balancer *b);
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * http_parser_bench.c
+ *
+ * micro-benchmark of the incremental request parser against the scanning
+ * it replaced: strstr for the end of the head over the whole buffer after
+ * every read, then sscanf of the request line into malloc'd tokens and
+ * strstr for the Host header. requests of a few typical sizes are fed in
+ * reads of read-size bytes, as they would come off the socket.
+ *
+ *     gcc -O2 -I.. http_parser_bench.c ../http.c -o http_parser_bench
+ *     ./http_parser_bench [iterations] [read-size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "http.h"
+
+#define MAX_HOST_LEN 256
+
+static const char *small_request =
+    "GET http://example.com/ HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "\r\n";
+
+static const char *browser_request =
+    "GET http://www.example.com:8080/articles/2024/07/some-long-article-title?ref=front&page=2 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:126.0) Gecko/20100101 Firefox/126.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://www.example.com:8080/\r\n"
+    "DNT: 1\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n";
+
+typedef struct sample {
+    const char *name;
+    char *request;
+    size_t len;
+} sample;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * browser_request with a few kilobytes of cookies before the empty line
+ */
+static char *cookie_request(size_t *len) {
+    size_t base = strlen(browser_request) - 2;
+    char *request = malloc(base + 6000);
+    memcpy(request, browser_request, base);
+    size_t pos = base;
+    pos += sprintf(request + pos, "Cookie: ");
+    for (int i = 0; i < 60; ++i) {
+        pos += sprintf(request + pos, "session_%02d=%s; ", i, "0123456789abcdef0123456789abcdef0123456789abcdef");
+    }
+    pos += sprintf(request + pos, "last=1\r\n\r\n");
+    request[pos] = '\0';
+    *len = pos;
+    return request;
+}
+
+/**
+ * the previous path: the whole buffer is searched after every read
+ */
+static int old_check_request(const char *request) {
+    char *first_row_end = strstr(request, "\r\n");
+    if (!first_row_end) {
+        return 400;
+    }
+    size_t first_row_len = first_row_end - request;
+    char *first_row = malloc(first_row_len + 1);
+    memcpy(first_row, request, first_row_len);
+    first_row[first_row_len] = '\0';
+    char *method = malloc(10);
+    char *path = malloc(first_row_len + 1);
+    char *protocol = malloc(100);
+    method[0] = path[0] = protocol[0] = '\0';
+    sscanf(first_row, "%9s %s %99s", method, path, protocol);
+    int result = 1;
+    if (strlen(method) == 0 || strlen(path) == 0 || strlen(protocol) == 0) {
+        result = 400;
+    } else if (strcmp(protocol, "HTTP/1.0") != 0 && strcmp(protocol, "HTTP/1.1") != 0) {
+        result = 400;
+    } else if (strstr(request, "Host: ") == NULL) {
+        result = 400;
+    } else if (strcmp(method, "GET") != 0) {
+        result = 501;
+    }
+    free(first_row);
+    free(method);
+    free(path);
+    free(protocol);
+    return result;
+}
+
+static int old_extract_host(const char *request, char *host, size_t host_len, in_port_t *port) {
+    char *host_start = strstr(request, "Host: ");
+    if (host_start == NULL) {
+        return -1;
+    }
+    host_start += strlen("Host: ");
+    char *line_end = strstr(host_start, "\r\n");
+    if (line_end == NULL) {
+        return -1;
+    }
+    char *host_end = strstr(host_start, ":");
+    host_end = (host_end != NULL && host_end < line_end) ? host_end : line_end;
+    if ((size_t) (host_end - host_start) >= host_len || host_end == host_start) {
+        return -1;
+    }
+    memcpy(host, host_start, host_end - host_start);
+    host[host_end - host_start] = '\0';
+    *port = *host_end == ':' ? (in_port_t) strtoul(host_end + 1, NULL, 10) : 80;
+    return 0;
+}
+
+static int old_path(const sample *s, char *buf, size_t read_size) {
+    size_t len = 0;
+    while (len < s->len) {
+        size_t n = s->len - len < read_size ? s->len - len : read_size;
+        memcpy(buf + len, s->request + len, n);
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    char host[MAX_HOST_LEN];
+    in_port_t port;
+    if (old_check_request(buf) != 1 || old_extract_host(buf, host, sizeof(host), &port) == -1) {
+        return -1;
+    }
+    return port;
+}
+
+static int new_path(const sample *s, char *buf, size_t read_size) {
+    http_request req;
+    http_request_init(&req);
+    size_t len = 0;
+    long head_len = HTTP_PARSE_AGAIN;
+    while (len < s->len && head_len == HTTP_PARSE_AGAIN) {
+        size_t n = s->len - len < read_size ? s->len - len : read_size;
+        memcpy(buf + len, s->request + len, n);
+        len += n;
+        buf[len] = '\0';
+        head_len = http_parse_request(&req, buf, len);
+    }
+    if (head_len <= 0 || !http_span_is(buf, req.method, "GET")) {
+        return -1;
+    }
+    // what check_request and extract_host look at
+    char host[MAX_HOST_LEN];
+    const char *value = buf + req.authority.off;
+    size_t value_len = req.authority.len;
+    if (value_len == 0 && !http_request_header(&req, buf, "Host", &value, &value_len)) {
+        return -1;
+    }
+    const char *colon = memchr(value, ':', value_len);
+    size_t name_len = colon != NULL ? (size_t) (colon - value) : value_len;
+    if (name_len == 0 || name_len >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, value, name_len);
+    host[name_len] = '\0';
+    in_port_t port = 80;
+    if (colon != NULL) {
+        port = 0;
+        for (const char *d = colon + 1; d < value + value_len; ++d) {
+            port = port * 10 + (*d - '0');
+        }
+    }
+    return port;
+}
+
+static double run(int (*path)(const sample *, char *, size_t), const sample *s, char *buf,
+                  size_t read_size, long iterations) {
+    volatile int sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iterations; ++i) {
+        sink += path(s, buf, read_size);
+    }
+    (void) sink;
+    return (now_sec() - start) / iterations * 1e9;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    size_t read_size = argc > 2 ? (size_t) atol(argv[2]) : 1000;
+    if (iterations <= 0 || read_size == 0) {
+        fprintf(stderr, "usage: %s [iterations] [read-size]\n", argv[0]);
+        return 1;
+    }
+
+    sample samples[3] = {
+        {"small", (char *) small_request, strlen(small_request)},
+        {"browser", (char *) browser_request, strlen(browser_request)},
+        {"cookies", NULL, 0},
+    };
+    samples[2].request = cookie_request(&samples[2].len);
+    char *buf = malloc(samples[2].len + 1);
+
+    printf("%-8s %6s %8s %14s %14s\n", "request", "bytes", "headers", "old ns/req", "new ns/req");
+    for (int i = 0; i < 3; ++i) {
+        const sample *s = &samples[i];
+        if (old_path(s, buf, read_size) != new_path(s, buf, read_size)) {
+            fprintf(stderr, "%s: the two paths disagree\n", s->name);
+            return 1;
+        }
+        http_request req;
+        http_request_init(&req);
+        http_parse_request(&req, s->request, s->len);
+        double old_ns = run(old_path, s, buf, read_size, iterations);
+        double new_ns = run(new_path, s, buf, read_size, iterations);
+        printf("%-8s %6zu %8d %14.1f %14.1f\n", s->name, s->len, req.num_headers, old_ns, new_ns);
+    }
+    free(samples[2].request);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,454 @@
+/**
+ * loadgen.c
+ *
+ * load generator for the proxy. every connection sends a request for url
+ * through the proxy and waits for the whole response before it sends the
+ * next one (closed loop), for a number of seconds or of requests. reports
+ * the request rate, the latency percentiles and, given the pid of the
+ * proxy, the cpu time the proxy spent per request.
+ *
+ *     gcc -O2 -I.. loadgen.c ../http.c -o loadgen -lpthread
+ *     ./loadgen [-c connections] [-t threads] [-d seconds | -n requests] [-p proxy-pid] [-x] <[ip:]proxy-port> <url>
+ *
+ * -x sends every request on a new connection (Connection: close).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "http.h"
+
+#define LG_HEAD_MAX 16384
+#define LG_EVENTS 256
+
+typedef enum lg_state {
+    LG_CONNECTING,
+    LG_SENDING,
+    LG_READING
+} lg_state;
+
+typedef struct lg_conn {
+    int fd;
+    lg_state state;
+    size_t sent;                //bytes of the request sent
+    uint64_t started_us;
+    int in_body;                //0 while the head is read into head
+    http_response resp;
+    size_t head_len;
+    char head[LG_HEAD_MAX];
+} lg_conn;
+
+typedef struct lg_thread {
+    pthread_t thread;
+    int num_conns;
+    lg_conn *conns;
+    uint32_t *samples;          //latency of every completed request, in microseconds
+    size_t num_samples;
+    size_t cap_samples;
+    unsigned long long errors;
+    unsigned long long not_ok; //status 300 and above
+    unsigned long long bytes;
+} lg_thread;
+
+static struct sockaddr_in proxy_addr;
+static char request[2048];
+static size_t request_len;
+static int close_each;
+static uint64_t deadline_us;
+static atomic_llong budget;     //requests left to start with -n, else unlimited
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static int take_request(void) {
+    return atomic_fetch_sub_explicit(&budget, 1, memory_order_relaxed) > 0;
+}
+
+static int open_conn(int epoll_fd, lg_conn *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    c->state = LG_CONNECTING;
+    c->sent = 0;
+    c->head_len = 0;
+    c->in_body = 0;
+    c->started_us = now_us();
+    if (connect(c->fd, (struct sockaddr *) &proxy_addr, sizeof(proxy_addr)) == -1 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_conn(lg_conn *c) {
+    if (c->fd != -1) {
+        close(c->fd);    // also takes it out of the epoll set
+        c->fd = -1;
+    }
+}
+
+static void record(lg_thread *t, uint64_t us) {
+    if (t->num_samples == t->cap_samples) {
+        size_t cap = t->cap_samples == 0 ? 65536 : t->cap_samples * 2;
+        uint32_t *temp = (uint32_t *) realloc(t->samples, cap * sizeof(uint32_t));
+        if (temp == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        t->samples = temp;
+        t->cap_samples = cap;
+    }
+    t->samples[t->num_samples++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+}
+
+// starts the next request of c, on a new connection if needed. returns -1 once c is done
+static int next_request(int epoll_fd, lg_conn *c, int reconnect) {
+    if (!take_request()) {
+        close_conn(c);
+        return -1;
+    }
+    if (reconnect) {
+        close_conn(c);
+        // a refused connection is retried, it counts as an error each time
+        return open_conn(epoll_fd, c) == -1 ? -1 : 0;
+    }
+    c->state = LG_SENDING;
+    c->sent = 0;
+    c->head_len = 0;
+    c->in_body = 0;
+    c->started_us = now_us();
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+static void complete(lg_thread *t, lg_conn *c) {
+    record(t, now_us() - c->started_us);
+    if (c->resp.status >= 300) {
+        t->not_ok++;
+    }
+}
+
+// returns 1 when the response is complete, 0 if more is needed, -1 on error
+static int read_response(lg_thread *t, lg_conn *c, char *scratch, size_t scratch_len) {
+    char *into = c->in_body ? scratch : c->head + c->head_len;
+    size_t room = c->in_body ? scratch_len : sizeof(c->head) - c->head_len;
+    ssize_t got = recv(c->fd, into, room, 0);
+    if (got == -1) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    if (got == 0) {
+        return c->in_body && c->resp.body.mode == BODY_UNTIL_CLOSE ? 1 : -1;
+    }
+    t->bytes += got;
+    if (c->in_body) {
+        http_body_consume(&c->resp.body, scratch, got);
+        return c->resp.body.done;
+    }
+    c->head_len += got;
+    size_t head_end = http_head_end(c->head, c->head_len);
+    if (head_end == 0) {
+        return c->head_len == sizeof(c->head) ? -1 : 0;
+    }
+    if (http_parse_response(c->head, head_end, 0, &c->resp) == -1) {
+        return -1;
+    }
+    c->in_body = 1;
+    http_body_consume(&c->resp.body, c->head + head_end, c->head_len - head_end);
+    return c->resp.body.done;
+}
+
+static void* run_thread(void *arg) {
+    lg_thread *t = (lg_thread *) arg;
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    char scratch[65536];
+    int active = 0;
+    for (int i = 0; i < t->num_conns; ++i) {
+        t->conns[i].fd = -1;
+        if (!take_request()) {
+            break;
+        }
+        if (open_conn(epoll_fd, &t->conns[i]) == -1) {
+            t->errors++;
+            continue;
+        }
+        active++;
+    }
+    struct epoll_event events[LG_EVENTS];
+    while (active > 0 && now_us() < deadline_us) {
+        int n = epoll_wait(epoll_fd, events, LG_EVENTS, 100);
+        for (int i = 0; i < n; ++i) {
+            lg_conn *c = (lg_conn *) events[i].data.ptr;
+            int result = 0;
+            if (c->state == LG_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    result = -1;
+                } else {
+                    c->state = LG_SENDING;
+                }
+            }
+            if (result == 0 && c->state == LG_SENDING) {
+                ssize_t wrote = send(c->fd, request + c->sent, request_len - c->sent, MSG_NOSIGNAL);
+                if (wrote == -1) {
+                    result = errno == EAGAIN || errno == EINTR ? 0 : -1;
+                } else if ((c->sent += wrote) == request_len) {
+                    c->state = LG_READING;
+                    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+                }
+            } else if (result == 0 && c->state == LG_READING) {
+                result = read_response(t, c, scratch, sizeof(scratch));
+            }
+            if (result == 1) {
+                complete(t, c);
+            } else if (result == -1) {
+                t->errors++;
+            } else {
+                continue;
+            }
+            int reconnect = result == -1 || close_each || !c->resp.keep_alive;
+            if (next_request(epoll_fd, c, reconnect) == -1) {
+                active--;
+            }
+        }
+    }
+    for (int i = 0; i < t->num_conns; ++i) {
+        close_conn(&t->conns[i]);
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint32_t *sorted, size_t num, double p) {
+    if (num == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) (p * num + 0.999999);
+    return sorted[rank == 0 ? 0 : rank - 1] / 1000.0;
+}
+
+// utime + stime of a process in clock ticks, or -1
+static long long process_ticks(pid_t pid) {
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    size_t len = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+    // the command name may contain spaces, the fields are counted after its closing parenthesis
+    char *after = strrchr(stat, ')');
+    unsigned long utime, stime;
+    if (after == NULL || sscanf(after + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                                &utime, &stime) != 2) {
+        return -1;
+    }
+    return (long long) utime + (long long) stime;
+}
+
+static int parse_proxy(const char *spec) {
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *colon = strrchr(spec, ':');
+    if (colon != NULL) {
+        char ip[64];
+        size_t len = (size_t) (colon - spec);
+        if (len >= sizeof(ip)) {
+            return -1;
+        }
+        memcpy(ip, spec, len);
+        ip[len] = '\0';
+        if (inet_pton(AF_INET, ip, &proxy_addr.sin_addr) != 1) {
+            return -1;
+        }
+    }
+    unsigned long port = strtoul(colon != NULL ? colon + 1 : spec, NULL, 10);
+    if (port == 0 || port > 65535) {
+        return -1;
+    }
+    proxy_addr.sin_port = htons((in_port_t) port);
+    return 0;
+}
+
+static int build_request(const char *url) {
+    if (strncmp(url, "http://", 7) != 0) {
+        return -1;
+    }
+    const char *host = url + 7;
+    size_t host_len = strcspn(host, "/");
+    int len = snprintf(request, sizeof(request), "GET %s%s HTTP/1.1\r\nHost: %.*s\r\n%s\r\n", url,
+                       host[host_len] == '\0' ? "/" : "", (int) host_len, host,
+                       close_each ? "Connection: close\r\n" : "");
+    if (host_len == 0 || len < 0 || (size_t) len >= sizeof(request)) {
+        return -1;
+    }
+    request_len = (size_t) len;
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-c connections] [-t threads] [-d seconds | -n requests] [-p proxy-pid] [-x] "
+            "<[ip:]proxy-port> <url>\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int num_conns = 64;
+    int num_threads = 1;
+    double seconds = 10;
+    long long requests = -1;
+    pid_t proxy_pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:n:p:x")) != -1) {
+        switch (opt) {
+            case 'c':
+                num_conns = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atof(optarg);
+                break;
+            case 'n':
+                requests = atoll(optarg);
+                break;
+            case 'p':
+                proxy_pid = (pid_t) atoi(optarg);
+                break;
+            case 'x':
+                close_each = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || num_conns <= 0 || num_threads <= 0 || seconds <= 0 ||
+        parse_proxy(argv[optind]) == -1 || build_request(argv[optind + 1]) == -1) {
+        usage(argv[0]);
+    }
+    if (num_threads > num_conns) {
+        num_threads = num_conns;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // with -n the run ends when the requests are done, the time limit is only a safety net
+    atomic_init(&budget, requests >= 0 ? requests : LLONG_MAX);
+    lg_thread *threads = (lg_thread *) calloc(num_threads, sizeof(lg_thread));
+    if (threads == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        threads[i].num_conns = num_conns / num_threads + (i < num_conns % num_threads);
+        threads[i].conns = (lg_conn *) calloc(threads[i].num_conns, sizeof(lg_conn));
+        if (threads[i].conns == NULL) {
+            perror("calloc");
+            return EXIT_FAILURE;
+        }
+    }
+    long long ticks_before = proxy_pid != 0 ? process_ticks(proxy_pid) : -1;
+    struct rusage usage_before, usage_after;
+    getrusage(RUSAGE_SELF, &usage_before);
+    uint64_t start = now_us();
+    deadline_us = start + (requests >= 0 ? 3600 * 1000000ULL : (uint64_t) (seconds * 1e6));
+    for (int i = 0; i < num_threads; ++i) {
+        if (pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    long long ticks_after = proxy_pid != 0 ? process_ticks(proxy_pid) : -1;
+    getrusage(RUSAGE_SELF, &usage_after);
+
+    size_t num = 0;
+    unsigned long long errors = 0, not_ok = 0, bytes = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        num += threads[i].num_samples;
+        errors += threads[i].errors;
+        not_ok += threads[i].not_ok;
+        bytes += threads[i].bytes;
+    }
+    uint32_t *samples = (uint32_t *) malloc((num > 0 ? num : 1) * sizeof(uint32_t));
+    if (samples == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t at = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        memcpy(samples + at, threads[i].samples, threads[i].num_samples * sizeof(uint32_t));
+        at += threads[i].num_samples;
+        free(threads[i].samples);
+        free(threads[i].conns);
+    }
+    free(threads);
+    qsort(samples, num, sizeof(uint32_t), compare_samples);
+
+    printf("requests   %zu in %.2fs, %.1f req/s, %.1f MB/s\n", num, elapsed, num / elapsed,
+           bytes / elapsed / (1024 * 1024));
+    printf("latency    p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n", percentile_ms(samples, num, 0.5),
+           percentile_ms(samples, num, 0.99), percentile_ms(samples, num, 0.999),
+           num > 0 ? samples[num - 1] / 1000.0 : 0);
+    printf("errors     %llu, status >= 300: %llu\n", errors, not_ok);
+    if (ticks_before >= 0 && ticks_after >= 0 && num > 0) {
+        double cpu_us = (ticks_after - ticks_before) * 1e6 / sysconf(_SC_CLK_TCK);
+        printf("proxy cpu  %.1f us/request, %.0f%% of a cpu\n", cpu_us / num, cpu_us / 1e4 / elapsed);
+    } else if (proxy_pid != 0) {
+        printf("proxy cpu  unknown, no process %d\n", (int) proxy_pid);
+    }
+    double own_us = (usage_after.ru_utime.tv_sec - usage_before.ru_utime.tv_sec +
+                     usage_after.ru_stime.tv_sec - usage_before.ru_stime.tv_sec) * 1e6 +
+                    (usage_after.ru_utime.tv_usec - usage_before.ru_utime.tv_usec +
+                     usage_after.ru_stime.tv_usec - usage_before.ru_stime.tv_usec);
+    // close to 100% per thread means the numbers above measure the load generator, not the proxy
+    printf("loadgen    %.0f%% of a cpu over %d threads\n", own_us / 1e4 / elapsed, num_threads);
+    free(samples);
+    return errors > 0 ? 2 : 0;
+}
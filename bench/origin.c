@@ -0,0 +1,264 @@
+/**
+ * origin.c
+ *
+ * stand-in for the servers behind the proxy, so the load scenarios run
+ * offline and every run gets the same answers. the path of a request says
+ * what to send back:
+ *
+ *     /<size>[?delay=<ms>][&chunked=<chunk-size>][&max-age=<s>]
+ *
+ * size and chunk-size take a k or m suffix. the body is size bytes of 'x'
+ * with a Content-Length, or in chunks of chunk-size bytes. the response
+ * goes out delay ms after its request came in and may be cached for
+ * max-age seconds (no-store by default). connections are kept alive and
+ * each is served by a thread of its own, so a delay only holds its own
+ * connection.
+ *
+ *     gcc -O2 -I.. origin.c ../http.c -o origin -lpthread
+ *     ./origin <port>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "http.h"
+
+#define ORIGIN_REQUEST_MAX 16384
+#define ORIGIN_STACK (256 * 1024)
+
+static char filler[65536];
+
+typedef struct response_spec {
+    unsigned long long size;
+    unsigned long long chunk;   //0 for a Content-Length body
+    unsigned long delay_ms;
+    unsigned long max_age;      //0 for no-store
+} response_spec;
+
+static unsigned long long parse_size(const char *text, const char **end) {
+    char *stop;
+    unsigned long long value = strtoull(text, &stop, 10);
+    if (*stop == 'k' || *stop == 'K') {
+        value *= 1024;
+        ++stop;
+    } else if (*stop == 'm' || *stop == 'M') {
+        value *= 1024 * 1024;
+        ++stop;
+    }
+    *end = stop;
+    return value;
+}
+
+// the target is origin-form, or absolute-form when the origin is asked directly
+static int parse_target(const char *target, size_t len, response_spec *spec) {
+    const char *end = target + len;
+    if (len > 7 && strncmp(target, "http://", 7) == 0) {
+        target = memchr(target + 7, '/', len - 7);
+        if (target == NULL) {
+            return -1;
+        }
+    }
+    if (*target != '/' || target + 1 == end || target[1] < '0' || target[1] > '9') {
+        return -1;
+    }
+    memset(spec, 0, sizeof(response_spec));
+    const char *p;
+    spec->size = parse_size(target + 1, &p);
+    while (p < end && (*p == '?' || *p == '&')) {
+        ++p;
+        if (strncmp(p, "delay=", 6) == 0) {
+            spec->delay_ms = strtoul(p + 6, (char **) &p, 10);
+        } else if (strncmp(p, "chunked=", 8) == 0) {
+            spec->chunk = parse_size(p + 8, &p);
+        } else if (strncmp(p, "max-age=", 8) == 0) {
+            spec->max_age = strtoul(p + 8, (char **) &p, 10);
+        }
+        // an unknown parameter is skipped
+        while (p < end && *p != '&') {
+            ++p;
+        }
+    }
+    return p <= end ? 0 : -1;
+}
+
+static int send_all(int fd, const char *data, size_t len, int more) {
+    while (len > 0) {
+        ssize_t wrote = send(fd, data, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+static int send_filler(int fd, unsigned long long len, int more) {
+    while (len > 0) {
+        size_t part = len < sizeof(filler) ? (size_t) len : sizeof(filler);
+        len -= part;
+        if (send_all(fd, filler, part, more || len > 0) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int respond(int fd, const response_spec *spec, int head_only, int close_after) {
+    if (spec->delay_ms > 0) {
+        struct timespec delay = {spec->delay_ms / 1000, (long) (spec->delay_ms % 1000) * 1000000};
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+    }
+    char head[256];
+    char cache_control[32];
+    char framing[64];
+    if (spec->max_age > 0) {
+        snprintf(cache_control, sizeof(cache_control), "max-age=%lu", spec->max_age);
+    } else {
+        strcpy(cache_control, "no-store");
+    }
+    if (spec->chunk > 0) {
+        strcpy(framing, "Transfer-Encoding: chunked");
+    } else {
+        snprintf(framing, sizeof(framing), "Content-Length: %llu", spec->size);
+    }
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                            "Cache-Control: %s\r\n%s\r\n%s\r\n", cache_control, framing,
+                            close_after ? "Connection: close\r\n" : "");
+    if (head_only) {
+        return send_all(fd, head, head_len, 0);
+    }
+    if (spec->chunk == 0) {
+        return send_all(fd, head, head_len, spec->size > 0) == -1 ? -1 : send_filler(fd, spec->size, 0);
+    }
+    if (send_all(fd, head, head_len, 1) == -1) {
+        return -1;
+    }
+    for (unsigned long long left = spec->size; left > 0;) {
+        unsigned long long part = left < spec->chunk ? left : spec->chunk;
+        char line[32];
+        int line_len = snprintf(line, sizeof(line), "%llx\r\n", part);
+        left -= part;
+        if (send_all(fd, line, line_len, 1) == -1 || send_filler(fd, part, 1) == -1 ||
+            send_all(fd, "\r\n", 2, 1) == -1) {
+            return -1;
+        }
+    }
+    return send_all(fd, "0\r\n\r\n", 5, 0);
+}
+
+static void* serve(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    char buf[ORIGIN_REQUEST_MAX];
+    size_t len = 0;
+    while (1) {
+        size_t head_len;
+        while ((head_len = http_head_end(buf, len)) == 0) {
+            if (len == sizeof(buf)) {
+                goto done;
+            }
+            ssize_t got = recv(fd, buf + len, sizeof(buf) - len, 0);
+            if (got <= 0) {
+                if (got == -1 && errno == EINTR) {
+                    continue;
+                }
+                goto done;
+            }
+            len += got;
+        }
+        // request line: method, target, version
+        const char *space = memchr(buf, ' ', head_len);
+        const char *target = space == NULL ? NULL : space + 1;
+        const char *target_end = target == NULL ? NULL : memchr(target, ' ', head_len - (target - buf));
+        response_spec spec;
+        if (target_end == NULL || parse_target(target, target_end - target, &spec) == -1) {
+            static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            send_all(fd, bad, sizeof(bad) - 1, 0);
+            goto done;
+        }
+        const char *value;
+        size_t value_len;
+        int close_after = strncmp(target_end + 1, "HTTP/1.0", 8) == 0 ||
+                          (http_find_header(buf, head_len, "Connection", &value, &value_len) &&
+                           http_header_has_token(value, value_len, "close"));
+        // a request body is read and thrown away
+        unsigned long long skip = 0;
+        if (http_find_header(buf, head_len, "Content-Length", &value, &value_len)) {
+            skip = strtoull(value, NULL, 10);
+        }
+        if (respond(fd, &spec, strncmp(buf, "HEAD ", 5) == 0, close_after) == -1 || close_after) {
+            goto done;
+        }
+        len -= head_len;
+        memmove(buf, buf + head_len, len);
+        while (skip > 0) {
+            if (len > 0) {
+                size_t take = len < skip ? len : (size_t) skip;
+                skip -= take;
+                len -= take;
+                memmove(buf, buf + take, len);
+                continue;
+            }
+            ssize_t got = recv(fd, buf, sizeof(buf), 0);
+            if (got <= 0) {
+                goto done;
+            }
+            len = got;
+        }
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    memset(filler, 'x', sizeof(filler));
+    signal(SIGPIPE, SIG_IGN);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((in_port_t) strtoul(argv[1], NULL, 10));
+    int on = 1;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+        bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        perror("origin");
+        return EXIT_FAILURE;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, ORIGIN_STACK);
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                continue;
+            }
+            perror("accept");
+            return EXIT_FAILURE;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve, (void *) (intptr_t) fd) != 0) {
+            close(fd);
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#!/bin/bash
+# runs load scenarios through the proxy against the origin stand-in, all on
+# loopback and without any name lookup, so a run needs no network and two
+# runs on the same machine are comparable.
+#
+#     bench/run.sh [scenario...]        (default: all of them)
+#
+# scenarios:
+#   small     1 KB uncacheable responses, 64 keep-alive connections
+#   cached    1 KB responses served from the proxy cache
+#   large     64 MB downloads on 4 connections
+#   chunked   256 KB chunked responses, 32 connections
+#   slow      1 KB after 100 ms at the origin, 512 connections
+#   filter    small, with a 100000 entry filter (CIDRs, names, wildcards)
+#   churn     small, on a new connection for every request
+#
+# environment: DURATION seconds per scenario (default 10), REACTORS event
+# loops (default 1), POOL threads (default 4), LOADGEN_THREADS (default 2),
+# PROXY_FLAGS more options of the proxy, PROXY_PORT and ORIGIN_PORT
+# (default 18080 and 18081).
+set -eu
+cd "$(dirname "$0")/.."
+
+DURATION=${DURATION:-10}
+REACTORS=${REACTORS:-1}
+POOL=${POOL:-4}
+LOADGEN_THREADS=${LOADGEN_THREADS:-2}
+PROXY_FLAGS=${PROXY_FLAGS:-}
+PROXY_PORT=${PROXY_PORT:-18080}
+ORIGIN_PORT=${ORIGIN_PORT:-18081}
+ORIGIN=http://127.0.0.1:$ORIGIN_PORT
+
+make -s proxyServer bench/origin bench/loadgen
+
+work=$(mktemp -d)
+origin_pid=
+proxy_pid=
+cleanup() {
+    [ -n "$proxy_pid" ] && kill "$proxy_pid" 2>/dev/null
+    [ -n "$origin_pid" ] && kill "$origin_pid" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+: > "$work/hosts"
+: > "$work/empty.filter"
+awk 'BEGIN {
+    for (i = 0; i < 40000; i++) printf "10.%d.%d.0/24\n", int(i / 256), i % 256
+    for (i = 0; i < 30000; i++) printf "host%d.example.com\n", i
+    for (i = 0; i < 30000; i++) printf "*.zone%d.example.net\n", i
+}' > "$work/big.filter"
+
+wait_port() {
+    for _ in $(seq 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "nothing listens on port $1" >&2
+    exit 1
+}
+
+start_proxy() {
+    ./proxyServer --reactors="$REACTORS" --dns-server=127.0.0.1:9 --hosts-file="$work/hosts" $PROXY_FLAGS \
+        "$PROXY_PORT" "$POOL" 2000000000 "$1" > "$work/proxy.log" 2>&1 &
+    proxy_pid=$!
+    wait_port "$PROXY_PORT"
+}
+
+stop_proxy() {
+    kill "$proxy_pid" 2>/dev/null
+    wait "$proxy_pid" 2>/dev/null || true
+    proxy_pid=
+}
+
+# scenario filter connections loadgen-flags url
+run() {
+    local name=$1 filter=$2 conns=$3 flags=$4 url=$5
+    echo "== $name: $conns connections, $url"
+    start_proxy "$filter"
+    bench/loadgen -c "$conns" -t "$LOADGEN_THREADS" -d "$DURATION" -p "$proxy_pid" $flags "$PROXY_PORT" "$url" || true
+    stop_proxy
+    echo
+}
+
+scenario() {
+    case $1 in
+        small)   run small "$work/empty.filter" 64 "" "$ORIGIN/1k" ;;
+        cached)  run cached "$work/empty.filter" 64 "" "$ORIGIN/1k?max-age=3600" ;;
+        large)   run large "$work/empty.filter" 4 "" "$ORIGIN/64m" ;;
+        chunked) run chunked "$work/empty.filter" 32 "" "$ORIGIN/256k?chunked=16k" ;;
+        slow)    run slow "$work/empty.filter" 512 "" "$ORIGIN/1k?delay=100" ;;
+        filter)  run filter "$work/big.filter" 64 "" "$ORIGIN/1k" ;;
+        churn)   run churn "$work/empty.filter" 32 "-x" "$ORIGIN/1k" ;;
+        *)       echo "unknown scenario $1" >&2; exit 1 ;;
+    esac
+}
+
+bench/origin "$ORIGIN_PORT" &
+origin_pid=$!
+wait_port "$ORIGIN_PORT"
+
+echo "commit $(git rev-parse --short HEAD 2>/dev/null || echo unknown), $(nproc) cpus, $DURATION s per scenario," \
+     "$REACTORS reactors, $POOL pool threads${PROXY_FLAGS:+, $PROXY_FLAGS}"
+echo
+if [ $# -eq 0 ]; then
+    set -- small cached large chunked slow filter churn
+fi
+for name in "$@"; do
+    scenario "$name"
+done
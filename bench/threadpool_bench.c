@@ -0,0 +1,213 @@
+/**
+ * threadpool_bench.c
+ *
+ * micro-benchmark of the ring/work-stealing threadpool against the single
+ * mutex linked-list queue it replaced. producers dispatch tiny jobs as fast
+ * as they can and the time until every job ran is measured.
+ *
+ * with a pause, each producer waits that many µs between jobs, the way a
+ * reactor hands over a job per request, and the cpu time the process
+ * spent per job is reported too: the pool is mostly idle then, and what
+ * its workers burn polling for work is taken from the reactors.
+ *
+ *     gcc -O2 -I.. threadpool_bench.c ../threadpool.c ../metrics.c -o threadpool_bench -lpthread
+ *     ./threadpool_bench [threads] [producers] [jobs-per-producer] [pause-us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "threadpool.h"
+
+static atomic_long done;
+
+static int tiny_job(void *arg) {
+    (void) arg;
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * the previous queue: one mutex, a malloc'd node per job, unbounded list
+ */
+typedef struct mutex_work {
+    dispatch_fn routine;
+    void *arg;
+    struct mutex_work *next;
+} mutex_work;
+
+typedef struct mutex_pool {
+    int num_threads;
+    int qsize;
+    pthread_t *threads;
+    mutex_work *qhead;
+    mutex_work *qtail;
+    pthread_mutex_t qlock;
+    pthread_cond_t q_not_empty;
+    pthread_cond_t q_empty;
+    int shutdown;
+    int dont_accept;
+} mutex_pool;
+
+static void *mutex_do_work(void *p) {
+    mutex_pool *t_pool = (mutex_pool *) p;
+    while (1) {
+        pthread_mutex_lock(&t_pool->qlock);
+        while (t_pool->qsize == 0 && !t_pool->shutdown) {
+            pthread_cond_wait(&t_pool->q_not_empty, &t_pool->qlock);
+        }
+        if (t_pool->shutdown) {
+            pthread_mutex_unlock(&t_pool->qlock);
+            return NULL;
+        }
+        mutex_work *work = t_pool->qhead;
+        t_pool->qhead = work->next;
+        if (--t_pool->qsize == 0) {
+            t_pool->qtail = NULL;
+        }
+        pthread_mutex_unlock(&t_pool->qlock);
+
+        work->routine(work->arg);
+        free(work->arg);
+        free(work);
+
+        pthread_mutex_lock(&t_pool->qlock);
+        if (t_pool->dont_accept && t_pool->qsize == 0) {
+            pthread_cond_signal(&t_pool->q_empty);
+        }
+        pthread_mutex_unlock(&t_pool->qlock);
+    }
+}
+
+static mutex_pool *mutex_create(int num_threads) {
+    mutex_pool *t_pool = (mutex_pool *) calloc(1, sizeof(mutex_pool));
+    t_pool->num_threads = num_threads;
+    t_pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
+    pthread_mutex_init(&t_pool->qlock, NULL);
+    pthread_cond_init(&t_pool->q_not_empty, NULL);
+    pthread_cond_init(&t_pool->q_empty, NULL);
+    for (int i = 0; i < num_threads; ++i) {
+        pthread_create(t_pool->threads + i, NULL, mutex_do_work, t_pool);
+    }
+    return t_pool;
+}
+
+static void mutex_dispatch(mutex_pool *from_me, dispatch_fn routine, void *arg) {
+    pthread_mutex_lock(&from_me->qlock);
+    mutex_work *work = (mutex_work *) malloc(sizeof(mutex_work));
+    work->routine = routine;
+    work->arg = arg;
+    work->next = NULL;
+    if (from_me->qtail == NULL) {
+        from_me->qhead = from_me->qtail = work;
+    } else {
+        from_me->qtail->next = work;
+        from_me->qtail = work;
+    }
+    from_me->qsize++;
+    pthread_cond_signal(&from_me->q_not_empty);
+    pthread_mutex_unlock(&from_me->qlock);
+}
+
+static void mutex_destroy(mutex_pool *destroyme) {
+    pthread_mutex_lock(&destroyme->qlock);
+    destroyme->dont_accept = 1;
+    while (destroyme->qsize > 0) {
+        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
+    }
+    destroyme->shutdown = 1;
+    pthread_cond_broadcast(&destroyme->q_not_empty);
+    pthread_mutex_unlock(&destroyme->qlock);
+    for (int i = 0; i < destroyme->num_threads; ++i) {
+        pthread_join(destroyme->threads[i], NULL);
+    }
+    free(destroyme->threads);
+    free(destroyme);
+}
+
+typedef struct producer_arg {
+    int use_rings;
+    void *pool;
+    long jobs;
+    long pause_us;
+} producer_arg;
+
+static void *producer(void *p) {
+    producer_arg *arg = (producer_arg *) p;
+    struct timespec pause = {0, arg->pause_us * 1000};
+    for (long i = 0; i < arg->jobs; ++i) {
+        if (arg->pause_us > 0) {
+            nanosleep(&pause, NULL);
+        }
+        if (arg->use_rings) {
+            dispatch((threadpool *) arg->pool, tiny_job, NULL);
+        } else {
+            mutex_dispatch((mutex_pool *) arg->pool, tiny_job, NULL);
+        }
+    }
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// the wall time until every job ran, the cpu time of the process in *cpu
+static double run(int use_rings, int threads, int producers, long jobs, long pause_us, double *cpu) {
+    atomic_store(&done, 0);
+    void *pool = use_rings ? (void *) create_threadpool(threads) : (void *) mutex_create(threads);
+    pthread_t *tids = (pthread_t *) malloc(sizeof(pthread_t) * producers);
+    producer_arg arg = {use_rings, pool, jobs, pause_us};
+
+    double start = now_seconds();
+    double start_cpu = cpu_seconds();
+    for (int i = 0; i < producers; ++i) {
+        pthread_create(tids + i, NULL, producer, &arg);
+    }
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    if (use_rings) {
+        destroy_threadpool((threadpool *) pool);
+    } else {
+        mutex_destroy((mutex_pool *) pool);
+    }
+    double elapsed = now_seconds() - start;
+    *cpu = cpu_seconds() - start_cpu;
+
+    if (atomic_load(&done) != jobs * producers) {
+        fprintf(stderr, "lost jobs: %ld of %ld ran\n", atomic_load(&done), jobs * producers);
+        exit(EXIT_FAILURE);
+    }
+    free(tids);
+    return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int producers = argc > 2 ? atoi(argv[2]) : 2;
+    long jobs = argc > 3 ? atol(argv[3]) : 1000000;
+    long pause_us = argc > 4 ? atol(argv[4]) : 0;
+    long total = jobs * producers;
+
+    printf("%d workers, %d producers, %ld jobs, %ld us between jobs\n", threads, producers, total, pause_us);
+    double cpu;
+    double mutex_time = run(0, threads, producers, jobs, pause_us, &cpu);
+    printf("mutex queue:    %8.3f s  %12.0f jobs/s  %8.2f us cpu/job\n", mutex_time, total / mutex_time,
+           cpu * 1e6 / total);
+    double ring_time = run(1, threads, producers, jobs, pause_us, &cpu);
+    printf("rings+stealing: %8.3f s  %12.0f jobs/s  %8.2f us cpu/job\n", ring_time, total / ring_time,
+           cpu * 1e6 / total);
+    return 0;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "cache.h"
+#include "http.h"
+#include "util.h"
+
+static cache_shard* shard_of(cache *c, uint32_t hash) {
+    return &c->shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry** bucket_of(cache_shard *shard, uint32_t hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_SHARD_BUCKETS];
+}
+
+// what an entry costs against the budget
+static size_t entry_size(const cache_entry *e) {
+    return sizeof(cache_entry) + e->data_len + strlen(e->key) + 1;
+}
+
+static void free_entry(cache_entry *e) {
+    free(e->key);
+    free(e->data);
+    free(e->etag);
+    free(e->last_modified);
+    free(e);
+}
+
+void cache_release(cache_entry *e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        free_entry(e);
+    }
+}
+
+static void lru_unlink(cache_shard *shard, cache_entry *e) {
+    if (e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(cache_shard *shard, cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = e;
+    } else {
+        shard->lru_tail = e;
+    }
+    shard->lru_head = e;
+}
+
+// take an entry out of its shard and drop the reference of the cache, caller holds the shard lock
+static void remove_entry(cache_shard *shard, cache_entry *e) {
+    cache_entry **link = bucket_of(shard, e->hash);
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    lru_unlink(shard, e);
+    shard->size -= entry_size(e);
+    cache_release(e);
+}
+
+// caller holds the shard lock
+static cache_entry* find_entry(cache_shard *shard, const char *key, uint32_t hash) {
+    for (cache_entry *e = *bucket_of(shard, hash); e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+cache* create_cache(size_t budget, size_t max_object) {
+    cache *c = (cache *) calloc(1, sizeof(cache));
+    if (c == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        pthread_mutex_init(&c->shards[i].lock, NULL);
+    }
+    c->shard_budget = budget / CACHE_SHARDS;
+    // an object never takes more than a shard can hold
+    c->max_object = max_object < c->shard_budget ? max_object : c->shard_budget;
+    return c;
+}
+
+cache_entry* cache_lookup(cache *c, const char *key) {
+    uint32_t hash = fnv1a32_str(key);
+    cache_shard *shard = shard_of(c, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry *e = find_entry(shard, key, hash);
+    if (e != NULL) {
+        atomic_fetch_add(&e->refs, 1);
+        lru_unlink(shard, e);
+        lru_push(shard, e);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return e;
+}
+
+int cache_entry_fresh(cache_entry *e) {
+    return now_ms() < atomic_load(&e->expires_ms);
+}
+
+int cache_entry_age(cache_entry *e) {
+    return atomic_load(&e->initial_age) + (int) ((now_ms() - atomic_load(&e->stored_ms)) / 1000);
+}
+
+// "Sun, 06 Nov 1994 08:49:37 GMT", the only date format servers are supposed to send
+static time_t parse_http_date(const char *value, size_t len) {
+    char date[64];
+    struct tm tm;
+    if (len >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value, len);
+    date[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/**
+ * looks for a directive of a Cache-Control value. returns 1 if it is
+ * there, with its numeric argument in *arg (-1 if it has none or it is
+ * not a number), else 0.
+ */
+static int cache_directive(const char *value, size_t value_len, const char *name, long *arg) {
+    size_t name_len = strlen(name);
+    size_t i = 0;
+    while (i < value_len) {
+        while (i < value_len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < value_len && value[i] != ',') {
+            i++;
+        }
+        if (i - start >= name_len && strncasecmp(value + start, name, name_len) == 0 &&
+            (i - start == name_len || value[start + name_len] == '=' || value[start + name_len] == ' ')) {
+            *arg = -1;
+            const char *p = value + start + name_len;
+            if (p < value + i && *p == '=') {
+                p++;
+                if (p < value + i && *p == '"') {
+                    p++;
+                }
+                if (p < value + i && *p >= '0' && *p <= '9') {
+                    *arg = 0;
+                    while (p < value + i && *p >= '0' && *p <= '9' && *arg < 0x7fffffff / 10) {
+                        *arg = *arg * 10 + (*p++ - '0');
+                    }
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// freshness lifetime the head gives explicitly, in seconds, -1 if none
+static long explicit_lifetime(const char *head, size_t head_len, const char *cc, size_t cc_len) {
+    long seconds;
+    // a shared cache follows s-maxage before max-age
+    if (cc != NULL && cache_directive(cc, cc_len, "s-maxage", &seconds) && seconds >= 0) {
+        return seconds;
+    }
+    if (cc != NULL && cache_directive(cc, cc_len, "max-age", &seconds) && seconds >= 0) {
+        return seconds;
+    }
+    const char *value;
+    size_t value_len;
+    if (!http_find_header(head, head_len, "Expires", &value, &value_len)) {
+        return -1;
+    }
+    time_t expires = parse_http_date(value, value_len);
+    if (expires == -1) { // an invalid date, "0" in particular, means already expired
+        return 0;
+    }
+    time_t date = time(NULL);
+    if (http_find_header(head, head_len, "Date", &value, &value_len)) {
+        time_t server_date = parse_http_date(value, value_len);
+        date = server_date != -1 ? server_date : date;
+    }
+    return expires > date ? (long) (expires - date) : 0;
+}
+
+int cache_response_policy(const char *head, size_t head_len, int status, cache_policy *policy) {
+    // the statuses a cache may store without being told so explicitly
+    if (status != 200 && status != 203 && status != 300 && status != 301 && status != 404 && status != 410) {
+        return 0;
+    }
+    const char *value;
+    size_t value_len;
+    const char *cc = NULL;
+    size_t cc_len = 0;
+    long arg;
+    if (http_find_header(head, head_len, "Cache-Control", &value, &value_len)) {
+        cc = value;
+        cc_len = value_len;
+        if (cache_directive(cc, cc_len, "no-store", &arg) || cache_directive(cc, cc_len, "private", &arg)) {
+            return 0;
+        }
+    }
+    // a response that varies would need one entry per variant, and cookies belong to one client
+    if ((http_find_header(head, head_len, "Vary", &value, &value_len) && value_len > 0) ||
+        http_find_header(head, head_len, "Set-Cookie", &value, &value_len)) {
+        return 0;
+    }
+    memset(policy, 0, sizeof(cache_policy));
+    policy->has_validator = http_find_header(head, head_len, "ETag", &value, &value_len) ||
+                            http_find_header(head, head_len, "Last-Modified", &value, &value_len);
+    if (http_find_header(head, head_len, "Age", &value, &value_len)) {
+        policy->initial_age = (int) strtol(value, NULL, 10);
+        policy->initial_age = policy->initial_age < 0 ? 0 : policy->initial_age;
+    }
+    long lifetime = explicit_lifetime(head, head_len, cc, cc_len);
+    if (cc != NULL && cache_directive(cc, cc_len, "no-cache", &arg)) {
+        lifetime = 0;
+    }
+    if (lifetime <= policy->initial_age) {
+        lifetime = 0;
+    }
+    policy->lifetime_ms = (int64_t) lifetime * 1000;
+    // without a lifetime the entry is only worth keeping if it can be revalidated
+    return policy->lifetime_ms > 0 || policy->has_validator;
+}
+
+static char* copy_header(const char *head, size_t head_len, const char *name) {
+    const char *value;
+    size_t value_len;
+    if (!http_find_header(head, head_len, name, &value, &value_len)) {
+        return NULL;
+    }
+    return strndup(value, value_len);
+}
+
+static void set_freshness(cache_entry *e, int64_t lifetime_ms, int initial_age) {
+    int64_t now = now_ms();
+    atomic_store(&e->stored_ms, now);
+    atomic_store(&e->initial_age, initial_age);
+    atomic_store(&e->expires_ms, now + lifetime_ms - (int64_t) initial_age * 1000);
+}
+
+void cache_store(cache *c, const char *key, char *data, size_t head_len, size_t data_len,
+                 const cache_policy *policy, struct in_addr addr) {
+    if (data_len > c->max_object) {
+        free(data);
+        return;
+    }
+    cache_entry *e = (cache_entry *) calloc(1, sizeof(cache_entry));
+    if (e == NULL || (e->key = strdup(key)) == NULL) {
+        free(e);
+        free(data);
+        return;
+    }
+    e->hash = fnv1a32_str(key);
+    atomic_init(&e->refs, 1);
+    e->data = data;
+    e->head_len = head_len;
+    e->data_len = data_len;
+    e->etag = copy_header(data, head_len, "ETag");
+    e->last_modified = copy_header(data, head_len, "Last-Modified");
+    e->addr = addr;
+    e->lifetime_ms = policy->lifetime_ms;
+    set_freshness(e, policy->lifetime_ms, policy->initial_age);
+
+    cache_shard *shard = shard_of(c, e->hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry *old = find_entry(shard, key, e->hash);
+    if (old != NULL) {
+        remove_entry(shard, old);
+    }
+    // make room by evicting from the cold end
+    while (shard->lru_tail != NULL && shard->size + entry_size(e) > c->shard_budget) {
+        remove_entry(shard, shard->lru_tail);
+    }
+    cache_entry **bucket = bucket_of(shard, e->hash);
+    e->next = *bucket;
+    *bucket = e;
+    lru_push(shard, e);
+    shard->size += entry_size(e);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_refresh(cache_entry *e, const char *head, size_t head_len) {
+    // the 304 may come with a new lifetime, else the one of the stored response holds again
+    const char *cc = NULL;
+    size_t cc_len = 0;
+    long arg;
+    if (http_find_header(head, head_len, "Cache-Control", &cc, &cc_len) &&
+        cache_directive(cc, cc_len, "no-cache", &arg)) {
+        set_freshness(e, 0, 0);
+        return;
+    }
+    long lifetime = explicit_lifetime(head, head_len, cc, cc_len);
+    set_freshness(e, lifetime >= 0 ? (int64_t) lifetime * 1000 : e->lifetime_ms, 0);
+}
+
+void destroy_cache(cache *c) {
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        cache_shard *shard = &c->shards[i];
+        while (shard->lru_head != NULL) {
+            remove_entry(shard, shard->lru_head);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(c);
+}
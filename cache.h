@@ -0,0 +1,130 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+/**
+ * cache.h
+ *
+ * Shared in-memory cache of GET responses.
+ *
+ * responses are stored as they came from the server, minus the hop-by-hop
+ * headers, under "host:port/path". an entry is fresh for the lifetime the
+ * server gave it (Cache-Control max-age / s-maxage, or Expires); a stale
+ * entry with an ETag or a Last-Modified is revalidated with a conditional
+ * request instead of being fetched again.
+ *
+ * the entries are spread over shards, each with its own lock, hash table
+ * and LRU list, and every shard evicts its least recently used entries to
+ * stay within its part of the memory budget. an entry is reference counted:
+ * a connection serving it keeps it alive even if it is evicted or replaced
+ * meanwhile, so the lock is only held for the lookup itself.
+ */
+
+#define CACHE_SHARDS 16
+#define CACHE_SHARD_BUCKETS 1024
+
+typedef struct cache_entry {
+    char *key;
+    uint32_t hash;
+    atomic_int refs;            //one for the cache while linked, one per connection serving it
+
+    char *data;                 //head without its final empty line, then the body
+    size_t head_len;
+    size_t data_len;
+    char *etag;                 //validators for the revalidation, NULL if the server sent none
+    char *last_modified;
+    struct in_addr addr;        //address the response came from, checked against the filter on a hit
+
+    _Atomic int64_t stored_ms;  //monotonic time the response was stored or last revalidated
+    _Atomic int64_t expires_ms; //monotonic time it becomes stale
+    int64_t lifetime_ms;        //freshness given by the server, kept for a 304 that gives none
+    atomic_int initial_age;     //seconds, the Age of the response when it was stored
+
+    struct cache_entry *next;   //bucket chain
+    struct cache_entry *lru_prev;   //most recently used first
+    struct cache_entry *lru_next;
+} cache_entry;
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry *buckets[CACHE_SHARD_BUCKETS];
+    cache_entry *lru_head;
+    cache_entry *lru_tail;      //evicted first
+    size_t size;                //bytes of the entries linked in this shard
+} cache_shard;
+
+typedef struct cache {
+    cache_shard shards[CACHE_SHARDS];
+    size_t shard_budget;        //bytes each shard may hold
+    size_t max_object;          //bigger responses are not stored
+} cache;
+
+/**
+ * what cache_response_policy found in a response head
+ */
+typedef struct cache_policy {
+    int64_t lifetime_ms;        //freshness, 0 when every use has to be revalidated
+    int initial_age;            //seconds, from the Age header
+    int has_validator;          //1 if the head has an ETag or a Last-Modified
+} cache_policy;
+
+/**
+ * create_cache returns an empty cache holding at most budget bytes, in
+ * responses of at most max_object bytes. returns NULL on failure.
+ */
+cache* create_cache(size_t budget, size_t max_object);
+
+/**
+ * cache_lookup returns the entry stored under key, with a reference the
+ * caller gives back with cache_release, or NULL if there is none. the
+ * entry may be stale, see cache_entry_fresh.
+ */
+cache_entry* cache_lookup(cache *c, const char *key);
+
+/**
+ * cache_entry_fresh returns 1 if the entry can be served without asking
+ * the server.
+ */
+int cache_entry_fresh(cache_entry *e);
+
+/**
+ * cache_entry_age returns the Age, in seconds, to send with the entry.
+ */
+int cache_entry_age(cache_entry *e);
+
+void cache_release(cache_entry *e);
+
+/**
+ * cache_response_policy decides whether a response to a GET may be stored
+ * in a shared cache: a cacheable status, no no-store, private, Vary or
+ * Set-Cookie, and either an explicit freshness or a validator. returns 1
+ * and fills policy if it may, else 0.
+ */
+int cache_response_policy(const char *head, size_t head_len, int status, cache_policy *policy);
+
+/**
+ * cache_store stores a response under key, replacing the entry that was
+ * there. data holds the head, without its final empty line, followed by the
+ * body; the cache takes ownership of it and frees it if it is not stored.
+ */
+void cache_store(cache *c, const char *key, char *data, size_t head_len, size_t data_len,
+                 const cache_policy *policy, struct in_addr addr);
+
+/**
+ * cache_refresh makes an entry fresh again after the server answered 304
+ * to its revalidation. head is the head of the 304.
+ */
+void cache_refresh(cache_entry *e, const char *head, size_t head_len);
+
+/**
+ * destroy_cache frees every entry. entries still referenced by a
+ * connection must not exist anymore.
+ */
+void destroy_cache(cache *c);
+
+#endif
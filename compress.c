@@ -0,0 +1,200 @@
+#include <string.h>
+#include <strings.h>
+#include "compress.h"
+
+#define GZIP_WINDOW_BITS (15 + 16)  //32 KB window, +16 asks zlib for the gzip wrapper
+#define GZIP_MEM_LEVEL 8
+#define BROTLI_WINDOW_BITS 18       //256 KB window
+#define BROTLI_MAX_QUALITY 11
+
+unsigned int compress_available(void) {
+#ifdef HAVE_BROTLI
+    return CODING_BIT(CODING_GZIP) | CODING_BIT(CODING_BR);
+#else
+    return CODING_BIT(CODING_GZIP);
+#endif
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// the q-value of a list element's parameters, 1000 for 1.0, 1000 too if there is none
+static int parse_q(const char *p, const char *end) {
+    while (p < end) {
+        while (p < end && (is_space(*p) || *p == ';')) {
+            p++;
+        }
+        if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+            p += 2;
+            int q = 0;
+            int scale = 1000;
+            if (p < end && *p == '1') {
+                return 1000;
+            }
+            if (p < end && *p == '0') {
+                p++;
+            }
+            if (p < end && *p == '.') {
+                for (p++; p < end && *p >= '0' && *p <= '9' && scale > 1; p++) {
+                    scale /= 10;
+                    q += (*p - '0') * scale;
+                }
+            }
+            return q;
+        }
+        while (p < end && *p != ';') {
+            p++;
+        }
+    }
+    return 1000;
+}
+
+content_coding compress_accepted(const char *value, size_t len, unsigned int enabled) {
+    int gzip_q = -1;
+    int br_q = -1;
+    int any_q = -1;
+    const char *end = value + len;
+    const char *p = value;
+    while (p < end) {
+        while (p < end && (is_space(*p) || *p == ',')) {
+            p++;
+        }
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && !is_space(*p)) {
+            p++;
+        }
+        size_t name_len = (size_t) (p - name);
+        const char *params = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        int q = parse_q(params, p);
+        if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (name_len == 2 && strncasecmp(name, "br", 2) == 0) {
+            br_q = q;
+        } else if (name_len == 1 && *name == '*') {
+            any_q = q;
+        }
+    }
+    // a coding not named is accepted as much as "*" says
+    if (gzip_q == -1) {
+        gzip_q = any_q;
+    }
+    if (br_q == -1) {
+        br_q = any_q;
+    }
+    if (!(enabled & CODING_BIT(CODING_GZIP))) {
+        gzip_q = 0;
+    }
+    if (!(enabled & CODING_BIT(CODING_BR))) {
+        br_q = 0;
+    }
+    if (br_q > 0 && br_q >= gzip_q) {
+        return CODING_BR;
+    }
+    return gzip_q > 0 ? CODING_GZIP : CODING_IDENTITY;
+}
+
+int compress_type(const char *value, size_t len) {
+    static const char *const types[] = {
+            "application/json", "application/javascript", "application/x-javascript",
+            "application/xml", "application/xhtml+xml", "image/svg+xml"
+    };
+    size_t type_len = 0;
+    while (type_len < len && value[type_len] != ';' && !is_space(value[type_len])) {
+        type_len++;
+    }
+    if (type_len >= 5 && strncasecmp(value, "text/", 5) == 0) {
+        // an event stream is read as it comes, an encoder would hold its events back
+        return !(type_len == 17 && strncasecmp(value, "text/event-stream", 17) == 0);
+    }
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (type_len == strlen(types[i]) && strncasecmp(value, types[i], type_len) == 0) {
+            return 1;
+        }
+    }
+    // application/ld+json, application/rss+xml and the like
+    return (type_len > 5 && strncasecmp(value + type_len - 5, "+json", 5) == 0) ||
+           (type_len > 4 && strncasecmp(value + type_len - 4, "+xml", 4) == 0);
+}
+
+int encoder_init(encoder *e, content_coding coding, int level, size_t size_hint) {
+    memset(e, 0, sizeof(encoder));
+    e->coding = coding;
+#ifdef HAVE_BROTLI
+    if (coding == CODING_BR) {
+        if ((e->br = BrotliEncoderCreateInstance(NULL, NULL, NULL)) == NULL) {
+            return -1;
+        }
+        BrotliEncoderSetParameter(e->br, BROTLI_PARAM_QUALITY,
+                                  (uint32_t) (level < BROTLI_MAX_QUALITY ? level : BROTLI_MAX_QUALITY));
+        BrotliEncoderSetParameter(e->br, BROTLI_PARAM_LGWIN, BROTLI_WINDOW_BITS);
+        BrotliEncoderSetParameter(e->br, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+        if (size_hint > 0 && size_hint < (1u << 30)) {
+            BrotliEncoderSetParameter(e->br, BROTLI_PARAM_SIZE_HINT, (uint32_t) size_hint);
+        }
+        return 0;
+    }
+#else
+    (void) size_hint;
+#endif
+    if (coding != CODING_GZIP) {
+        return -1;
+    }
+    return deflateInit2(&e->z, level < Z_BEST_COMPRESSION ? level : Z_BEST_COMPRESSION, Z_DEFLATED,
+                        GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+int encoder_run(encoder *e, const char *in, size_t len, int finish, char *out, size_t out_cap,
+                size_t *in_used, size_t *out_len) {
+#ifdef HAVE_BROTLI
+    if (e->coding == CODING_BR) {
+        size_t avail_in = len;
+        size_t avail_out = out_cap;
+        const uint8_t *next_in = (const uint8_t *) in;
+        uint8_t *next_out = (uint8_t *) out;
+        if (!BrotliEncoderCompressStream(e->br, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                         &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+            return -1;
+        }
+        *in_used = len - avail_in;
+        *out_len = out_cap - avail_out;
+        if (finish) {
+            return BrotliEncoderIsFinished(e->br) ? 0 : 1;
+        }
+        return avail_in > 0 || BrotliEncoderHasMoreOutput(e->br) ? 1 : 0;
+    }
+#endif
+    e->z.next_in = (Bytef *) in;
+    e->z.avail_in = (uInt) len;
+    e->z.next_out = (Bytef *) out;
+    e->z.avail_out = (uInt) out_cap;
+    int ret = deflate(&e->z, finish ? Z_FINISH : Z_NO_FLUSH);
+    *in_used = len - e->z.avail_in;
+    *out_len = out_cap - e->z.avail_out;
+    // Z_BUF_ERROR only says that no progress was possible, the next call goes on
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        return -1;
+    }
+    if (finish) {
+        return ret == Z_STREAM_END ? 0 : 1;
+    }
+    // a full output may hold back more of what was already taken
+    return e->z.avail_in > 0 || e->z.avail_out == 0 ? 1 : 0;
+}
+
+void encoder_end(encoder *e) {
+#ifdef HAVE_BROTLI
+    if (e->coding == CODING_BR) {
+        BrotliEncoderDestroyInstance(e->br);
+        e->br = NULL;
+        return;
+    }
+#endif
+    if (e->coding == CODING_GZIP) {
+        deflateEnd(&e->z);
+    }
+}
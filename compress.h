@@ -0,0 +1,83 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+/**
+ * compress.h
+ *
+ * Content codings the proxy applies to the responses it relays: which one
+ * a client accepts, which responses are worth compressing, and a
+ * streaming encoder that is fed the body as it is read, so a response of
+ * any size only holds the state of its encoder (a 32 KB window and the
+ * match tables for gzip, a 256 KB window for brotli).
+ *
+ * gzip comes with zlib. brotli is built in with HAVE_BROTLI (make
+ * BROTLI=1), without it a request for br is answered with gzip.
+ */
+
+typedef enum content_coding {
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_BR
+} content_coding;
+
+#define CODING_BIT(coding) (1u << (coding))
+
+typedef struct encoder {
+    content_coding coding;
+    z_stream z;
+#ifdef HAVE_BROTLI
+    BrotliEncoderState *br;
+#endif
+} encoder;
+
+/**
+ * compress_available returns the codings this build can produce, as
+ * CODING_BIT flags.
+ */
+unsigned int compress_available(void);
+
+/**
+ * compress_accepted picks the coding of a response from the value of the
+ * Accept-Encoding header of its request, among the enabled ones (CODING_BIT
+ * flags): the one with the highest q-value, br before gzip on a tie.
+ * returns CODING_IDENTITY if the client accepts none of them.
+ */
+content_coding compress_accepted(const char *value, size_t len, unsigned int enabled);
+
+/**
+ * compress_type returns 1 if a response with this Content-Type value is
+ * text that compresses well: the text types but event streams, JSON,
+ * JavaScript, XML and SVG.
+ */
+int compress_type(const char *value, size_t len);
+
+/**
+ * encoder_init starts a stream of coding at level (1 to 9, 11 at most for
+ * brotli). size_hint is the length of the body, 0 if it is not known.
+ * returns 0, or -1 if the encoder could not be set up.
+ */
+int encoder_init(encoder *e, content_coding coding, int level, size_t size_hint);
+
+/**
+ * encoder_run compresses what it can of the len bytes of in into out_cap
+ * bytes of out. finish is 1 once in holds the last of the body, the
+ * stream is then ended. stores in *in_used the bytes of in it took and in
+ * *out_len the bytes it wrote. returns 1 if it has more to write, to be
+ * called again with the rest of in and room in out, 0 once it took all of
+ * in (and ended the stream if finish), -1 on failure.
+ */
+int encoder_run(encoder *e, const char *in, size_t len, int finish, char *out, size_t out_cap,
+                size_t *in_used, size_t *out_len);
+
+/**
+ * encoder_end frees the state of the stream.
+ */
+void encoder_end(encoder *e);
+
+#endif
@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "disk_cache.h"
+#include "util.h"
+
+#define DISK_RECORD_MAGIC 0x32435250u   //"PRC2"
+#define DISK_INDEX_MAGIC 0x32495250u    //"PRI2"
+#define DISK_INDEX_NAME "index"
+
+/**
+ * what precedes every response in a segment, followed by the key, the head
+ * and the body, padded to 8 bytes
+ */
+typedef struct disk_record {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t head_len;
+    uint32_t addr;
+    uint64_t body_len;
+    int64_t stored_ms;          //wall clock, the record has to make sense after a restart
+    int64_t expires_ms;
+    uint32_t flags;
+    uint32_t data_checksum;     //of the head and the body
+    uint32_t checksum;          //of the fields above and the key
+    uint32_t pad;
+} disk_record;
+
+typedef struct index_header {
+    uint32_t magic;
+    uint32_t num_segments;
+    uint64_t num_entries;
+    uint32_t checksum;          //of everything after the header
+    uint32_t pad;
+} index_header;
+
+typedef struct index_segment {
+    uint32_t id;
+    uint32_t pad;
+    uint64_t end;
+} index_segment;
+
+typedef struct index_entry {
+    uint32_t seg_id;
+    uint32_t hash;
+    uint64_t off;
+} index_entry;
+
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_key(const char *key, size_t len) {
+    return fnv1a32(FNV1A_INIT, key, len);
+}
+
+static uint32_t record_checksum(const disk_record *rec, const char *key) {
+    return fnv1a32(fnv1a32(FNV1A_INIT, rec, offsetof(disk_record, checksum)), key, rec->key_len);
+}
+
+// the head and the body match their checksum, a record cut short by a crash does not
+static int record_intact(const disk_record *rec) {
+    const char *data = (const char *) (rec + 1) + rec->key_len;
+    return rec->data_checksum == fnv1a32(FNV1A_INIT, data, rec->head_len + rec->body_len);
+}
+
+static size_t record_size(const disk_record *rec) {
+    size_t size = sizeof(disk_record) + rec->key_len + rec->head_len + rec->body_len;
+    return (size + 7) & ~(size_t) 7;
+}
+
+// the record at off if its header and key are intact, else NULL
+static const disk_record* record_at(const disk_segment *seg, size_t off) {
+    if (off + sizeof(disk_record) > DISK_SEGMENT_SIZE) {
+        return NULL;
+    }
+    const disk_record *rec = (const disk_record *) (seg->map + off);
+    if (rec->magic != DISK_RECORD_MAGIC || rec->body_len > DISK_SEGMENT_SIZE ||
+        off + record_size(rec) > DISK_SEGMENT_SIZE ||
+        rec->checksum != record_checksum(rec, (const char *) (rec + 1))) {
+        return NULL;
+    }
+    return rec;
+}
+
+static char* segment_path(const disk_cache *dc, uint32_t id, char *path, size_t len) {
+    snprintf(path, len, "%s/%08x.seg", dc->dir, id);
+    return path;
+}
+
+static disk_segment* open_segment(disk_cache *dc, uint32_t id) {
+    char path[4096];
+    disk_segment *seg = (disk_segment *) calloc(1, sizeof(disk_segment));
+    if (seg == NULL) {
+        return NULL;
+    }
+    seg->id = id;
+    seg->refs = 1;
+    if ((seg->fd = open(segment_path(dc, id, path, sizeof(path)), O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        perror("open");
+        free(seg);
+        return NULL;
+    }
+    // sparse, only the records written take space
+    struct stat st;
+    if (fstat(seg->fd, &st) == -1 || (st.st_size != DISK_SEGMENT_SIZE && ftruncate(seg->fd, DISK_SEGMENT_SIZE) == -1)) {
+        perror("ftruncate");
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    if ((seg->map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, seg->fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+static void put_segment(disk_segment *seg) {
+    if (--seg->refs == 0) {
+        munmap(seg->map, DISK_SEGMENT_SIZE);
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+static void append_segment(disk_cache *dc, disk_segment *seg) {
+    seg->next = NULL;
+    if (dc->newest != NULL) {
+        dc->newest->next = seg;
+    } else {
+        dc->oldest = seg;
+    }
+    dc->newest = seg;
+    dc->num_segments++;
+}
+
+static disk_segment* find_segment(disk_cache *dc, uint32_t id) {
+    for (disk_segment *seg = dc->oldest; seg != NULL; seg = seg->next) {
+        if (seg->id == id) {
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+// unlink an entry from its bucket and its segment, caller holds the lock
+static void remove_entry(disk_cache *dc, disk_entry *e) {
+    disk_entry **link = &dc->buckets[e->hash % DISK_BUCKETS];
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    link = &e->seg->entries;
+    while (*link != e) {
+        link = &(*link)->seg_next;
+    }
+    *link = e->seg_next;
+    dc->count--;
+    free(e);
+}
+
+// caller holds the lock. entries loaded from the index are checked here, when first used
+static disk_entry* find_entry(disk_cache *dc, const char *key, size_t key_len, uint32_t hash) {
+    for (disk_entry *e = dc->buckets[hash % DISK_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash != hash) {
+            continue;
+        }
+        const disk_record *rec = record_at(e->seg, e->off);
+        if (rec != NULL && rec->key_len == key_len && memcmp(rec + 1, key, key_len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// index the record at off, it replaces an older response under the same key. caller holds the lock
+static void index_record(disk_cache *dc, disk_segment *seg, size_t off, uint32_t hash, const char *key, size_t key_len) {
+    disk_entry *old = key != NULL ? find_entry(dc, key, key_len, hash) : NULL;
+    if (old != NULL) {
+        remove_entry(dc, old);
+    }
+    disk_entry *e = (disk_entry *) malloc(sizeof(disk_entry));
+    if (e == NULL) {
+        return;
+    }
+    e->hash = hash;
+    e->seg = seg;
+    e->off = off;
+    e->next = dc->buckets[hash % DISK_BUCKETS];
+    dc->buckets[hash % DISK_BUCKETS] = e;
+    e->seg_next = seg->entries;
+    seg->entries = e;
+    dc->count++;
+}
+
+// drop the oldest segment and its entries, the file goes once no connection sends from it
+static void drop_oldest(disk_cache *dc) {
+    disk_segment *seg = dc->oldest;
+    char path[4096];
+    while (seg->entries != NULL) {
+        remove_entry(dc, seg->entries);
+    }
+    dc->oldest = seg->next;
+    if (dc->oldest == NULL) {
+        dc->newest = NULL;
+    }
+    dc->num_segments--;
+    unlink(segment_path(dc, seg->id, path, sizeof(path)));
+    put_segment(seg);
+}
+
+/**
+ * flush the records of the newest segment to the disk, before an index
+ * listing them is written: the index is trusted without reading the
+ * records, only those appended after it are checked in full. the older
+ * segments were flushed when they filled up. caller holds the write lock
+ */
+static void sync_newest(disk_cache *dc) {
+    if (fdatasync(dc->newest->fd) == -1) {
+        perror("fdatasync");
+    }
+}
+
+// write the index next to the segments, atomically replacing the previous one. caller holds the lock
+static void write_index(disk_cache *dc) {
+    char path[4096], tmp[4096];
+    snprintf(path, sizeof(path), "%s/%s", dc->dir, DISK_INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", dc->dir, DISK_INDEX_NAME);
+    size_t len = sizeof(index_header) + dc->num_segments * sizeof(index_segment) + dc->count * sizeof(index_entry);
+    char *buf = (char *) malloc(len);
+    if (buf == NULL) {
+        return;
+    }
+    index_header *header = (index_header *) buf;
+    index_segment *segs = (index_segment *) (header + 1);
+    index_entry *entries = (index_entry *) (segs + dc->num_segments);
+    size_t n = 0, k = 0;
+    for (disk_segment *seg = dc->oldest; seg != NULL; seg = seg->next, ++n) {
+        segs[n].id = seg->id;
+        segs[n].pad = 0;
+        segs[n].end = seg->end;
+        for (disk_entry *e = seg->entries; e != NULL; e = e->seg_next, ++k) {
+            entries[k].seg_id = seg->id;
+            entries[k].hash = e->hash;
+            entries[k].off = e->off;
+        }
+    }
+    header->magic = DISK_INDEX_MAGIC;
+    header->num_segments = (uint32_t) n;
+    header->num_entries = k;
+    header->pad = 0;
+    header->checksum = fnv1a32(FNV1A_INIT, header + 1, len - sizeof(index_header));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("open");
+        free(buf);
+        return;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t wrote = write(fd, buf + written, len - written);
+        if (wrote == -1 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            break;
+        }
+        written += wrote;
+    }
+    close(fd);
+    free(buf);
+    if (written < len || rename(tmp, path) == -1) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * loads the index file into segs (open segments sorted by id): returns, for
+ * each segment, where the records the index knows about end, so only the
+ * records after them are scanned. a missing or damaged index gives zeros.
+ */
+static void load_index(disk_cache *dc, size_t *scan_from) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dc->dir, DISK_INDEX_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(index_header) ||
+        (buf = (char *) malloc(st.st_size)) == NULL) {
+        close(fd);
+        return;
+    }
+    ssize_t got = read(fd, buf, st.st_size);
+    close(fd);
+    index_header *header = (index_header *) buf;
+    if (got != st.st_size || header->magic != DISK_INDEX_MAGIC ||
+        (size_t) st.st_size != sizeof(index_header) + header->num_segments * sizeof(index_segment) +
+                                header->num_entries * sizeof(index_entry) ||
+        header->checksum != fnv1a32(FNV1A_INIT, header + 1, st.st_size - sizeof(index_header))) {
+        fprintf(stderr, "disk cache: ignoring damaged index, scanning the segments\n");
+        free(buf);
+        return;
+    }
+    index_segment *segs = (index_segment *) (header + 1);
+    index_entry *entries = (index_entry *) (segs + header->num_segments);
+    size_t i = 0;
+    for (disk_segment *seg = dc->oldest; seg != NULL; seg = seg->next, ++i) {
+        for (uint32_t s = 0; s < header->num_segments; ++s) {
+            if (segs[s].id == seg->id && segs[s].end <= DISK_SEGMENT_SIZE) {
+                scan_from[i] = segs[s].end;
+            }
+        }
+    }
+    // entries were written segment by segment, the newest last, so later ones replace earlier ones
+    disk_segment *seg = NULL;
+    for (uint64_t k = 0; k < header->num_entries; ++k) {
+        if (seg == NULL || seg->id != entries[k].seg_id) {
+            seg = find_segment(dc, entries[k].seg_id);
+        }
+        if (seg != NULL && entries[k].off < DISK_SEGMENT_SIZE) {
+            index_record(dc, seg, entries[k].off, entries[k].hash, NULL, 0);
+        }
+    }
+    free(buf);
+}
+
+// index the records appended after from, returns where the valid records end
+static size_t scan_segment(disk_cache *dc, disk_segment *seg, size_t from) {
+    size_t off = from;
+    const disk_record *rec;
+    while ((rec = record_at(seg, off)) != NULL && record_intact(rec)) {
+        const char *key = (const char *) (rec + 1);
+        index_record(dc, seg, off, hash_key(key, rec->key_len), key, rec->key_len);
+        off += record_size(rec);
+    }
+    return off;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+disk_cache* create_disk_cache(const char *dir, size_t budget, size_t max_object) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return NULL;
+    }
+    disk_cache *dc = (disk_cache *) calloc(1, sizeof(disk_cache));
+    if (dc == NULL || (dc->dir = strdup(dir)) == NULL) {
+        perror("calloc");
+        free(dc);
+        return NULL;
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+    pthread_mutex_init(&dc->write_lock, NULL);
+    // at least two segments, one being filled and one full
+    dc->budget = budget < 2 * (size_t) DISK_SEGMENT_SIZE ? 2 * (size_t) DISK_SEGMENT_SIZE : budget;
+    size_t record_max = DISK_SEGMENT_SIZE - sizeof(disk_record) - 4096;
+    dc->max_object = max_object < record_max ? max_object : record_max;
+
+    // the segments present, oldest first
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        destroy_disk_cache(dc);
+        return NULL;
+    }
+    uint32_t *ids = NULL;
+    size_t num_ids = 0, cap_ids = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        unsigned int id;
+        char tail;
+        if (sscanf(ent->d_name, "%8x.se%c", &id, &tail) != 2 || tail != 'g' || strlen(ent->d_name) != 12) {
+            continue;
+        }
+        if (num_ids == cap_ids) {
+            cap_ids = cap_ids == 0 ? 16 : cap_ids * 2;
+            uint32_t *temp = (uint32_t *) realloc(ids, cap_ids * sizeof(uint32_t));
+            if (temp == NULL) {
+                break;
+            }
+            ids = temp;
+        }
+        ids[num_ids++] = id;
+    }
+    closedir(d);
+    if (num_ids > 1) {
+        qsort(ids, num_ids, sizeof(uint32_t), compare_ids);
+    }
+    for (size_t i = 0; i < num_ids; ++i) {
+        disk_segment *seg = open_segment(dc, ids[i]);
+        if (seg != NULL) {
+            append_segment(dc, seg);
+        }
+    }
+    free(ids);
+
+    size_t *scan_from = (size_t *) calloc(dc->num_segments + 1, sizeof(size_t));
+    if (scan_from == NULL) {
+        destroy_disk_cache(dc);
+        return NULL;
+    }
+    load_index(dc, scan_from);
+    size_t i = 0;
+    for (disk_segment *seg = dc->oldest; seg != NULL; seg = seg->next, ++i) {
+        seg->end = scan_segment(dc, seg, scan_from[i]);
+    }
+    free(scan_from);
+    while (dc->num_segments * (size_t) DISK_SEGMENT_SIZE > dc->budget) {
+        drop_oldest(dc);
+    }
+    if (dc->newest == NULL) {
+        disk_segment *seg = open_segment(dc, 0);
+        if (seg == NULL) {
+            destroy_disk_cache(dc);
+            return NULL;
+        }
+        append_segment(dc, seg);
+    }
+    return dc;
+}
+
+void disk_cache_release(disk_cache *dc, disk_segment *seg) {
+    pthread_mutex_lock(&dc->lock);
+    put_segment(seg);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+// 1 if the pages of [off, off + len) are in memory. else 0, and they are read in the background
+static int resident(const disk_segment *seg, size_t off, size_t len) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = off & ~(page - 1);
+    size_t pages = (off + len - start + page - 1) / page;
+    unsigned char vec[64];
+    for (size_t p = 0; p < pages; p += sizeof(vec)) {
+        size_t n = pages - p < sizeof(vec) ? pages - p : sizeof(vec);
+        if (mincore(seg->map + start + p * page, n * page, vec) == -1) {
+            return 1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (!(vec[i] & 1)) {
+                madvise(seg->map + start, pages * page, MADV_WILLNEED);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int disk_cache_lookup(disk_cache *dc, const char *key, disk_hit *hit) {
+    size_t key_len = strlen(key);
+    uint32_t hash = hash_key(key, key_len);
+    // only the index in memory is read under the lock, the mapping may have to wait on the
+    // disk. the newest entry of the hash is the one under key, a colliding key is a miss
+    pthread_mutex_lock(&dc->lock);
+    disk_entry *e = dc->buckets[hash % DISK_BUCKETS];
+    while (e != NULL && e->hash != hash) {
+        e = e->next;
+    }
+    disk_segment *seg = e != NULL ? e->seg : NULL;
+    size_t off = e != NULL ? e->off : 0;
+    if (seg != NULL) {
+        seg->refs++;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    if (seg == NULL) {
+        return 0;
+    }
+
+    // the event loop does not wait on the disk: a record not in memory is a miss this time
+    const disk_record *rec = (const disk_record *) (seg->map + off);
+    int64_t now = wall_ms();
+    if (off + sizeof(disk_record) > DISK_SEGMENT_SIZE || !resident(seg, off, sizeof(disk_record)) ||
+        rec->magic != DISK_RECORD_MAGIC || off + sizeof(disk_record) + rec->key_len + rec->head_len > DISK_SEGMENT_SIZE ||
+        !resident(seg, off, sizeof(disk_record) + rec->key_len + rec->head_len) ||
+        (rec = record_at(seg, off)) == NULL || rec->key_len != key_len || memcmp(rec + 1, key, key_len) != 0 ||
+        now >= rec->expires_ms) {
+        disk_cache_release(dc, seg);
+        return 0;
+    }
+    hit->seg = seg;
+    hit->head = (const char *) (rec + 1) + rec->key_len;
+    hit->head_len = rec->head_len;
+    hit->body_off = (off_t) (off + sizeof(disk_record) + rec->key_len + rec->head_len);
+    hit->body_len = rec->body_len;
+    hit->age = (int) ((now - rec->stored_ms) / 1000);
+    hit->addr.s_addr = rec->addr;
+    return 1;
+}
+
+// start a new segment once the newest is full, dropping the oldest over the budget. caller holds the lock
+static disk_segment* roll_segment(disk_cache *dc) {
+    disk_segment *seg = open_segment(dc, dc->newest->id + 1);
+    if (seg == NULL) {
+        return NULL;
+    }
+    append_segment(dc, seg);
+    while (dc->num_segments * (size_t) DISK_SEGMENT_SIZE > dc->budget && dc->oldest != seg) {
+        drop_oldest(dc);
+    }
+    // a full segment never changes again, a good time to save the index
+    write_index(dc);
+    return seg;
+}
+
+int disk_cache_store(disk_cache *dc, const char *key, const char *data, size_t head_len, size_t data_len,
+                     const cache_policy *policy, struct in_addr addr) {
+    size_t key_len = strlen(key);
+    if (data_len > dc->max_object || key_len > 4096) {
+        return -1;
+    }
+    int64_t now = wall_ms();
+    disk_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = DISK_RECORD_MAGIC;
+    rec.key_len = (uint32_t) key_len;
+    rec.head_len = (uint32_t) head_len;
+    rec.addr = addr.s_addr;
+    rec.body_len = data_len - head_len;
+    rec.stored_ms = now - (int64_t) policy->initial_age * 1000;
+    rec.expires_ms = now + policy->lifetime_ms - (int64_t) policy->initial_age * 1000;
+    rec.data_checksum = fnv1a32(FNV1A_INIT, data, data_len);
+    rec.checksum = record_checksum(&rec, key);
+    size_t size = record_size(&rec);
+    static const char padding[8];
+
+    // records go one after the other so a scan finds them all, the lookups go on meanwhile
+    pthread_mutex_lock(&dc->write_lock);
+    if (!dc->sealed && dc->newest->end + size > DISK_SEGMENT_SIZE) {
+        sync_newest(dc);
+    }
+    pthread_mutex_lock(&dc->lock);
+    if (dc->sealed) {
+        pthread_mutex_unlock(&dc->lock);
+        pthread_mutex_unlock(&dc->write_lock);
+        return -1;
+    }
+    disk_segment *seg = dc->newest;
+    if (seg->end + size > DISK_SEGMENT_SIZE && (seg = roll_segment(dc)) == NULL) {
+        pthread_mutex_unlock(&dc->lock);
+        pthread_mutex_unlock(&dc->write_lock);
+        return -1;
+    }
+    seg->refs++;
+    size_t off = seg->end;
+    pthread_mutex_unlock(&dc->lock);
+
+    struct iovec iov[4] = {
+        {&rec, sizeof(rec)},
+        {(void *) key, key_len},
+        {(void *) data, data_len},
+        {(void *) padding, size - sizeof(rec) - key_len - data_len},
+    };
+    size_t written = 0;
+    while (written < size) {
+        ssize_t wrote = pwritev(seg->fd, iov, 4, (off_t) (off + written));
+        if (wrote == -1 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            break;
+        }
+        written += wrote;
+        // skip what went out
+        size_t skip = wrote;
+        for (int i = 0; i < 4; ++i) {
+            size_t n = skip < iov[i].iov_len ? skip : iov[i].iov_len;
+            iov[i].iov_base = (char *) iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+            skip -= n;
+        }
+    }
+
+    pthread_mutex_lock(&dc->lock);
+    int stored = -1;
+    // the segment may have been dropped meanwhile if the budget is tiny, then the record is lost
+    if (written == size && dc->newest == seg) {
+        seg->end = off + size;
+        index_record(dc, seg, off, hash_key(key, key_len), key, key_len);
+        stored = 0;
+    }
+    put_segment(seg);
+    pthread_mutex_unlock(&dc->lock);
+    pthread_mutex_unlock(&dc->write_lock);
+    return stored;
+}
+
+void disk_cache_seal(disk_cache *dc, int sealed) {
+    // a write in progress finishes first, the index has its record
+    pthread_mutex_lock(&dc->write_lock);
+    if (sealed && !dc->sealed && dc->newest != NULL) {
+        sync_newest(dc);
+    }
+    pthread_mutex_lock(&dc->lock);
+    if (sealed && !dc->sealed && dc->newest != NULL) {
+        write_index(dc);
+    }
+    dc->sealed = sealed;
+    pthread_mutex_unlock(&dc->lock);
+    pthread_mutex_unlock(&dc->write_lock);
+}
+
+void destroy_disk_cache(disk_cache *dc) {
+    pthread_mutex_lock(&dc->lock);
+    if (dc->newest != NULL && !dc->sealed) {
+        sync_newest(dc);
+        write_index(dc);
+    }
+    while (dc->oldest != NULL) {
+        disk_segment *seg = dc->oldest;
+        while (seg->entries != NULL) {
+            remove_entry(dc, seg->entries);
+        }
+        dc->oldest = seg->next;
+        put_segment(seg);
+    }
+    pthread_mutex_unlock(&dc->lock);
+    pthread_mutex_destroy(&dc->lock);
+    pthread_mutex_destroy(&dc->write_lock);
+    free(dc->dir);
+    free(dc);
+}
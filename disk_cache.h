@@ -0,0 +1,124 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "cache.h"
+
+/**
+ * disk_cache.h
+ *
+ * Persistent tier of the response cache, for what does not fit in memory
+ * and for what should survive a restart.
+ *
+ * responses are appended as records to segment files of DISK_SEGMENT_SIZE
+ * bytes, each mapped read-only: lookups read keys and heads from the
+ * mapping, hits send the body with sendfile() straight from the page
+ * cache. when the segments outgrow the budget the oldest one is dropped
+ * with every entry it holds, so the space is reclaimed without compaction.
+ *
+ * the index lives in memory and is written to an index file whenever a
+ * segment fills up and on shutdown, once the segment is flushed to disk.
+ * on startup the index file is loaded and only the records appended after
+ * it was written are scanned, checking each against the checksum of its
+ * head and body, so a restarted proxy answers from its cache right away
+ * and never from a record a crash cut short.
+ *
+ * a sealed cache is only read: it stores nothing and leaves the index
+ * file alone, so a successor process can take the directory over while
+ * this one still answers from its mappings.
+ */
+
+#define DISK_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DISK_BUCKETS 4096
+
+/**
+ * a segment file, it stays open and mapped while a connection sends from it
+ */
+typedef struct disk_segment {
+    uint32_t id;
+    int fd;
+    char *map;                  //DISK_SEGMENT_SIZE bytes, read-only
+    size_t end;                 //bytes of records written, the next one is appended here
+    int refs;                   //one for the cache while it is in the list, one per connection or writer using it
+    struct disk_entry *entries; //entries whose record is in this segment
+    struct disk_segment *next;  //the oldest segment first
+} disk_segment;
+
+typedef struct disk_entry {
+    uint32_t hash;
+    disk_segment *seg;
+    size_t off;                 //offset of the record in the segment
+    struct disk_entry *next;    //bucket chain
+    struct disk_entry *seg_next;    //entries of the same segment
+} disk_entry;
+
+typedef struct disk_cache {
+    char *dir;
+    size_t budget;              //bytes of segment files kept
+    size_t max_object;
+    pthread_mutex_t write_lock; //one record written at a time, so a scan finds them all
+    pthread_mutex_t lock;       //protects everything below, not held during the writes
+    disk_entry *buckets[DISK_BUCKETS];
+    disk_segment *oldest;
+    disk_segment *newest;       //records are appended to it
+    size_t num_segments;
+    size_t count;
+    int sealed;                 //1 while the directory belongs to another process
+} disk_cache;
+
+/**
+ * a fresh response found on disk
+ */
+typedef struct disk_hit {
+    disk_segment *seg;          //referenced until disk_cache_release
+    const char *head;           //head without its final empty line, in the mapping
+    size_t head_len;
+    off_t body_off;             //offset of the body in seg->fd
+    size_t body_len;
+    int age;                    //seconds since the server sent it
+    struct in_addr addr;        //address the response came from
+} disk_hit;
+
+/**
+ * create_disk_cache opens (or creates) the cache in dir and loads its
+ * index. it keeps at most budget bytes of responses of at most max_object
+ * bytes. returns NULL on failure.
+ */
+disk_cache* create_disk_cache(const char *dir, size_t budget, size_t max_object);
+
+/**
+ * disk_cache_lookup returns 1 and fills hit if a fresh response is stored
+ * under key, else 0. it does not wait on the disk: if the key and head are
+ * not in memory they are read ahead and the lookup misses. the caller
+ * gives hit->seg back with disk_cache_release.
+ */
+int disk_cache_lookup(disk_cache *dc, const char *key, disk_hit *hit);
+
+void disk_cache_release(disk_cache *dc, disk_segment *seg);
+
+/**
+ * disk_cache_store appends a response (the head without its final empty
+ * line, then the body) under key. it blocks on the write, run it off the
+ * event loop. returns 0, or -1 if the response was not stored.
+ */
+int disk_cache_store(disk_cache *dc, const char *key, const char *data, size_t head_len, size_t data_len,
+                     const cache_policy *policy, struct in_addr addr);
+
+/**
+ * disk_cache_seal writes the index and stops every write if sealed is 1,
+ * so another process may open dir; 0 takes the directory back, provided
+ * that process did not write to it.
+ */
+void disk_cache_seal(disk_cache *dc, int sealed);
+
+/**
+ * destroy_disk_cache writes the index and closes the segments. no hit may
+ * be in use anymore.
+ */
+void destroy_disk_cache(disk_cache *dc);
+
+#endif
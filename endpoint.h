@@ -0,0 +1,28 @@
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+/**
+ * endpoint.h
+ *
+ * every fd registered in a reactor's epoll set carries a pointer to an
+ * endpoint, the kind tells the event loop who handles the event.
+ */
+
+// what a registered file descriptor stands for
+typedef enum endpoint_kind {
+    EP_LISTEN,
+    EP_WAKEUP,
+    EP_CLIENT,
+    EP_UPSTREAM,
+    EP_ATTEMPT,         //a connect racing others for the upstream connection of a request
+    EP_IDLE             //an upstream connection parked in the keep-alive pool
+} endpoint_kind;
+
+typedef struct endpoint {
+    int fd;
+    endpoint_kind kind;
+    unsigned int events;        //events currently registered in epoll
+    struct conn *owner;         //NULL for the listen, wakeup and idle fds
+} endpoint;
+
+#endif
@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include "filter.h"
+#include "util.h"
+
+#define FILTER_LINE_LEN 512
+#define RELOAD_SETTLE_MS 200    //quiet time after the last change of the file before it is read
+
+static uint32_t prefix_mask(int len) {
+    return len == 0 ? 0 : 0xFFFFFFFFu << (32 - len);
+}
+
+static int bit_at(uint32_t addr, int i) {
+    return (int) ((addr >> (31 - i)) & 1);
+}
+
+// FNV-1a over the lower cased name, the first len bytes
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t h = FNV1A_INIT;
+    for (size_t i = 0; i < len; ++i) {
+        h = fnv1a32_byte(h, (unsigned char) tolower((unsigned char) name[i]));
+    }
+    return h;
+}
+
+static int32_t new_node(filter *f, uint32_t prefix, int len, int terminal) {
+    if (f->num_nodes == f->cap_nodes) {
+        size_t cap = f->cap_nodes * 2;
+        radix_node *temp = (radix_node *) realloc(f->nodes, cap * sizeof(radix_node));
+        if (temp == NULL) {
+            return -1;
+        }
+        f->nodes = temp;
+        f->cap_nodes = cap;
+    }
+    radix_node *n = &f->nodes[f->num_nodes];
+    n->prefix = prefix & prefix_mask(len);
+    n->len = (uint8_t) len;
+    n->terminal = (uint8_t) terminal;
+    n->child[0] = n->child[1] = -1;
+    return (int32_t) f->num_nodes++;
+}
+
+static int insert_prefix(filter *f, uint32_t prefix, int len) {
+    prefix &= prefix_mask(len);
+    int32_t node = 0;
+    while (1) {
+        // invariant: the prefix of node is a prefix of the one being inserted
+        if (f->nodes[node].len == len) {
+            f->nodes[node].terminal = 1;
+            return 0;
+        }
+        int bit = bit_at(prefix, f->nodes[node].len);
+        int32_t child = f->nodes[node].child[bit];
+        if (child == -1) {
+            int32_t leaf = new_node(f, prefix, len, 1);
+            if (leaf == -1) {
+                return -1;
+            }
+            f->nodes[node].child[bit] = leaf;
+            return 0;
+        }
+        // length of the prefix shared by the child and the new entry
+        int limit = f->nodes[child].len < len ? f->nodes[child].len : len;
+        uint32_t diff = f->nodes[child].prefix ^ prefix;
+        int common = diff == 0 ? 32 : __builtin_clz(diff);
+        common = common < limit ? common : limit;
+        if (common == f->nodes[child].len) {
+            node = child;
+            continue;
+        }
+        // the entry branches off inside the child's prefix, split it there
+        int32_t split = new_node(f, prefix, common, common == len);
+        if (split == -1) {
+            return -1;
+        }
+        f->nodes[split].child[bit_at(f->nodes[child].prefix, common)] = child;
+        if (common < len) {
+            int32_t leaf = new_node(f, prefix, len, 1);
+            if (leaf == -1) {
+                return -1;
+            }
+            f->nodes[split].child[bit_at(prefix, common)] = leaf;
+        }
+        f->nodes[node].child[bit] = split;
+        return 0;
+    }
+}
+
+static int match_addr(const filter *f, uint32_t addr) {
+    const radix_node *node = &f->nodes[0];
+    while (1) {
+        if (node->terminal) {
+            return 1;
+        }
+        if (node->len == 32) {
+            return 0;
+        }
+        int32_t child = node->child[bit_at(addr, node->len)];
+        if (child == -1) {
+            return 0;
+        }
+        node = &f->nodes[child];
+        if ((addr & prefix_mask(node->len)) != node->prefix) {
+            return 0;
+        }
+    }
+}
+
+static int set_init(name_set *set) {
+    set->mask = 63;
+    set->count = 0;
+    set->slots = (name_slot *) calloc(set->mask + 1, sizeof(name_slot));
+    return set->slots == NULL ? -1 : 0;
+}
+
+static void set_free(name_set *set) {
+    for (size_t i = 0; set->slots != NULL && i <= set->mask; ++i) {
+        free(set->slots[i].name);
+    }
+    free(set->slots);
+}
+
+// linear probing, the name of a slot is compared only when the hashes agree
+static const name_slot* set_find(const name_set *set, const char *name, size_t len, uint32_t hash) {
+    for (size_t i = hash & set->mask;; i = (i + 1) & set->mask) {
+        const name_slot *slot = &set->slots[i];
+        if (slot->name == NULL) {
+            return slot;
+        }
+        if (slot->hash == hash && strncasecmp(slot->name, name, len) == 0 && slot->name[len] == '\0') {
+            return slot;
+        }
+    }
+}
+
+static int set_contains(const name_set *set, const char *name, size_t len) {
+    return set->count > 0 && set_find(set, name, len, hash_name(name, len))->name != NULL;
+}
+
+static int set_add(name_set *set, const char *name) {
+    size_t len = strlen(name);
+    uint32_t hash = hash_name(name, len);
+    if (set_find(set, name, len, hash)->name != NULL) {
+        return 0;
+    }
+    // keep the load under a half so the probe sequences stay short
+    if ((set->count + 1) * 2 > set->mask + 1) {
+        size_t cap = (set->mask + 1) * 2;
+        name_slot *slots = (name_slot *) calloc(cap, sizeof(name_slot));
+        if (slots == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i <= set->mask; ++i) {
+            if (set->slots[i].name != NULL) {
+                size_t j = set->slots[i].hash & (cap - 1);
+                while (slots[j].name != NULL) {
+                    j = (j + 1) & (cap - 1);
+                }
+                slots[j] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->mask = cap - 1;
+    }
+    name_slot *slot = (name_slot *) set_find(set, name, len, hash);
+    if ((slot->name = strdup(name)) == NULL) {
+        return -1;
+    }
+    for (char *p = slot->name; *p != '\0'; ++p) {
+        *p = (char) tolower((unsigned char) *p);
+    }
+    slot->hash = hash;
+    set->count++;
+    return 0;
+}
+
+filter* create_filter(void) {
+    filter *f = (filter *) calloc(1, sizeof(filter));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->cap_nodes = 64;
+    f->nodes = (radix_node *) malloc(f->cap_nodes * sizeof(radix_node));
+    if (f->nodes == NULL || set_init(&f->names) == -1 || set_init(&f->suffixes) == -1) {
+        destroy_filter(f);
+        return NULL;
+    }
+    new_node(f, 0, 0, 0);
+    return f;
+}
+
+int filter_add(filter *f, const char *line) {
+    char entry[FILTER_LINE_LEN];
+    while (isspace((unsigned char) *line)) {
+        line++;
+    }
+    size_t len = strlen(line);
+    while (len > 0 && isspace((unsigned char) line[len - 1])) {
+        len--;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (len >= sizeof(entry)) {
+        return -1;
+    }
+    memcpy(entry, line, len);
+    entry[len] = '\0';
+
+    if (entry[0] >= '0' && entry[0] <= '9') { // if starts with number we know that this is an ip address
+        long mask_len = 32;
+        char *mask_start = strchr(entry, '/');
+        if (mask_start != NULL) {
+            char *end;
+            mask_len = strtol(mask_start + 1, &end, 10);
+            if (end == mask_start + 1 || *end != '\0' || mask_len < 0 || mask_len > 32) {
+                return -1;
+            }
+            *mask_start = '\0';
+        }
+        struct in_addr addr;
+        if (inet_pton(AF_INET, entry, &addr) != 1) {
+            return -1;
+        }
+        if (insert_prefix(f, ntohl(addr.s_addr), (int) mask_len) == -1) {
+            return -1;
+        }
+    } else if (entry[0] == '*' && entry[1] == '.' && entry[2] != '\0') {
+        if (set_add(&f->suffixes, entry + 2) == -1) {
+            return -1;
+        }
+    } else if (set_add(&f->names, entry) == -1) {
+        return -1;
+    }
+    f->num_entries++;
+    return 0;
+}
+
+filter* load_filter(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    filter *f = create_filter();
+    if (f == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    char line[FILTER_LINE_LEN];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+        if (filter_add(f, line) == -1) {
+            fprintf(stderr, "%s:%d: ignoring malformed filter entry\n", path, line_no);
+        }
+    }
+    fclose(file);
+    return f;
+}
+
+int filter_match(const filter *f, const char *host, const struct in_addr *addrs, int naddrs) {
+    for (int i = 0; i < naddrs; ++i) {
+        if (match_addr(f, ntohl(addrs[i].s_addr))) {
+            return 1;
+        }
+    }
+    size_t len = strlen(host);
+    if (set_contains(&f->names, host, len)) {
+        return 1;
+    }
+    // every proper suffix that starts after a dot, "a.b.example.com" tries "b.example.com", "example.com", "com"
+    for (size_t i = 0; i < len; ++i) {
+        if (host[i] == '.' && set_contains(&f->suffixes, host + i + 1, len - i - 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void destroy_filter(filter *f) {
+    if (f == NULL) {
+        return;
+    }
+    set_free(&f->names);
+    set_free(&f->suffixes);
+    free(f->nodes);
+    free(f);
+}
+
+void live_filter_init(live_filter *live, filter *f) {
+    atomic_init(&live->current, f);
+    atomic_init(&live->phase, 0);
+    atomic_init(&live->readers[0], 0);
+    atomic_init(&live->readers[1], 0);
+    pthread_mutex_init(&live->swap_lock, NULL);
+}
+
+int live_filter_match(live_filter *live, const char *host, const struct in_addr *addrs, int naddrs) {
+    // announce the lookup before loading the pointer, a swap that comes after
+    // the load then has to wait for the counter to drop
+    unsigned int phase = atomic_load(&live->phase) & 1;
+    atomic_fetch_add(&live->readers[phase], 1);
+    int blocked = filter_match(atomic_load(&live->current), host, addrs, naddrs);
+    atomic_fetch_sub(&live->readers[phase], 1);
+    return blocked;
+}
+
+void live_filter_swap(live_filter *live, filter *f) {
+    pthread_mutex_lock(&live->swap_lock);
+    filter *old = atomic_exchange(&live->current, f);
+    // a reader may have read the phase before the previous flip and still count in the
+    // other counter, so wait for both: flip, drain the old phase, flip again, drain again
+    for (int i = 0; i < 2; ++i) {
+        unsigned int phase = atomic_fetch_add(&live->phase, 1) & 1;
+        while (atomic_load(&live->readers[phase]) != 0) {
+            struct timespec pause = {0, 100000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    pthread_mutex_unlock(&live->swap_lock);
+    destroy_filter(old);
+}
+
+void live_filter_destroy(live_filter *live) {
+    destroy_filter(atomic_load(&live->current));
+    pthread_mutex_destroy(&live->swap_lock);
+}
+
+static void reload(filter_watcher *w) {
+    filter *f = load_filter(w->path);
+    if (f == NULL) {
+        fprintf(stderr, "%s: reload failed (%s), keeping the current filter\n", w->path, strerror(errno));
+        return;
+    }
+    live_filter_swap(w->live, f);
+    fprintf(stderr, "%s: filter reloaded, %zu entries\n", w->path, f->num_entries);
+}
+
+// 1 if the inotify events read from the fd concern the filter file
+static int file_changed(filter_watcher *w) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+    while ((len = read(w->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            if (event->len > 0 && strcmp(event->name, w->name) == 0) {
+                changed = 1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+static void* watch_filter(void *arg) {
+    filter_watcher *w = (filter_watcher *) arg;
+    int pending = 0;    //the file changed, reload once it stays quiet for RELOAD_SETTLE_MS
+    while (1) {
+        struct epoll_event events[3];
+        int n = epoll_wait(w->epoll_fd, events, 3, pending ? RELOAD_SETTLE_MS : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return NULL;
+        }
+        if (n == 0) { // settled
+            pending = 0;
+            reload(w);
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == w->stop_fd) {
+                return NULL;
+            }
+            if (fd == w->signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(w->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                }
+                pending = 0;
+                reload(w);
+            } else if (fd == w->inotify_fd && file_changed(w)) {
+                pending = 1;
+            }
+        }
+    }
+}
+
+static int watch_fd(int epoll_fd, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+filter_watcher* start_filter_watcher(live_filter *live, const char *path) {
+    filter_watcher *w = (filter_watcher *) calloc(1, sizeof(filter_watcher));
+    if (w == NULL || (w->path = strdup(path)) == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->live = live;
+    w->epoll_fd = w->signal_fd = w->inotify_fd = w->stop_fd = -1;
+    char *slash = strrchr(w->path, '/');
+    w->name = slash != NULL ? slash + 1 : w->path;
+
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w->signal_fd = signalfd(-1, &hup, SFD_NONBLOCK | SFD_CLOEXEC);
+    w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    w->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->epoll_fd == -1 || w->signal_fd == -1 || w->inotify_fd == -1 || w->stop_fd == -1 ||
+        watch_fd(w->epoll_fd, w->signal_fd) == -1 || watch_fd(w->epoll_fd, w->inotify_fd) == -1 ||
+        watch_fd(w->epoll_fd, w->stop_fd) == -1) {
+        perror("start_filter_watcher");
+        stop_filter_watcher(w);
+        return NULL;
+    }
+    // watch the directory, not the file: a file replaced by a rename keeps the old inode
+    char *dir = slash == NULL ? strdup(".") : (slash == w->path ? strdup("/") : strndup(w->path, slash - w->path));
+    if (dir == NULL || inotify_add_watch(w->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+        // reloading on SIGHUP still works
+        fprintf(stderr, "%s: cannot watch for changes, reload with SIGHUP\n", w->path);
+    }
+    free(dir);
+    if (pthread_create(&w->thread, NULL, watch_filter, (void *) w) != 0) {
+        perror("pthread_create");
+        w->thread = 0;
+        stop_filter_watcher(w);
+        return NULL;
+    }
+    return w;
+}
+
+void stop_filter_watcher(filter_watcher *w) {
+    if (w->thread != 0) {
+        uint64_t one = 1;
+        if (write(w->stop_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+        pthread_join(w->thread, NULL);
+    }
+    int fds[] = {w->epoll_fd, w->signal_fd, w->inotify_fd, w->stop_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    free(w->path);
+    free(w);
+}
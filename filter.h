@@ -0,0 +1,135 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/**
+ * filter.h
+ *
+ * The host filter, compiled once at load time.
+ *
+ * addresses and CIDR blocks go into a path-compressed binary radix tree
+ * over the 32-bit address, host names into two hash sets: exact names,
+ * and the suffixes of "*.example.com" wildcards. a lookup costs at most
+ * one tree walk plus one hash probe per label of the host name, and never
+ * allocates.
+ *
+ * a live_filter publishes the current filter to the lookup threads. a
+ * reload builds the new filter on the side, swaps the pointer atomically
+ * and frees the old one after a grace period, once no lookup can still be
+ * reading it (RCU style: two reader counters and a phase that flips), so
+ * lookups never take a lock or wait for a reload.
+ */
+
+typedef struct radix_node {
+    uint32_t prefix;            //the first len bits are significant, the rest are zero
+    uint8_t len;
+    uint8_t terminal;           //1 if a filter entry ends here
+    int32_t child[2];           //index in the node array, -1 for none
+} radix_node;
+
+typedef struct name_slot {
+    uint32_t hash;
+    char *name;                 //lower case, NULL for an empty slot
+} name_slot;
+
+typedef struct name_set {
+    name_slot *slots;
+    size_t mask;                //capacity - 1, the capacity is a power of two
+    size_t count;
+} name_set;
+
+typedef struct filter {
+    radix_node *nodes;          //nodes[0] is the root, the empty prefix
+    size_t num_nodes;
+    size_t cap_nodes;
+    name_set names;             //blocked host names
+    name_set suffixes;          //"example.com" for "*.example.com": blocks every name below it
+    size_t num_entries;
+} filter;
+
+/**
+ * create_filter returns an empty filter, NULL on failure.
+ */
+filter* create_filter(void);
+
+/**
+ * filter_add adds one line of a filter file: an IPv4 address, a CIDR block
+ * ("a.b.c.d/len"), a host name or a "*.domain" wildcard. blank lines are
+ * ignored. returns 0, or -1 if the line is malformed or memory ran out.
+ */
+int filter_add(filter *f, const char *line);
+
+/**
+ * load_filter builds a filter from a file, one entry per line. malformed
+ * lines are reported on stderr and skipped. returns NULL if the file
+ * cannot be read.
+ */
+filter* load_filter(const char *path);
+
+/**
+ * filter_match returns 1 if host (compared case-insensitively) or any of
+ * the naddrs addresses it resolved to is blocked. the entries are IPv4,
+ * a host with IPv6 addresses only is matched by its name.
+ */
+int filter_match(const filter *f, const char *host, const struct in_addr *addrs, int naddrs);
+
+void destroy_filter(filter *f);
+
+typedef struct live_filter {
+    _Atomic(filter *) current;
+    atomic_uint phase;          //readers announce themselves in readers[phase & 1]
+    atomic_size_t readers[2];
+    pthread_mutex_t swap_lock;  //one swap at a time
+} live_filter;
+
+/**
+ * live_filter_init publishes f, the live filter owns it from now on.
+ */
+void live_filter_init(live_filter *live, filter *f);
+
+/**
+ * live_filter_match runs filter_match on the current filter. lock-free,
+ * callable from any thread.
+ */
+int live_filter_match(live_filter *live, const char *host, const struct in_addr *addrs, int naddrs);
+
+/**
+ * live_filter_swap publishes f and destroys the previous filter once no
+ * lookup uses it anymore. blocks the caller for that grace period only.
+ */
+void live_filter_swap(live_filter *live, filter *f);
+
+/**
+ * live_filter_destroy destroys the current filter. no lookup may run.
+ */
+void live_filter_destroy(live_filter *live);
+
+/**
+ * reloads a live filter from its file on SIGHUP or when the file changes
+ */
+typedef struct filter_watcher {
+    live_filter *live;
+    char *path;
+    const char *name;           //file name part of path, matched against the inotify events
+    int epoll_fd;
+    int signal_fd;              //SIGHUP
+    int inotify_fd;             //watches the directory, editors often replace the file by a rename
+    int stop_fd;                //eventfd, stops the thread
+    pthread_t thread;
+} filter_watcher;
+
+/**
+ * start_filter_watcher starts a thread that reloads live from path. SIGHUP
+ * must be blocked in every thread of the process before any is created.
+ * a reload that fails keeps the current filter. returns NULL on failure.
+ */
+filter_watcher* start_filter_watcher(live_filter *live, const char *path);
+
+void stop_filter_watcher(filter_watcher *w);
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * http_parser_fuzz.c
+ *
+ * fuzz harness of the incremental request parser. every input is parsed
+ * once in one call and once fed in pieces at split points taken from the
+ * input itself; both must reach the same result, and every span of a
+ * successful parse must lie inside the head. the head rewritten for
+ * forwarding must only point into the head and the added text, and parse
+ * again. the bytes after the head go through the framing of the body.
+ *
+ * with libFuzzer:
+ *     clang -g -O1 -fsanitize=fuzzer,address -I.. http_parser_fuzz.c ../http.c -o http_parser_fuzz
+ * without it, a standalone driver mutates a few seed requests:
+ *     gcc -g -O1 -fsanitize=address,undefined -DFUZZ_STANDALONE -I.. http_parser_fuzz.c ../http.c -o http_parser_fuzz
+ *     ./http_parser_fuzz [iterations] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "http.h"
+
+static void check_span(http_span span, size_t head_len) {
+    if (span.off > head_len || span.len > head_len - span.off) {
+        abort();
+    }
+}
+
+// the forwarded head is a request head too
+static void check_rewrite(const http_request *req, const char *buf) {
+    static const char *const drop[] = {"Host", NULL};
+    static const char connection[] = "Connection: close\r\n";
+    http_list_append append[] = {{"Via", "1.1 fuzz"}, {"X-Forwarded-For", "192.0.2.1"}};
+    http_rewrite rw;
+    if (http_rewrite_request(&rw, req, buf, drop, append, 2) == -1 ||
+        http_rewrite_add(&rw, connection, sizeof(connection) - 1) == -1 || http_rewrite_end(&rw) == -1) {
+        return;
+    }
+    char *out = malloc(HTTP_MAX_HEAD + HTTP_REWRITE_TEXT + 64);
+    size_t len = 0;
+    for (int i = 0; i < rw.num_iov; ++i) {
+        const char *base = rw.iov[i].iov_base;
+        size_t n = rw.iov[i].iov_len;
+        if (!((base >= buf && base + n <= buf + req->head_len) ||
+              (base >= rw.text && base + n <= rw.text + rw.text_len) || base == connection ||
+              (i == rw.num_iov - 1 && n == 2 && memcmp(base, "\r\n", 2) == 0))) {
+            abort();
+        }
+        memcpy(out + len, base, n);
+        len += n;
+    }
+    http_request again;
+    http_request_init(&again);
+    if (req->num_headers <= HTTP_MAX_HEADERS - 3 && len < HTTP_MAX_HEAD &&
+        http_parse_request(&again, out, len) != (long) len) {
+        abort();
+    }
+    free(out);
+}
+
+static long parse_in_pieces(http_request *req, const char *buf, size_t size, const uint8_t *splits) {
+    http_request_init(req);
+    size_t len = 0;
+    long result = HTTP_PARSE_AGAIN;
+    for (size_t i = 0; result == HTTP_PARSE_AGAIN && len < size; ++i) {
+        size_t step = 1 + splits[i % size] % 32;
+        len = size - len < step ? size : len + step;
+        result = http_parse_request(req, buf, len);
+    }
+    return result;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    // a copy of exactly size bytes, so the sanitizer sees any read past the end
+    char *buf = malloc(size);
+    memcpy(buf, data, size);
+
+    http_request whole, pieces;
+    http_request_init(&whole);
+    long result = http_parse_request(&whole, buf, size);
+    if (parse_in_pieces(&pieces, buf, size, data) != result) {
+        abort();
+    }
+    if (result > 0) {
+        size_t head_len = (size_t) result;
+        if (head_len > size || whole.num_headers > HTTP_MAX_HEADERS ||
+            whole.num_headers != pieces.num_headers) {
+            abort();
+        }
+        http_span spans[] = {whole.method, whole.target, whole.authority, whole.path};
+        for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); ++i) {
+            check_span(spans[i], head_len);
+        }
+        for (int i = 0; i < whole.num_headers; ++i) {
+            check_span(whole.headers[i].name, head_len);
+            check_span(whole.headers[i].value, head_len);
+            if (memcmp(&whole.headers[i], &pieces.headers[i], sizeof(http_header)) != 0) {
+                abort();
+            }
+        }
+        const char *value;
+        size_t value_len;
+        if (http_request_header(&whole, buf, "Host", &value, &value_len) &&
+            (value < buf || value + value_len > buf + head_len)) {
+            abort();
+        }
+        check_rewrite(&whole, buf);
+        // a request body is framed by a length or chunks, never until close
+        http_body body;
+        if (http_request_body(&whole, buf, &body) == 0) {
+            if (body.mode == BODY_UNTIL_CLOSE) {
+                abort();
+            }
+            size_t taken = http_body_consume(&body, buf + head_len, size - head_len);
+            // a body ended, is malformed, or took every byte
+            if (taken < size - head_len && !body.done && !body.error) {
+                abort();
+            }
+            // and it is framed the same when it comes a byte at a time
+            http_body bytewise;
+            http_request_body(&whole, buf, &bytewise);
+            size_t bytewise_taken = 0;
+            for (size_t i = head_len; i < size; ++i) {
+                bytewise_taken += http_body_consume(&bytewise, buf + i, 1);
+            }
+            if (bytewise_taken != taken || bytewise.done != body.done || bytewise.error != body.error) {
+                abort();
+            }
+        }
+        // a finished parse does not move
+        if (http_parse_request(&whole, buf, size) != result) {
+            abort();
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+static const char *seeds[] = {
+    "GET http://example.com/ HTTP/1.1\r\nHost: example.com\r\n\r\n",
+    "GET /index.html?q=1 HTTP/1.0\r\nhost: example.com:8080\r\nConnection: keep-alive\r\n\r\n",
+    "POST http://example.com:81/form HTTP/1.1\r\nHost: example.com\r\nContent-Length: 3\r\n"
+    "Transfer-Encoding: chunked\r\n\r\nabc",
+    "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n\r\n\x16\x03\x01",
+    "PUT /upload HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5;ext=1\r\nhello\r\n0\r\nTrailer: x\r\n\r\n",
+    "POST /upload HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "10000000000000005\r\nhello\r\n0\r\n\r\nGET /smuggled HTTP/1.1\r\n\r\n",
+    "GET * HTTP/1.1\r\nX-Empty:\r\nX-Spaces:   padded value \t \r\nAccept: */*\r\n\r\n"
+    "GET / HTTP/1.1\r\n\r\n",
+};
+
+static uint64_t rng_state;
+
+static uint32_t next_random(void) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t) (rng_state >> 33);
+}
+
+static size_t mutate(uint8_t *data, size_t size, size_t cap) {
+    static const char interesting[] = "\r\n: \t/?#@[]%\x7f\x80\xff\0GETHTTP/1.1";
+    int rounds = 1 + next_random() % 8;
+    for (int r = 0; r < rounds; ++r) {
+        size_t at = size ? next_random() % size : 0;
+        switch (next_random() % 5) {
+            case 0: // flip a bit
+                if (size) {
+                    data[at] ^= 1 << (next_random() % 8);
+                }
+                break;
+            case 1: // overwrite with an interesting byte
+                if (size) {
+                    data[at] = interesting[next_random() % (sizeof(interesting) - 1)];
+                }
+                break;
+            case 2: // insert one
+                if (size < cap) {
+                    memmove(data + at + 1, data + at, size - at);
+                    data[at] = interesting[next_random() % (sizeof(interesting) - 1)];
+                    size++;
+                }
+                break;
+            case 3: // delete a run
+                if (size) {
+                    size_t n = 1 + next_random() % 8;
+                    n = n > size - at ? size - at : n;
+                    memmove(data + at, data + at + n, size - at - n);
+                    size -= n;
+                }
+                break;
+            case 4: // duplicate a run, grows header lines and header counts
+                if (size) {
+                    size_t n = 1 + next_random() % 64;
+                    n = n > size - at ? size - at : n;
+                    if (size + n <= cap) {
+                        memmove(data + at + n, data + at, size - at);
+                        size += n;
+                    }
+                }
+                break;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    size_t cap = HTTP_MAX_HEAD + 4096;
+    uint8_t *data = malloc(cap);
+    size_t num_seeds = sizeof(seeds) / sizeof(seeds[0]);
+    long complete = 0, errors = 0;
+
+    for (long i = 0; i < iterations; ++i) {
+        const char *seed = seeds[next_random() % num_seeds];
+        size_t size = strlen(seed);
+        memcpy(data, seed, size);
+        size = mutate(data, size, cap);
+        if (next_random() % 64 == 0) { // now and then a head close to the size limit
+            size_t grow = HTTP_MAX_HEAD - 64 + next_random() % 128;
+            memset(data + size, 'a', grow);
+            size += grow;
+        }
+        LLVMFuzzerTestOneInput(data, size);
+
+        http_request req;
+        http_request_init(&req);
+        long result = http_parse_request(&req, (const char *) data, size);
+        complete += result > 0;
+        errors += result == HTTP_PARSE_ERROR;
+    }
+    printf("%ld inputs: %ld complete heads, %ld rejected, %ld incomplete\n",
+           iterations, complete, errors, iterations - complete - errors);
+    free(data);
+    return 0;
+}
+
+#endif
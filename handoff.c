@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "handoff.h"
+
+#define HANDOFF_READY 'R'
+
+extern char **environ;
+
+static int handoff_fd = -1;     //channel to the predecessor, until handoff_ready
+
+// room for the most fds a message carries, aligned for the header
+typedef union handoff_control {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+} handoff_control;
+
+int handoff_receive(int **fds) {
+    const char *value = getenv(HANDOFF_ENV);
+    if (value == NULL) {
+        return 0;
+    }
+    char *end;
+    long fd = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX) {
+        fprintf(stderr, "%s=%s: not a file descriptor\n", HANDOFF_ENV, value);
+        return -1;
+    }
+    // a successor of this process gets a channel of its own
+    unsetenv(HANDOFF_ENV);
+    handoff_fd = (int) fd;
+    fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+
+    uint32_t count = 0;
+    handoff_control control;
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    while ((n = recvmsg(handoff_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = n == -1 ? NULL : CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "no listening sockets came with the handoff\n");
+        return -1;
+    }
+    int received = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int *got = (int *) malloc(sizeof(int) * (received > 0 ? received : 1));
+    if (got == NULL || n != sizeof(count) || (uint32_t) received != count || count == 0 ||
+        (msg.msg_flags & MSG_CTRUNC)) {
+        fprintf(stderr, "the handoff did not carry the sockets it announced\n");
+        int *sent = (int *) CMSG_DATA(cmsg);
+        for (int i = 0; i < received; ++i) {
+            close(sent[i]);
+        }
+        free(got);
+        return -1;
+    }
+    memcpy(got, CMSG_DATA(cmsg), sizeof(int) * received);
+    *fds = got;
+    return received;
+}
+
+int handoff_ready(void) {
+    if (handoff_fd == -1) {
+        return 0;
+    }
+    char ready = HANDOFF_READY;
+    ssize_t n = send(handoff_fd, &ready, 1, MSG_NOSIGNAL);
+    close(handoff_fd);
+    handoff_fd = -1;
+    return n == 1 ? 0 : -1;
+}
+
+static int send_fds(int channel, const int *fds, int num_fds) {
+    uint32_t count = (uint32_t) num_fds;
+    handoff_control control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    ssize_t n;
+    while ((n = sendmsg(channel, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    return n == sizeof(count) ? 0 : -1;
+}
+
+// 1 once the successor said it is ready, 0 if it closed the channel or took too long
+static int wait_ready(int channel) {
+    struct pollfd pfd = {channel, POLLIN, 0};
+    int n;
+    while ((n = poll(&pfd, 1, HANDOFF_READY_TIMEOUT * 1000)) == -1 && errno == EINTR) {
+    }
+    char ready = 0;
+    return n == 1 && read(channel, &ready, 1) == 1 && ready == HANDOFF_READY;
+}
+
+int handoff_spawn(char *const argv[], const int *fds, int num_fds) {
+    if (num_fds < 1 || num_fds > HANDOFF_MAX_FDS) {
+        fprintf(stderr, "cannot hand %d sockets over\n", num_fds);
+        return -1;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    // the environment of the successor is built here: the child of a threaded process may only exec
+    size_t num_vars = 0;
+    while (environ[num_vars] != NULL) {
+        num_vars++;
+    }
+    char **env = (char **) malloc(sizeof(char *) * (num_vars + 2));
+    if (env == NULL) {
+        perror("malloc");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    char channel_var[64];
+    snprintf(channel_var, sizeof(channel_var), "%s=%d", HANDOFF_ENV, sv[1]);
+    size_t k = 0;
+    for (size_t i = 0; i < num_vars; ++i) {
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0) {
+            env[k++] = environ[i];
+        }
+    }
+    env[k++] = channel_var;
+    env[k] = NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(sv[1], F_SETFD, 0);
+        execvpe(argv[0], argv, env);
+        _exit(127);
+    }
+    free(env);
+    close(sv[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+    // the sockets wait in the channel until the successor asks for them
+    int ready = send_fds(sv[0], fds, num_fds) == 0 && wait_ready(sv[0]);
+    close(sv[0]);
+    if (!ready) {
+        fprintf(stderr, "%s: the new process did not get ready\n", argv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void* watch_signals(void *arg) {
+    signal_watcher *w = (signal_watcher *) arg;
+    struct pollfd pfds[2] = {{w->signal_fd, POLLIN, 0}, {w->stop_fd, POLLIN, 0}};
+    while (1) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return NULL;
+        }
+        if (pfds[1].revents != 0) {
+            return NULL;
+        }
+        struct signalfd_siginfo info;
+        while (read(w->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            w->action(w->ctx, (int) info.ssi_signo);
+        }
+    }
+}
+
+signal_watcher* start_signal_watcher(const sigset_t *signals, signal_action action, void *ctx) {
+    signal_watcher *w = (signal_watcher *) calloc(1, sizeof(signal_watcher));
+    if (w == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    w->action = action;
+    w->ctx = ctx;
+    w->signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    w->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->signal_fd == -1 || w->stop_fd == -1 || pthread_create(&w->thread, NULL, watch_signals, (void *) w) != 0) {
+        perror("start_signal_watcher");
+        w->thread = 0;
+        stop_signal_watcher(w);
+        return NULL;
+    }
+    return w;
+}
+
+void stop_signal_watcher(signal_watcher *w) {
+    if (w->thread != 0) {
+        uint64_t one = 1;
+        if (write(w->stop_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+        pthread_join(w->thread, NULL);
+    }
+    if (w->signal_fd != -1) {
+        close(w->signal_fd);
+    }
+    if (w->stop_fd != -1) {
+        close(w->stop_fd);
+    }
+    free(w);
+}
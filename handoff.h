@@ -0,0 +1,71 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <pthread.h>
+#include <signal.h>
+
+/**
+ * handoff.h
+ *
+ * Restarts without refusing a connection. the running proxy starts a new
+ * copy of its binary with the same arguments and passes it its listening
+ * sockets over a Unix socket (SCM_RIGHTS): they stay open throughout, so
+ * the kernel keeps queueing the connections that come meanwhile, and the
+ * successor takes them from the same accept queues. once the successor
+ * says it is about to accept, the old process stops accepting and drains.
+ *
+ * the successor finds the Unix socket in its environment (HANDOFF_ENV),
+ * anything started without it opens its sockets itself.
+ */
+
+#define HANDOFF_ENV "PROXY_HANDOFF_FD"
+#define HANDOFF_MAX_FDS 253         //SCM_MAX_FD, what one message may carry
+#define HANDOFF_READY_TIMEOUT 10    //seconds a successor has to get ready
+
+/**
+ * handoff_receive takes the listening sockets a predecessor passed to this
+ * process and stores them, close-on-exec, in a malloc'd array in *fds.
+ * returns their count, 0 if the process was not started by a handoff, -1
+ * on failure.
+ */
+int handoff_receive(int **fds);
+
+/**
+ * handoff_ready tells the predecessor that this process accepts now. returns
+ * 0, or -1 if the predecessor gave up waiting: it kept the sockets, this
+ * process must not serve. a no-op without a predecessor.
+ */
+int handoff_ready(void);
+
+/**
+ * handoff_spawn execs argv (argv[0] looked up in PATH, so a binary replaced
+ * on disk is the one started), passes it the num_fds sockets of fds and
+ * waits up to HANDOFF_READY_TIMEOUT for it to be ready. returns 0 once it
+ * is, -1 if it could not be started or failed, it is then killed.
+ */
+int handoff_spawn(char *const argv[], const int *fds, int num_fds);
+
+typedef void (*signal_action)(void *ctx, int signo);
+
+typedef struct signal_watcher {
+    int signal_fd;
+    int stop_fd;                //eventfd, written to stop the thread
+    signal_action action;
+    void *ctx;
+    pthread_t thread;
+} signal_watcher;
+
+/**
+ * start_signal_watcher starts a thread that calls action for each of
+ * signals the process receives. the signals must be blocked in every
+ * thread, before any is created. returns NULL on failure.
+ */
+signal_watcher* start_signal_watcher(const sigset_t *signals, signal_action action, void *ctx);
+
+/**
+ * stop_signal_watcher waits for the action in progress, if any, and stops
+ * the thread.
+ */
+void stop_signal_watcher(signal_watcher *w);
+
+#endif
@@ -0,0 +1,735 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/uio.h>
+#include "http.h"
+
+// characters allowed in a method or a header name (RFC 7230 tchar)
+static const unsigned char tchar[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+    ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+// visible characters, obs-text included: most of a target or a header value
+static inline int vchar(unsigned char c) {
+    return (unsigned char) (c - 0x21) < 0x5e || c >= 0x80;
+}
+
+/**
+ * the bytes of a token or a value are checked in a tight loop instead of
+ * going through the state machine one by one, they are most of the head
+ */
+static size_t skip_tchar(const char *buf, size_t i, size_t end) {
+    while (i < end && tchar[(unsigned char) buf[i]]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t skip_vchar(const char *buf, size_t i, size_t end) {
+    while (i < end && vchar((unsigned char) buf[i])) {
+        i++;
+    }
+    return i;
+}
+
+// header values: visible characters and white space
+static size_t skip_field(const char *buf, size_t i, size_t end) {
+    // eight bytes at a time while none of them is a control character or DEL
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    while (end - i >= 8) {
+        uint64_t word, del;
+        memcpy(&word, buf + i, 8);
+        del = word ^ (0x7f * ones);
+        if (((word - 0x20 * ones) & ~word & highs) != 0 || ((del - ones) & ~del & highs) != 0) {
+            break;
+        }
+        i += 8;
+    }
+    while (i < end && (vchar((unsigned char) buf[i]) || buf[i] == ' ' || buf[i] == '\t')) {
+        i++;
+    }
+    return i;
+}
+
+void http_request_init(http_request *req) {
+    memset(req, 0, offsetof(http_request, headers));
+    req->num_headers = 0;
+    req->head_len = 0;
+    req->state = REQ_METHOD;
+}
+
+// split an absolute-form target ("http://host:port/path") into authority and path. the target of
+// CONNECT is only an authority ("host:port"), the one of any other method never is
+static int split_target(http_request *req, const char *buf) {
+    const char *target = buf + req->target.off;
+    size_t len = req->target.len;
+    if (req->method.len == 7 && strncasecmp(buf + req->method.off, "CONNECT", 7) == 0) {
+        if (memchr(target, '/', len) != NULL || memchr(target, ':', len) == NULL) {
+            return -1;
+        }
+        req->authority = req->target;
+        req->path.off = req->target.off + len;
+        req->path.len = 0;
+        return 0;
+    }
+    req->path = req->target;
+    if (target[0] == '/' || (len == 1 && target[0] == '*')) {
+        return 0;
+    }
+    if (len < 7 || strncasecmp(target, "http://", 7) != 0) {
+        return -1;
+    }
+    size_t i = 7;
+    while (i < len && target[i] != '/' && target[i] != '?' && target[i] != '#') {
+        i++;
+    }
+    if (i == 7) {
+        return -1;
+    }
+    req->authority.off = req->target.off + 7;
+    req->authority.len = i - 7;
+    req->path.off = req->target.off + i;
+    req->path.len = len - i;
+    return 0;
+}
+
+long http_parse_request(http_request *req, const char *buf, size_t len) {
+    size_t i = req->pos;
+    size_t end = len < HTTP_MAX_HEAD ? len : HTTP_MAX_HEAD;
+    for (; i < end; ++i) {
+        unsigned char c = (unsigned char) buf[i];
+        switch (req->state) {
+            case REQ_METHOD:
+                if (c == ' ' && i > req->mark) {
+                    req->method.off = req->mark;
+                    req->method.len = i - req->mark;
+                    req->mark = i + 1;
+                    req->state = REQ_TARGET;
+                } else if (!tchar[c]) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            case REQ_TARGET:
+                if (vchar(c)) {
+                    i = skip_vchar(buf, i, end) - 1;
+                } else if (c == ' ' && i > req->mark) {
+                    req->target.off = req->mark;
+                    req->target.len = i - req->mark;
+                    if (split_target(req, buf) == -1) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    req->mark = i + 1;
+                    req->state = REQ_VERSION;
+                } else {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            case REQ_VERSION:
+                if (c == '\r') {
+                    if (i - req->mark != 8 || strncmp(buf + req->mark, "HTTP/1.", 7) != 0 ||
+                        (buf[i - 1] != '0' && buf[i - 1] != '1')) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    req->minor_version = buf[i - 1] - '0';
+                    req->state = REQ_LINE_LF;
+                } else if (i - req->mark >= 8) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            case REQ_LINE_LF:
+            case REQ_HEADER_LF:
+                if (c != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                req->state = REQ_HEADER_START;
+                break;
+            case REQ_HEADER_START:
+                if (c == '\r') {
+                    req->state = REQ_END_LF;
+                } else if (tchar[c]) { // a line starting with white space would be an obsolete fold, rejected
+                    if (req->num_headers == HTTP_MAX_HEADERS) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    req->mark = i;
+                    req->state = REQ_NAME;
+                } else {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            case REQ_NAME:
+                if (tchar[c]) {
+                    i = skip_tchar(buf, i, end) - 1;
+                } else if (c == ':') {
+                    http_header *h = &req->headers[req->num_headers];
+                    h->name.off = req->mark;
+                    h->name.len = i - req->mark;
+                    req->state = REQ_VALUE_START;
+                } else if (!tchar[c]) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            case REQ_VALUE_START:
+                if (c == ' ' || c == '\t') {
+                    break;
+                }
+                req->mark = i;
+                req->state = REQ_VALUE;
+                // c is the first byte of the value, or the end of an empty one
+                // fall through
+            case REQ_VALUE:
+                if (c == '\r') {
+                    size_t value_end = i;
+                    while (value_end > req->mark && (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t')) {
+                        value_end--;
+                    }
+                    http_header *h = &req->headers[req->num_headers++];
+                    h->value.off = req->mark;
+                    h->value.len = value_end - req->mark;
+                    req->state = REQ_HEADER_LF;
+                } else if (vchar(c) || c == ' ' || c == '\t') {
+                    i = skip_field(buf, i, end) - 1;
+                } else {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            case REQ_END_LF:
+                if (c != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                req->state = REQ_DONE;
+                req->head_len = i + 1;
+                req->pos = i + 1;
+                return (long) req->head_len;
+            case REQ_DONE:
+                return (long) req->head_len;
+        }
+    }
+    req->pos = i;
+    if (req->state == REQ_DONE) {
+        return (long) req->head_len;
+    }
+    return len >= HTTP_MAX_HEAD ? HTTP_PARSE_ERROR : HTTP_PARSE_AGAIN;
+}
+
+int http_span_is(const char *buf, http_span span, const char *text) {
+    return strlen(text) == span.len && strncasecmp(buf + span.off, text, span.len) == 0;
+}
+
+int http_request_header(const http_request *req, const char *buf, const char *name,
+                        const char **value, size_t *value_len) {
+    for (int i = 0; i < req->num_headers; ++i) {
+        if (http_span_is(buf, req->headers[i].name, name)) {
+            *value = buf + req->headers[i].value.off;
+            *value_len = req->headers[i].value.len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+size_t http_head_end(const char *buf, size_t len) {
+    for (size_t i = 3; i < len; ++i) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' && buf[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+int http_find_header(const char *head, size_t head_len, const char *name,
+                     const char **value, size_t *value_len) {
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    // skip the start line
+    const char *line = memchr(head, '\n', head_len);
+    while (line != NULL && ++line < end) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) {
+            return 0;
+        }
+        if ((size_t) (line_end - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char *v = line + name_len + 1;
+            const char *v_end = line_end;
+            while (v < v_end && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t')) {
+                v_end--;
+            }
+            *value = v;
+            *value_len = v_end - v;
+            return 1;
+        }
+        line = line_end;
+    }
+    return 0;
+}
+
+static int has_token(const char *value, size_t value_len, const char *token, size_t token_len) {
+    size_t i = 0;
+    while (i < value_len) {
+        while (i < value_len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < value_len && value[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_header_has_token(const char *value, size_t value_len, const char *token) {
+    return has_token(value, value_len, token, strlen(token));
+}
+
+int http_request_keep_alive(const http_request *req, const char *buf) {
+    const char *value;
+    size_t value_len;
+    int has_connection = http_request_header(req, buf, "Connection", &value, &value_len);
+    if (req->minor_version >= 1) {
+        return !(has_connection && http_header_has_token(value, value_len, "close"));
+    }
+    return has_connection && http_header_has_token(value, value_len, "keep-alive");
+}
+
+static const char *const hop_by_hop[] = {"Connection", "Keep-Alive", "TE", "Trailer", "Upgrade", NULL};
+
+static int in_list(const char *buf, http_span name, const char *const *list) {
+    for (; list != NULL && *list != NULL; ++list) {
+        if (http_span_is(buf, name, *list)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// whether header i stays out of the forwarded request
+static int dropped(const http_request *req, const char *buf, int i, const char *const *drop) {
+    http_span name = req->headers[i].name;
+    if ((name.len > 6 && strncasecmp(buf + name.off, "Proxy-", 6) == 0) ||
+        in_list(buf, name, hop_by_hop) || in_list(buf, name, drop)) {
+        return 1;
+    }
+    // Connection lists more headers meant for this hop only
+    for (int j = 0; j < req->num_headers; ++j) {
+        if (http_span_is(buf, req->headers[j].name, "Connection") &&
+            has_token(buf + req->headers[j].value.off, req->headers[j].value.len, buf + name.off, name.len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_rewrite_add(http_rewrite *rw, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    // slices that follow each other in memory go out as one
+    struct iovec *last = rw->num_iov > 0 ? &rw->iov[rw->num_iov - 1] : NULL;
+    if (last != NULL && (const char *) last->iov_base + last->iov_len == data) {
+        last->iov_len += len;
+        return 0;
+    }
+    if (rw->num_iov == HTTP_REWRITE_IOV) {
+        return -1;
+    }
+    rw->iov[rw->num_iov].iov_base = (void *) data;
+    rw->iov[rw->num_iov].iov_len = len;
+    rw->num_iov++;
+    return 0;
+}
+
+int http_rewrite_add_text(http_rewrite *rw, const char *text, size_t len) {
+    if (len > HTTP_REWRITE_TEXT - rw->text_len) {
+        return -1;
+    }
+    char *copy = rw->text + rw->text_len;
+    memcpy(copy, text, len);
+    rw->text_len += len;
+    return http_rewrite_add(rw, copy, len);
+}
+
+// the value of a list header, with the separator it needs after what the line already holds
+static int add_element(http_rewrite *rw, const char *value, int first) {
+    if (!first && http_rewrite_add_text(rw, ", ", 2) == -1) {
+        return -1;
+    }
+    return http_rewrite_add_text(rw, value, strlen(value));
+}
+
+int http_rewrite_request(http_rewrite *rw, const http_request *req, const char *buf,
+                         const char *const *drop, const http_list_append *append, int num_append) {
+    rw->num_iov = 0;
+    rw->next = 0;
+    rw->text_len = 0;
+    unsigned char left_out[HTTP_MAX_HEADERS];
+    for (int i = 0; i < req->num_headers; ++i) {
+        left_out[i] = (unsigned char) dropped(req, buf, i, drop);
+    }
+    // the head is sent as is between the lines left out and the elements added
+    size_t head_end = req->head_len - 2;
+    size_t run = 0;
+    for (int i = 0; i < req->num_headers; ++i) {
+        size_t line = req->headers[i].name.off;
+        size_t line_end = i + 1 < req->num_headers ? req->headers[i + 1].name.off : head_end;
+        if (left_out[i]) {
+            if (http_rewrite_add(rw, buf + run, line - run) == -1) {
+                return -1;
+            }
+            run = line_end;
+            continue;
+        }
+        for (int a = 0; a < num_append; ++a) {
+            // the element goes to the last line of the list
+            if (!http_span_is(buf, req->headers[i].name, append[a].name)) {
+                continue;
+            }
+            int later = 0;
+            for (int j = i + 1; j < req->num_headers && !later; ++j) {
+                later = !left_out[j] && http_span_is(buf, req->headers[j].name, append[a].name);
+            }
+            if (later) {
+                continue;
+            }
+            size_t value_end = req->headers[i].value.off + req->headers[i].value.len;
+            if (http_rewrite_add(rw, buf + run, value_end - run) == -1 ||
+                add_element(rw, append[a].value, req->headers[i].value.len == 0) == -1) {
+                return -1;
+            }
+            run = value_end;
+        }
+    }
+    if (http_rewrite_add(rw, buf + run, head_end - run) == -1) {
+        return -1;
+    }
+    for (int a = 0; a < num_append; ++a) {
+        int found = 0;
+        for (int i = 0; i < req->num_headers && !found; ++i) {
+            found = !left_out[i] && http_span_is(buf, req->headers[i].name, append[a].name);
+        }
+        if (!found &&
+            (http_rewrite_add_text(rw, append[a].name, strlen(append[a].name)) == -1 ||
+             http_rewrite_add_text(rw, ": ", 2) == -1 || add_element(rw, append[a].value, 1) == -1 ||
+             http_rewrite_add_text(rw, "\r\n", 2) == -1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int http_rewrite_end(http_rewrite *rw) {
+    return http_rewrite_add(rw, "\r\n", 2);
+}
+
+ssize_t http_rewrite_send(http_rewrite *rw, int fd) {
+    ssize_t wrote = writev(fd, rw->iov + rw->next, rw->num_iov - rw->next);
+    if (wrote <= 0) {
+        return wrote;
+    }
+    // skip what went out, a slice sent in part starts later
+    size_t left = (size_t) wrote;
+    while (rw->next < rw->num_iov && left >= rw->iov[rw->next].iov_len) {
+        left -= rw->iov[rw->next].iov_len;
+        rw->next++;
+    }
+    if (left > 0) {
+        rw->iov[rw->next].iov_base = (char *) rw->iov[rw->next].iov_base + left;
+        rw->iov[rw->next].iov_len -= left;
+    }
+    return wrote;
+}
+
+// a Content-Length value is digits only: strtoull would take a sign, spaces
+// or a 0x, and a framing the proxy and the peer read differently
+static int parse_content_length(const char *value, size_t value_len, unsigned long long *length) {
+    if (value_len == 0 || value_len > 19) {
+        return -1;
+    }
+    *length = 0;
+    for (size_t i = 0; i < value_len; ++i) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        *length = *length * 10 + (unsigned long long) (value[i] - '0');
+    }
+    return 0;
+}
+
+int http_request_body(const http_request *req, const char *buf, http_body *body) {
+    memset(body, 0, sizeof(http_body));
+    int chunked = 0, has_length = 0;
+    unsigned long long length = 0;
+    for (int i = 0; i < req->num_headers; ++i) {
+        const char *value = buf + req->headers[i].value.off;
+        size_t value_len = req->headers[i].value.len;
+        if (http_span_is(buf, req->headers[i].name, "Transfer-Encoding")) {
+            // chunked must be the last coding, and the proxy does not decode any other
+            if (chunked || value_len != 7 || strncasecmp(value, "chunked", 7) != 0) {
+                return -1;
+            }
+            chunked = 1;
+        } else if (http_span_is(buf, req->headers[i].name, "Content-Length")) {
+            unsigned long long value_length;
+            if (parse_content_length(value, value_len, &value_length) == -1) {
+                return -1;
+            }
+            if (has_length && value_length != length) {
+                return -1;
+            }
+            has_length = 1;
+            length = value_length;
+        }
+    }
+    // a message with both is how requests get smuggled past a proxy
+    if (chunked && has_length) {
+        return -1;
+    }
+    if (chunked) {
+        body->mode = BODY_CHUNKED;
+        body->chunk = CHUNK_SIZE;
+    } else if (has_length && length > 0) {
+        body->mode = BODY_LENGTH;
+        body->remaining = length;
+    } else {
+        body->mode = BODY_NONE;
+        body->done = 1;
+    }
+    return 0;
+}
+
+int http_parse_response(const char *head, size_t head_len, int head_request, http_response *resp) {
+    memset(resp, 0, sizeof(http_response));
+    if (head_len < 12 || strncmp(head, "HTTP/1.", 7) != 0 || !isdigit((unsigned char) head[7]) ||
+        head[8] != ' ' || !isdigit((unsigned char) head[9]) || !isdigit((unsigned char) head[10]) ||
+        !isdigit((unsigned char) head[11])) {
+        return -1;
+    }
+    resp->minor_version = head[7] - '0';
+    resp->status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+
+    const char *value;
+    size_t value_len;
+    int has_connection = http_find_header(head, head_len, "Connection", &value, &value_len);
+    if (resp->minor_version >= 1) {
+        resp->keep_alive = !(has_connection && http_header_has_token(value, value_len, "close"));
+    } else {
+        resp->keep_alive = has_connection && http_header_has_token(value, value_len, "keep-alive");
+    }
+
+    http_body *body = &resp->body;
+    if (head_request || resp->status == 204 || resp->status == 304 ||
+        (resp->status >= 100 && resp->status < 200)) {
+        body->mode = BODY_NONE;
+        body->done = 1;
+        // an interim response is followed by the real one, do not try to frame that
+        if (resp->status >= 100 && resp->status < 200) {
+            body->mode = BODY_UNTIL_CLOSE;
+            body->done = 0;
+            resp->keep_alive = 0;
+        }
+        return 0;
+    }
+    if (http_find_header(head, head_len, "Transfer-Encoding", &value, &value_len)) {
+        if (http_header_has_token(value, value_len, "chunked")) {
+            body->mode = BODY_CHUNKED;
+            body->chunk = CHUNK_SIZE;
+        } else {
+            body->mode = BODY_UNTIL_CLOSE;
+            resp->keep_alive = 0;
+        }
+        return 0;
+    }
+    if (http_find_header(head, head_len, "Content-Length", &value, &value_len)) {
+        unsigned long long length;
+        if (parse_content_length(value, value_len, &length) == -1) {
+            return -1;
+        }
+        body->mode = BODY_LENGTH;
+        body->remaining = length;
+        body->done = length == 0;
+        return 0;
+    }
+    body->mode = BODY_UNTIL_CLOSE;
+    resp->keep_alive = 0;
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (char) tolower((unsigned char) c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// walk the chunked coding, only the data bytes are skipped in bulk
+// payload, if not NULL, gets the chunk data moved to its start and *payload_len its length
+static size_t consume_chunked(http_body *body, const char *data, size_t len, char *payload, size_t *payload_len) {
+    size_t i = 0;
+    while (i < len && !body->done) {
+        char c = data[i];
+        switch (body->chunk) {
+            case CHUNK_SIZE: {
+                int digit = hex_value(c);
+                if (digit >= 0) {
+                    if (++body->digits > CHUNK_MAX_DIGITS) {
+                        body->error = 1;
+                        return i;
+                    }
+                    body->remaining = body->remaining * 16 + digit;
+                    i++;
+                    break;
+                }
+                if (body->digits == 0) {
+                    body->error = 1;
+                    return i;
+                }
+                body->chunk = CHUNK_SIZE_WS;
+                continue; // the same byte may already end the line
+            }
+            case CHUNK_SIZE_WS:
+                if (c == ';') {
+                    body->chunk = CHUNK_EXT;
+                } else if (c == '\r') {
+                    body->chunk = CHUNK_SIZE_LF;
+                } else if (c != ' ' && c != '\t') {
+                    body->error = 1;
+                    return i;
+                }
+                i++;
+                break;
+            case CHUNK_EXT:
+                if (c == '\r') {
+                    body->chunk = CHUNK_SIZE_LF;
+                } else if (c == '\n') {
+                    body->error = 1;
+                    return i;
+                }
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    body->error = 1;
+                    return i;
+                }
+                body->chunk = body->remaining == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                size_t take = len - i < body->remaining ? len - i : (size_t) body->remaining;
+                if (payload != NULL) {
+                    memmove(payload + *payload_len, data + i, take);
+                    *payload_len += take;
+                }
+                body->remaining -= take;
+                i += take;
+                if (body->remaining == 0) {
+                    body->chunk = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (c != '\r') {
+                    body->error = 1;
+                    return i;
+                }
+                body->chunk = CHUNK_DATA_LF;
+                i++;
+                break;
+            case CHUNK_DATA_LF:
+                if (c != '\n') {
+                    body->error = 1;
+                    return i;
+                }
+                body->chunk = CHUNK_SIZE;
+                body->digits = 0;
+                i++;
+                break;
+            case CHUNK_TRAILER_START:
+                if (c == '\n') {
+                    body->error = 1;
+                    return i;
+                }
+                body->chunk = c == '\r' ? CHUNK_LAST_LF : CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\r') {
+                    body->chunk = CHUNK_TRAILER_LF;
+                } else if (c == '\n') {
+                    body->error = 1;
+                    return i;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_LF:
+            case CHUNK_LAST_LF:
+                if (c != '\n') {
+                    body->error = 1;
+                    return i;
+                }
+                if (body->chunk == CHUNK_LAST_LF) {
+                    body->done = 1;
+                } else {
+                    body->chunk = CHUNK_TRAILER_START;
+                }
+                i++;
+                break;
+        }
+    }
+    return i;
+}
+
+size_t http_body_consume(http_body *body, const char *data, size_t len) {
+    if (body->done || body->error) {
+        return 0;
+    }
+    switch (body->mode) {
+        case BODY_NONE:
+            body->done = 1;
+            return 0;
+        case BODY_LENGTH: {
+            size_t take = len < body->remaining ? len : (size_t) body->remaining;
+            body->remaining -= take;
+            body->done = body->remaining == 0;
+            return take;
+        }
+        case BODY_CHUNKED:
+            return consume_chunked(body, data, len, NULL, NULL);
+        case BODY_UNTIL_CLOSE:
+            return len;
+    }
+    return len;
+}
+
+size_t http_body_payload(http_body *body, char *data, size_t len) {
+    if (body->mode != BODY_CHUNKED) {
+        return http_body_consume(body, data, len);
+    }
+    size_t payload_len = 0;
+    consume_chunked(body, data, len, data, &payload_len);
+    return payload_len;
+}
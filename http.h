@@ -0,0 +1,261 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * http.h
+ *
+ * HTTP/1.x message framing. the proxy relays messages byte for byte, it
+ * only needs to know where a message ends so the connection under it can
+ * carry the next one.
+ *
+ * requests are parsed incrementally: the parser resumes where the previous
+ * call stopped, so every byte is looked at once however the head arrives,
+ * and it records the request line and the headers as spans of the caller's
+ * buffer instead of copying them. lines must end with CRLF.
+ *
+ * a request is forwarded the same way: the outgoing head is a list of
+ * slices of the parsed buffer, with the removed headers left out, and of
+ * the few bytes the proxy adds, written with a single writev.
+ */
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEAD (64 * 1024)   //a longer request head is rejected
+
+// http_parse_request return values, a positive value is the length of the head
+#define HTTP_PARSE_AGAIN 0          //the head is not complete yet
+#define HTTP_PARSE_ERROR -1         //malformed, too long or too many headers
+
+/**
+ * a piece of the parsed buffer, kept as an offset so the buffer may be
+ * reallocated between two calls
+ */
+typedef struct http_span {
+    size_t off;
+    size_t len;
+} http_span;
+
+typedef struct http_header {
+    http_span name;
+    http_span value;            //without the surrounding white space
+} http_header;
+
+typedef enum request_state {
+    REQ_METHOD,
+    REQ_TARGET,
+    REQ_VERSION,
+    REQ_LINE_LF,                //the LF that ends the request line
+    REQ_HEADER_START,           //start of a header line, or of the empty line
+    REQ_NAME,
+    REQ_VALUE_START,            //white space before the value
+    REQ_VALUE,
+    REQ_HEADER_LF,
+    REQ_END_LF,                 //the LF of the empty line
+    REQ_DONE
+} request_state;
+
+typedef struct http_request {
+    request_state state;
+    size_t pos;                 //next byte to look at
+    size_t mark;                //start of the token being read
+
+    http_span method;
+    http_span target;
+    http_span authority;        //host[:port] of an absolute-form target, the whole target of CONNECT, else empty
+    http_span path;             //path and query, the whole target for the origin form, empty for CONNECT
+    int minor_version;          //1 for HTTP/1.1, 0 for HTTP/1.0
+    http_header headers[HTTP_MAX_HEADERS];
+    int num_headers;
+    size_t head_len;            //set once the parse is done
+} http_request;
+
+#define HTTP_REWRITE_IOV (HTTP_MAX_HEADERS + 16)
+#define HTTP_REWRITE_TEXT 1024
+
+/**
+ * an outgoing request head. the slices point into the parsed buffer, which
+ * must stay in place until the head is sent, and into text
+ */
+typedef struct http_rewrite {
+    struct iovec iov[HTTP_REWRITE_IOV];
+    int num_iov;
+    int next;                       //first slice not completely sent
+    char text[HTTP_REWRITE_TEXT];   //bytes added by the proxy
+    size_t text_len;
+} http_rewrite;
+
+/**
+ * an element added to a list header such as Via: at the end of its last
+ * line, or on a line of its own if the request has none
+ */
+typedef struct http_list_append {
+    const char *name;
+    const char *value;
+} http_list_append;
+
+// how the end of a body is found
+typedef enum body_mode {
+    BODY_NONE,          //no body (HEAD, 1xx, 204, 304)
+    BODY_LENGTH,        //Content-Length bytes
+    BODY_CHUNKED,       //chunked transfer coding, ends with the last chunk and the trailers
+    BODY_UNTIL_CLOSE    //everything until the peer closes
+} body_mode;
+
+typedef enum chunk_state {
+    CHUNK_SIZE,         //hex digits of the chunk size
+    CHUNK_SIZE_WS,      //whitespace after them
+    CHUNK_EXT,          //chunk extensions up to the end of the size line
+    CHUNK_SIZE_LF,      //the LF that ends the size line
+    CHUNK_DATA,
+    CHUNK_DATA_CR,      //the CRLF after the data
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,//start of a trailer line, an empty line ends the body
+    CHUNK_TRAILER,      //inside a trailer line
+    CHUNK_TRAILER_LF,   //the LF that ends it
+    CHUNK_LAST_LF       //the LF of the final empty line
+} chunk_state;
+
+#define CHUNK_MAX_DIGITS 16         //hex digits of a chunk size, what fits in 64 bits
+
+/**
+ * tracks how far into a body a relay is
+ */
+typedef struct http_body {
+    body_mode mode;
+    unsigned long long remaining;   //BODY_LENGTH: bytes left, BODY_CHUNKED: bytes left of the current chunk
+    chunk_state chunk;
+    int digits;                     //of the chunk size read so far
+    int done;                       //1 once the last byte of the body went through
+    int error;                      //1 once the chunked framing turned out malformed, nothing more is taken
+} http_body;
+
+/**
+ * what the proxy needs to know about a response head
+ */
+typedef struct http_response {
+    int status;
+    int minor_version;      //1 for HTTP/1.1, 0 for HTTP/1.0
+    int keep_alive;         //1 if the server keeps the connection open after this response
+    http_body body;
+} http_response;
+
+/**
+ * http_request_init prepares req for the parse of a new request.
+ */
+void http_request_init(http_request *req);
+
+/**
+ * http_parse_request continues parsing the request head in buf, of which
+ * the first len bytes are valid. buf must start with the same bytes as in
+ * the previous calls for the same request, only longer. returns the length
+ * of the head once it is complete, HTTP_PARSE_AGAIN or HTTP_PARSE_ERROR.
+ */
+long http_parse_request(http_request *req, const char *buf, size_t len);
+
+/**
+ * http_request_header looks for a header of a parsed request by name
+ * (case-insensitive). on success stores its value and returns 1, else 0.
+ */
+int http_request_header(const http_request *req, const char *buf, const char *name,
+                        const char **value, size_t *value_len);
+
+/**
+ * http_rewrite_request starts the outgoing head of a parsed request: the
+ * request line and the headers, without the final empty line. dropped are
+ * the hop-by-hop headers (Connection, Keep-Alive, TE, Trailer, Upgrade,
+ * Proxy-*, and the ones Connection names) and the names of drop, a NULL
+ * terminated list (or NULL). returns 0, or -1 if rw is full.
+ */
+int http_rewrite_request(http_rewrite *rw, const http_request *req, const char *buf,
+                         const char *const *drop, const http_list_append *append, int num_append);
+
+/**
+ * http_rewrite_add appends len bytes to the head, they must stay in place
+ * until it is sent. http_rewrite_add_text appends a copy of them.
+ * return 0, or -1 if rw is full.
+ */
+int http_rewrite_add(http_rewrite *rw, const char *data, size_t len);
+int http_rewrite_add_text(http_rewrite *rw, const char *text, size_t len);
+
+/**
+ * http_rewrite_end appends the empty line that ends the head.
+ */
+int http_rewrite_end(http_rewrite *rw);
+
+/**
+ * http_rewrite_send writes what is left of the head to fd with writev and
+ * returns what writev returned. the head is sent once rw->next reaches
+ * rw->num_iov.
+ */
+ssize_t http_rewrite_send(http_rewrite *rw, int fd);
+
+/**
+ * http_span_is compares a span with a string, case-insensitively.
+ */
+int http_span_is(const char *buf, http_span span, const char *text);
+
+/**
+ * http_head_end returns the length of the head (up to and including the
+ * empty line) if buf holds a complete head, else 0.
+ */
+size_t http_head_end(const char *buf, size_t len);
+
+/**
+ * http_find_header looks for a header by name (case-insensitive) in a head
+ * of head_len bytes. on success stores the trimmed value and its length and
+ * returns 1, else returns 0.
+ */
+int http_find_header(const char *head, size_t head_len, const char *name,
+                     const char **value, size_t *value_len);
+
+/**
+ * http_header_has_token returns 1 if the comma separated header value
+ * contains token (case-insensitive).
+ */
+int http_header_has_token(const char *value, size_t value_len, const char *token);
+
+/**
+ * http_request_keep_alive returns 1 if the client of a parsed request
+ * expects the connection to stay open after the response: HTTP/1.1
+ * without "Connection: close", or HTTP/1.0 with "Connection: keep-alive".
+ */
+int http_request_keep_alive(const http_request *req, const char *buf);
+
+/**
+ * http_request_body sets body up for the body of a parsed request: chunked
+ * if Transfer-Encoding says so, else Content-Length bytes, else none.
+ * returns 0, or -1 if the framing is ambiguous or unsupported: a coding
+ * other than chunked, both headers, or malformed or differing lengths.
+ */
+int http_request_body(const http_request *req, const char *buf, http_body *body);
+
+/**
+ * http_parse_response parses a complete response head. head_request is 1
+ * when the request was a HEAD, whose response never has a body.
+ * returns 0, or -1 if the head is not a valid HTTP/1.x response.
+ */
+int http_parse_response(const char *head, size_t head_len, int head_request, http_response *resp);
+
+/**
+ * http_body_consume feeds the next len bytes of the message to the body
+ * tracker. returns how many of them belong to the body, fewer than len
+ * only when the body ended inside data (body->done is then 1) or its
+ * framing is malformed (body->error is then 1). the chunked coding is
+ * taken strictly: a size line is 1 to CHUNK_MAX_DIGITS hex digits, then
+ * only whitespace or ";" extensions, and every line ends with CRLF. where
+ * a malformed body ends is unknown, the connection it came on cannot
+ * carry another message.
+ */
+size_t http_body_consume(http_body *body, const char *data, size_t len);
+
+/**
+ * http_body_payload feeds len bytes of a body to its tracker like
+ * http_body_consume, and moves what they carry of the payload, the body
+ * without its chunked framing, to the start of data. returns the length
+ * of the payload. the bytes must all belong to the body.
+ */
+size_t http_body_payload(http_body *body, char *data, size_t len);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <ctype.h>
+#include "limiter.h"
+#include "mempool.h"
+#include "util.h"
+
+#define LIMITER_BURST_NS 1000000000LL   //how far ahead of now a budget may be paid up to
+#define BYTE_COST_SHIFT 10              //byte_interval is kept in 1024ths of a ns, fast links cost fractions of one
+
+limiter* create_limiter(int rate, int conns, int64_t bandwidth) {
+    limiter *l = (limiter *) mem_calloc(1, sizeof(limiter));
+    if (l == NULL) {
+        return NULL;
+    }
+    if ((l->slots = (limit_slot *) mem_calloc(LIMITER_SLOTS, sizeof(limit_slot))) == NULL) {
+        free(l);
+        return NULL;
+    }
+    l->rate_interval = rate > 0 ? LIMITER_BURST_NS / rate : 0;
+    l->byte_interval = bandwidth > 0 ? (LIMITER_BURST_NS << BYTE_COST_SHIFT) / bandwidth : 0;
+    if (bandwidth > 0 && l->byte_interval == 0) {
+        l->byte_interval = 1;
+    }
+    l->max_holders = conns;
+    return l;
+}
+
+// a slot nobody holds with both budgets paid up to the past carries nothing worth keeping
+static int reusable(limit_slot *slot, int64_t now_ns) {
+    return atomic_load_explicit(&slot->holders, memory_order_relaxed) == 0 &&
+           atomic_load_explicit(&slot->rate_paid, memory_order_relaxed) <= now_ns &&
+           atomic_load_explicit(&slot->bytes_paid, memory_order_relaxed) <= now_ns;
+}
+
+limit_slot* limiter_hold(limiter *l, uint64_t key, int64_t now_ns) {
+    if (key == 0) {
+        key = 1;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        limit_slot *free_slot = NULL;
+        uint64_t free_key = 0;
+        for (uint64_t i = 0; i < LIMITER_PROBES; ++i) {
+            limit_slot *slot = &l->slots[(key + i) & (LIMITER_SLOTS - 1)];
+            uint64_t found = atomic_load_explicit(&slot->key, memory_order_acquire);
+            if (found == key) {
+                atomic_fetch_add_explicit(&slot->holders, 1, memory_order_relaxed);
+                return slot;
+            }
+            if (free_slot == NULL && (found == 0 || reusable(slot, now_ns))) {
+                free_slot = slot;
+                free_key = found;
+            }
+        }
+        if (free_slot == NULL) {
+            return NULL;
+        }
+        // another thread may claim it first, for this key or another one, then look again
+        if (atomic_compare_exchange_strong_explicit(&free_slot->key, &free_key, key,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&free_slot->holders, 1, memory_order_relaxed);
+            return free_slot;
+        }
+    }
+    return NULL;
+}
+
+void limiter_release(limit_slot *slot) {
+    atomic_fetch_sub_explicit(&slot->holders, 1, memory_order_relaxed);
+}
+
+limit_kind limiter_check_holders(const limiter *l, limit_slot *slot) {
+    if (l->max_holders > 0 && atomic_load_explicit(&slot->holders, memory_order_relaxed) > l->max_holders) {
+        return LIMIT_CONNS;
+    }
+    return LIMIT_NONE;
+}
+
+limit_kind limiter_admit(const limiter *l, limit_slot *slot, int64_t now_ns) {
+    if (l->byte_interval != 0 &&
+        atomic_load_explicit(&slot->bytes_paid, memory_order_relaxed) - now_ns > LIMITER_BURST_NS) {
+        return LIMIT_BANDWIDTH;
+    }
+    if (l->rate_interval == 0) {
+        return LIMIT_NONE;
+    }
+    int64_t paid = atomic_load_explicit(&slot->rate_paid, memory_order_relaxed);
+    int64_t next;
+    do {
+        next = (paid > now_ns ? paid : now_ns) + l->rate_interval;
+        if (next - now_ns > LIMITER_BURST_NS) {
+            return LIMIT_RATE;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&slot->rate_paid, &paid, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return LIMIT_NONE;
+}
+
+void limiter_spend(const limiter *l, limit_slot *slot, size_t bytes, int64_t now_ns) {
+    if (l->byte_interval == 0 || bytes == 0) {
+        return;
+    }
+    int64_t cost = (int64_t) (((uint64_t) bytes * (uint64_t) l->byte_interval) >> BYTE_COST_SHIFT);
+    int64_t paid = atomic_load_explicit(&slot->bytes_paid, memory_order_relaxed);
+    int64_t next;
+    do {
+        next = (paid > now_ns ? paid : now_ns) + cost;
+    } while (!atomic_compare_exchange_weak_explicit(&slot->bytes_paid, &paid, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+}
+
+// splitmix64 finalizer, neighbouring addresses land far apart
+uint64_t limiter_hash_addr(uint32_t addr) {
+    uint64_t h = (uint64_t) addr + 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// FNV-1a 64 over the lowercased name
+uint64_t limiter_hash_name(const char *name) {
+    uint64_t h = FNV1A64_INIT;
+    for (const unsigned char *p = (const unsigned char *) name; *p != '\0'; ++p) {
+        h = fnv1a64_byte(h, (unsigned char) tolower(*p));
+    }
+    return h;
+}
+
+void destroy_limiter(limiter *l) {
+    if (l == NULL) {
+        return;
+    }
+    free(l->slots);
+    free(l);
+}
@@ -0,0 +1,106 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * limiter.h
+ *
+ * Admission control: a request rate, a number of concurrent holders and
+ * a bandwidth per key (a client address, a destination host), shared by
+ * every thread without locks.
+ *
+ * each key has a slot in a fixed open-addressed table, found by probing a
+ * few slots from its hash. a slot is claimed with a compare-and-swap of
+ * its key, and a slot nobody holds whose budgets are back to full is as
+ * good as free, so the table ages by itself: the next key that needs
+ * room takes it, nothing sweeps. a key that finds no room is not limited.
+ *
+ * the rate and the bandwidth are kept as a generic cell rate algorithm:
+ * one 64-bit word per budget holds the time the budget is paid up to, a
+ * request moves it a rate interval ahead and is refused if that would
+ * put it more than a second ahead of now, so a key may burst up to one
+ * second of its rate. bytes move it ahead without a check, a key that
+ * spent more than a second of its bandwidth is refused until it paid
+ * that back. every update is one compare-and-swap.
+ *
+ * a hash names a key, two keys with the same 64-bit hash share a slot.
+ * a claim racing a reuse of the same slot can mix the counts of two keys
+ * for an instant, the table itself stays consistent.
+ */
+
+#define LIMITER_SLOTS 65536         //a power of two
+#define LIMITER_PROBES 8            //slots looked at from the one the hash points to
+
+typedef enum limit_kind {
+    LIMIT_NONE,
+    LIMIT_RATE,                 //more requests per second than allowed
+    LIMIT_CONNS,                //more concurrent holders than allowed
+    LIMIT_BANDWIDTH,            //more bytes per second than allowed
+    LIMIT_KINDS
+} limit_kind;
+
+typedef struct limit_slot {
+    _Atomic uint64_t key;       //hash of the key, 0 while the slot was never claimed
+    _Atomic int64_t rate_paid;  //ns the request rate is paid up to
+    _Atomic int64_t bytes_paid; //ns the bandwidth is paid up to
+    atomic_int holders;         //connections or requests holding the slot, it is not reused meanwhile
+} limit_slot;
+
+typedef struct limiter {
+    int64_t rate_interval;      //ns a request costs, 0 for no rate limit
+    int64_t byte_interval;      //1024ths of a ns a byte costs, 0 for no bandwidth limit
+    int max_holders;            //0 for no limit
+    limit_slot *slots;
+} limiter;
+
+/**
+ * create_limiter returns an empty table for rate requests per second,
+ * conns concurrent holders and bandwidth bytes per second per key, 0 for
+ * no limit on one of them. NULL on failure.
+ */
+limiter* create_limiter(int rate, int conns, int64_t bandwidth);
+
+/**
+ * limiter_hold finds or claims the slot of key and holds it until
+ * limiter_release. returns NULL if the table has no room near key, the
+ * key is not limited then.
+ */
+limit_slot* limiter_hold(limiter *l, uint64_t key, int64_t now_ns);
+
+/**
+ * limiter_release gives back a hold of limiter_hold.
+ */
+void limiter_release(limit_slot *slot);
+
+/**
+ * limiter_check_holders returns LIMIT_CONNS if the slot has more holders
+ * than allowed, the caller's own hold included, else LIMIT_NONE.
+ */
+limit_kind limiter_check_holders(const limiter *l, limit_slot *slot);
+
+/**
+ * limiter_admit takes one request from the rate of the slot. returns
+ * LIMIT_NONE if it is admitted, else the budget it is over, and then
+ * nothing was taken.
+ */
+limit_kind limiter_admit(const limiter *l, limit_slot *slot, int64_t now_ns);
+
+/**
+ * limiter_spend charges bytes to the bandwidth of the slot.
+ */
+void limiter_spend(const limiter *l, limit_slot *slot, size_t bytes, int64_t now_ns);
+
+/**
+ * limiter_hash_addr and limiter_hash_name make the key of an IPv4
+ * address in network order, and of a host name compared
+ * case-insensitively.
+ */
+uint64_t limiter_hash_addr(uint32_t addr);
+uint64_t limiter_hash_name(const char *name);
+
+void destroy_limiter(limiter *l);
+
+#endif
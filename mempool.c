@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "mempool.h"
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_extra {
+    struct arena_extra *next;
+    _Alignas(ARENA_ALIGN) char data[];
+} arena_extra;
+
+_Thread_local mem_stats thread_mem_stats;
+
+void* mem_alloc(size_t size) {
+    thread_mem_stats.heap_allocs++;
+    return malloc(size);
+}
+
+void* mem_calloc(size_t count, size_t size) {
+    thread_mem_stats.heap_allocs++;
+    return calloc(count, size);
+}
+
+void* mem_realloc(void *ptr, size_t size) {
+    thread_mem_stats.heap_allocs++;
+    return realloc(ptr, size);
+}
+
+void block_pool_init(block_pool *pool, size_t size, size_t max_free) {
+    // a free block stores the link to the next one
+    pool->size = size < sizeof(void *) ? sizeof(void *) : size;
+    pool->max_free = max_free;
+    pool->num_free = 0;
+    pool->free_list = NULL;
+}
+
+void* block_get(block_pool *pool) {
+    void *block = pool->free_list;
+    if (block != NULL) {
+        pool->free_list = *(void **) block;
+        pool->num_free--;
+        thread_mem_stats.pool_reuses++;
+        return block;
+    }
+    thread_mem_stats.pool_allocs++;
+    return mem_alloc(pool->size);
+}
+
+void block_put(block_pool *pool, void *block) {
+    if (block == NULL) {
+        return;
+    }
+    if (pool->num_free >= pool->max_free) {
+        free(block);
+        return;
+    }
+    *(void **) block = pool->free_list;
+    pool->free_list = block;
+    pool->num_free++;
+}
+
+void block_pool_destroy(block_pool *pool) {
+    while (pool->free_list != NULL) {
+        void *block = pool->free_list;
+        pool->free_list = *(void **) block;
+        free(block);
+    }
+    pool->num_free = 0;
+}
+
+void arena_init(arena *a, block_pool *pool) {
+    a->pool = pool;
+    a->base = NULL;
+    a->used = 0;
+    a->extra = NULL;
+}
+
+void* arena_alloc(arena *a, size_t size) {
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (a->base == NULL && rounded <= a->pool->size) {
+        if ((a->base = (char *) block_get(a->pool)) == NULL) {
+            return NULL;
+        }
+        a->used = 0;
+    }
+    if (a->base != NULL && rounded <= a->pool->size - a->used) {
+        void *ptr = a->base + a->used;
+        a->used += rounded;
+        return ptr;
+    }
+    thread_mem_stats.arena_overflows++;
+    arena_extra *extra = (arena_extra *) mem_alloc(sizeof(arena_extra) + size);
+    if (extra == NULL) {
+        return NULL;
+    }
+    extra->next = a->extra;
+    a->extra = extra;
+    return extra->data;
+}
+
+void arena_reset(arena *a) {
+    while (a->extra != NULL) {
+        arena_extra *next = a->extra->next;
+        free(a->extra);
+        a->extra = next;
+    }
+    // an idle connection holds no block
+    block_put(a->pool, a->base);
+    a->base = NULL;
+    a->used = 0;
+}
@@ -0,0 +1,91 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stddef.h>
+
+/**
+ * mempool.h
+ *
+ * Memory of the request path without the global allocator.
+ *
+ * a reactor keeps pools of fixed-size blocks: its connections, the I/O
+ * buffers they read requests and response heads into, the buffers holding
+ * what a slow client did not take yet. a block given back is handed out
+ * again rather than freed, so once the pools are warm a request costs a
+ * few pointer swaps. the small, short-lived allocations of a request (the
+ * rewritten request, the cache key, a generated head or error page) are
+ * carved from an arena of the connection, released at once when the
+ * connection moves on to its next request.
+ *
+ * the pools and arenas are not thread-safe, each one belongs to a reactor.
+ * what still goes to malloc on a thread goes through mem_alloc and friends
+ * and is counted in its mem_stats.
+ */
+
+/**
+ * allocation counters of a thread
+ */
+typedef struct mem_stats {
+    size_t heap_allocs;         //calls to malloc, calloc and realloc
+    size_t pool_reuses;         //blocks handed out again by a pool
+    size_t pool_allocs;         //blocks a pool had to allocate, included in heap_allocs
+    size_t arena_overflows;     //arena allocations that did not fit in its block, included in heap_allocs
+} mem_stats;
+
+extern _Thread_local mem_stats thread_mem_stats;
+
+void* mem_alloc(size_t size);
+void* mem_calloc(size_t count, size_t size);
+void* mem_realloc(void *ptr, size_t size);
+
+/**
+ * free list of blocks of one size
+ */
+typedef struct block_pool {
+    size_t size;                //bytes of every block
+    size_t max_free;            //blocks kept for reuse, the ones given back beyond are freed
+    size_t num_free;
+    void *free_list;            //a free block holds the address of the next one
+} block_pool;
+
+void block_pool_init(block_pool *pool, size_t size, size_t max_free);
+
+/**
+ * block_get returns a block of pool->size bytes, NULL if it cannot be
+ * allocated. its content is undefined.
+ */
+void* block_get(block_pool *pool);
+
+void block_put(block_pool *pool, void *block);
+
+/**
+ * block_pool_destroy frees the blocks kept for reuse, the ones handed out
+ * must have been given back.
+ */
+void block_pool_destroy(block_pool *pool);
+
+/**
+ * bump allocator whose first block comes from a pool and is given back on
+ * reset. allocations that do not fit in it get blocks of their own.
+ */
+typedef struct arena {
+    block_pool *pool;
+    char *base;                 //block of the pool, NULL until the first allocation
+    size_t used;
+    struct arena_extra *extra;  //blocks of the allocations that did not fit
+} arena;
+
+void arena_init(arena *a, block_pool *pool);
+
+/**
+ * arena_alloc returns size bytes, aligned for any type, valid until the
+ * next arena_reset. NULL if they cannot be allocated.
+ */
+void* arena_alloc(arena *a, size_t size);
+
+/**
+ * arena_reset releases every allocation of the arena.
+ */
+void arena_reset(arena *a);
+
+#endif
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+#define ADMIN_REQUEST_MAX 4096
+#define ADMIN_TIMEOUT_S 2           //a scraper that does not send its request in time is dropped
+
+// values below 2^HIST_SUB_BITS have a bucket each, the others 2^HIST_SUB_BITS per power of two
+static int bucket_of(uint64_t us) {
+    if (us < (1 << HIST_SUB_BITS)) {
+        return (int) us;
+    }
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (int) (us >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    int bucket = (exp - HIST_SUB_BITS + 1) * (1 << HIST_SUB_BITS) + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// the first value of the next bucket, every value of the bucket is below it
+static uint64_t bucket_end(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return (uint64_t) bucket + 1;
+    }
+    int exp = bucket / (1 << HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (bucket % (1 << HIST_SUB_BITS));
+    return ((1ULL << HIST_SUB_BITS) + sub + 1) << (exp - HIST_SUB_BITS);
+}
+
+void histogram_record(histogram *h, uint64_t us) {
+    counter_add(&h->buckets[bucket_of(us)], 1);
+    counter_add(&h->sum, us);
+}
+
+void metrics_printf(metrics_buf *out, const char *format, ...) {
+    while (!out->failed) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(out->data + out->len, out->cap - out->len, format, args);
+        va_end(args);
+        if (n < 0) {
+            out->failed = 1;
+            return;
+        }
+        if ((size_t) n < out->cap - out->len) {
+            out->len += n;
+            return;
+        }
+        size_t cap = out->cap == 0 ? 16384 : out->cap * 2;
+        while (cap - out->len <= (size_t) n) {
+            cap *= 2;
+        }
+        char *temp = (char *) realloc(out->data, cap);
+        if (temp == NULL) {
+            out->failed = 1;
+            return;
+        }
+        out->data = temp;
+        out->cap = cap;
+    }
+}
+
+void metrics_counter(metrics_buf *out, const char *name, const char *help, uint64_t value) {
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+                   (unsigned long long) value);
+}
+
+void metrics_gauge(metrics_buf *out, const char *name, const char *help, uint64_t value) {
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name,
+                   (unsigned long long) value);
+}
+
+void metrics_histogram(metrics_buf *out, const char *name, const char *help, const histogram *const *parts, int num) {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t sum = 0;
+    int last = -1;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        buckets[b] = 0;
+        for (int i = 0; i < num; ++i) {
+            buckets[b] += counter_read(&parts[i]->buckets[b]);
+        }
+        if (buckets[b] != 0) {
+            last = b;
+        }
+    }
+    for (int i = 0; i < num; ++i) {
+        sum += counter_read(&parts[i]->sum);
+    }
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    // the buckets up to the last one used, the set only grows from one scrape to the next
+    uint64_t count = 0;
+    for (int b = 0; b <= last && b < HIST_BUCKETS - 1; ++b) {
+        count += buckets[b];
+        metrics_printf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double) bucket_end(b) / 1e6,
+                       (unsigned long long) count);
+    }
+    if (last == HIST_BUCKETS - 1) {
+        count += buckets[last];
+    }
+    metrics_printf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n", name,
+                   (unsigned long long) count, name, (double) sum / 1e6, name, (unsigned long long) count);
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t wrote = send(fd, data, len, MSG_NOSIGNAL);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+static void serve_scrape(admin_server *s, int fd) {
+    char request[ADMIN_REQUEST_MAX];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t got = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        len += got;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[len] = '\0';
+    char head[160];
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0) {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+    metrics_buf out;
+    memset(&out, 0, sizeof(out));
+    s->render(s->ctx, &out);
+    if (out.failed) {
+        static const char failed[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n"
+                                     "Connection: close\r\n\r\n";
+        send_all(fd, failed, sizeof(failed) - 1);
+    } else {
+        int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\nConnection: close\r\n\r\n", out.len);
+        if (send_all(fd, head, head_len) == 0) {
+            send_all(fd, out.data, out.len);
+        }
+    }
+    free(out.data);
+}
+
+static void* run_admin_server(void *arg) {
+    admin_server *s = (admin_server *) arg;
+    while (1) {
+        int fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // the listening socket was shut down by stop_admin_server
+            return NULL;
+        }
+        struct timeval timeout = {ADMIN_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_scrape(s, fd);
+        close(fd);
+    }
+}
+
+static int parse_admin_address(const char *spec, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *colon = strrchr(spec, ':');
+    const char *port = colon != NULL ? colon + 1 : spec;
+    if (colon != NULL) {
+        char ip[64];
+        size_t len = (size_t) (colon - spec);
+        if (len >= sizeof(ip)) {
+            return -1;
+        }
+        memcpy(ip, spec, len);
+        ip[len] = '\0';
+        if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1) {
+            return -1;
+        }
+    }
+    char *end;
+    unsigned long value = strtoul(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || value == 0 || value > 65535) {
+        return -1;
+    }
+    addr->sin_port = htons((in_port_t) value);
+    return 0;
+}
+
+admin_server* start_admin_server(const char *spec, metrics_render render, void *ctx) {
+    struct sockaddr_in addr;
+    if (parse_admin_address(spec, &addr) == -1) {
+        fprintf(stderr, "%s: not an admin address\n", spec);
+        return NULL;
+    }
+    admin_server *s = (admin_server *) calloc(1, sizeof(admin_server));
+    if (s == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    s->render = render;
+    s->ctx = ctx;
+    int on = 1;
+    if ((s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP)) == -1 ||
+        setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+        bind(s->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(s->fd, 16) == -1) {
+        perror("admin socket");
+        if (s->fd != -1) {
+            close(s->fd);
+        }
+        free(s);
+        return NULL;
+    }
+    if (pthread_create(&s->thread, NULL, run_admin_server, (void *) s) != 0) {
+        perror("pthread_create");
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void stop_admin_server(admin_server *s) {
+    // accept fails once the socket is shut down, the thread ends after the scrape it may be serving
+    shutdown(s->fd, SHUT_RDWR);
+    pthread_join(s->thread, NULL);
+    close(s->fd);
+    free(s);
+}
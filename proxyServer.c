@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -8,422 +10,655 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include "threadpool.h"
-#define IPV4_BINARY_LENGTH 32
-#define READ_BUFFER_LEN 1000
-#define RESPONSE_BUFFER_LEN 5000
+#include "proxyServer.h"
+#include "reactor.h"
+#include "resolver.h"
+#include "filter.h"
+#include "metrics.h"
+#include "compress.h"
+#include "handoff.h"
+#define USAGE "Usage: proxyServer [options] <port> <pool-size> <max-number-of-request> <filter>\n"\
+              "  --reactors=<n>         event loops, each with its own listening socket (0 = one per cpu)\n"\
+              "  --backlog=<n>          listen backlog\n"\
+              "  --pin-cpus             bind reactor i to cpu i\n"\
+              "  --no-splice            relay through a user space buffer instead of splice()\n"\
+              "  --queue-capacity=<n>   jobs the threadpool queues\n"\
+              "  --queue-policy=<p>     reject (503) or drop when the queue is full\n"\
+              "  --dns-server=<ip[:port]> name server to query (default: first of /etc/resolv.conf)\n"\
+              "  --hosts-file=<path>    names answered without a query (default /etc/hosts)\n"\
+              "  --upstream-max-idle=<n> idle upstream connections kept per reactor (0 = no pooling)\n"\
+              "  --upstream-max-idle-per-host=<n> idle connections kept per host and port\n"\
+              "  --upstream-idle-timeout=<s> seconds an idle upstream connection is kept\n"\
+              "  --client-idle-timeout=<s> seconds a client may wait between requests\n"\
+              "  --header-timeout=<s>   seconds a request head may take once it started (408)\n"\
+              "  --connect-timeout=<s>  seconds an upstream has to accept the connection (504)\n"\
+              "  --io-timeout=<s>       seconds a response or tunnel may go without traffic\n"\
+              "  --transfer-timeout=<s> seconds a request may take from head to last byte (0 = no limit)\n"\
+              "  --balance=<p>          p2c or latency, how the address of a new upstream connection is picked\n"\
+              "  --connect-stagger=<ms> delay before the next address of a host is tried alongside\n"\
+              "  --eject-failures=<n>   failed connects in a row that take an address out of rotation\n"\
+              "  --eject-time=<s>       seconds it stays out\n"\
+              "  --client-rate=<n>      requests per second of a client address (429, 0 = no limit)\n"\
+              "  --client-conns=<n>     connections open at once from a client address\n"\
+              "  --client-bandwidth=<KB> KB per second sent to a client address\n"\
+              "  --host-rate=<n>        requests per second sent to an upstream host (503, 0 = no limit)\n"\
+              "  --host-conns=<n>       requests under way at once to an upstream host\n"\
+              "  --host-bandwidth=<KB>  KB per second read from an upstream host\n"\
+              "  --compress=<codings>   gzip, br or gzip,br: compress text responses the client accepts so\n"\
+              "  --compress-level=<n>   1 (fastest) to 9, up to 11 for br\n"\
+              "  --compress-min=<bytes> smallest response compressed\n"\
+              "  --cache-size=<MB>      memory of the response cache (0 = no caching)\n"\
+              "  --cache-max-object=<KB> biggest response the cache stores\n"\
+              "  --disk-cache=<dir>     persistent cache in dir\n"\
+              "  --disk-cache-size=<MB> disk space it uses\n"\
+              "  --disk-cache-max-object=<MB> biggest response it stores\n"\
+              "  --coalesce-wait=<ms>   how long a request waits on a fetch of the same object (0 = no coalescing)\n"\
+              "  --mem-stats            print the allocation counters of the reactors on exit\n"\
+              "  --admin=<[ip:]port>    serve Prometheus metrics on /metrics (ip defaults to 127.0.0.1)\n"\
+              "  --trace=<file>         write the phase timings of every request to file (tools/trace_decode)\n"\
+              "  --drain-timeout=<s>    on SIGTERM or an upgrade (SIGUSR2), seconds the open connections get to finish\n"\
+              "  --connect-ports=<list> ports CONNECT may tunnel to, e.g. 443,8443,9000-9100 (default 443)\n"
+
+#define MAX_LIMIT_RATE 1000000    //requests per second, a request then costs 1 µs of the budget
+#define MAX_LIMIT_KB 16777216       //KB per second
 
-typedef struct Client{
-    struct sockaddr_in sock_info;
-    int sock_fd;
-}Client;
-
-struct Node {
-    char *line;
-    struct Node *next;
-};
-
-
-
-int client_handler (void*);
-int check_request(const char *);
 void arguments_check(const int *,const size_t *,const size_t*);
-void insert_host(char *);
-int search_host(char *);
-char* to_binary(char*);
-char* token_to_binary(int);
-char* error_generator(int);
-void write_to_socket(int, char*, unsigned long);
-void free_list();
-void write_to_client_socket(int, unsigned char*, unsigned long);
-
-struct Node* filter_head = NULL;
+unsigned int parse_codings(const char *);
+int parse_ports(const char *, uint64_t *);
+int open_listener(in_port_t, int, int);
+void render_metrics(void *, metrics_buf *);
+void on_signal(void *, int);
+
+/**
+ * what a scrape of the admin server reads
+ */
+typedef struct metrics_sources {
+    reactor_group *group;
+    threadpool *tp;
+} metrics_sources;
+
+/**
+ * what the shutdown and upgrade signals act on
+ */
+typedef struct lifecycle {
+    reactor_group *group;
+    const proxy_config *config;
+    admin_server *admin;        //stopped while a successor starts, it binds the same port
+    metrics_sources *sources;
+    char **argv;                //what the successor is started with
+    int *listen_fds;
+    int num_listeners;
+    int draining;
+} lifecycle;
+
+live_filter host_filter;
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+    static struct option long_options[] = {
+            {"reactors", required_argument, NULL, 'r'},
+            {"backlog",  required_argument, NULL, 'b'},
+            {"pin-cpus", no_argument,       NULL, 'c'},
+            {"no-splice", no_argument,      NULL, 'n'},
+            {"queue-capacity", required_argument, NULL, 'q'},
+            {"queue-policy", required_argument, NULL, 'o'},
+            {"dns-server", required_argument, NULL, 'd'},
+            {"hosts-file", required_argument, NULL, 'H'},
+            {"upstream-max-idle", required_argument, NULL, 'I'},
+            {"upstream-max-idle-per-host", required_argument, NULL, 'P'},
+            {"upstream-idle-timeout", required_argument, NULL, 'T'},
+            {"client-idle-timeout", required_argument, NULL, 'k'},
+            {"header-timeout", required_argument, NULL, 'E'},
+            {"connect-timeout", required_argument, NULL, 'N'},
+            {"io-timeout", required_argument, NULL, 'i'},
+            {"transfer-timeout", required_argument, NULL, 'F'},
+            {"balance", required_argument, NULL, 'B'},
+            {"connect-stagger", required_argument, NULL, 'G'},
+            {"eject-failures", required_argument, NULL, 'J'},
+            {"eject-time", required_argument, NULL, 'j'},
+            {"client-rate", required_argument, NULL, 'R'},
+            {"client-conns", required_argument, NULL, 'L'},
+            {"client-bandwidth", required_argument, NULL, 'U'},
+            {"host-rate", required_argument, NULL, 'Q'},
+            {"host-conns", required_argument, NULL, 'K'},
+            {"host-bandwidth", required_argument, NULL, 'V'},
+            {"compress", required_argument, NULL, 'z'},
+            {"compress-level", required_argument, NULL, 'l'},
+            {"compress-min", required_argument, NULL, 'm'},
+            {"cache-size", required_argument, NULL, 'C'},
+            {"cache-max-object", required_argument, NULL, 'X'},
+            {"disk-cache", required_argument, NULL, 'D'},
+            {"disk-cache-size", required_argument, NULL, 'S'},
+            {"disk-cache-max-object", required_argument, NULL, 'O'},
+            {"coalesce-wait", required_argument, NULL, 'W'},
+            {"mem-stats", no_argument, NULL, 'M'},
+            {"admin", required_argument, NULL, 'A'},
+            {"trace", required_argument, NULL, 't'},
+            {"drain-timeout", required_argument, NULL, 'e'},
+            {"connect-ports", required_argument, NULL, 'p'},
+            {NULL, 0, NULL, 0}
+    };
+    proxy_config config;
+    memset(&config, 0, sizeof(proxy_config));
+    config.num_reactors = 1; // 0 means one per online cpu
+    config.backlog = SOMAXCONN;
+    config.use_splice = 1;
+    config.queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    // the reactors dispatch, they answer 503 rather than wait for room
+    config.queue_policy = TP_REJECT;
+    config.hosts_file = "/etc/hosts";
+    config.upstream_max_idle = 256;
+    config.upstream_max_idle_per_host = 8;
+    config.upstream_idle_timeout = 30;
+    config.client_idle_timeout = 15;
+    config.header_timeout = 10;
+    config.connect_timeout = 10;
+    config.io_timeout = 60;
+    config.balance = BALANCE_P2C;
+    config.connect_stagger = 250;
+    config.eject_failures = 3;
+    config.eject_time = 30;
+    config.compress_level = 5;
+    config.coalesce_wait = 5000;
+    config.drain_timeout = 30;
+    // a tunnel to any port would relay mail, ssh and the like
+    parse_ports("443", config.connect_ports);
+    long cache_mb = 64;
+    long cache_max_kb = 1024;
+    long disk_mb = 1024;
+    long disk_max_mb = 32;
+    long client_kb = 0;
+    long host_kb = 0;
+    long compress_min = 1024;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:b:cnq:o:d:H:I:P:T:k:E:N:i:F:B:G:J:j:R:L:U:Q:K:V:z:l:m:C:X:D:S:O:W:MA:t:e:p:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                config.num_reactors = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.backlog = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                config.pin_cpus = 1;
+                break;
+            case 'n':
+                config.use_splice = 0;
+                break;
+            case 'q':
+                config.queue_capacity = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                if (strcmp(optarg, "reject") == 0) {
+                    config.queue_policy = TP_REJECT;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    config.queue_policy = TP_DROP;
+                } else {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                config.dns_server = optarg;
+                break;
+            case 'H':
+                config.hosts_file = optarg;
+                break;
+            case 'I':
+                config.upstream_max_idle = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'P':
+                config.upstream_max_idle_per_host = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'T':
+                config.upstream_idle_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                config.client_idle_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'E':
+                config.header_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'N':
+                config.connect_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                config.io_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'F':
+                config.transfer_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'B':
+                if (strcmp(optarg, "p2c") == 0) {
+                    config.balance = BALANCE_P2C;
+                } else if (strcmp(optarg, "latency") == 0) {
+                    config.balance = BALANCE_LATENCY;
+                } else {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'G':
+                config.connect_stagger = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'J':
+                config.eject_failures = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'j':
+                config.eject_time = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'R':
+                config.client_rate = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'L':
+                config.client_conns = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'U':
+                client_kb = strtol(optarg, NULL, 10);
+                break;
+            case 'Q':
+                config.host_rate = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'K':
+                config.host_conns = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'V':
+                host_kb = strtol(optarg, NULL, 10);
+                break;
+            case 'z':
+                if ((config.compress = parse_codings(optarg)) == 0) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                config.compress_level = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                compress_min = strtol(optarg, NULL, 10);
+                break;
+            case 'C':
+                cache_mb = strtol(optarg, NULL, 10);
+                break;
+            case 'X':
+                cache_max_kb = strtol(optarg, NULL, 10);
+                break;
+            case 'D':
+                config.disk_cache_dir = optarg;
+                break;
+            case 'S':
+                disk_mb = strtol(optarg, NULL, 10);
+                break;
+            case 'O':
+                disk_max_mb = strtol(optarg, NULL, 10);
+                break;
+            case 'M':
+                config.mem_stats = 1;
+                break;
+            case 'W':
+                config.coalesce_wait = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'A':
+                config.admin = optarg;
+                break;
+            case 't':
+                config.trace_file = optarg;
+                break;
+            case 'e':
+                config.drain_timeout = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                if (parse_ports(optarg, config.connect_ports) == -1) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                printf(USAGE);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 4 || config.num_reactors < 0 || config.backlog < 1 ||
+        config.queue_capacity < 1 || config.upstream_max_idle < 0 ||
+        config.upstream_max_idle_per_host < 0 || config.upstream_idle_timeout < 1 ||
+        config.client_idle_timeout < 1 || config.header_timeout < 1 || config.connect_timeout < 1 ||
+        config.io_timeout < 1 || config.transfer_timeout < 0 || config.connect_stagger < 1 ||
+        config.eject_failures < 1 || config.eject_time < 1 || config.client_rate < 0 ||
+        config.client_rate > MAX_LIMIT_RATE || config.client_conns < 0 || client_kb < 0 ||
+        client_kb > MAX_LIMIT_KB || config.host_rate < 0 || config.host_rate > MAX_LIMIT_RATE ||
+        config.host_conns < 0 || host_kb < 0 || host_kb > MAX_LIMIT_KB || config.compress_level < 1 ||
+        config.compress_level > 11 || compress_min < 0 || cache_mb < 0 || cache_max_kb < 1 ||
+        disk_mb < 1 || disk_max_mb < 1 || config.coalesce_wait < 0 || config.drain_timeout < 0) {
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
+    config.compress_min = (size_t) compress_min;
+    config.client_bandwidth = (size_t) client_kb * 1024;
+    config.host_bandwidth = (size_t) host_kb * 1024;
+    config.cache_size = (size_t) cache_mb * 1024 * 1024;
+    config.cache_max_object = (size_t) cache_max_kb * 1024;
+    config.disk_cache_size = (size_t) disk_mb * 1024 * 1024;
+    config.disk_cache_max_object = (size_t) disk_max_mb * 1024 * 1024;
+    if (config.num_reactors == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.num_reactors = cpus > 0 ? (int) cpus : 1;
+    }
+    int num_reactors = config.num_reactors;
     //read the arguments from the command line, convert them to specified types
-    int port_i = (in_port_t)strtoul(argv[1],NULL, 10);
-    size_t pool_size = strtoul(argv[2], NULL, 10);
-    size_t max_tasks = strtoul(argv[3], NULL, 10);
-    char* file_path = argv[4];
+    int port_i = (in_port_t)strtoul(argv[optind],NULL, 10);
+    size_t pool_size = strtoul(argv[optind + 1], NULL, 10);
+    size_t max_tasks = strtoul(argv[optind + 2], NULL, 10);
+    char* file_path = argv[optind + 3];
 
     arguments_check(&port_i, &pool_size, &max_tasks);
+    config.max_tasks = max_tasks;
     in_port_t port = (in_port_t)port_i;
-    // open the filter file
-    FILE *file = fopen(file_path, "r");
-    if (file == NULL) {
+    // compile the names and ips of forbidden hosts
+    filter* initial_filter = load_filter(file_path);
+    if (initial_filter == NULL) {
         printf("Error opening file\n");
         exit(EXIT_FAILURE);
     }
-    // create a linked list with names and ips of forbidden hosts
-    char file_read_buffer[256];
-    while (fgets(file_read_buffer, sizeof(file_read_buffer), file) != NULL) {
-        // Remove newline character from the end of the line
-        file_read_buffer[strcspn(file_read_buffer, "\r\n")] = '\0';
-        insert_host(file_read_buffer);
-    }
-    fclose(file);
-    file = NULL;
-
-    // create our proxy server
-    struct sockaddr_in* proxy_info = (struct sockaddr_in*)malloc(sizeof (struct sockaddr_in));
-    memset(proxy_info, 0, sizeof(struct sockaddr_in));
-    proxy_info ->sin_family = AF_INET;
-    proxy_info -> sin_port = htons(port);
-    proxy_info -> sin_addr.s_addr = htonl(INADDR_ANY);
-
-    int welcome_socket;
-    if((welcome_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1){
-        perror("socket");
-        free_list();
+    live_filter_init(&host_filter, initial_filter);
+    // SIGHUP reloads the filter, SIGTERM and SIGINT drain, SIGUSR2 upgrades. they are taken with
+    // signalfds by watcher threads, so they have to be blocked before any thread is created to inherit the mask
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    filter_watcher* watcher = start_filter_watcher(&host_filter, file_path);
+    if (watcher == NULL) {
+        live_filter_destroy(&host_filter);
         exit(EXIT_FAILURE);
     }
 
-    if(bind(welcome_socket, (struct sockaddr*)proxy_info, sizeof (struct sockaddr_in)) == -1){
-        close(welcome_socket);
-        free(proxy_info);
-        free_list();
-        perror("bind");
+    // the listening sockets of the process this one replaces are kept, with their accept queues
+    int* listen_fds = NULL;
+    int inherited = handoff_receive(&listen_fds);
+    if (inherited == -1) {
+        stop_filter_watcher(watcher);
+        live_filter_destroy(&host_filter);
         exit(EXIT_FAILURE);
     }
-
-    if(listen(welcome_socket, 5) == -1){
-        close(welcome_socket);
-        free(proxy_info);
-        free_list();
-        perror("listen");
+    if (inherited > 0) {
+        if (inherited != num_reactors) {
+            fprintf(stderr, "%d listening sockets handed over, running %d reactors instead of %d\n",
+                    inherited, inherited, num_reactors);
+        }
+        config.num_reactors = num_reactors = inherited;
+        config.handed_over = 1;
+    }
+    // create our proxy server, a listening socket per reactor
+    if (listen_fds == NULL && (listen_fds = (int*)malloc(sizeof(int) * num_reactors)) == NULL) {
+        perror("malloc");
+        stop_filter_watcher(watcher);
+        live_filter_destroy(&host_filter);
         exit(EXIT_FAILURE);
     }
-    threadpool* tp = create_threadpool((int)pool_size);
-    // using a loop accept requests, limited by max num of requests
-    for (size_t i = 0; i < max_tasks; ++i) {
-        Client* client = (Client*) malloc(sizeof(Client));
-        socklen_t struct_len = sizeof(struct sockaddr_in);
-        client -> sock_fd = accept(welcome_socket, (struct sockaddr*)&client->sock_info,
-                                   &struct_len);
-        dispatch(tp, client_handler, (void *) client);
-    }
-
-    // free our resources
-    destroy_threadpool(tp);
-    close(welcome_socket);
-    free(proxy_info);
-    free_list();
-    return 0;
-}
-
-int client_handler(void* arg) {
-    Client *client = (Client *) arg;
-    char read_buffer[READ_BUFFER_LEN];
-    memset(read_buffer, 0, READ_BUFFER_LEN);
-    char *client_request = (char *) malloc(READ_BUFFER_LEN);
-    size_t allocated_size = READ_BUFFER_LEN;
-    memset(client_request, 0, allocated_size);
-    size_t bytes_read;
-    size_t total_bytes_read = 0;
-    do{ // read until we find the end of request signature
-        bytes_read = read(client->sock_fd, read_buffer, sizeof(read_buffer));
-        if (bytes_read <= 0) {
-            break;
-        }
-        total_bytes_read += bytes_read; // accumulate the total response length
-        if (total_bytes_read >= allocated_size) { // Check the need of reallocation
-            allocated_size *= 2; // Double the allocated size
-            char *temp = realloc(client_request, allocated_size);
-            if (temp == NULL) {
-                char* msg = error_generator(500);
-                write_to_socket(client -> sock_fd, msg, strlen(msg));
-                free(msg);
-                free(client_request);
-                return 0;
+    for (int i = 0; i < num_reactors && !config.handed_over; ++i) {
+        if ((listen_fds[i] = open_listener(port, config.backlog, num_reactors > 1)) == -1) {
+            while (i-- > 0) {
+                close(listen_fds[i]);
             }
-            client_request = temp;
+            free(listen_fds);
+            stop_filter_watcher(watcher);
+            live_filter_destroy(&host_filter);
+            exit(EXIT_FAILURE);
         }
-        memcpy(client_request + total_bytes_read - bytes_read, read_buffer, bytes_read);
-        memset(read_buffer, 0, allocated_size);
-
-    //+ total_bytes_read - 4
-    } while (strstr((char *) client_request, "\r\n\r\n") == NULL);
-    if(total_bytes_read == 0){
-        return 0;
-    }
-    client_request[total_bytes_read] = '\0';
-    int validity;
-    int sock_fd = -1;
-    //check if the three tokens exist
-    if ((validity = check_request((char *) client_request)) != 1){
-        char* msg =  error_generator(validity);
-        write_to_socket(client -> sock_fd, msg, strlen(msg));
-        free(msg);
-        goto termination;
     }
-
-    //extract the host name and the port(if existed) from the client request
-    char host[100];
-    char* host_start = strstr(client_request, "Host: ") + strlen("Host: ");
-    char* host_end = strstr(host_start, ":");
-    host_end = (host_end != NULL && host_end < strstr(host_start, "\r\n")) ? host_end : strstr(host_start, "\r\n");
-    int i = 0;
-    for (; i < host_end - host_start; i++) {
-        host[i] = *(host_start + i);
-    }
-    host[i] = '\0';
-
-
-    in_port_t port;
-    char* port_start = *host_end != ':' ? NULL : host_end + 1;
-    if(port_start != NULL){
-        char * port_end = strstr(port_start, "\r\n");
-        char port_str[10];
-        memset(port_str, 0, 10);
-        i = 0;
-        for (; i < port_end - port_start; i++) {
-            port_str[i] = *(port_start + i);
+    // a client that disconnects mid response must not kill the whole proxy
+    signal(SIGPIPE, SIG_IGN);
+    threadpool* tp = create_bounded_threadpool((int)pool_size, config.queue_capacity, config.queue_policy);
+    if (tp == NULL) {
+        printf(USAGE);
+        for (int i = 0; i < num_reactors; ++i) {
+            close(listen_fds[i]);
         }
-        port_str[i] = '\0';
-        port = strtoul(port_str, NULL, 10);
-    }
-    else{
-        port = 80;
-    }
-    // get the server info to connect it
-    struct hostent *server_info = NULL;
-    server_info = gethostbyname(host);
-    struct sockaddr_in sock_info;
-
-    if(server_info != NULL) {
-        memset(&sock_info, 0, sizeof(struct sockaddr_in));
-        sock_info.sin_family = AF_INET;
-        sock_info.sin_port = htons(port);
-        sock_info.sin_addr.s_addr = ((struct in_addr *) server_info->h_addr_list[0])->s_addr;
-    }
-    else{
-        char* msg = error_generator(404);
-        write_to_socket(client -> sock_fd, msg, strlen(msg));
-        free(msg);
-        goto termination;
-
-    }
-    if(search_host(host)){
-        char* msg = error_generator(403);
-        write_to_socket(client -> sock_fd, msg, strlen(msg));
-        free(msg);
-        goto termination;
+        free(listen_fds);
+        stop_filter_watcher(watcher);
+        live_filter_destroy(&host_filter);
+        exit(EXIT_FAILURE);
     }
-
-    if ((sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
-        char* msg = error_generator(500);
-        write_to_socket(client -> sock_fd, msg, strlen(msg));
-        free(msg);
-        goto termination;
-    }
-    if (connect(sock_fd, (struct sockaddr *) &sock_info, sizeof(struct sockaddr_in)) == -1) {
-        char* msg = error_generator(500);
-        write_to_socket(client -> sock_fd, msg, strlen(msg));
-        free(msg);
-        goto termination;
-
+    // serve requests from the event loops, limited by max num of requests
+    resolver* res = create_resolver(config.dns_server, config.hosts_file);
+    reactor_group* group = res == NULL ? NULL : create_reactor_group(listen_fds, tp, res, &config);
+    if (group == NULL) {
+        destroy_threadpool(tp);
+        if (res != NULL) {
+            destroy_resolver(res);
+        }
+        for (int i = 0; i < num_reactors; ++i) {
+            close(listen_fds[i]);
+        }
+        free(listen_fds);
+        stop_filter_watcher(watcher);
+        live_filter_destroy(&host_filter);
+        exit(EXIT_FAILURE);
     }
-
-    //change the connection attribute to close, or add it.
-    char* connection_start = strstr(client_request, "Connection: ");
-    if (connection_start != NULL) {
-        // Calculate the length of the substring before "Connection: "
-        size_t prefix_length = connection_start - client_request;
-
-        // Allocate memory for the new request, including additional space for "Connection: close"
-        char* new_request = (char*)malloc(prefix_length + strlen("Connection: close\r\n\r\n") + 1);
-        memcpy(new_request, client_request, prefix_length);
-        strcpy(new_request + prefix_length, "Connection: close\r\n\r\n");
-        free(client_request);
-        client_request = new_request;
+    // the admin server only reads counters, it starts once there is something to read
+    metrics_sources sources = {group, tp};
+    admin_server* admin = NULL;
+    if (config.admin != NULL && (admin = start_admin_server(config.admin, render_metrics, &sources)) == NULL) {
+        fprintf(stderr, "metrics are not served\n");
+    }
+    lifecycle lc = {group, &config, admin, &sources, argv, listen_fds, num_reactors, 0};
+    int status = EXIT_SUCCESS;
+    if (handoff_ready() == -1) {
+        // the predecessor kept the sockets and serves on
+        fprintf(stderr, "the handoff was called off\n");
+        status = EXIT_FAILURE;
     } else {
-        char* new_request = (char*)malloc(strlen(client_request) - 4 + strlen("Connection: close\r\n\r\n") + 1);
-        strcpy(new_request, client_request);
-        memcpy(new_request + strlen(client_request) - 4, "Connection: close\r\n\r\n", strlen("Connection: close\r\n\r\n"));
-        free(client_request);
-        client_request = new_request;
+        signal_watcher* signals = start_signal_watcher(&stop, on_signal, &lc);
+        run_reactor_group(group);
+        if (signals != NULL) {
+            stop_signal_watcher(signals);
+        }
     }
 
-    if (send(sock_fd, client_request, strlen(client_request), 0) == -1) {
-        char* msg = error_generator(500);
-        write_to_socket(client -> sock_fd, msg, strlen(msg));
-        free(msg);
-        goto termination;
+    // free our resources
+    if (lc.admin != NULL) {
+        stop_admin_server(lc.admin);
     }
-
-    unsigned char response_buffer[RESPONSE_BUFFER_LEN];
-    memset(response_buffer, 0, RESPONSE_BUFFER_LEN);
-    ssize_t response_bytes_read = read(sock_fd, response_buffer, RESPONSE_BUFFER_LEN);
-    while(response_bytes_read > 0){
-        write_to_client_socket(client -> sock_fd, response_buffer, response_bytes_read);
-        memset(response_buffer, 0, RESPONSE_BUFFER_LEN);
-        response_bytes_read = read(sock_fd, response_buffer, RESPONSE_BUFFER_LEN);
-    }
-    termination:
-    if(sock_fd != -1) {
-        close(sock_fd);
-    }
-    close(client -> sock_fd);
-    free(client_request);
-    return 1;
+    destroy_threadpool(tp);
+    destroy_reactor_group(group);
+    destroy_resolver(res);
+    for (int i = 0; i < num_reactors; ++i) {
+        close(listen_fds[i]);
+    }
+    free(listen_fds);
+    stop_filter_watcher(watcher);
+    live_filter_destroy(&host_filter);
+    return status;
 }
 
-
-
-int check_request(const char * request) {
-    char* first_row_end = strstr(request, "\r\n");
-    if(!first_row_end || first_row_end < request){
-        return 400;
-    }
-    ssize_t first_row_len = first_row_end - request;//copy the first len to check essential tokens
-    char* first_row = (char*) malloc(first_row_len + 1);
-    memset(first_row, 0, first_row_len);
-    memcpy(first_row, request, first_row_len);
-    first_row[first_row_len] = '\0';
-    char* method = (char*)malloc(10);
-    char* path = (char*) malloc(100);
-    char* protocol = (char*) malloc(100);
-
-    sscanf(first_row, "%s %s %s", method, path, protocol);
-
-    if(strlen(method) == 0 || strlen(path) == 0 || strlen(protocol) == 0){
-        free(first_row);
-        return 400;
-    }
-    if(((strcmp(protocol, "HTTP/1.0")) != 0 && strcmp(protocol, "HTTP/1.1") != 0)){
-        free(first_row);
-        return 400;
-    }
-    if(strstr(request, "Host: ") == NULL){
-        free(first_row);
-        return 400;
+void on_signal(void *ctx, int signo) {
+    lifecycle *lc = (lifecycle *) ctx;
+    if (lc->draining) {
+        // a second signal does not wait for the open connections anymore
+        if (signo != SIGUSR2) {
+            drain_reactor_group(lc->group, 0);
+        }
+        return;
     }
-    if(strcmp(method, "GET") != 0){
-        free(first_row);
-        return 501;
+    if (signo == SIGUSR2) {
+        // the successor takes the disk cache and the admin port over, this process only reads its cache from now
+        reactor_group *g = lc->group;
+        if (g->disk != NULL) {
+            disk_cache_seal(g->disk, 1);
+        }
+        if (lc->admin != NULL) {
+            stop_admin_server(lc->admin);
+            lc->admin = NULL;
+        }
+        if (handoff_spawn(lc->argv, lc->listen_fds, lc->num_listeners) == -1) {
+            fprintf(stderr, "upgrade failed, serving on\n");
+            if (g->disk != NULL) {
+                disk_cache_seal(g->disk, 0);
+            }
+            if (lc->config->admin != NULL &&
+                (lc->admin = start_admin_server(lc->config->admin, render_metrics, lc->sources)) == NULL) {
+                fprintf(stderr, "metrics are not served\n");
+            }
+            return;
+        }
     }
-    free(first_row);
-    free(method);
-    free(protocol);
-    free(path);
-    return 1;
+    lc->draining = 1;
+    drain_reactor_group(lc->group, lc->config->drain_timeout);
 }
 
-char* to_binary(char* ip_string) {
-    char *bin = (char *) malloc(IPV4_BINARY_LENGTH + 1);
-    memset(bin, 0, IPV4_BINARY_LENGTH + 1);
-
-    char ip_bytes_array[4][9];
-    sscanf(ip_string, "%8[^.].%8[^.].%8[^.].%8s", ip_bytes_array[0], ip_bytes_array[1], ip_bytes_array[2],
-           ip_bytes_array[3]);
-    for (int i = 0; i < 4; ++i) {
-        char *ret = token_to_binary((int) strtoul(ip_bytes_array[i], NULL, 10));
-        strcat(bin, ret);
-        free(ret);
-    }
-    return bin;
+void render_metrics(void *ctx, metrics_buf *out) {
+    metrics_sources *sources = (metrics_sources *) ctx;
+    threadpool *tp = sources->tp;
+    reactor_group_metrics(sources->group, out);
+    uint64_t jobs = 0;
+    const histogram *waits[MAXT_IN_POOL];
+    for (int i = 0; i < tp->num_threads; ++i) {
+        jobs += counter_read(&tp->workers[i].jobs);
+        waits[i] = &tp->workers[i].wait;
+    }
+    int queued = atomic_load(&tp->qsize);
+    metrics_gauge(out, "proxy_threadpool_queued_jobs", "Jobs waiting for a pool thread.", queued > 0 ? queued : 0);
+    metrics_counter(out, "proxy_threadpool_jobs_total", "Jobs run by the pool threads.", jobs);
+    metrics_histogram(out, "proxy_threadpool_wait_seconds", "Time jobs spent queued.", waits, tp->num_threads);
 }
 
-char* token_to_binary(int token){
-    char * ret = (char*) malloc(9);
-    for (int i = 0; i < 8; ++i) {
-        ret[7-i] = (char)((token % 2) + '0');
-        token /= 2;
-    }
-    ret[8] = '\0';
-    return ret;
-}
+int open_listener(in_port_t port, int backlog, int reuse_port) {
+    struct sockaddr_in proxy_info;
+    memset(&proxy_info, 0, sizeof(struct sockaddr_in));
+    proxy_info.sin_family = AF_INET;
+    proxy_info.sin_port = htons(port);
+    proxy_info.sin_addr.s_addr = htonl(INADDR_ANY);
 
-void write_to_socket(int sock_fd, char* msg, unsigned long bytes_to_write){
-    if(sock_fd == -1){
-        return;
+    int welcome_socket;
+    // a successor only gets the socket through a handoff, not by inheriting it across exec
+    if((welcome_socket = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP)) == -1){
+        perror("socket");
+        return -1;
     }
-    unsigned long bytes_written = 0;
-    unsigned long wrote;
-    unsigned long left_bytes = bytes_to_write;
-    while(bytes_written < bytes_to_write){
-        wrote = write(sock_fd, msg + bytes_written, left_bytes);
-        bytes_written += wrote;
-        left_bytes -= wrote;
+    int on = 1;
+    if(setsockopt(welcome_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1){
+        perror("setsockopt");
     }
-}
-void write_to_client_socket(int sock_fd, unsigned char* msg, unsigned long bytes_to_write) {
-
-    if(sock_fd == -1){
-        return;
+    // every reactor binds its own socket to the same port, the kernel balances between them
+    if(reuse_port && setsockopt(welcome_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1){
+        close(welcome_socket);
+        perror("setsockopt");
+        return -1;
+    }
+    if(bind(welcome_socket, (struct sockaddr*)&proxy_info, sizeof (struct sockaddr_in)) == -1){
+        close(welcome_socket);
+        perror("bind");
+        return -1;
     }
-    unsigned long bytes_written = 0;
-    unsigned long wrote;
-    unsigned long left_bytes = bytes_to_write;
-    while(bytes_written < bytes_to_write){
-        wrote = write(sock_fd, msg + bytes_written, left_bytes);
-        bytes_written += wrote;
-        left_bytes -= wrote;
+    if(listen(welcome_socket, backlog) == -1){
+        close(welcome_socket);
+        perror("listen");
+        return -1;
     }
+    return welcome_socket;
 }
 
-
-void insert_host(char *line) {
-    struct Node* newNode = (struct Node*)malloc(sizeof(struct Node));
-    if (newNode == NULL) {
-        perror("malloc\n");
-        exit(EXIT_FAILURE);
-    }
-    if(line[0] >= '0' && line[0] <= '9'){ // if starts with number we know that this is an ip address
-        char* mask_start = NULL;
-        unsigned long mask_len = 32;
-        if((mask_start = strstr(line, "/")) != NULL){
-            mask_len = strtoul(mask_start + 1, NULL, 10);
-            *mask_start = '\0';
+int extract_host(const http_request *req, const char *buf, char *host, size_t host_len, in_port_t *port) {
+    //the authority of an absolute target wins over the Host header
+    const char* host_start = buf + req->authority.off;
+    size_t len = req->authority.len;
+    if (len == 0 && !http_request_header(req, buf, "Host", &host_start, &len)) {
+        return -1;
+    }
+    //an IPv6 literal is bracketed, its colons are not the one of the port
+    const char* name = host_start;
+    const char* name_end = host_start + len;
+    const char* colon;
+    if (len > 0 && host_start[0] == '[') {
+        const char* bracket = memchr(host_start, ']', len);
+        if (bracket == NULL || (bracket + 1 < name_end && bracket[1] != ':')) {
+            return -1;
         }
-        char* ret = to_binary(line); // convert the specified token to bunary value
-        memset(line, 0 , strlen(line));
-        memcpy(line, ret, strlen(ret));
-        mask_len = mask_len <= IPV4_BINARY_LENGTH ? mask_len : IPV4_BINARY_LENGTH;
-        line[mask_len] = '\0';
-        free(ret);
-    }
-    newNode->line = strdup(line); // Copy the line into the node
-    newNode->next = NULL;
-    if (filter_head == NULL) {
-        filter_head = newNode;
+        name = host_start + 1;
+        name_end = bracket;
+        colon = bracket + 1 < host_start + len ? bracket + 1 : NULL;
     } else {
-        struct Node* temp = filter_head;
-        while (temp->next != NULL) {
-            temp = temp->next;
+        colon = memchr(host_start, ':', len);
+        name_end = colon != NULL ? colon : name_end;
+    }
+    size_t name_len = (size_t)(name_end - name);
+    if (name_len == 0 || name_len >= host_len || memchr(host_start, '@', len) != NULL) {
+        return -1;
+    }
+    memcpy(host, name, name_len);
+    host[name_len] = '\0';
+
+    *port = 80;
+    if (colon != NULL) {
+        unsigned long value = 0;
+        const char* digit = colon + 1;
+        const char* end = host_start + len;
+        if (digit == end || end - digit > 5) {
+            return -1;
+        }
+        for (; digit < end; ++digit) {
+            if (*digit < '0' || *digit > '9') {
+                return -1;
+            }
+            value = value * 10 + (*digit - '0');
         }
-        temp->next = newNode;
+        if (value == 0 || value > 65535) {
+            return -1;
+        }
+        *port = (in_port_t) value;
     }
+    return 0;
 }
 
-int search_host(char *line) {
-    struct Node* current = filter_head;
-    struct hostent *host_ip = gethostbyname(line);
+int rewrite_request(http_rewrite *rw, const http_request *req, const char *buf, struct in_addr client,
+                    int keep_alive, const char *extra) {
+    // the proxy answers 100-continue itself, the server gets the body without having to ask for it
+    static const char *const drop[] = {"Expect", NULL};
+    char via[32];
+    char forwarded[INET_ADDRSTRLEN];
+    snprintf(via, sizeof(via), "1.%d proxyServer", req->minor_version);
+    inet_ntop(AF_INET, &client, forwarded, sizeof(forwarded));
+    http_list_append append[] = {{"Via", via}, {"X-Forwarded-For", forwarded}};
+    // the upstream connection is kept for the next request unless the pool is disabled
+    const char* connection = keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    extra = extra != NULL ? extra : "";
+    if (http_rewrite_request(rw, req, buf, drop, append, 2) == -1 ||
+        http_rewrite_add_text(rw, extra, strlen(extra)) == -1 ||
+        http_rewrite_add(rw, connection, strlen(connection)) == -1 ||
+        http_rewrite_end(rw) == -1) {
+        return -1;
+    }
+    return 0;
+}
 
-    if (host_ip == NULL) {
-        //printf("gethostbyname\n");
+int check_request(const http_request *req, const char *buf) {
+    // the parser already checked the three tokens of the request line and the protocol version
+    const char* value;
+    size_t value_len;
+    if (req->authority.len == 0 && !http_request_header(req, buf, "Host", &value, &value_len)) {
+        return 400;
+    }
+    // what follows the head of CONNECT is the start of the tunnel, not a body
+    if (http_span_is(buf, req->method, "CONNECT")) {
         return 1;
     }
-
-    // Convert the IP address to a string format
-    struct in_addr **addr_list = (struct in_addr **)host_ip->h_addr_list;
-    char* ip_string =  to_binary(inet_ntoa(*addr_list[0]));
-    while (current != NULL) {
-        if (strcmp(current->line, line) == 0 || strncmp(ip_string, current -> line, strlen(current -> line)) == 0) {
-            free(ip_string);
-            return 1; // Found
-        }
-        current = current->next;
+    http_body body;
+    if (http_request_body(req, buf, &body) == -1) {
+        return 400;
     }
-    free(ip_string);
-    return 0; // Not found
+    return 1;
 }
 
-char* error_generator(int error_type){
-    char * ret = (char*) malloc(1000);
-    memset(ret, 0, 1000);
+int search_host(const char *host, const struct in_addr *addrs, int naddrs) {
+    return live_filter_match(&host_filter, host, addrs, naddrs);
+}
+
+int error_generator(int error_type, char *ret){
+    ret[0] = '\0';
     char error_description[50];
     error_description[0] = '\0';
     char body_description[50];
@@ -433,9 +668,10 @@ char* error_generator(int error_type){
     gettimeofday(&tv, NULL);
 
     time_t current_time = tv.tv_sec;
-    struct tm *time_info = gmtime(&current_time);
+    struct tm time_info; // the reactors generate errors concurrently, gmtime shares its result
+    gmtime_r(&current_time, &time_info);
     char date[50];
-    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", time_info);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &time_info);
 
     switch (error_type) {
         case 400:
@@ -450,6 +686,14 @@ char* error_generator(int error_type){
             strcat(error_description, "404 Not Found");
             strcat(body_description, "File not found.");
             break;
+        case 408:
+            strcat(error_description, "408 Request Timeout");
+            strcat(body_description, "The request took too long.");
+            break;
+        case 429:
+            strcat(error_description, "429 Too Many Requests");
+            strcat(body_description, "Slow down.");
+            break;
         case 500:
             strcat(error_description, "500 Internal Server Error");
             strcat(body_description, "Some server side error.");
@@ -458,8 +702,22 @@ char* error_generator(int error_type){
             strcat(error_description, "501 Not supported");
             strcat(body_description, "Method is not supported.");
             break;
-        default:
-            return "";
+        case 502:
+            strcat(error_description, "502 Bad Gateway");
+            strcat(body_description, "The server could not be reached.");
+            break;
+        case 503:
+            strcat(error_description, "503 Service Unavailable");
+            strcat(body_description, "Server is busy.");
+            break;
+        case 504:
+            strcat(error_description, "504 Gateway Timeout");
+            strcat(body_description, "The server did not answer in time.");
+            break;
+        default: // unknown codes are reported as an internal error
+            strcat(error_description, "500 Internal Server Error");
+            strcat(body_description, "Some server side error.");
+            break;
     }
     char body[500];
     snprintf(body, sizeof(body), "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n"
@@ -474,37 +732,73 @@ char* error_generator(int error_type){
                                     "Date: %s\r\n"
                                     "Content-Type: text/html\r\n"
                                     "Content-Length: %ld\r\n"
+                                    "%s"
                                     "Connection: close\r\n\r\n"
-            , error_description, date, strlen(body));
+            , error_description, date, strlen(body),
+            // the limits refill within a second
+            error_type == 429 ? "Retry-After: 1\r\n" : "");
 
     strcat(ret, headers);
     strcat(ret, body);
-    return ret;
+    return (int) strlen(ret);
 }
 
-void free_list(){
-    struct Node * p = filter_head;
-    struct Node* temp;
+// the codings of a comma separated list as CODING_BIT flags, 0 if one is unknown or not built in
+unsigned int parse_codings(const char *list) {
+    unsigned int codings = 0;
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        if (len == 4 && strncmp(list, "gzip", 4) == 0) {
+            codings |= CODING_BIT(CODING_GZIP);
+        } else if (len == 2 && strncmp(list, "br", 2) == 0) {
+            codings |= CODING_BIT(CODING_BR);
+        } else {
+            return 0;
+        }
+        list += len + (list[len] == ',');
+    }
+    return (codings & compress_available()) == codings ? codings : 0;
+}
 
-    while (p != NULL){
-        free(p -> line);
-        temp = p -> next;
-        free(p);
-        p = temp;
+// the ports and port ranges of a comma separated list as bits of ports, -1 if one is malformed
+int parse_ports(const char *list, uint64_t *ports) {
+    memset(ports, 0, sizeof(uint64_t) * CONNECT_PORT_WORDS);
+    if (*list == '\0') {
+        return -1;
+    }
+    while (*list != '\0') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end != list && *end == '-') {
+            const char *from = end + 1;
+            last = strtol(from, &end, 10);
+            if (end == from) {
+                return -1;
+            }
+        }
+        if (end == list || (*end != ',' && *end != '\0') || first < 1 || last > 65535 || first > last) {
+            return -1;
+        }
+        for (long port = first; port <= last; ++port) {
+            ports[port / 64] |= (uint64_t) 1 << (port % 64);
+        }
+        list = end + (*end == ',');
     }
+    return 0;
 }
 
 void arguments_check(const int * port, const size_t * pool_size, const size_t* max_requests){
     if(*port <= 0 || *port > 65535){
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
     if(*pool_size < 1){
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
     if(*max_requests <= 0){
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
 }
\ No newline at end of file
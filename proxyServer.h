@@ -0,0 +1,109 @@
+#ifndef PROXYSERVER_H
+#define PROXYSERVER_H
+
+#include <netinet/in.h>
+#include "threadpool.h"
+#include "http.h"
+#include "balancer.h"
+
+/**
+ * proxyServer.h
+ *
+ * Request-level helpers shared between main() and the connection
+ * state machine in reactor.c.
+ */
+
+#define MAX_HOST_LEN 256
+#define ERROR_RESPONSE_LEN 1000     //room error_generator needs
+#define CONNECT_PORT_WORDS (65536 / 64)
+
+/**
+ * tunables read from the command line
+ */
+typedef struct proxy_config {
+    int num_reactors;           //event loops, each with its own listening socket
+    int backlog;                //listen backlog of every listening socket
+    int pin_cpus;               //1 to bind reactor i to cpu i
+    int use_splice;             //1 to relay responses with splice() through a pipe
+    size_t max_tasks;           //number of requests to serve before stopping
+    int queue_capacity;         //jobs the threadpool queues before applying queue_policy
+    overflow_policy queue_policy;
+    const char *dns_server;     //"ip[:port]", NULL for the system name server
+    const char *hosts_file;     //names resolved without a query, NULL for none
+    int upstream_max_idle;      //idle upstream connections kept per reactor, 0 disables the pool
+    int upstream_max_idle_per_host;
+    int upstream_idle_timeout;  //seconds an idle upstream connection is kept
+    int client_idle_timeout;    //seconds a client connection may wait without sending a request
+    int header_timeout;         //seconds a request head may take once its first byte came
+    int connect_timeout;        //seconds an upstream has to accept the connection
+    int io_timeout;             //seconds a response or tunnel may go without traffic
+    int transfer_timeout;       //seconds a request may take from its head to its last byte, 0 for no limit
+    balance_policy balance;     //which address of a host a new upstream connection tries first
+    int connect_stagger;        //ms a connect is given before the next address is tried alongside
+    int eject_failures;         //failed connects in a row that take an address out of rotation
+    int eject_time;             //seconds it stays out
+    int client_rate;            //requests per second of a client address, 0 for no limit
+    int client_conns;           //connections open at once from a client address, 0 for no limit
+    size_t client_bandwidth;    //bytes per second sent to a client address, 0 for no limit
+    int host_rate;              //requests per second sent upstream to a host, 0 for no limit
+    int host_conns;             //requests under way at once to a host, 0 for no limit
+    size_t host_bandwidth;      //bytes per second read from a host, 0 for no limit
+    unsigned int compress;      //CODING_BIT flags of the codings responses may be sent with, 0 disables compression
+    int compress_level;         //1 (fastest) to 9, up to 11 for brotli
+    size_t compress_min;        //bytes, a response known to be smaller is sent as is
+    size_t cache_size;          //bytes of responses the cache holds, 0 disables it
+    size_t cache_max_object;    //bytes, bigger responses are not cached
+    const char *disk_cache_dir; //directory of the persistent cache, NULL for none
+    size_t disk_cache_size;     //bytes of segment files it keeps
+    size_t disk_cache_max_object;
+    int mem_stats;              //1 to print the allocation counters of every reactor on exit
+    int coalesce_wait;          //ms a request waits on a fetch of the same object, 0 disables coalescing
+    const char *admin;          //"[ip:]port" of the metrics endpoint, NULL for none
+    const char *trace_file;     //where the phase timings of every request are written, NULL for none
+    int drain_timeout;          //seconds the connections open when the proxy stops are given to finish
+    int handed_over;            //1 if the listening sockets came from the process this one replaces
+    uint64_t connect_ports[CONNECT_PORT_WORDS]; //a bit per port CONNECT may open a tunnel to
+} proxy_config;
+
+/**
+ * check_request validates a parsed request, whose head is in buf.
+ * returns 1 if the request can be forwarded, else the HTTP status
+ * code that should be sent back to the client: 400 without a host or
+ * with a body whose length cannot be told.
+ */
+int check_request(const http_request *req, const char *buf);
+
+/**
+ * extract_host copies the host the request is for, the authority of an
+ * absolute target or else the Host header, into host (at most host_len - 1
+ * characters), without the brackets of an IPv6 literal, and stores the
+ * port, 80 if none was given.
+ * returns 0 on success, -1 if there is no host or it is malformed.
+ */
+int extract_host(const http_request *req, const char *buf, char *host, size_t host_len, in_port_t *port);
+
+/**
+ * rewrite_request builds in rw the head forwarded for a parsed request:
+ * its own lines without the hop-by-hop headers and Expect, client added
+ * to X-Forwarded-For, the proxy to Via, the header lines of extra (NULL
+ * for none) and Connection set to "keep-alive" if keep_alive is 1, else
+ * to "close". buf must stay in place until rw is sent.
+ * returns 0, or -1 if the head has too many pieces.
+ */
+int rewrite_request(http_rewrite *rw, const http_request *req, const char *buf, struct in_addr client,
+                    int keep_alive, const char *extra);
+
+/**
+ * search_host returns 1 if the host, or one of the naddrs IPv4 addresses
+ * it resolved to, is blocked by the filter.
+ */
+int search_host(const char *, const struct in_addr *addrs, int naddrs);
+
+/**
+ * error_generator writes the full HTTP error response for the given status
+ * code into buf, which holds at least ERROR_RESPONSE_LEN bytes. returns
+ * its length.
+ */
+int error_generator(int, char *buf);
+
+#endif
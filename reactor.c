@@ -0,0 +1,3011 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "reactor.h"
+
+#define MAX_EVENTS 256
+#define RELAY_BUFFER_LEN 65536
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define RESPONSE_HEAD_MAX 65536     //a head that does not fit is relayed unframed
+#define CONN_POOL_MAX 1024          //memory of closed connections a reactor keeps
+#define IO_POOL_MAX 1024
+#define RELAY_POOL_MAX 64
+#define FETCH_POOL_MAX 256
+#define CACHE_FILL_LEN 16384        //first size of the copy of a response of unknown length
+#define CHUNK_SIZE_ROOM 10          //room kept for the size line of an encoded chunk, 8 hex digits and CRLF
+#define ENCODE_MIN_ROOM 4096        //an encoder is not run with less output room than this
+#define ENCODE_TAIL_ROOM 8          //CRLF after an encoded chunk, then the last chunk
+#define ENCODED_HEAD_EXTRA 128      //what the head of a compressed response may grow by: the W/ of its ETag and 77 bytes of headers
+
+/**
+ * argument of store_job: a complete response on its way into the cache tiers
+ */
+typedef struct store_task {
+    reactor_group *g;
+    char *data;
+    size_t head_len;
+    size_t data_len;
+    cache_policy policy;
+    struct in_addr addr;
+    char key[];                 //the key of the connection is in its arena, this copy outlives it
+} store_task;
+
+static void watch(reactor *, endpoint *, unsigned int);
+static void close_conn(conn *);
+static void release_pipe(conn *);
+static void send_error(conn *, int);
+static void flush_client(conn *);
+static void flush_upstream(conn *);
+static void connect_upstream(conn *);
+static void on_request_complete(conn *, size_t);
+static void release_cache_state(conn *);
+static void leave_fetch(conn *);
+static int answer_from_cache(conn *, int);
+static void start_lookup(conn *);
+static void start_tunnel(conn *);
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// register, modify or remove the fd of an endpoint so epoll reports exactly "events"
+static void watch(reactor *r, endpoint *ep, unsigned int events) {
+    if (ep->fd == -1 || ep->events == events) {
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ep;
+    int op = events == 0 ? EPOLL_CTL_DEL : (ep->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    if (epoll_ctl(r->epoll_fd, op, ep->fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+    ep->events = events;
+}
+
+static reactor* create_reactor(reactor_group *g, int id, int listen_fd) {
+    // the metrics of the reactor start on a cache line of their own
+    reactor *r = (reactor *) aligned_alloc(64, sizeof(reactor));
+    if (r == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    memset(r, 0, sizeof(reactor));
+    r->group = g;
+    r->id = id;
+    r->tp = g->tp;
+    pthread_mutex_init(&r->done_lock, NULL);
+
+    if ((r->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        free(r);
+        return NULL;
+    }
+    int wake_fd;
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+    if (set_nonblocking(listen_fd) == -1) {
+        perror("fcntl");
+        close(wake_fd);
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+    block_pool_init(&r->conns, sizeof(conn), CONN_POOL_MAX);
+    block_pool_init(&r->io_bufs, IO_BUFFER_LEN, IO_POOL_MAX);
+    block_pool_init(&r->relay_bufs, RELAY_BUFFER_LEN, RELAY_POOL_MAX);
+    block_pool_init(&r->fetch_blocks, sizeof(fetch), FETCH_POOL_MAX);
+    r->now_ms = now_ms();
+    timer_wheel_init(&r->timers, (uint64_t) r->now_ms);
+    if ((r->relay_buf = (char *) block_get(&r->relay_bufs)) == NULL) {
+        perror("malloc");
+        close(wake_fd);
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+    const proxy_config *config = g->config;
+    if ((r->pool = create_upstream_pool(r->epoll_fd, config->upstream_max_idle, config->upstream_max_idle_per_host,
+                                        config->upstream_idle_timeout * 1000)) == NULL ||
+        (r->balancer = create_balancer(config->balance, config->eject_failures, config->eject_time * 1000)) == NULL) {
+        perror("malloc");
+        if (r->pool != NULL) {
+            destroy_upstream_pool(r->pool);
+        }
+        block_put(&r->relay_bufs, r->relay_buf);
+        block_pool_destroy(&r->relay_bufs);
+        close(wake_fd);
+        close(r->epoll_fd);
+        free(r);
+        return NULL;
+    }
+    r->listener.fd = listen_fd;
+    r->listener.kind = EP_LISTEN;
+    r->wakeup.fd = wake_fd;
+    r->wakeup.kind = EP_WAKEUP;
+    watch(r, &r->listener, EPOLLIN);
+    watch(r, &r->wakeup, EPOLLIN);
+    return r;
+}
+
+static void destroy_reactor(reactor *r) {
+    destroy_upstream_pool(r->pool);
+    destroy_balancer(r->balancer);
+    while (r->num_spare_pipes > 0) {
+        r->num_spare_pipes--;
+        close(r->spare_pipes[r->num_spare_pipes][0]);
+        close(r->spare_pipes[r->num_spare_pipes][1]);
+    }
+    block_put(&r->relay_bufs, r->relay_buf);
+    block_pool_destroy(&r->conns);
+    block_pool_destroy(&r->io_bufs);
+    block_pool_destroy(&r->relay_bufs);
+    block_pool_destroy(&r->fetch_blocks);
+    close(r->wakeup.fd);
+    close(r->epoll_fd);
+    pthread_mutex_destroy(&r->done_lock);
+    free(r);
+}
+
+// the request buffer and the response head start in I/O buffers and move to the heap if they outgrow them
+static void release_buffer(reactor *r, char *buf, size_t cap) {
+    if (cap == IO_BUFFER_LEN) {
+        block_put(&r->io_bufs, buf);
+    } else {
+        free(buf);
+    }
+}
+
+static char* grow_buffer(reactor *r, char *buf, size_t len, size_t cap, size_t new_cap) {
+    if (cap != IO_BUFFER_LEN) {
+        return (char *) mem_realloc(buf, new_cap);
+    }
+    char *temp = (char *) mem_alloc(new_cap);
+    if (temp != NULL) {
+        memcpy(temp, buf, len);
+        block_put(&r->io_bufs, buf);
+    }
+    return temp;
+}
+
+// give back the pending response bytes to wherever they came from
+static void release_resp(conn *c) {
+    reactor *r = c->reactor;
+    switch (c->resp_from) {
+        case RESP_IO:
+            block_put(&r->io_bufs, c->resp);
+            break;
+        case RESP_RELAY:
+            block_put(&r->relay_bufs, c->resp);
+            break;
+        case RESP_HEAP:
+            free(c->resp);
+            break;
+        case RESP_ARENA:
+            break;
+    }
+    c->resp = NULL;
+    c->resp_len = c->resp_off = 0;
+    c->resp_from = RESP_ARENA;
+}
+
+// a new record for the request starting at start_us
+static void trace_begin(conn *c, uint64_t start_us) {
+    memset(&c->trace, 0, sizeof(trace_record));
+    memset(c->trace.at, 0xff, sizeof(c->trace.at));
+    c->trace.start_us = start_us;
+}
+
+static conn* new_conn(reactor *r, int fd, struct sockaddr_in *info) {
+    conn *c = (conn *) block_get(&r->conns);
+    if (c == NULL) {
+        return NULL;
+    }
+    memset(c, 0, sizeof(conn));
+    // the request buffer is taken when the first bytes arrive
+    arena_init(&c->arena, &r->io_bufs);
+    http_request_init(&c->req);
+    c->state = CONN_READING_REQUEST;
+    c->reactor = r;
+    c->client_info = *info;
+    c->client.fd = fd;
+    c->client.kind = EP_CLIENT;
+    c->client.owner = c;
+    c->upstream.fd = -1;
+    c->upstream.kind = EP_UPSTREAM;
+    c->upstream.owner = c;
+    for (int i = 0; i < CONNECT_RACE_WIDTH; ++i) {
+        c->race.attempts[i].ep.fd = -1;
+        c->race.attempts[i].ep.kind = EP_ATTEMPT;
+        c->race.attempts[i].ep.owner = c;
+    }
+    c->pipe_fds[0] = c->pipe_fds[1] = -1;
+    c->no_splice = !r->group->config->use_splice;
+    timer_init(&c->timer, TIMER_CONN, c);
+    if (r->trace != NULL) {
+        trace_begin(c, monotonic_us());
+    }
+    return c;
+}
+
+// lend an empty pipe of the reactor, creating one if the pool is empty. fds is left alone if it holds one
+static int take_pipe(reactor *r, int fds[2]) {
+    if (fds[0] != -1) {
+        return 0;
+    }
+    if (r->num_spare_pipes > 0) {
+        r->num_spare_pipes--;
+        fds[0] = r->spare_pipes[r->num_spare_pipes][0];
+        fds[1] = r->spare_pipes[r->num_spare_pipes][1];
+        return 0;
+    }
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        fds[0] = fds[1] = -1;
+        return -1;
+    }
+    // a bigger pipe moves more bytes per splice, it is only a hint
+    fcntl(fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    return 0;
+}
+
+// give a drained pipe back to the reactor so the next connection does not pay for pipe2().
+// one that still holds bytes cannot be reused, it is closed instead
+static void give_pipe(reactor *r, int fds[2], size_t pending) {
+    if (fds[0] == -1) {
+        return;
+    }
+    if (pending == 0 && r->num_spare_pipes < PIPE_POOL_MAX) {
+        r->spare_pipes[r->num_spare_pipes][0] = fds[0];
+        r->spare_pipes[r->num_spare_pipes][1] = fds[1];
+        r->num_spare_pipes++;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    fds[0] = fds[1] = -1;
+}
+
+static int borrow_pipe(conn *c) {
+    return take_pipe(c->reactor, c->pipe_fds);
+}
+
+static void return_pipe(conn *c) {
+    give_pipe(c->reactor, c->pipe_fds, 0);
+}
+
+static void release_pipe(conn *c) {
+    give_pipe(c->reactor, c->pipe_fds, c->pipe_pending);
+    c->pipe_pending = 0;
+}
+
+// what the directions of a closing tunnel hold goes back to the reactor
+static void release_tunnel(conn *c) {
+    if (c->state != CONN_TUNNELING) {
+        return;
+    }
+    tunnel_dir *dirs[] = {&c->tunnel.up, &c->tunnel.down};
+    for (int i = 0; i < 2; ++i) {
+        give_pipe(c->reactor, dirs[i]->pipe_fds, dirs[i]->pending);
+        block_put(&c->reactor->relay_bufs, dirs[i]->buf);
+        dirs[i]->buf = NULL;
+        dirs[i]->pending = 0;
+    }
+}
+
+// arm the timer of c for the deadline of what it waits on from now. the transfer deadline, if
+// the request has one, caps the connect and io ones
+static void set_deadline(conn *c, deadline_kind kind) {
+    reactor *r = c->reactor;
+    const proxy_config *config = r->group->config;
+    int64_t seconds;
+    switch (kind) {
+        case DEADLINE_IDLE:
+            seconds = config->client_idle_timeout;
+            break;
+        case DEADLINE_HEAD:
+            seconds = config->header_timeout;
+            break;
+        case DEADLINE_CONNECT:
+            seconds = config->connect_timeout;
+            break;
+        case DEADLINE_IO:
+            seconds = config->io_timeout;
+            c->active_ms = r->now_ms;
+            break;
+        default:
+            c->deadline = DEADLINE_NONE;
+            timer_cancel(&r->timers, &c->timer);
+            return;
+    }
+    int64_t at = r->now_ms + seconds * 1000;
+    if (kind != DEADLINE_IDLE && kind != DEADLINE_HEAD && c->transfer_deadline_ms != 0 &&
+        c->transfer_deadline_ms < at) {
+        at = c->transfer_deadline_ms;
+    }
+    c->deadline = kind;
+    timer_arm(&r->timers, &c->timer, (uint64_t) at);
+}
+
+// a client that has no request in progress may wait client_idle_timeout for the next one
+static void idle_client(conn *c) {
+    set_deadline(c, DEADLINE_IDLE);
+}
+
+// give up a connect of the race, a failed one counts against its address
+static void end_attempt(conn *c, connect_attempt *a, int failed) {
+    reactor *r = c->reactor;
+    watch(r, &a->ep, 0);
+    close(a->ep.fd);
+    a->ep.fd = -1;
+    c->race.in_flight--;
+    if (failed) {
+        counter_add(&r->metrics.connect_failures, 1);
+    }
+    if (a->backend != NULL) {
+        a->backend->load--;
+        if (failed && balancer_failed(r->balancer, a->backend, r->now_ms)) {
+            counter_add(&r->metrics.ejections, 1);
+        }
+        a->backend = NULL;
+    }
+}
+
+// close the connects still racing for the upstream connection
+static void end_race(conn *c, int failed) {
+    for (int i = 0; c->race.in_flight > 0 && i < CONNECT_RACE_WIDTH; ++i) {
+        if (c->race.attempts[i].ep.fd != -1) {
+            end_attempt(c, &c->race.attempts[i], failed);
+        }
+    }
+}
+
+// the request no longer uses the connection it opened, its address carries that much less load
+static void release_backend(conn *c) {
+    if (c->backend != NULL) {
+        c->backend->load--;
+        c->backend = NULL;
+    }
+}
+
+// drop the upstream connection and the connects racing for one, the endpoint can be registered
+// again with a new fd
+static void close_upstream(conn *c) {
+    end_race(c, 0);
+    release_backend(c);
+    if (c->upstream.fd == -1) {
+        return;
+    }
+    watch(c->reactor, &c->upstream, 0);
+    close(c->upstream.fd);
+    c->upstream.fd = -1;
+}
+
+// the request in progress reached phase, a no-op unless the proxy traces
+static void trace_mark(conn *c, trace_phase phase) {
+    if (c->reactor->trace != NULL) {
+        uint64_t elapsed = monotonic_us() - c->trace.start_us;
+        c->trace.at[phase] = elapsed < TRACE_NONE ? (uint32_t) elapsed : TRACE_NONE - 1;
+    }
+}
+
+// the record of the request that ended goes to the ring, the next one starts now
+static void trace_end(conn *c) {
+    reactor *r = c->reactor;
+    uint64_t now = monotonic_us();
+    // an idle connection that closes had no request
+    if (c->started_us != 0 || c->resp_status != 0) {
+        c->trace.at[TRACE_END] = now - c->trace.start_us < TRACE_NONE ?
+                                 (uint32_t) (now - c->trace.start_us) : TRACE_NONE - 1;
+        c->trace.client = c->client_info.sin_addr.s_addr;
+        c->trace.status = (uint16_t) c->resp_status;
+        c->trace.reactor = (uint8_t) r->id;
+        trace_push(r->trace, &c->trace);
+    }
+    trace_begin(c, now);
+}
+
+// the request in progress is over, its status and latency are counted
+static void end_request(conn *c) {
+    reactor_metrics *m = &c->reactor->metrics;
+    if (c->reactor->trace != NULL) {
+        trace_end(c);
+    }
+    if (c->resp_status >= 100 && c->resp_status < STATUS_CODES) {
+        counter_add(&m->status[c->resp_status], 1);
+    }
+    if (c->started_us != 0) {
+        histogram_record(&m->total, monotonic_us() - c->started_us);
+    }
+    c->resp_status = 0;
+    c->started_us = 0;
+}
+
+// the limits run on the clock of the batch, in ns
+static int64_t limit_now(const reactor *r) {
+    return r->now_ms * 1000000;
+}
+
+// what a client is sent counts against its bandwidth
+static void sent_to_client(conn *c, size_t bytes) {
+    counter_add(&c->reactor->metrics.client_bytes_out, bytes);
+    c->trace.bytes = bytes < UINT32_MAX - c->trace.bytes ? c->trace.bytes + (uint32_t) bytes : UINT32_MAX;
+    if (c->client_limit != NULL) {
+        limiter_spend(c->reactor->group->clients, c->client_limit, bytes, limit_now(c->reactor));
+    }
+}
+
+// what an upstream sends counts against the bandwidth of its host
+static void read_from_upstream(conn *c, size_t bytes) {
+    counter_add(&c->reactor->metrics.upstream_bytes_in, bytes);
+    if (c->host_limit != NULL) {
+        limiter_spend(c->reactor->group->hosts, c->host_limit, bytes, limit_now(c->reactor));
+    }
+}
+
+static void release_host_limit(conn *c) {
+    if (c->host_limit != NULL) {
+        limiter_release(c->host_limit);
+        c->host_limit = NULL;
+    }
+}
+
+static void release_encoding(conn *c) {
+    if (c->encoding != NULL) {
+        encoder_end(&c->encoding->enc);
+        free(c->encoding);
+        c->encoding = NULL;
+    }
+}
+
+// a new connection of a client over its limit is told so and closed
+static void admit_client(conn *c) {
+    reactor *r = c->reactor;
+    limiter *l = r->group->clients;
+    if (l == NULL) {
+        return;
+    }
+    c->client_limit = limiter_hold(l, limiter_hash_addr(c->client_info.sin_addr.s_addr), limit_now(r));
+    if (c->client_limit != NULL && limiter_check_holders(l, c->client_limit) == LIMIT_CONNS) {
+        counter_add(&r->metrics.client_limited[LIMIT_CONNS], 1);
+        send_error(c, 429);
+    }
+}
+
+// a request of a client over its rate or bandwidth is refused. returns 0 if it was
+static int admit_request(conn *c) {
+    reactor *r = c->reactor;
+    if (c->client_limit == NULL) {
+        return 1;
+    }
+    limit_kind over = limiter_admit(r->group->clients, c->client_limit, limit_now(r));
+    if (over == LIMIT_NONE) {
+        return 1;
+    }
+    counter_add(&r->metrics.client_limited[over], 1);
+    send_error(c, 429);
+    return 0;
+}
+
+// the host of a request that goes upstream is held until the request is over. a host over
+// its limits is not contacted. returns 0 if the request was refused
+static int admit_host(conn *c) {
+    reactor *r = c->reactor;
+    limiter *l = r->group->hosts;
+    if (l == NULL || c->host_limit != NULL) {
+        return 1;
+    }
+    c->host_limit = limiter_hold(l, limiter_hash_name(c->host), limit_now(r));
+    if (c->host_limit == NULL) {
+        return 1;
+    }
+    limit_kind over = limiter_check_holders(l, c->host_limit);
+    if (over == LIMIT_NONE) {
+        over = limiter_admit(l, c->host_limit, limit_now(r));
+    }
+    if (over == LIMIT_NONE) {
+        return 1;
+    }
+    release_host_limit(c);
+    counter_add(&r->metrics.host_limited[over], 1);
+    send_error(c, 503);
+    return 0;
+}
+
+// the fds are closed right away, the memory is released after the current epoll batch
+// because later events of the same batch may still point at this connection
+static void close_conn(conn *c) {
+    if (c->state == CONN_CLOSED) {
+        return;
+    }
+    end_request(c);
+    close_upstream(c);
+    release_host_limit(c);
+    release_encoding(c);
+    if (c->client_limit != NULL) {
+        limiter_release(c->client_limit);
+        c->client_limit = NULL;
+    }
+    set_deadline(c, DEADLINE_NONE);
+    close(c->client.fd);
+    c->client.fd = -1;
+    release_pipe(c);
+    release_tunnel(c);
+    release_cache_state(c);
+    c->state = CONN_CLOSED;
+    c->next = c->reactor->dead_head;
+    c->reactor->dead_head = c;
+    // live_next is kept, a walk of the list that reaches c goes on from it
+    if (c->live_prev != NULL) {
+        c->live_prev->live_next = c->live_next;
+    } else {
+        c->reactor->live_head = c->live_next;
+    }
+    if (c->live_next != NULL) {
+        c->live_next->live_prev = c->live_prev;
+    }
+    c->reactor->live--;
+    counter_add(&c->reactor->metrics.closed, 1);
+}
+
+static void free_dead(reactor *r) {
+    while (r->dead_head != NULL) {
+        conn *c = r->dead_head;
+        r->dead_head = c->next;
+        release_buffer(r, c->request, c->request_cap);
+        release_buffer(r, c->head, c->head_cap);
+        release_resp(c);
+        block_put(&r->relay_bufs, c->up_buf);
+        arena_reset(&c->arena);
+        block_put(&r->conns, c);
+    }
+}
+
+static void wake(reactor *r) {
+    uint64_t one = 1;
+    if (write(r->wakeup.fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+// reserve a slot of the request budget, the reactors share it so together they
+// serve max_tasks requests. returns the slot, or -1 once the budget is spent
+static long take_slot(reactor_group *g) {
+    size_t slot = atomic_fetch_add(&g->requests, 1);
+    if (slot >= g->config->max_tasks) {
+        atomic_fetch_sub(&g->requests, 1);
+        return -1;
+    }
+    return (long) slot;
+}
+
+// the last slot is taken for good, every reactor stops listening
+static void check_budget(reactor_group *g, long slot) {
+    if ((size_t) slot + 1 == g->config->max_tasks) {
+        atomic_store(&g->accept_done, 1);
+        for (int i = 0; i < g->num_reactors; ++i) {
+            wake(g->reactors[i]);
+        }
+    }
+}
+
+// a keep-alive client pays for each request after its first one
+static int reserve_request(reactor_group *g) {
+    long slot = take_slot(g);
+    if (slot == -1) {
+        return 0;
+    }
+    check_budget(g, slot);
+    return 1;
+}
+
+static void on_accept(reactor *r) {
+    reactor_group *g = r->group;
+    while (1) {
+        // the first request of a connection is paid for before accepting it
+        long slot = take_slot(g);
+        if (slot == -1) {
+            return;
+        }
+        struct sockaddr_in info;
+        socklen_t struct_len = sizeof(struct sockaddr_in);
+        int fd = accept4(r->listener.fd, (struct sockaddr *) &info, &struct_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            atomic_fetch_sub(&g->requests, 1);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        check_budget(g, slot);
+        // a response goes out in pieces (head, then body or cache entry), the last one must not wait for an ack
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        conn *c = new_conn(r, fd, &info);
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->live_next = r->live_head;
+        if (r->live_head != NULL) {
+            r->live_head->live_prev = c;
+        }
+        r->live_head = c;
+        r->live++;
+        counter_add(&r->metrics.accepted, 1);
+        idle_client(c);
+        watch(r, &c->client, EPOLLIN);
+        admit_client(c);
+    }
+}
+
+// hand a connection back to its reactor, from the resolver or a pool thread
+static void post_to_reactor(conn *c) {
+    reactor *r = c->reactor;
+    pthread_mutex_lock(&r->done_lock);
+    c->next = r->done_head;
+    r->done_head = c;
+    pthread_mutex_unlock(&r->done_lock);
+    wake(r);
+}
+
+// called by the resolver thread once the name of a pending lookup is resolved
+static void on_dns_answer(void *ctx, const dns_result *result) {
+    conn *c = (conn *) ctx;
+    c->dns = *result;
+    post_to_reactor(c);
+}
+
+// the IPv4 addresses of a lookup, the ones the filter has entries for
+static int ipv4_addrs(const dns_result *dns, struct in_addr *addrs) {
+    int n = 0;
+    for (int i = 0; i < dns->naddrs; ++i) {
+        if (dns->addrs[i].family == AF_INET) {
+            addrs[n++] = dns->addrs[i].v4;
+        }
+    }
+    return n;
+}
+
+/**
+ * runs on a pool thread: the filter lookup, the CPU work of a request.
+ * the host is blocked if any of its addresses is, whichever one it is
+ * connected to later.
+ */
+static int filter_job(void *arg) {
+    conn *c = (conn *) arg;
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    trace_mark(c, TRACE_DEQUEUE);
+    c->status = search_host(c->host, addrs, ipv4_addrs(&c->dns, addrs)) ? 403 : 0;
+    trace_mark(c, TRACE_FILTER);
+    post_to_reactor(c);
+    return 1;
+}
+
+static void on_resolved(conn *c) {
+    histogram_record(&c->reactor->metrics.dns, monotonic_us() - c->phase_us);
+    trace_mark(c, TRACE_DNS);
+    if (c->dns.status != DNS_OK || c->dns.naddrs == 0) {
+        send_error(c, 404);
+        return;
+    }
+    c->state = CONN_FILTERING;
+    // the job runs on the connection itself, the pool does not free it
+    int queued = try_dispatch_borrowed(c->reactor->tp, filter_job, (void *) c);
+    if (queued != TP_QUEUED) {
+        // the pool is overloaded, answer right away or drop the connection per the policy
+        if (queued == TP_REJECTED) {
+            send_error(c, 503);
+        } else {
+            close_conn(c);
+        }
+    }
+}
+
+// drop what the connection holds of the cache, the entries go back to it
+static void release_cache_state(conn *c) {
+    leave_fetch(c);
+    c->cache_key = NULL;
+    free(c->fill);
+    c->fill = NULL;
+    c->fill_len = c->fill_cap = c->fill_head_len = 0;
+    if (c->stale != NULL) {
+        cache_release(c->stale);
+        c->stale = NULL;
+    }
+    if (c->hit != NULL) {
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    if (c->disk.seg != NULL) {
+        disk_cache_release(c->reactor->group->disk, c->disk.seg);
+        c->disk.seg = NULL;
+    }
+}
+
+// the head of a cached response, with the hop-by-hop headers of this connection, becomes the pending bytes
+static int cached_head(conn *c, const char *stored, size_t stored_len, int age, const char *label) {
+    char tail[128];
+    int tail_len = snprintf(tail, sizeof(tail), "Age: %d\r\nX-Cache: %s\r\nConnection: %s\r\n\r\n",
+                            age, label, c->keep_alive ? "keep-alive" : "close");
+    char *head = (char *) arena_alloc(&c->arena, stored_len + tail_len);
+    if (head == NULL) {
+        return -1;
+    }
+    memcpy(head, stored, stored_len);
+    memcpy(head + stored_len, tail, tail_len);
+    c->resp_status = stored_len > 12 ? atoi(stored + 9) : 0;
+    release_resp(c);
+    c->resp = head;
+    c->resp_len = stored_len + tail_len;
+    c->resp_off = 0;
+    memset(&c->response, 0, sizeof(http_response));
+    c->response.keep_alive = 1;
+    c->response.body.done = 1;
+    c->head_done = 1;
+    c->state = CONN_RELAYING;
+    return 0;
+}
+
+// answer the request from memory, the body is sent straight from the entry
+static void serve_hit(conn *c, cache_entry *e, const char *label) {
+    if (cached_head(c, e->data, e->head_len, cache_entry_age(e), label) == -1) {
+        cache_release(e);
+        send_error(c, 500);
+        return;
+    }
+    c->hit = e;
+    c->hit_off = 0;
+    c->trace.flags |= TRACE_CACHED;
+    watch(c->reactor, &c->client, 0);
+    flush_client(c);
+}
+
+// answer the request from disk, the body is sent with sendfile from the segment
+static void serve_disk_hit(conn *c, const disk_hit *hit) {
+    c->disk = *hit;
+    c->disk_sent = 0;
+    c->trace.flags |= TRACE_CACHED;
+    if (cached_head(c, hit->head, hit->head_len, hit->age, "HIT-DISK") == -1) {
+        send_error(c, 500);
+        return;
+    }
+    watch(c->reactor, &c->client, 0);
+    flush_client(c);
+}
+
+/**
+ * decides whether the cache is involved in the request and sets its key.
+ * returns 1 if it may answer it, 0 if it may only store the response,
+ * -1 if it is not involved at all.
+ */
+static int cache_mode(conn *c) {
+    const char *buf = c->request;
+    const char *value;
+    size_t value_len;
+    reactor_group *g = c->reactor->group;
+    // a request whose body is still to come is not answered without reading it
+    if ((g->cache == NULL && g->disk == NULL) || !http_span_is(buf, c->req.method, "GET") || !c->upload.done ||
+        http_request_header(&c->req, buf, "Authorization", &value, &value_len)) {
+        return -1;
+    }
+    int has_cc = http_request_header(&c->req, buf, "Cache-Control", &value, &value_len);
+    if (has_cc && http_header_has_token(value, value_len, "no-store")) {
+        return -1;
+    }
+    size_t path_len = c->req.path.len;
+    if ((c->cache_key = (char *) arena_alloc(&c->arena, strlen(c->host) + 8 + path_len)) == NULL) {
+        return -1;
+    }
+    int len = sprintf(c->cache_key, "%s:%u", c->host, c->port);
+    for (int i = 0; i < len; ++i) {
+        c->cache_key[i] = (char) tolower((unsigned char) c->cache_key[i]);
+    }
+    memcpy(c->cache_key + len, buf + c->req.path.off, path_len);
+    c->cache_key[len + path_len] = '\0';
+
+    // the client asks for a fresh copy, or its own conditional or partial response
+    if ((has_cc && http_header_has_token(value, value_len, "no-cache")) ||
+        (http_request_header(&c->req, buf, "Pragma", &value, &value_len) &&
+         http_header_has_token(value, value_len, "no-cache")) ||
+        http_request_header(&c->req, buf, "If-None-Match", &value, &value_len) ||
+        http_request_header(&c->req, buf, "If-Modified-Since", &value, &value_len) ||
+        http_request_header(&c->req, buf, "Range", &value, &value_len)) {
+        return 0;
+    }
+    return 1;
+}
+
+static fetch** fetch_bucket(reactor *r, uint32_t hash) {
+    return &r->fetches[hash % FETCH_BUCKETS];
+}
+
+static void free_fetch(reactor *r, fetch *f) {
+    if (f->done) {
+        free(f->data);
+    }
+    block_put(&r->fetch_blocks, f);
+}
+
+// later requests for the key do not join the fetch anymore
+static void unlink_fetch(reactor *r, fetch *f) {
+    timer_cancel(&r->timers, &f->timer);
+    if (!f->linked) {
+        return;
+    }
+    fetch **link = fetch_bucket(r, f->hash);
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+    f->linked = 0;
+}
+
+static void push_follower(conn **list, conn *c) {
+    c->fetch_prev = NULL;
+    c->fetch_next = *list;
+    if (*list != NULL) {
+        (*list)->fetch_prev = c;
+    }
+    *list = c;
+}
+
+// a waiting follower goes its own way: the cache may hold the response by now, else it fetches it itself
+static void fetch_alone(conn *c) {
+    release_cache_state(c);
+    if (answer_from_cache(c, 0)) {
+        return;
+    }
+    start_lookup(c);
+}
+
+// the fetch cannot serve its followers: the ones that already sent part of the response
+// are closed, the waiting ones fetch on their own
+static void dissolve_fetch(reactor *r, fetch *f) {
+    unlink_fetch(r, f);
+    conn *waiting = f->waiting;
+    f->waiting = NULL;
+    while (f->readers != NULL) {
+        close_conn(f->readers);
+    }
+    if (f->leader != NULL) {
+        f->leader->fetch = NULL;
+    }
+    free_fetch(r, f);
+    while (waiting != NULL) {
+        conn *next = waiting->fetch_next;
+        waiting->fetch = NULL;
+        fetch_alone(waiting);
+        waiting = next;
+    }
+}
+
+static void leave_fetch(conn *c) {
+    fetch *f = c->fetch;
+    if (f == NULL) {
+        return;
+    }
+    if (f->leader == c) {
+        dissolve_fetch(c->reactor, f);
+        return;
+    }
+    if (c->fetch_prev != NULL) {
+        c->fetch_prev->fetch_next = c->fetch_next;
+    } else if (f->waiting == c) {
+        f->waiting = c->fetch_next;
+    } else {
+        f->readers = c->fetch_next;
+    }
+    if (c->fetch_next != NULL) {
+        c->fetch_next->fetch_prev = c->fetch_prev;
+    }
+    c->fetch = NULL;
+    c->fetch_prev = c->fetch_next = NULL;
+    // a complete fetch lives as long as one of its followers is sending it
+    if (f->done && f->readers == NULL) {
+        free_fetch(c->reactor, f);
+    }
+}
+
+// the follower sends the head of the fetch, then its body as the leader reads it
+static void read_fetch(conn *c) {
+    fetch *f = c->fetch;
+    push_follower(&f->readers, c);
+    c->fetch_sent = 0;
+    c->trace.flags |= TRACE_CACHED;
+    if (cached_head(c, f->data, f->head_len, f->age, "COALESCED") == -1) {
+        send_error(c, 500);
+        return;
+    }
+    c->response.body.done = 0;
+    flush_client(c);
+}
+
+static void follow_fetch(conn *c, fetch *f) {
+    if (c->stale != NULL) { // the leader revalidates it
+        cache_release(c->stale);
+        c->stale = NULL;
+    }
+    c->fetch = f;
+    watch(c->reactor, &c->client, 0);
+    if (f->head_len == 0) {
+        c->state = CONN_FOLLOWING;
+        push_follower(&f->waiting, c);
+        return;
+    }
+    read_fetch(c);
+}
+
+static void lead_fetch(conn *c, uint32_t hash) {
+    reactor *r = c->reactor;
+    fetch *f = (fetch *) block_get(&r->fetch_blocks);
+    if (f == NULL) {
+        return;
+    }
+    memset(f, 0, sizeof(fetch));
+    // the key stays in the arena of the leader for as long as the fetch can be joined
+    f->key = c->cache_key;
+    f->hash = hash;
+    f->leader = c;
+    f->linked = 1;
+    fetch **bucket = fetch_bucket(r, hash);
+    f->next = *bucket;
+    *bucket = f;
+    // the followers still waiting for the head then fetch on their own
+    timer_init(&f->timer, TIMER_FETCH, f);
+    timer_arm(&r->timers, &f->timer, (uint64_t) (r->now_ms + r->group->config->coalesce_wait));
+    c->fetch = f;
+}
+
+/**
+ * a miss: the request follows the fetch already running for its key, or
+ * leads a new one. returns 1 if it follows.
+ */
+static int join_fetch(conn *c) {
+    reactor *r = c->reactor;
+    if (r->group->config->coalesce_wait == 0) {
+        return 0;
+    }
+    uint32_t hash = fnv1a32_str(c->cache_key);
+    for (fetch *f = *fetch_bucket(r, hash); f != NULL; f = f->next) {
+        if (f->hash == hash && strcmp(f->key, c->cache_key) == 0) {
+            follow_fetch(c, f);
+            return 1;
+        }
+    }
+    lead_fetch(c, hash);
+    return 0;
+}
+
+// a follower that finishes frees the fetch once it was the last one, only the saved link is used
+static void flush_readers(fetch *f) {
+    for (conn *reader = f->readers; reader != NULL;) {
+        conn *next = reader->fetch_next;
+        flush_client(reader);
+        reader = next;
+    }
+}
+
+// the leader copied more of the response: the followers send it on
+static void feed_followers(conn *c) {
+    fetch *f = c->fetch;
+    if (f == NULL) {
+        return;
+    }
+    if (c->fill == NULL) { // not cacheable, or it outgrew the cache
+        dissolve_fetch(c->reactor, f);
+        return;
+    }
+    f->data = c->fill;
+    f->len = c->fill_len;
+    if (f->head_len == 0) {
+        f->head_len = c->fill_head_len;
+        f->age = c->fill_policy.initial_age;
+        timer_cancel(&c->reactor->timers, &f->timer);
+        conn *waiting = f->waiting;
+        f->waiting = NULL;
+        while (waiting != NULL) {
+            conn *next = waiting->fetch_next;
+            read_fetch(waiting);
+            waiting = next;
+        }
+        return;
+    }
+    flush_readers(f);
+}
+
+/**
+ * the leader read the whole response: the fetch keeps the copy for the
+ * followers still sending it, the leader gets another one for the cache.
+ * returns the fetch if it has such followers, the caller flushes them
+ * once the response is stored, else NULL.
+ */
+static fetch* complete_fetch(conn *c) {
+    fetch *f = c->fetch;
+    unlink_fetch(c->reactor, f);
+    c->fetch = NULL;
+    f->leader = NULL;
+    if (f->readers == NULL) {
+        free_fetch(c->reactor, f);
+        return NULL;
+    }
+    f->data = c->fill;
+    f->len = c->fill_len;
+    f->done = 1;
+    if ((c->fill = (char *) mem_alloc(f->len)) != NULL) {
+        memcpy(c->fill, f->data, f->len);
+    }
+    return f;
+}
+
+/**
+ * returns 1 if the cache answered the request, or if it follows a fetch
+ * of the same object when coalesce is 1. a stale entry that can be
+ * revalidated is kept in c->stale.
+ */
+static int answer_from_cache(conn *c, int coalesce) {
+    reactor_group *g = c->reactor->group;
+    if (cache_mode(c) != 1) {
+        return 0;
+    }
+    cache_entry *e = g->cache != NULL ? cache_lookup(g->cache, c->cache_key) : NULL;
+    if (e == NULL || !cache_entry_fresh(e)) {
+        // what memory does not hold (or only stale) may be on disk
+        disk_hit hit;
+        if (g->disk != NULL && disk_cache_lookup(g->disk, c->cache_key, &hit)) {
+            if (e != NULL) {
+                cache_release(e);
+            }
+            if (search_host(c->host, &hit.addr, hit.addr.s_addr != htonl(INADDR_ANY))) {
+                disk_cache_release(g->disk, hit.seg);
+                counter_add(&c->reactor->metrics.filter_blocked, 1);
+                send_error(c, 403);
+                return 1;
+            }
+            serve_disk_hit(c, &hit);
+            return 1;
+        }
+    }
+    if (e == NULL) {
+        return coalesce && join_fetch(c);
+    }
+    if (cache_entry_fresh(e)) {
+        // the filter may have changed since the response was stored. a single lookup,
+        // cheap enough to run here rather than to hand the hit to the pool
+        if (search_host(c->host, &e->addr, e->addr.s_addr != htonl(INADDR_ANY))) {
+            cache_release(e);
+            counter_add(&c->reactor->metrics.filter_blocked, 1);
+            send_error(c, 403);
+            return 1;
+        }
+        serve_hit(c, e, "HIT");
+        return 1;
+    }
+    if (e->etag != NULL || e->last_modified != NULL) {
+        c->stale = e;
+    } else {
+        cache_release(e);
+    }
+    return coalesce && join_fetch(c);
+}
+
+static int is_tunnel_request(conn *c) {
+    return http_span_is(c->request, c->req.method, "CONNECT");
+}
+
+static int tunnel_port_allowed(const conn *c) {
+    const uint64_t *ports = c->reactor->group->config->connect_ports;
+    return (int) ((ports[c->port / 64] >> (c->port % 64)) & 1);
+}
+
+static void on_request_complete(conn *c, size_t head_len) {
+    // the body bytes read with the head go out with it. pipelined requests wait behind them,
+    // hidden by the terminating null until this one is answered
+    size_t body_bytes = 0;
+    if (is_tunnel_request(c)) {
+        // what follows the head is the start of the tunnel, it waits the same way
+        memset(&c->upload, 0, sizeof(http_body));
+        c->upload.done = 1;
+    } else if (http_request_body(&c->req, c->request, &c->upload) == 0) {
+        body_bytes = http_body_consume(&c->upload, c->request + head_len, c->request_len - head_len);
+    }
+    c->request_end = head_len + body_bytes;
+    c->saved_byte = c->request[c->request_end];
+    c->request[c->request_end] = '\0';
+    const proxy_config *config = c->reactor->group->config;
+    c->transfer_deadline_ms = config->transfer_timeout > 0 ?
+                              c->reactor->now_ms + (int64_t) config->transfer_timeout * 1000 : 0;
+    set_deadline(c, DEADLINE_IO);
+    c->started_us = monotonic_us();
+    trace_mark(c, TRACE_HEAD);
+    counter_add(&c->reactor->metrics.requests, 1);
+    // the first request was paid for when the connection was accepted
+    if (c->requests++ > 0 && !reserve_request(c->reactor->group)) {
+        close_conn(c);
+        return;
+    }
+    // once the proxy stops accepting the client is told the connection closes after this response
+    c->keep_alive = http_request_keep_alive(&c->req, c->request) &&
+                    !atomic_load(&c->reactor->group->accept_done);
+    if (c->upload.error) {
+        // where the body ends is unknown, so is where the next request starts
+        c->keep_alive = 0;
+        send_error(c, 400);
+        return;
+    }
+    if (!admit_request(c)) {
+        return;
+    }
+    int validity;
+    if ((validity = check_request(&c->req, c->request)) != 1) {
+        send_error(c, validity);
+        return;
+    }
+    if (extract_host(&c->req, c->request, c->host, sizeof(c->host), &c->port) == -1) {
+        send_error(c, 400);
+        return;
+    }
+    if (is_tunnel_request(c) && !tunnel_port_allowed(c)) {
+        counter_add(&c->reactor->metrics.tunnel_port_refused, 1);
+        send_error(c, 403);
+        return;
+    }
+    if (answer_from_cache(c, 1)) {
+        return;
+    }
+    start_lookup(c);
+}
+
+static void start_lookup(conn *c) {
+    if (!admit_host(c)) {
+        return;
+    }
+    // the client fd leaves the epoll set while the resolver or the pool own the
+    // connection, otherwise a hang up would be reported (and the connection freed) under their feet
+    c->state = CONN_RESOLVING;
+    c->phase_us = monotonic_us();
+    trace_mark(c, TRACE_LOOKUP);
+    watch(c->reactor, &c->client, 0);
+    c->dns_wait.cb = on_dns_answer;
+    c->dns_wait.ctx = c;
+    if (resolver_lookup(c->reactor->group->res, c->host, &c->dns_wait, &c->dns) == DNS_HIT) {
+        on_resolved(c);
+    }
+}
+
+static void on_client_readable(conn *c) {
+    while (1) {
+        if (c->request == NULL) {
+            if ((c->request = (char *) block_get(&c->reactor->io_bufs)) == NULL) {
+                close_conn(c);
+                return;
+            }
+            c->request_cap = IO_BUFFER_LEN;
+        }
+        if (c->request_len + 1 >= c->request_cap) { // keep room for the terminating null
+            char *temp = grow_buffer(c->reactor, c->request, c->request_len, c->request_cap, c->request_cap * 2);
+            if (temp == NULL) {
+                send_error(c, 500);
+                return;
+            }
+            c->request = temp;
+            c->request_cap *= 2;
+        }
+        ssize_t bytes_read = read(c->client.fd, c->request + c->request_len, c->request_cap - c->request_len - 1);
+        if (bytes_read > 0) {
+            counter_add(&c->reactor->metrics.client_bytes_in, bytes_read);
+            if (c->deadline == DEADLINE_IDLE) { // the head started, the rest of it gets header_timeout
+                set_deadline(c, DEADLINE_HEAD);
+            }
+            c->request_len += bytes_read;
+            c->request[c->request_len] = '\0';
+            // the parser resumes where it stopped, only the new bytes are looked at
+            long head_len = http_parse_request(&c->req, c->request, c->request_len);
+            if (head_len > 0) {
+                on_request_complete(c, (size_t) head_len);
+                return;
+            }
+            if (head_len == HTTP_PARSE_ERROR) {
+                send_error(c, 400);
+                return;
+            }
+            continue;
+        }
+        if (bytes_read == 0) { // the client finished sending before the end of the head
+            if (c->request_len == 0) {
+                close_conn(c);
+            } else {
+                send_error(c, 400);
+            }
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            close_conn(c);
+        }
+        return;
+    }
+}
+
+static void on_connected(conn *c) {
+    set_deadline(c, DEADLINE_IO);
+    // the wait for the response starts with the request going out
+    c->phase_us = monotonic_us();
+    trace_mark(c, TRACE_CONNECT);
+    if (c->reused) {
+        c->trace.flags |= TRACE_REUSED;
+    }
+    if (is_tunnel_request(c)) {
+        start_tunnel(c);
+        return;
+    }
+    // a stale entry is revalidated with its validators, the ones too long to fit are left out
+    char validators[512] = "";
+    if (c->stale != NULL) {
+        size_t len = 0;
+        if (c->stale->etag != NULL && strlen(c->stale->etag) < 200) {
+            len += sprintf(validators + len, "If-None-Match: %s\r\n", c->stale->etag);
+        }
+        if (c->stale->last_modified != NULL && strlen(c->stale->last_modified) < 200) {
+            sprintf(validators + len, "If-Modified-Since: %s\r\n", c->stale->last_modified);
+        }
+    }
+    // the head and the body bytes read with it go out as slices of the request buffer, which stays put until sent
+    if ((c->out = (http_rewrite *) arena_alloc(&c->arena, sizeof(http_rewrite))) == NULL ||
+        rewrite_request(c->out, &c->req, c->request, c->client_info.sin_addr,
+                        c->reactor->pool->max_idle > 0, validators) == -1 ||
+        http_rewrite_add(c->out, c->request + c->req.head_len, c->request_end - c->req.head_len) == -1) {
+        c->out = NULL;
+        send_error(c, 500);
+        return;
+    }
+    c->state = CONN_RELAYING;
+    flush_upstream(c);
+}
+
+// a request may be sent again on a new connection if the server closed the pooled one meanwhile,
+// unless it has a body: the server may have acted on it, and what was streamed cannot be read again
+static int can_retry(conn *c) {
+    return c->reused && c->upload.mode == BODY_NONE;
+}
+
+// a pooled connection the server closed meanwhile: send the request again on a new one.
+// only done while no byte of the response arrived, so nothing reached the client yet
+static void retry_fresh(conn *c) {
+    close_upstream(c);
+    c->out = NULL;
+    c->head_len = 0;
+    c->reused = 0;
+    connect_upstream(c);
+}
+
+static void start_connect(conn *c) {
+    // a tunnel gets a connection of its own, it never goes back to the pool either
+    int fd = is_tunnel_request(c) ? -1 : upstream_pool_take(c->reactor->pool, c->host, c->port);
+    if (fd != -1) {
+        c->upstream.fd = fd;
+        c->reused = 1;
+        c->state = CONN_CONNECTING;
+        on_connected(c);
+        return;
+    }
+    connect_upstream(c);
+}
+
+// the first connect to succeed becomes the upstream connection, the others are closed
+static void win_race(conn *c, connect_attempt *a) {
+    reactor *r = c->reactor;
+    uint64_t now = monotonic_us();
+    histogram_record(&r->metrics.connect, now - c->phase_us);
+    if (a->backend != NULL) {
+        balancer_connected(r->balancer, a->backend, (int64_t) (now - a->started_us), r->now_ms);
+    }
+    // the connects that started earlier and are still in flight are that slow at least
+    for (int i = 0; i < CONNECT_RACE_WIDTH; ++i) {
+        connect_attempt *other = &c->race.attempts[i];
+        if (other->ep.fd != -1 && other->backend != NULL && other->started_us < a->started_us) {
+            balancer_outrun(r->balancer, other->backend, (int64_t) (now - other->started_us), r->now_ms);
+        }
+    }
+    // the load of the address stays counted while the request uses the connection
+    watch(r, &a->ep, 0);
+    c->upstream.fd = a->ep.fd;
+    c->backend = a->backend;
+    a->ep.fd = -1;
+    a->backend = NULL;
+    c->race.in_flight--;
+    end_race(c, 0);
+    on_connected(c);
+}
+
+// the timer of a racing connection fires for the next address or for the connect deadline
+static void arm_race(conn *c) {
+    connect_race *race = &c->race;
+    int64_t at = race->deadline_ms;
+    if (race->next < race->count && race->in_flight < CONNECT_RACE_WIDTH && race->next_ms < at) {
+        at = race->next_ms;
+    }
+    c->deadline = DEADLINE_CONNECT;
+    timer_arm(&c->reactor->timers, &c->timer, (uint64_t) at);
+}
+
+// connect to the next address, and to the one after it right away if that fails at once. a
+// connect in progress is given connect_stagger ms before the next address is tried alongside
+static void advance_race(conn *c) {
+    reactor *r = c->reactor;
+    connect_race *race = &c->race;
+    while (race->next < race->count && race->in_flight < CONNECT_RACE_WIDTH) {
+        connect_attempt *a = race->attempts;
+        while (a->ep.fd != -1) {
+            a++;
+        }
+        const dns_addr *addr = &c->dns.addrs[race->order[race->next++]];
+        struct sockaddr_storage sa;
+        socklen_t len = dns_addr_sockaddr(addr, c->port, &sa);
+        if ((a->ep.fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) == -1) {
+            send_error(c, 500);
+            return;
+        }
+        counter_add(&r->metrics.connect_attempts, 1);
+        if (race->in_flight > 0) {
+            counter_add(&r->metrics.connect_fallbacks, 1);
+        }
+        race->in_flight++;
+        a->started_us = monotonic_us();
+        if ((a->backend = balancer_get(r->balancer, addr, c->port)) != NULL) {
+            a->backend->load++;
+        }
+        if (connect(a->ep.fd, (struct sockaddr *) &sa, len) == 0) {
+            win_race(c, a);
+            return;
+        }
+        if (errno != EINPROGRESS) {
+            end_attempt(c, a, 1);
+            continue;
+        }
+        watch(r, &a->ep, EPOLLOUT);
+        race->next_ms = r->now_ms + r->group->config->connect_stagger;
+        return;
+    }
+    if (race->in_flight == 0) {
+        // every address was tried and none took the connection
+        send_error(c, 502);
+    }
+}
+
+// open a new upstream connection, racing connects over the addresses of the host
+static void connect_upstream(conn *c) {
+    reactor *r = c->reactor;
+    connect_race *race = &c->race;
+    c->phase_us = monotonic_us();
+    c->state = CONN_CONNECTING;
+    race->count = balancer_order(r->balancer, &c->dns, c->port, r->now_ms, race->order);
+    race->next = 0;
+    set_deadline(c, DEADLINE_CONNECT);
+    race->deadline_ms = (int64_t) c->timer.expires;
+    advance_race(c);
+    if (c->state == CONN_CONNECTING) {
+        arm_race(c);
+    }
+}
+
+static void on_attempt_event(conn *c, connect_attempt *a) {
+    if (c->state != CONN_CONNECTING || a->ep.fd == -1) {
+        return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(a->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        end_attempt(c, a, 1);
+        advance_race(c);
+        if (c->state == CONN_CONNECTING) {
+            arm_race(c);
+        }
+        return;
+    }
+    win_race(c, a);
+}
+
+// how much to read next, never past the end of a Content-Length body
+static size_t read_limit(const http_body *body, size_t limit) {
+    if (body->mode == BODY_LENGTH && body->remaining < limit) {
+        return (size_t) body->remaining;
+    }
+    return limit;
+}
+
+// the client is read for more of the body once the upstream took the previous piece
+static unsigned int upload_client_events(conn *c) {
+    return c->state == CONN_RELAYING && c->up_buf != NULL && c->up_len == 0 ? EPOLLIN : 0;
+}
+
+static unsigned int upload_upstream_events(conn *c) {
+    return c->state == CONN_RELAYING && c->up_off < c->up_len ? EPOLLOUT : 0;
+}
+
+// the whole body reached the upstream
+static int upload_complete(conn *c) {
+    return c->upload.done && c->up_buf == NULL;
+}
+
+// the body is not streamed anymore, all of it went out or it never will
+static void stop_upload(conn *c) {
+    block_put(&c->reactor->relay_bufs, c->up_buf);
+    c->up_buf = NULL;
+    c->up_len = c->up_off = 0;
+    if (!c->upload.done) { // where the next request starts is unknown
+        c->keep_alive = 0;
+    }
+}
+
+// bytes the client sent after the end of the body belong to its next request
+static int keep_pipelined(conn *c, const char *data, size_t len) {
+    if (c->request_len + len + 1 > c->request_cap) {
+        size_t cap = c->request_cap;
+        while (cap < c->request_len + len + 1) {
+            cap *= 2;
+        }
+        char *temp = grow_buffer(c->reactor, c->request, c->request_len + 1, c->request_cap, cap);
+        if (temp == NULL) {
+            return -1;
+        }
+        c->request = temp;
+        c->request_cap = cap;
+    }
+    memcpy(c->request + c->request_len, data, len);
+    if (c->request_len == c->request_end) { // the first pipelined byte hides behind the terminating null
+        c->saved_byte = c->request[c->request_end];
+        c->request[c->request_end] = '\0';
+    }
+    c->request_len += len;
+    c->request[c->request_len] = '\0';
+    return 0;
+}
+
+// the head is out but the body is not complete: stream the rest of it from the client
+static void start_upload(conn *c) {
+    if ((c->up_buf = (char *) block_get(&c->reactor->relay_bufs)) == NULL) {
+        close_conn(c);
+        return;
+    }
+    const char *value;
+    size_t value_len;
+    if (c->req.minor_version >= 1 && http_request_header(&c->req, c->request, "Expect", &value, &value_len) &&
+        http_header_has_token(value, value_len, "100-continue")) {
+        // the client waits for a go before it sends the body
+        static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        c->resp = (char *) go_on;
+        c->resp_len = sizeof(go_on) - 1;
+        c->resp_off = 0;
+        c->resp_from = RESP_ARENA;
+    }
+    flush_client(c);
+}
+
+// write the request head, the body bytes read with it, then the ones read from the client since
+static void flush_upstream(conn *c) {
+    while (c->out != NULL && c->out->next < c->out->num_iov) {
+        ssize_t wrote = http_rewrite_send(c->out, c->upstream.fd);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(c->reactor, &c->upstream, EPOLLOUT);
+                return;
+            }
+            if (can_retry(c)) {
+                retry_fresh(c);
+                return;
+            }
+            send_error(c, 500);
+            return;
+        }
+        counter_add(&c->reactor->metrics.upstream_bytes_out, wrote);
+    }
+    if (c->out != NULL) {
+        c->out = NULL;
+        if (!c->upload.done) {
+            start_upload(c);
+            return;
+        }
+        // the request is out, wait for the response
+        watch(c->reactor, &c->upstream, EPOLLIN);
+        return;
+    }
+    // while the client has response bytes to take, the upstream is only written
+    unsigned int response = c->client.events & EPOLLOUT ? 0 : EPOLLIN;
+    int broken = 0;
+    while (c->up_off < c->up_len && !broken) {
+        ssize_t wrote = send(c->upstream.fd, c->up_buf + c->up_off, c->up_len - c->up_off, MSG_NOSIGNAL);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(c->reactor, &c->client, c->client.events & ~EPOLLIN);
+                watch(c->reactor, &c->upstream, EPOLLOUT | response);
+                return;
+            }
+            broken = 1;
+            continue;
+        }
+        counter_add(&c->reactor->metrics.upstream_bytes_out, wrote);
+        c->up_off += wrote;
+    }
+    c->up_len = c->up_off = 0;
+    if (broken) {
+        // the server stopped reading the body, its answer is still relayed
+        c->upload.done = 0;
+        stop_upload(c);
+    } else if (c->upload.done) {
+        stop_upload(c);
+    }
+    watch(c->reactor, &c->client, (c->client.events & EPOLLOUT) | upload_client_events(c));
+    watch(c->reactor, &c->upstream, response);
+}
+
+// read the next piece of the request body, the client is not read again before the upstream took it
+static void read_upload(conn *c) {
+    ssize_t bytes_read = read(c->client.fd, c->up_buf, read_limit(&c->upload, RELAY_BUFFER_LEN));
+    if (bytes_read == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close_conn(c);
+        }
+        return;
+    }
+    counter_add(&c->reactor->metrics.client_bytes_in, bytes_read);
+    if (bytes_read == 0) {
+        // the client half-closed before the end of its body, so does the proxy towards the
+        // server, whose answer to the truncated request still goes back
+        shutdown(c->upstream.fd, SHUT_WR);
+        stop_upload(c);
+        watch(c->reactor, &c->client, c->client.events & EPOLLOUT);
+        return;
+    }
+    size_t body_bytes = http_body_consume(&c->upload, c->up_buf, bytes_read);
+    if (c->upload.error) {
+        // the upstream has part of the request, it is closed with the client
+        c->keep_alive = 0;
+        if (!c->head_done && c->resp == NULL) {
+            send_error(c, 400);
+        } else {
+            close_conn(c);
+        }
+        return;
+    }
+    if (body_bytes < (size_t) bytes_read &&
+        keep_pipelined(c, c->up_buf + body_bytes, bytes_read - body_bytes) == -1) {
+        close_conn(c);
+        return;
+    }
+    c->up_len = body_bytes;
+    c->up_off = 0;
+    flush_upstream(c);
+}
+
+// queue the part of the response the client did not take yet, it is sent before anything else.
+// rather than copying it, the connection keeps the relay buffer and the reactor takes another one
+static int keep_leftover(conn *c, size_t off, size_t len) {
+    reactor *r = c->reactor;
+    char *next = (char *) block_get(&r->relay_bufs);
+    if (next == NULL) {
+        return -1;
+    }
+    release_resp(c);
+    c->resp = r->relay_buf;
+    c->resp_from = RESP_RELAY;
+    c->resp_off = off;
+    c->resp_len = len;
+    r->relay_buf = next;
+    return 0;
+}
+
+// stop reading the upstream until the client took what is already pending, an upload goes on
+static void wait_for_client(conn *c) {
+    watch(c->reactor, &c->upstream, upload_upstream_events(c));
+    watch(c->reactor, &c->client, EPOLLOUT | upload_client_events(c));
+}
+
+// get ready for the next request of a keep-alive client, it may already be in the buffer
+static void next_request(conn *c) {
+    end_request(c);
+    release_host_limit(c);
+    c->request[c->request_end] = c->saved_byte;
+    c->request_len -= c->request_end;
+    memmove(c->request, c->request + c->request_end, c->request_len + 1);
+    c->request_end = 0;
+    c->out = NULL;
+    c->reused = 0;
+    c->status = 0;
+    c->head_done = 0;
+    memset(&c->response, 0, sizeof(http_response));
+    release_encoding(c);
+    release_cache_state(c);
+    // what the request carved from the arena is not referenced anymore
+    arena_reset(&c->arena);
+    c->state = CONN_READING_REQUEST;
+
+    http_request_init(&c->req);
+    if (c->request_len == 0) {
+        // nothing pipelined, an idle client holds no buffer
+        release_buffer(c->reactor, c->request, c->request_cap);
+        c->request = NULL;
+        c->request_cap = 0;
+        idle_client(c);
+        watch(c->reactor, &c->client, EPOLLIN);
+        return;
+    }
+    long head_len = http_parse_request(&c->req, c->request, c->request_len);
+    if (head_len > 0) { // pipelined
+        on_request_complete(c, (size_t) head_len);
+        return;
+    }
+    if (head_len == HTTP_PARSE_ERROR) {
+        send_error(c, 400);
+        return;
+    }
+    idle_client(c);
+    watch(c->reactor, &c->client, EPOLLIN);
+}
+
+/**
+ * runs on a pool thread: the disk write of a response, then the memory
+ * tier takes the copy over
+ */
+static int store_job(void *arg) {
+    store_task *task = (store_task *) arg;
+    reactor_group *g = task->g;
+    disk_cache_store(g->disk, task->key, task->data, task->head_len, task->data_len, &task->policy, task->addr);
+    if (g->cache != NULL) {
+        cache_store(g->cache, task->key, task->data, task->head_len, task->data_len, &task->policy, task->addr);
+    } else {
+        free(task->data);
+    }
+    return 1;
+}
+
+// hand the complete copy of a response to the cache tiers
+// the address a response is stored with, the filter is asked about it again on a hit. it saw
+// every address of the host before the fetch, the first IPv4 one stands for them, 0.0.0.0 if none
+static struct in_addr stored_addr(const conn *c) {
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    if (ipv4_addrs(&c->dns, addrs) == 0) {
+        addrs[0].s_addr = htonl(INADDR_ANY);
+    }
+    return addrs[0];
+}
+
+static void store_response(conn *c) {
+    reactor_group *g = c->reactor->group;
+    size_t key_len = strlen(c->cache_key);
+    store_task *task = g->disk != NULL ? (store_task *) mem_alloc(sizeof(store_task) + key_len + 1) : NULL;
+    if (task != NULL) {
+        // the disk write blocks, it is done on the pool
+        task->g = g;
+        memcpy(task->key, c->cache_key, key_len + 1);
+        task->data = c->fill;
+        task->head_len = c->fill_head_len;
+        task->data_len = c->fill_len;
+        task->policy = c->fill_policy;
+        task->addr = stored_addr(c);
+        if (try_dispatch(c->reactor->tp, store_job, (void *) task) == TP_QUEUED) {
+            c->fill = NULL;
+            return;
+        }
+        free(task);
+    }
+    // no disk tier, or the pool is overloaded: memory only
+    if (g->cache != NULL) {
+        cache_store(g->cache, c->cache_key, c->fill, c->fill_head_len, c->fill_len,
+                    &c->fill_policy, stored_addr(c));
+        c->fill = NULL;
+    }
+}
+
+// the response was read to its end: park the upstream connection if the server keeps it open
+static void release_upstream(conn *c) {
+    if (c->upstream.fd != -1 && c->response.keep_alive && c->response.body.done && c->out == NULL &&
+        upload_complete(c)) {
+        watch(c->reactor, &c->upstream, 0);
+        upstream_pool_put(c->reactor->pool, c->host, c->port, c->upstream.fd);
+        c->upstream.fd = -1;
+        release_backend(c);
+    } else {
+        close_upstream(c);
+    }
+}
+
+// the whole response reached the client: store its copy, release the upstream connection,
+// and wait for the next request if both the client and the response allow it
+static void finish_response(conn *c) {
+    if (c->fill != NULL && c->response.body.done) {
+        // stored before the followers finish, a request they pipelined finds it in the cache
+        fetch *f = c->fetch != NULL ? complete_fetch(c) : NULL;
+        if (c->fill != NULL) {
+            store_response(c);
+        }
+        if (f != NULL) {
+            flush_readers(f);
+        }
+    }
+    release_upstream(c);
+    // the client read the response headers of the server, a "close" there closes it on its side too.
+    // once the request budget is spent no further request would be served, close right away.
+    // a response that came before the end of the body leaves the rest of it unread
+    if (c->keep_alive && c->response.keep_alive && upload_complete(c) &&
+        !atomic_load(&c->reactor->group->accept_done)) {
+        next_request(c);
+        return;
+    }
+    close_conn(c);
+}
+
+// headers that only concern one connection, they are not stored with a response
+static int hop_by_hop(const char *line, size_t len) {
+    static const char *names[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "Age:", "X-Cache:"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        size_t name_len = strlen(names[i]);
+        if (len >= name_len && strncasecmp(line, names[i], name_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the biggest response one of the cache tiers takes
+static size_t fill_limit(const reactor_group *g) {
+    size_t memory = g->cache != NULL ? g->cache->max_object : 0;
+    size_t disk = g->disk != NULL ? g->disk->max_object : 0;
+    return memory > disk ? memory : disk;
+}
+
+// start the copy of a response the cache may store, from its head without the hop-by-hop headers
+static void start_fill(conn *c, size_t head_end) {
+    http_body *body = &c->response.body;
+    if (c->cache_key == NULL || body->mode == BODY_UNTIL_CLOSE ||
+        (body->mode == BODY_LENGTH && head_end + body->remaining > fill_limit(c->reactor->group)) ||
+        !cache_response_policy(c->head, head_end, c->response.status, &c->fill_policy)) {
+        return;
+    }
+    size_t cap = head_end + (body->mode == BODY_LENGTH ? (size_t) body->remaining :
+                             body->mode == BODY_CHUNKED ? CACHE_FILL_LEN : 0);
+    if ((c->fill = (char *) mem_alloc(cap)) == NULL) {
+        return;
+    }
+    c->fill_cap = cap;
+    c->fill_len = 0;
+    const char *line = c->head;
+    const char *end = c->head + head_end;
+    while (line < end && *line != '\r' && *line != '\n') { // up to the empty line
+        const char *line_end = memchr(line, '\n', end - line);
+        size_t len = line_end != NULL ? (size_t) (line_end + 1 - line) : (size_t) (end - line);
+        if (!hop_by_hop(line, len)) {
+            memcpy(c->fill + c->fill_len, line, len);
+            c->fill_len += len;
+        }
+        line += len;
+    }
+    c->fill_head_len = c->fill_len;
+}
+
+// copy body bytes into the fill, a response that outgrows the cache is given up
+static void append_fill(conn *c, const char *data, size_t len) {
+    size_t max_object = fill_limit(c->reactor->group);
+    if (c->fill == NULL || len == 0) {
+        return;
+    }
+    if (c->fill_len + len > max_object) {
+        free(c->fill);
+        c->fill = NULL;
+        return;
+    }
+    if (c->fill_len + len > c->fill_cap) {
+        size_t cap = c->fill_cap * 2 > c->fill_len + len ? c->fill_cap * 2 : c->fill_len + len;
+        char *temp = (char *) mem_realloc(c->fill, cap < max_object ? cap : max_object);
+        if (temp == NULL) {
+            free(c->fill);
+            c->fill = NULL;
+            return;
+        }
+        c->fill = temp;
+        c->fill_cap = cap < max_object ? cap : max_object;
+    }
+    memcpy(c->fill + c->fill_len, data, len);
+    c->fill_len += len;
+}
+
+// the server confirmed the stale entry: it is fresh again and answers the request
+static void on_revalidated(conn *c, size_t head_end) {
+    cache_entry *e = c->stale;
+    c->stale = NULL;
+    cache_refresh(e, c->head, head_end);
+    // the followers find the entry fresh now
+    leave_fetch(c);
+    release_buffer(c->reactor, c->head, c->head_cap);
+    c->head = NULL;
+    c->head_len = c->head_cap = 0;
+    release_upstream(c);
+    serve_hit(c, e, "REVALIDATED");
+}
+
+// hand the head (and the body bytes read with it) over to the client
+static void relay_head(conn *c) {
+    c->head_done = 1;
+    c->resp_status = c->response.status;
+    feed_followers(c);
+    release_resp(c);
+    c->resp = c->head;
+    c->resp_len = c->head_len;
+    c->resp_from = c->head_cap == IO_BUFFER_LEN ? RESP_IO : RESP_HEAP;
+    c->head = NULL;
+    c->head_len = c->head_cap = 0;
+    flush_client(c);
+}
+
+// compress the response if the client takes a coding of it, and it is text big enough to be worth it
+static void start_encoding(conn *c, size_t head_end) {
+    const proxy_config *config = c->reactor->group->config;
+    const http_body *body = &c->response.body;
+    const char *value;
+    size_t value_len;
+    // the encoded body is sent chunked, which an HTTP/1.0 client does not read
+    if (config->compress == 0 || c->response.status != 200 || body->mode == BODY_NONE ||
+        c->req.minor_version != 1 || (body->mode == BODY_LENGTH && body->remaining < config->compress_min) ||
+        !http_request_header(&c->req, c->request, "Accept-Encoding", &value, &value_len)) {
+        return;
+    }
+    content_coding coding = compress_accepted(value, value_len, config->compress);
+    if (coding == CODING_IDENTITY || http_find_header(c->head, head_end, "Content-Encoding", &value, &value_len) ||
+        !http_find_header(c->head, head_end, "Content-Type", &value, &value_len) ||
+        !compress_type(value, value_len) ||
+        (http_find_header(c->head, head_end, "Cache-Control", &value, &value_len) &&
+         http_header_has_token(value, value_len, "no-transform"))) {
+        return;
+    }
+    response_encoder *e = (response_encoder *) mem_alloc(sizeof(response_encoder));
+    if (e == NULL) {
+        return;
+    }
+    if (encoder_init(&e->enc, coding, config->compress_level,
+                     body->mode == BODY_LENGTH ? (size_t) body->remaining : 0) == -1) {
+        free(e);
+        return;
+    }
+    e->payload = *body;
+    c->encoding = e;
+    counter_add(&c->reactor->metrics.compressed, 1);
+    c->trace.flags |= TRACE_COMPRESSED;
+}
+
+static int header_line_is(const char *line, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    return len > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':';
+}
+
+// the head of a compressed response, written into out of cap bytes: its length is gone, the body is
+// chunked, the coding and Vary are added and a strong ETag becomes weak, the bytes are not the same
+// anymore. a response has one ETag, the others are dropped. returns 0 if out is too small
+static size_t encoded_head(conn *c, size_t head_end, char *out, size_t cap) {
+    const char *line = c->head;
+    const char *end = c->head + head_end;
+    size_t len = 0;
+    int vary = 0, etag = 0;
+    while (line < end && *line != '\r' && *line != '\n') { // up to the empty line
+        const char *line_end = memchr(line, '\n', end - line);
+        size_t line_len = line_end != NULL ? (size_t) (line_end + 1 - line) : (size_t) (end - line);
+        if (header_line_is(line, line_len, "Content-Length") || header_line_is(line, line_len, "Transfer-Encoding") ||
+            (header_line_is(line, line_len, "ETag") && etag++ > 0)) {
+            line += line_len;
+            continue;
+        }
+        size_t copied = 0;
+        if (header_line_is(line, line_len, "ETag")) {
+            size_t value = 5;
+            while (value < line_len && (line[value] == ' ' || line[value] == '\t')) {
+                value++;
+            }
+            if (line_len - value < 2 || strncmp(line + value, "W/", 2) != 0) {
+                if (cap - len < value + 2) {
+                    return 0;
+                }
+                memcpy(out + len, line, value);
+                memcpy(out + len + value, "W/", 2);
+                len += value + 2;
+                copied = value;
+            }
+        } else if (header_line_is(line, line_len, "Vary")) {
+            vary |= http_header_has_token(line + 5, line_len - 5, "Accept-Encoding") ||
+                    http_header_has_token(line + 5, line_len - 5, "*");
+        }
+        if (cap - len < line_len - copied) {
+            return 0;
+        }
+        memcpy(out + len, line + copied, line_len - copied);
+        len += line_len - copied;
+        line += line_len;
+    }
+    int tail = snprintf(out + len, cap - len, "Content-Encoding: %s\r\nTransfer-Encoding: chunked\r\n%s\r\n",
+                        c->encoding->enc.coding == CODING_BR ? "br" : "gzip",
+                        vary ? "" : "Vary: Accept-Encoding\r\n");
+    if (tail < 0 || (size_t) tail >= cap - len) {
+        return 0;
+    }
+    return len + (size_t) tail;
+}
+
+// grow the response being encoded, a relay buffer that is too small moves to the heap
+static int grow_encoded(conn *c, size_t *cap, size_t len) {
+    size_t new_cap = *cap * 2;
+    char *temp;
+    if (c->resp_from == RESP_RELAY) {
+        if ((temp = (char *) mem_alloc(new_cap)) == NULL) {
+            return -1;
+        }
+        memcpy(temp, c->resp, len);
+        block_put(&c->reactor->relay_bufs, c->resp);
+    } else if ((temp = (char *) mem_realloc(c->resp, new_cap)) == NULL) {
+        return -1;
+    }
+    c->resp = temp;
+    c->resp_from = RESP_HEAP;
+    *cap = new_cap;
+    return 0;
+}
+
+/**
+ * make the bytes pending for the client of prefix_len bytes of prefix (the head of the
+ * response, or nothing) and of payload compressed, as one chunk. finish ends the stream and the
+ * body. returns -1 on failure
+ */
+static int encode_response(conn *c, const char *prefix, size_t prefix_len, const char *payload, size_t len,
+                           int finish) {
+    reactor *r = c->reactor;
+    size_t data = prefix_len + CHUNK_SIZE_ROOM;
+    size_t cap = RELAY_BUFFER_LEN;
+    release_resp(c);
+    if (data + ENCODE_MIN_ROOM + ENCODE_TAIL_ROOM <= cap) {
+        c->resp = (char *) block_get(&r->relay_bufs);
+        c->resp_from = RESP_RELAY;
+    } else {
+        cap = data + ENCODE_MIN_ROOM + ENCODE_TAIL_ROOM;
+        c->resp = (char *) mem_alloc(cap);
+        c->resp_from = RESP_HEAP;
+    }
+    if (c->resp == NULL) {
+        c->resp_from = RESP_ARENA;
+        return -1;
+    }
+    if (prefix_len > 0) {
+        memcpy(c->resp, prefix, prefix_len);
+    }
+    size_t pos = data;
+    size_t off = 0;
+    int more;
+    do {
+        if (cap - pos < ENCODE_MIN_ROOM + ENCODE_TAIL_ROOM && grow_encoded(c, &cap, pos) == -1) {
+            return -1;
+        }
+        size_t used;
+        size_t wrote;
+        more = encoder_run(&c->encoding->enc, payload + off, len - off, finish, c->resp + pos,
+                           cap - pos - ENCODE_TAIL_ROOM, &used, &wrote);
+        off += used;
+        pos += wrote;
+    } while (more == 1);
+    if (more == -1) {
+        return -1;
+    }
+    size_t encoded = pos - data;
+    size_t start = 0;
+    if (encoded > 0) {
+        // the size line goes right before the data, the prefix is moved up against it
+        char size_line[CHUNK_SIZE_ROOM + 1];
+        int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", encoded);
+        start = CHUNK_SIZE_ROOM - size_len;
+        memcpy(c->resp + data - size_len, size_line, size_len);
+        memmove(c->resp + start, c->resp, prefix_len);
+        memcpy(c->resp + pos, "\r\n", 2);
+        pos += 2;
+    } else {
+        pos = prefix_len;
+    }
+    if (finish) {
+        memcpy(c->resp + pos, "0\r\n\r\n", 5);
+        pos += 5;
+    }
+    c->resp_off = start;
+    c->resp_len = pos;
+    counter_add(&r->metrics.compress_in, len);
+    counter_add(&r->metrics.compress_out, encoded);
+    return 0;
+}
+
+// relay_head for a compressed response: its new head and the body bytes read with it, encoded
+static void relay_encoded_head(conn *c, size_t head_end) {
+    c->head_done = 1;
+    c->resp_status = c->response.status;
+    feed_followers(c);
+    char *head = (char *) arena_alloc(&c->arena, head_end + ENCODED_HEAD_EXTRA);
+    size_t head_len = head != NULL ? encoded_head(c, head_end, head, head_end + ENCODED_HEAD_EXTRA) : 0;
+    if (head_len == 0) {
+        close_conn(c);
+        return;
+    }
+    size_t payload = http_body_payload(&c->encoding->payload, c->head + head_end, c->head_len - head_end);
+    if (encode_response(c, head, head_len, c->head + head_end, payload, c->response.body.done) == -1) {
+        close_conn(c);
+        return;
+    }
+    release_buffer(c->reactor, c->head, c->head_cap);
+    c->head = NULL;
+    c->head_len = c->head_cap = 0;
+    flush_client(c);
+}
+
+// the response head is read into its own buffer and parsed before any byte goes to the client
+static void read_response_head(conn *c) {
+    if (c->head_len == c->head_cap) {
+        size_t cap = c->head_cap == 0 ? IO_BUFFER_LEN : c->head_cap * 2;
+        char *temp = cap > RESPONSE_HEAD_MAX ? NULL :
+                     c->head == NULL ? (char *) block_get(&c->reactor->io_bufs) :
+                     grow_buffer(c->reactor, c->head, c->head_len, c->head_cap, cap);
+        if (temp == NULL) {
+            // no end of head in sight, relay it as is and do not reuse the connection
+            c->response.body.mode = BODY_UNTIL_CLOSE;
+            relay_head(c);
+            return;
+        }
+        c->head = temp;
+        c->head_cap = cap;
+    }
+    ssize_t bytes_read = read(c->upstream.fd, c->head + c->head_len, c->head_cap - c->head_len);
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        if (can_retry(c) && c->head_len == 0) {
+            retry_fresh(c);
+            return;
+        }
+        // relay whatever arrived, then close
+        c->state = CONN_CLOSING;
+        relay_head(c);
+        return;
+    }
+    if (c->head_len == 0) {
+        histogram_record(&c->reactor->metrics.ttfb, monotonic_us() - c->phase_us);
+        trace_mark(c, TRACE_FIRST_BYTE);
+    }
+    read_from_upstream(c, bytes_read);
+    c->head_len += bytes_read;
+    size_t head_end = http_head_end(c->head, c->head_len);
+    if (head_end == 0) {
+        return;
+    }
+    if (http_parse_response(c->head, head_end, strncmp(c->request, "HEAD ", 5) == 0, &c->response) == -1) {
+        memset(&c->response, 0, sizeof(http_response));
+        c->response.body.mode = BODY_UNTIL_CLOSE;
+    }
+    start_encoding(c, head_end);
+    // the body bytes read together with the head
+    size_t body_bytes = http_body_consume(&c->response.body, c->head + head_end, c->head_len - head_end);
+    if (c->response.body.error) {
+        // nothing reached the client yet, the upstream connection is not pooled
+        send_error(c, 502);
+        return;
+    }
+    if (head_end + body_bytes < c->head_len) { // the server sent past the end of the response
+        c->response.keep_alive = 0;
+        c->head_len = head_end + body_bytes;
+    }
+    if (c->stale != NULL) {
+        if (c->response.status == 304) {
+            on_revalidated(c, head_end);
+            return;
+        }
+        // a new response replaces the entry
+        cache_release(c->stale);
+        c->stale = NULL;
+    }
+    start_fill(c, head_end);
+    append_fill(c, c->head + head_end, body_bytes);
+    if (c->encoding != NULL) {
+        relay_encoded_head(c, head_end);
+        return;
+    }
+    relay_head(c);
+}
+
+// copy path: read into the reactor buffer and write straight to the client
+static void relay_buffered(conn *c) {
+    reactor *r = c->reactor;
+    ssize_t response_bytes_read = read(c->upstream.fd, r->relay_buf,
+                                       read_limit(&c->response.body, RELAY_BUFFER_LEN));
+    if (response_bytes_read == 0) {
+        if (c->encoding != NULL && c->response.body.mode == BODY_UNTIL_CLOSE) {
+            // the end of the body, the client gets the end of the stream and its last chunk
+            c->response.body.done = 1;
+            c->response.keep_alive = 0;
+            if (encode_response(c, NULL, 0, "", 0, 1) == -1) {
+                close_conn(c);
+                return;
+            }
+            flush_client(c);
+            return;
+        }
+        close_conn(c);
+        return;
+    }
+    if (response_bytes_read == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close_conn(c);
+        }
+        return;
+    }
+    read_from_upstream(c, response_bytes_read);
+    size_t body_bytes = http_body_consume(&c->response.body, r->relay_buf, response_bytes_read);
+    if (c->response.body.error) {
+        // the client has part of the response and the upstream an unknown rest of it, both go
+        close_conn(c);
+        return;
+    }
+    if (body_bytes < (size_t) response_bytes_read) { // the server sent past the end of the response
+        c->response.keep_alive = 0;
+        response_bytes_read = body_bytes;
+    }
+    append_fill(c, r->relay_buf, response_bytes_read);
+    feed_followers(c);
+    if (c->encoding != NULL) {
+        size_t payload = http_body_payload(&c->encoding->payload, r->relay_buf, response_bytes_read);
+        if (encode_response(c, NULL, 0, r->relay_buf, payload, c->response.body.done) == -1) {
+            close_conn(c);
+            return;
+        }
+        flush_client(c);
+        return;
+    }
+    size_t written = 0;
+    while (written < (size_t) response_bytes_read) {
+        ssize_t wrote = send(c->client.fd, r->relay_buf + written, response_bytes_read - written, MSG_NOSIGNAL);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            close_conn(c);
+            return;
+        }
+        sent_to_client(c, wrote);
+        written += wrote;
+    }
+    if (written < (size_t) response_bytes_read) {
+        if (keep_leftover(c, written, response_bytes_read) == -1) {
+            close_conn(c);
+            return;
+        }
+        wait_for_client(c);
+        return;
+    }
+    if (c->response.body.done) {
+        finish_response(c);
+    }
+}
+
+// zero-copy path: the bytes go upstream socket -> pipe -> client socket inside the kernel
+static void relay_upstream(conn *c) {
+    if (!c->head_done) {
+        read_response_head(c);
+        return;
+    }
+    // a chunked body has to be parsed to find its end, a cached one copied and a compressed one
+    // encoded, they cannot bypass user space
+    if (c->no_splice || c->response.body.mode == BODY_CHUNKED || c->fill != NULL || c->encoding != NULL ||
+        borrow_pipe(c) == -1) {
+        relay_buffered(c);
+        return;
+    }
+    ssize_t spliced = splice(c->upstream.fd, NULL, c->pipe_fds[1], NULL,
+                             read_limit(&c->response.body, RELAY_PIPE_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (spliced > 0) {
+        read_from_upstream(c, spliced);
+        http_body_consume(&c->response.body, NULL, spliced);
+        c->pipe_pending = spliced;
+        flush_client(c);
+        return;
+    }
+    // nothing is in flight, the pipe is free for other connections
+    return_pipe(c);
+    if (spliced == 0) {
+        close_conn(c);
+        return;
+    }
+    if (errno == EINVAL || errno == ENOSYS) { // this pair of fds cannot splice
+        c->no_splice = 1;
+        relay_buffered(c);
+        return;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        close_conn(c);
+    }
+}
+
+// write the pending response bytes, while the client is slow the upstream is not read
+static void flush_client(conn *c) {
+    reactor *r = c->reactor;
+    while (c->resp_off < c->resp_len) {
+        ssize_t wrote = send(c->client.fd, c->resp + c->resp_off, c->resp_len - c->resp_off, MSG_NOSIGNAL);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_for_client(c);
+                return;
+            }
+            close_conn(c);
+            return;
+        }
+        sent_to_client(c, wrote);
+        c->resp_off += wrote;
+    }
+    release_resp(c);
+    while (c->pipe_pending > 0) {
+        ssize_t spliced = splice(c->pipe_fds[0], NULL, c->client.fd, NULL, c->pipe_pending,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (spliced == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_for_client(c);
+                return;
+            }
+            close_conn(c);
+            return;
+        }
+        sent_to_client(c, spliced);
+        c->pipe_pending -= spliced;
+    }
+    if (c->hit != NULL) {
+        cache_entry *e = c->hit;
+        while (c->hit_off < e->data_len - e->head_len) {
+            ssize_t wrote = send(c->client.fd, e->data + e->head_len + c->hit_off,
+                                 e->data_len - e->head_len - c->hit_off, MSG_NOSIGNAL);
+            if (wrote == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait_for_client(c);
+                    return;
+                }
+                close_conn(c);
+                return;
+            }
+            sent_to_client(c, wrote);
+            c->hit_off += wrote;
+        }
+        cache_release(e);
+        c->hit = NULL;
+    }
+    while (c->disk.seg != NULL && c->disk_sent < c->disk.body_len) {
+        off_t off = c->disk.body_off + (off_t) c->disk_sent;
+        ssize_t sent = sendfile(c->client.fd, c->disk.seg->fd, &off, c->disk.body_len - c->disk_sent);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_for_client(c);
+                return;
+            }
+            close_conn(c);
+            return;
+        }
+        sent_to_client(c, sent);
+        c->disk_sent += sent;
+    }
+    if (c->disk.seg != NULL) {
+        disk_cache_release(r->group->disk, c->disk.seg);
+        c->disk.seg = NULL;
+    }
+    if (c->fetch != NULL && c->fetch->leader != c) {
+        fetch *f = c->fetch;
+        while (c->fetch_sent < f->len - f->head_len) {
+            ssize_t wrote = send(c->client.fd, f->data + f->head_len + c->fetch_sent,
+                                 f->len - f->head_len - c->fetch_sent, MSG_NOSIGNAL);
+            if (wrote == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait_for_client(c);
+                    return;
+                }
+                close_conn(c);
+                return;
+            }
+            sent_to_client(c, wrote);
+            c->fetch_sent += wrote;
+        }
+        if (!f->done) { // caught up with the leader, it feeds the rest as it reads it
+            watch(r, &c->client, 0);
+            return;
+        }
+        leave_fetch(c);
+        c->response.body.done = 1;
+    }
+    return_pipe(c);
+    if (c->state == CONN_CLOSING) {
+        close_conn(c);
+        return;
+    }
+    if (c->head_done && c->response.body.done) {
+        finish_response(c);
+        return;
+    }
+    watch(r, &c->client, upload_client_events(c));
+    watch(r, &c->upstream, EPOLLIN | upload_upstream_events(c));
+}
+
+// replace whatever the connection was doing with an error response, then close
+static void send_error(conn *c, int status) {
+    char *msg = (char *) arena_alloc(&c->arena, ERROR_RESPONSE_LEN);
+    if (msg == NULL) {
+        close_conn(c);
+        return;
+    }
+    int len = error_generator(status, msg);
+    c->resp_status = status;
+    leave_fetch(c);
+    stop_upload(c);
+    close_upstream(c);
+    release_pipe(c);
+    release_resp(c);
+    c->resp = msg;
+    c->resp_len = len;
+    c->state = CONN_CLOSING;
+    flush_client(c);
+}
+
+// the pipe, or the buffer once splice is off, that the next bytes of a direction are read into
+static int hold_tunnel_dir(reactor *r, tunnel_dir *d) {
+    if (!d->copy && take_pipe(r, d->pipe_fds) == -1) {
+        d->copy = 1;
+    }
+    if (d->copy && d->buf == NULL && (d->buf = (char *) block_get(&r->relay_bufs)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+// a direction with nothing in flight holds nothing
+static void empty_tunnel_dir(reactor *r, tunnel_dir *d) {
+    give_pipe(r, d->pipe_fds, 0);
+    block_put(&r->relay_bufs, d->buf);
+    d->buf = NULL;
+    d->off = 0;
+}
+
+// bytes the proxy already has for a direction, the first ones it sends
+static int preload_tunnel_dir(reactor *r, tunnel_dir *d, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (len > RELAY_BUFFER_LEN || hold_tunnel_dir(r, d) == -1) {
+        return -1;
+    }
+    if (d->copy) {
+        memcpy(d->buf, data, len);
+    } else if (write(d->pipe_fds[1], data, len) != (ssize_t) len) {
+        return -1;
+    }
+    d->pending = len;
+    return 0;
+}
+
+// move the bytes of a direction from src to dst until one of them would block. at most one read
+// is done per call, epoll reports a source with more to read again, so a busy tunnel does not
+// starve the other connections. the bytes read and written are added to *in and *out.
+// returns -1 once the tunnel is broken
+static int pump_tunnel_dir(reactor *r, tunnel_dir *d, int src, int dst, size_t *in, size_t *out) {
+    int filled = 0;
+    while (1) {
+        if (d->pending > 0) {
+            ssize_t wrote = d->copy ? send(dst, d->buf + d->off, d->pending, MSG_NOSIGNAL)
+                                    : splice(d->pipe_fds[0], NULL, dst, NULL, d->pending,
+                                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (wrote == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            *out += wrote;
+            d->pending -= wrote;
+            d->off += wrote;
+            continue;
+        }
+        empty_tunnel_dir(r, d);
+        if (d->eof || filled) {
+            return 0;
+        }
+        if (hold_tunnel_dir(r, d) == -1) {
+            return -1;
+        }
+        ssize_t got = d->copy ? read(src, d->buf, RELAY_BUFFER_LEN)
+                              : splice(src, NULL, d->pipe_fds[1], NULL, RELAY_PIPE_SIZE,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (got > 0) {
+            *in += got;
+            d->pending = got;
+            filled = 1;
+        } else if (got == 0) {
+            // the source is done sending, the other direction goes on
+            d->eof = 1;
+            shutdown(dst, SHUT_WR);
+        } else if (errno == EINVAL && !d->copy) {
+            d->copy = 1;
+        } else if (errno != EINTR) {
+            empty_tunnel_dir(r, d);
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+}
+
+// a direction waits for its source while nothing is in flight, for its destination otherwise
+static unsigned int tunnel_events(const tunnel_dir *from, const tunnel_dir *to) {
+    return (from->pending == 0 && !from->eof ? EPOLLIN : 0) | (to->pending > 0 ? EPOLLOUT : 0);
+}
+
+static void pump_tunnel(conn *c) {
+    reactor *r = c->reactor;
+    reactor_metrics *m = &r->metrics;
+    tunnel *t = &c->tunnel;
+    size_t up_in = 0, up_out = 0, down_in = 0, down_out = 0;
+    int failed = pump_tunnel_dir(r, &t->up, c->client.fd, c->upstream.fd, &up_in, &up_out) == -1 ||
+                 pump_tunnel_dir(r, &t->down, c->upstream.fd, c->client.fd, &down_in, &down_out) == -1;
+    counter_add(&m->client_bytes_in, up_in);
+    counter_add(&m->upstream_bytes_out, up_out);
+    read_from_upstream(c, down_in);
+    sent_to_client(c, down_out);
+    if (failed || (t->up.eof && t->down.eof && t->up.pending == 0 && t->down.pending == 0)) {
+        close_conn(c);
+        return;
+    }
+    watch(r, &c->client, tunnel_events(&t->up, &t->down));
+    watch(r, &c->upstream, tunnel_events(&t->down, &t->up));
+}
+
+// the target of CONNECT accepted: the client is told so, and what it sent after its head
+// is the first thing the target gets
+static void start_tunnel(conn *c) {
+    static const char established[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+    reactor *r = c->reactor;
+    tunnel *t = &c->tunnel;
+    memset(t, 0, sizeof(tunnel));
+    t->up.pipe_fds[0] = t->up.pipe_fds[1] = -1;
+    t->down.pipe_fds[0] = t->down.pipe_fds[1] = -1;
+    t->up.copy = t->down.copy = c->no_splice;
+    c->state = CONN_TUNNELING;
+    c->request[c->request_end] = c->saved_byte;
+    if (preload_tunnel_dir(r, &t->down, established, sizeof(established) - 1) == -1 ||
+        preload_tunnel_dir(r, &t->up, c->request + c->request_end, c->request_len - c->request_end) == -1) {
+        close_conn(c);
+        return;
+    }
+    // the request ends with the tunnel open, what goes through it is not a response
+    c->resp_status = 200;
+    c->trace.flags |= TRACE_TUNNEL;
+    end_request(c);
+    counter_add(&r->metrics.tunnels, 1);
+    // a tunnel lasts as long as it carries traffic, transfer_timeout is for requests
+    c->transfer_deadline_ms = 0;
+    set_deadline(c, DEADLINE_IO);
+    // nothing of the request is needed anymore, an idle tunnel holds no buffer
+    release_buffer(r, c->request, c->request_cap);
+    c->request = NULL;
+    c->request_len = c->request_cap = c->request_end = 0;
+    arena_reset(&c->arena);
+    pump_tunnel(c);
+}
+
+// the drain deadline of the group passed, nothing is waited for anymore
+static int drain_over(const reactor *r) {
+    return r->draining && r->now_ms >= atomic_load(&r->group->drain_deadline_ms);
+}
+
+// close the connections the reactor owns right now, the ones the resolver or a pool thread
+// hold are closed when they come back. close_idle limits it to the keep-alive clients between
+// requests, a client that did not send its first request yet is still answered
+static void close_live(reactor *r, int close_idle) {
+    conn *c = r->live_head;
+    while (c != NULL) {
+        conn *next = c->live_next;
+        if (c->state != CONN_CLOSED && c->state != CONN_RESOLVING && c->state != CONN_FILTERING &&
+            (!close_idle || (c->state == CONN_READING_REQUEST && c->request_len == 0 && c->requests > 0))) {
+            close_conn(c);
+        }
+        c = next;
+    }
+}
+
+static void start_drain(reactor *r) {
+    r->draining = 1;
+    close_live(r, 1);
+}
+
+static void on_wakeup(reactor *r) {
+    uint64_t count;
+    if (read(r->wakeup.fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    if (atomic_load(&r->group->accept_done)) {
+        watch(r, &r->listener, 0);
+        if (!r->draining && atomic_load(&r->group->drain_deadline_ms) != 0) {
+            start_drain(r);
+        }
+    }
+    pthread_mutex_lock(&r->done_lock);
+    conn *c = r->done_head;
+    r->done_head = NULL;
+    pthread_mutex_unlock(&r->done_lock);
+
+    while (c != NULL) {
+        conn *next = c->next;
+        c->next = NULL;
+        if (drain_over(r)) {
+            close_conn(c);
+        } else if (c->state == CONN_RESOLVING) {
+            on_resolved(c);
+        } else if (c->status != 0) {
+            if (c->status == 403) {
+                counter_add(&r->metrics.filter_blocked, 1);
+            }
+            send_error(c, c->status);
+        } else {
+            start_connect(c);
+        }
+        c = next;
+    }
+}
+
+static void on_client_event(conn *c, unsigned int events) {
+    c->active_ms = c->reactor->now_ms;
+    switch (c->state) {
+        case CONN_READING_REQUEST:
+            on_client_readable(c);
+            break;
+        case CONN_TUNNELING:
+            pump_tunnel(c);
+            break;
+        case CONN_RELAYING:
+        case CONN_CLOSING:
+            if (c->state == CONN_RELAYING && (c->client.events & EPOLLIN) &&
+                (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                read_upload(c);
+            }
+            if (c->state != CONN_CLOSED && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                flush_client(c);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void on_upstream_event(conn *c, unsigned int events) {
+    c->active_ms = c->reactor->now_ms;
+    switch (c->state) {
+        case CONN_TUNNELING:
+            pump_tunnel(c);
+            break;
+        case CONN_RELAYING:
+            if (c->out != NULL || (c->upstream.events & EPOLLOUT)) {
+                flush_upstream(c);
+            }
+            if (c->state == CONN_RELAYING && c->out == NULL && (c->upstream.events & EPOLLIN) &&
+                (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                relay_upstream(c);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// the deadline c was waiting for came
+static void on_deadline(conn *c) {
+    reactor *r = c->reactor;
+    deadline_kind kind = c->deadline;
+    c->deadline = DEADLINE_NONE;
+    switch (c->state) {
+        case CONN_RESOLVING:
+        case CONN_FILTERING:
+            // the resolver or a pool thread holds the connection, it is looked at again later
+            set_deadline(c, DEADLINE_IO);
+            return;
+        default:
+            break;
+    }
+    if (kind == DEADLINE_CONNECT && c->state == CONN_CONNECTING) {
+        if (r->now_ms < c->race.deadline_ms) {
+            // connect_stagger passed, one more address is tried alongside
+            advance_race(c);
+            if (c->state == CONN_CONNECTING) {
+                arm_race(c);
+            }
+            return;
+        }
+        // the connects that did not make it in time count against their addresses
+        end_race(c, 1);
+    }
+    if (kind == DEADLINE_IO) {
+        int transfer_over = c->transfer_deadline_ms != 0 && r->now_ms >= c->transfer_deadline_ms;
+        int64_t quiet_until = c->active_ms + (int64_t) r->group->config->io_timeout * 1000;
+        if (!transfer_over && quiet_until > r->now_ms) {
+            // there was traffic since the timer was armed, it fires again io_timeout after the last of it
+            c->deadline = DEADLINE_IO;
+            timer_arm(&r->timers, &c->timer, (uint64_t) (c->transfer_deadline_ms != 0 &&
+                      c->transfer_deadline_ms < quiet_until ? c->transfer_deadline_ms : quiet_until));
+            return;
+        }
+        kind = transfer_over ? DEADLINE_TRANSFER : DEADLINE_IO;
+    }
+    counter_add(&r->metrics.timeouts[kind], 1);
+    switch (kind) {
+        case DEADLINE_HEAD:
+            send_error(c, 408);
+            break;
+        case DEADLINE_CONNECT:
+        case DEADLINE_IO:
+        case DEADLINE_TRANSFER:
+            // the client is told why, unless part of a response or tunnel reached it already
+            if (c->state == CONN_FOLLOWING || c->state == CONN_CONNECTING ||
+                (c->state == CONN_RELAYING && !c->head_done && c->resp == NULL)) {
+                send_error(c, 504);
+            } else {
+                close_conn(c);
+            }
+            break;
+        default:
+            close_conn(c);
+            break;
+    }
+}
+
+// handle the deadlines that passed, the ones handled may arm and cancel others meanwhile
+static void expire_deadlines(reactor *r) {
+    timer *t;
+    while ((t = timer_wheel_expire(&r->timers, (uint64_t) r->now_ms)) != NULL) {
+        if (t->kind == TIMER_FETCH) {
+            dissolve_fetch(r, (fetch *) t->owner);
+        } else {
+            on_deadline((conn *) t->owner);
+        }
+    }
+}
+
+static void* run_reactor(void *arg) {
+    reactor *r = (reactor *) arg;
+    reactor_group *g = r->group;
+    if (g->config->pin_cpus) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->id % (cpus > 0 ? cpus : 1), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "reactor %d: could not pin to a cpu\n", r->id);
+        }
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while (!atomic_load(&g->accept_done) || r->live > 0) {
+        // wake up in time for the next deadline and to close the upstream connections that expire
+        r->now_ms = now_ms();
+        expire_deadlines(r);
+        int64_t next_deadline = timer_wheel_next(&r->timers, (uint64_t) r->now_ms);
+        int client_timeout = next_deadline > INT_MAX ? INT_MAX : (int) next_deadline;
+        free_dead(r);
+        int pool_timeout = upstream_pool_expire(r->pool);
+        int timeout = client_timeout == -1 || (pool_timeout != -1 && pool_timeout < client_timeout) ?
+                      pool_timeout : client_timeout;
+        if (r->draining) {
+            // past the deadline of the drain every connection goes, the ones out with the resolver
+            // or the pool when they come back
+            int64_t left = atomic_load(&g->drain_deadline_ms) - r->now_ms;
+            if (left <= 0) {
+                close_live(r, 0);
+                free_dead(r);
+            } else if (timeout == -1 || left < timeout) {
+                timeout = left > INT_MAX ? INT_MAX : (int) left;
+            }
+        }
+        if (atomic_load(&g->accept_done) && r->live == 0) {
+            break;
+        }
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, timeout);
+        r->now_ms = now_ms();
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            endpoint *ep = (endpoint *) events[i].data.ptr;
+            switch (ep->kind) {
+                case EP_LISTEN:
+                    on_accept(r);
+                    break;
+                case EP_WAKEUP:
+                    on_wakeup(r);
+                    break;
+                case EP_CLIENT:
+                    on_client_event(ep->owner, events[i].events);
+                    break;
+                case EP_UPSTREAM:
+                    on_upstream_event(ep->owner, events[i].events);
+                    break;
+                case EP_ATTEMPT:
+                    on_attempt_event(ep->owner, (connect_attempt *) ep);
+                    break;
+                case EP_IDLE:
+                    upstream_pool_on_event(r->pool, ep);
+                    break;
+            }
+        }
+        free_dead(r);
+        upstream_pool_free_dead(r->pool);
+    }
+    // the counters are thread-local, keep them for whoever joins this thread
+    r->stats = thread_mem_stats;
+    return NULL;
+}
+
+void drain_reactor_group(reactor_group *g, int timeout) {
+    int64_t deadline = now_ms() + (int64_t) timeout * 1000;
+    int64_t current = atomic_load(&g->drain_deadline_ms);
+    // a later call may only bring the deadline closer
+    while ((current == 0 || deadline < current) &&
+           !atomic_compare_exchange_weak(&g->drain_deadline_ms, &current, deadline)) {
+    }
+    atomic_store(&g->accept_done, 1);
+    for (int i = 0; i < g->num_reactors; ++i) {
+        wake(g->reactors[i]);
+    }
+}
+
+// a limiter is only built when one of its limits is set. returns -1 on failure
+static int create_limits(limiter **l, int rate, int conns, size_t bandwidth) {
+    if (rate == 0 && conns == 0 && bandwidth == 0) {
+        return 0;
+    }
+    *l = create_limiter(rate, conns, (int64_t) bandwidth);
+    return *l == NULL ? -1 : 0;
+}
+
+reactor_group* create_reactor_group(int *listen_fds, threadpool *tp, resolver *res, const proxy_config *config) {
+    int num_reactors = config->num_reactors;
+    reactor_group *g = (reactor_group *) malloc(sizeof(reactor_group));
+    if (g == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(g, 0, sizeof(reactor_group));
+    g->num_reactors = num_reactors;
+    g->config = config;
+    g->tp = tp;
+    g->res = res;
+    if (config->cache_size > 0 && (g->cache = create_cache(config->cache_size, config->cache_max_object)) == NULL) {
+        free(g);
+        return NULL;
+    }
+    if (config->disk_cache_dir != NULL &&
+        (g->disk = create_disk_cache(config->disk_cache_dir, config->disk_cache_size,
+                                     config->disk_cache_max_object)) == NULL) {
+        if (g->cache != NULL) {
+            destroy_cache(g->cache);
+        }
+        free(g);
+        return NULL;
+    }
+    atomic_init(&g->requests, 0);
+    atomic_init(&g->accept_done, 0);
+    atomic_init(&g->drain_deadline_ms, 0);
+    g->reactors = (reactor **) calloc(num_reactors, sizeof(reactor *));
+    g->threads = (pthread_t *) calloc(num_reactors, sizeof(pthread_t));
+    if (g->reactors == NULL || g->threads == NULL ||
+        create_limits(&g->clients, config->client_rate, config->client_conns, config->client_bandwidth) == -1 ||
+        create_limits(&g->hosts, config->host_rate, config->host_conns, config->host_bandwidth) == -1) {
+        perror("calloc");
+        destroy_reactor_group(g);
+        return NULL;
+    }
+    for (int i = 0; i < num_reactors; ++i) {
+        if ((g->reactors[i] = create_reactor(g, i, listen_fds[i])) == NULL) {
+            destroy_reactor_group(g);
+            return NULL;
+        }
+    }
+    if (config->trace_file != NULL) {
+        if ((g->tracer = start_tracer(config->trace_file, num_reactors, config->handed_over)) == NULL) {
+            destroy_reactor_group(g);
+            return NULL;
+        }
+        for (int i = 0; i < num_reactors; ++i) {
+            g->reactors[i]->trace = &g->tracer->rings[i];
+        }
+    }
+    return g;
+}
+
+void run_reactor_group(reactor_group *g) {
+    for (int i = 0; i < g->num_reactors; ++i) {
+        if (pthread_create(g->threads + i, NULL, run_reactor, (void *) g->reactors[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < g->num_reactors; ++i) {
+        pthread_join(g->threads[i], NULL);
+    }
+    if (g->config->mem_stats) {
+        for (int i = 0; i < g->num_reactors; ++i) {
+            reactor *r = g->reactors[i];
+            fprintf(stderr, "reactor %d: %zu requests, %zu heap allocations, %zu pool reuses, "
+                    "%zu pool allocations, %zu arena overflows\n", r->id, (size_t) counter_read(&r->metrics.requests),
+                    r->stats.heap_allocs, r->stats.pool_reuses, r->stats.pool_allocs, r->stats.arena_overflows);
+        }
+    }
+}
+
+void destroy_reactor_group(reactor_group *g) {
+    if (g->tracer != NULL) {
+        stop_tracer(g->tracer);
+    }
+    if (g->reactors != NULL) {
+        for (int i = 0; i < g->num_reactors; ++i) {
+            if (g->reactors[i] != NULL) {
+                destroy_reactor(g->reactors[i]);
+            }
+        }
+    }
+    free(g->reactors);
+    free(g->threads);
+    if (g->cache != NULL) {
+        destroy_cache(g->cache);
+    }
+    if (g->disk != NULL) {
+        destroy_disk_cache(g->disk);
+    }
+    destroy_limiter(g->clients);
+    destroy_limiter(g->hosts);
+    free(g);
+}
+
+// a counter summed over the reactors, offset is where it sits in reactor_metrics
+static uint64_t sum_counter(reactor_group *g, size_t offset) {
+    uint64_t sum = 0;
+    for (int i = 0; i < g->num_reactors; ++i) {
+        sum += counter_read((const counter *) ((const char *) &g->reactors[i]->metrics + offset));
+    }
+    return sum;
+}
+
+static void group_histogram(reactor_group *g, metrics_buf *out, const char *name, const char *help, size_t offset) {
+    const histogram *parts[g->num_reactors];
+    for (int i = 0; i < g->num_reactors; ++i) {
+        parts[i] = (const histogram *) ((const char *) &g->reactors[i]->metrics + offset);
+    }
+    metrics_histogram(out, name, help, parts, g->num_reactors);
+}
+
+void reactor_group_metrics(reactor_group *g, metrics_buf *out) {
+    uint64_t accepted = sum_counter(g, offsetof(reactor_metrics, accepted));
+    uint64_t closed = sum_counter(g, offsetof(reactor_metrics, closed));
+    metrics_counter(out, "proxy_connections_accepted_total", "Client connections accepted.", accepted);
+    // both are read at about the same time, closed may be a little ahead
+    metrics_gauge(out, "proxy_connections_open", "Client connections open.", accepted > closed ? accepted - closed : 0);
+    metrics_counter(out, "proxy_requests_total", "Requests read from clients.",
+                    sum_counter(g, offsetof(reactor_metrics, requests)));
+    metrics_printf(out, "# HELP proxy_responses_total Responses sent to clients, by status code.\n"
+                   "# TYPE proxy_responses_total counter\n");
+    for (int code = 100; code < STATUS_CODES; ++code) {
+        uint64_t count = sum_counter(g, offsetof(reactor_metrics, status) + code * sizeof(counter));
+        if (count != 0) {
+            metrics_printf(out, "proxy_responses_total{code=\"%d\"} %llu\n", code, (unsigned long long) count);
+        }
+    }
+    metrics_counter(out, "proxy_client_received_bytes_total", "Bytes read from clients.",
+                    sum_counter(g, offsetof(reactor_metrics, client_bytes_in)));
+    metrics_counter(out, "proxy_client_sent_bytes_total", "Bytes sent to clients.",
+                    sum_counter(g, offsetof(reactor_metrics, client_bytes_out)));
+    metrics_counter(out, "proxy_upstream_received_bytes_total", "Bytes read from upstream servers.",
+                    sum_counter(g, offsetof(reactor_metrics, upstream_bytes_in)));
+    metrics_counter(out, "proxy_upstream_sent_bytes_total", "Bytes sent to upstream servers.",
+                    sum_counter(g, offsetof(reactor_metrics, upstream_bytes_out)));
+    metrics_counter(out, "proxy_filter_blocked_total", "Requests refused by the host filter.",
+                    sum_counter(g, offsetof(reactor_metrics, filter_blocked)));
+    metrics_counter(out, "proxy_tunnels_total", "CONNECT tunnels opened.",
+                    sum_counter(g, offsetof(reactor_metrics, tunnels)));
+    metrics_counter(out, "proxy_tunnel_port_refused_total", "CONNECT requests to a port tunnels may not open.",
+                    sum_counter(g, offsetof(reactor_metrics, tunnel_port_refused)));
+    metrics_counter(out, "proxy_upstream_connect_attempts_total", "Connects to an address of an upstream host.",
+                    sum_counter(g, offsetof(reactor_metrics, connect_attempts)));
+    metrics_counter(out, "proxy_upstream_connect_failures_total", "Connects refused, unreachable or timed out.",
+                    sum_counter(g, offsetof(reactor_metrics, connect_failures)));
+    metrics_counter(out, "proxy_upstream_connect_fallbacks_total",
+                    "Connects to the next address started while an earlier one was in flight.",
+                    sum_counter(g, offsetof(reactor_metrics, connect_fallbacks)));
+    metrics_counter(out, "proxy_upstream_ejections_total", "Upstream addresses taken out of rotation.",
+                    sum_counter(g, offsetof(reactor_metrics, ejections)));
+    metrics_counter(out, "proxy_compressed_responses_total", "Responses sent with a content coding of the proxy.",
+                    sum_counter(g, offsetof(reactor_metrics, compressed)));
+    metrics_counter(out, "proxy_compress_input_bytes_total", "Body bytes given to the encoders.",
+                    sum_counter(g, offsetof(reactor_metrics, compress_in)));
+    metrics_counter(out, "proxy_compress_output_bytes_total", "Bytes the encoders made of them.",
+                    sum_counter(g, offsetof(reactor_metrics, compress_out)));
+    if (g->tracer != NULL) {
+        uint64_t dropped = 0;
+        for (int i = 0; i < g->num_reactors; ++i) {
+            dropped += counter_read(&g->tracer->rings[i].dropped);
+        }
+        metrics_counter(out, "proxy_trace_dropped_total", "Request traces lost to a full ring.", dropped);
+    }
+    static const char *const limit_names[LIMIT_KINDS] = {"", "rate", "conns", "bandwidth"};
+    metrics_printf(out, "# HELP proxy_limited_total Connections and requests refused by a limit, by target and limit.\n"
+                   "# TYPE proxy_limited_total counter\n");
+    for (int kind = LIMIT_RATE; kind < LIMIT_KINDS; ++kind) {
+        uint64_t clients = sum_counter(g, offsetof(reactor_metrics, client_limited) + kind * sizeof(counter));
+        uint64_t hosts = sum_counter(g, offsetof(reactor_metrics, host_limited) + kind * sizeof(counter));
+        metrics_printf(out, "proxy_limited_total{target=\"client\",limit=\"%s\"} %llu\n", limit_names[kind],
+                       (unsigned long long) clients);
+        metrics_printf(out, "proxy_limited_total{target=\"host\",limit=\"%s\"} %llu\n", limit_names[kind],
+                       (unsigned long long) hosts);
+    }
+    static const char *const deadline_names[DEADLINE_KINDS] = {"", "idle", "header", "connect", "io", "transfer"};
+    metrics_printf(out, "# HELP proxy_timeouts_total Connections ended by a deadline, by kind.\n"
+                   "# TYPE proxy_timeouts_total counter\n");
+    for (int kind = DEADLINE_IDLE; kind < DEADLINE_KINDS; ++kind) {
+        uint64_t count = sum_counter(g, offsetof(reactor_metrics, timeouts) + kind * sizeof(counter));
+        metrics_printf(out, "proxy_timeouts_total{kind=\"%s\"} %llu\n", deadline_names[kind],
+                       (unsigned long long) count);
+    }
+    group_histogram(g, out, "proxy_dns_seconds", "Name lookups, cached answers included.",
+                    offsetof(reactor_metrics, dns));
+    group_histogram(g, out, "proxy_upstream_connect_seconds", "New upstream connections.",
+                    offsetof(reactor_metrics, connect));
+    group_histogram(g, out, "proxy_upstream_ttfb_seconds", "From the request sent to the first byte of the response.",
+                    offsetof(reactor_metrics, ttfb));
+    group_histogram(g, out, "proxy_request_seconds", "From the request read to the response sent.",
+                    offsetof(reactor_metrics, total));
+}
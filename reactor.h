@@ -0,0 +1,431 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "threadpool.h"
+#include "proxyServer.h"
+#include "resolver.h"
+#include "endpoint.h"
+#include "http.h"
+#include "upstream_pool.h"
+#include "cache.h"
+#include "disk_cache.h"
+#include "mempool.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "balancer.h"
+#include "limiter.h"
+#include "compress.h"
+#include "trace.h"
+
+/**
+ * reactor.h
+ *
+ * An epoll based event loop that drives every client connection through
+ * a non-blocking state machine:
+ *
+ *     reading request -> resolving -> filtering -> connecting -> relaying -> closing
+ *            ^                                          |              |
+ *            |                                          +-> tunneling  |
+ *            +-------------------- keep-alive -------------------------+
+ *
+ * one reactor thread multiplexes all the sockets. names are resolved by
+ * the asynchronous resolver, CPU work (the filter lookup) is handed to
+ * the threadpool, and both post their result back to the reactor through
+ * an eventfd.
+ *
+ * a new upstream connection is raced over the addresses of the host in
+ * the order the reactor's balancer gives: the next address is tried when
+ * the connects in flight did not succeed within connect_stagger ms or one
+ * of them failed (happy eyeballs), the first to succeed is kept and the
+ * others are closed. what each connect took or how it failed goes back to
+ * the balancer, which keeps failing addresses out of rotation for a while.
+ *
+ * the limits of the group (limiter.h) are checked as early as they can
+ * be: the connections of a client address when it is accepted, its rate
+ * and bandwidth once the head of a request is read, and those of the host
+ * before its name is looked up. a client over its limits gets a 429, a
+ * request to a host over its limits a 503, both without an upstream.
+ *
+ * responses are framed (Content-Length or chunked) so that, once one is
+ * complete, the upstream connection can be parked in the reactor's
+ * keep-alive pool and reused by the next request to the same host.
+ *
+ * a text response the client accepts compressed is encoded as it is read
+ * (compress.h) and sent chunked: it leaves the splice path, and its
+ * encoder is the only state it holds on top of a plain relay.
+ *
+ * a request body is streamed while the response comes back: what the
+ * client sends goes through a relay buffer to the upstream, and the client
+ * is not read again before the upstream took it, so an upload holds one
+ * buffer whatever its size. a client that half-closes before the end of
+ * its body gets the answer of the server to the truncated request.
+ *
+ * a CONNECT request that passes the filter turns its connection into a
+ * tunnel once the target accepted: the bytes of each direction are spliced
+ * through a pipe (copied through a relay buffer without splice) lent only
+ * while they are in flight, so an idle tunnel holds two sockets and
+ * nothing else. a side that closes is passed on as a half-close and the
+ * tunnel ends once both did.
+ *
+ * cacheable GET responses are copied into the shared response cache while
+ * they are relayed. a request with a fresh entry is answered from the
+ * cache right after it is parsed, without any lookup or upstream
+ * connection; a stale one is revalidated by a conditional request. the
+ * disk tier is written on the threadpool and its hits go out with sendfile.
+ *
+ * concurrent misses of the same cache key on a reactor are collapsed into
+ * one fetch: the first request goes upstream, the others follow it and are
+ * sent the copy of the response as it is read. followers that waited
+ * coalesce_wait ms without seeing a head, or whose leader failed before
+ * its response turned out cacheable, fetch on their own.
+ *
+ * the buffers and small allocations of a request come from pools and an
+ * arena per connection (mempool.h), so a request in the steady state does
+ * not call malloc.
+ *
+ * every connection has one deadline at a time, for what it is waiting on:
+ * a request (client_idle_timeout), the rest of a request head once its
+ * first byte came (header_timeout, answered with 408), the upstream to
+ * accept (connect_timeout, 504), or traffic on either socket while a
+ * response or a tunnel is under way (io_timeout, 504 if the client got
+ * nothing yet). a request may also be given transfer_timeout from its head
+ * to its last byte. the deadlines are timers on a timing wheel per
+ * reactor, along with the coalesce_wait of the fetches; the io one is not
+ * moved on every read or write, the event handlers only note the time and
+ * the timer is pushed back when it fires early.
+ *
+ * every reactor counts what it does in its own metrics block, read by the
+ * admin server when it is scraped.
+ *
+ * a reactor group runs several reactors, one thread each, every one of
+ * them accepting on its own SO_REUSEPORT listening socket so the kernel
+ * spreads new connections without any handoff between threads.
+ */
+
+// what owns a timer of the reactor's wheel
+typedef enum timer_kind {
+    TIMER_CONN,
+    TIMER_FETCH
+} timer_kind;
+
+/**
+ * what the timer of a connection is armed for
+ */
+typedef enum deadline_kind {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,              //waiting for a request
+    DEADLINE_HEAD,              //the first bytes of a request head came, the rest must follow
+    DEADLINE_CONNECT,           //the upstream has not accepted yet, fires early to try the next address
+    DEADLINE_IO,                //a response or tunnel is under way, no traffic for io_timeout ends it
+    DEADLINE_TRANSFER,          //only counted: the io deadline found transfer_timeout passed
+    DEADLINE_KINDS
+} deadline_kind;
+
+typedef enum conn_state {
+    CONN_READING_REQUEST,
+    CONN_RESOLVING,
+    CONN_FOLLOWING,             //waiting for the head of a fetch led by another connection
+    CONN_FILTERING,
+    CONN_CONNECTING,
+    CONN_RELAYING,
+    CONN_TUNNELING,             //CONNECT accepted, bytes are pumped both ways until both sides closed
+    CONN_CLOSING,
+    CONN_CLOSED
+} conn_state;
+
+/**
+ * where the pending response bytes of a connection live, so they are
+ * given back to the right place
+ */
+typedef enum resp_buffer {
+    RESP_ARENA,                 //the arena of the connection, released with it
+    RESP_IO,                    //an I/O buffer of the reactor pool
+    RESP_RELAY,                 //a relay buffer of the reactor pool
+    RESP_HEAP                   //a response head that outgrew its I/O buffer
+} resp_buffer;
+
+/**
+ * one direction of a tunnel. what is read from the source waits in a pipe,
+ * or in a relay buffer once splice is off, until the destination took it.
+ * the pipe or buffer is given back to the reactor as soon as it is empty.
+ */
+typedef struct tunnel_dir {
+    int pipe_fds[2];
+    char *buf;
+    size_t pending;             //bytes read from the source and not yet written
+    size_t off;                 //where they start in buf
+    int copy;                   //1 once splice failed on this direction, copy instead
+    int eof;                    //1 once the source closed, the destination was shut down for writing
+} tunnel_dir;
+
+typedef struct tunnel {
+    tunnel_dir up;              //client to upstream
+    tunnel_dir down;            //upstream to client
+} tunnel;
+
+/**
+ * a response compressed on its way to the client. the body read from the
+ * upstream goes through a second tracker of its framing, which strips the
+ * chunks, and what it carries is encoded and sent in chunks of its own
+ */
+typedef struct response_encoder {
+    encoder enc;
+    http_body payload;          //framing of the upstream body, as far as the encoder was fed
+} response_encoder;
+
+#define CONNECT_RACE_WIDTH 4       //connects a request may have in flight at once
+
+/**
+ * a connect to one address of the host, the endpoint is first so the
+ * event loop finds the attempt from it
+ */
+typedef struct connect_attempt {
+    endpoint ep;                //fd -1 while the slot is free
+    backend *backend;           //the address, NULL if the balancer had no room to track it
+    uint64_t started_us;
+} connect_attempt;
+
+/**
+ * the connects of a request racing for its upstream connection
+ */
+typedef struct connect_race {
+    unsigned char order[DNS_MAX_ADDRS]; //addresses of the lookup in the order they are tried
+    int count;
+    int next;                   //index in order of the next address to try
+    int in_flight;
+    int64_t next_ms;            //the next address is tried then if none succeeded meanwhile
+    int64_t deadline_ms;        //the connect deadline, the request gets a 504 then
+    connect_attempt attempts[CONNECT_RACE_WIDTH];
+} connect_race;
+
+typedef struct conn {
+    conn_state state;
+    endpoint client;
+    endpoint upstream;
+    struct sockaddr_in client_info;
+
+    char *request;              //raw request as read from the client, pipelined ones after it, NULL while idle
+    size_t request_len;
+    size_t request_cap;         //IO_BUFFER_LEN while it is an I/O buffer, more once it grew on the heap
+    http_request req;           //incremental parse of the request head, spans into request
+    size_t request_end;         //length of the request being served
+    char saved_byte;            //first byte of the next request, overwritten by the terminating null
+    int keep_alive;             //1 if the client expects the connection to stay open after the response
+    int requests;               //requests started on this connection
+    uint64_t started_us;        //when the head of the request in progress was read, 0 if there is none
+    uint64_t phase_us;          //start of the lookup, connect or upstream wait being timed
+    int resp_status;            //status of the response being sent, counted once it is done
+    trace_record trace;         //phases of the request in progress, pushed to the trace ring when it ends
+
+    timer timer;                //armed for deadline, on the wheel of the reactor
+    deadline_kind deadline;
+    int64_t active_ms;          //last event on either socket, the io deadline counts from it
+    int64_t transfer_deadline_ms;   //end of transfer_timeout for the request in progress, 0 if none
+
+    char host[MAX_HOST_LEN];
+    in_port_t port;
+    dns_waiter dns_wait;        //registration with the resolver while the name is looked up
+    dns_result dns;
+    int status;                 //result of the filter job, 0 or an HTTP status
+
+    int reused;                 //1 if the upstream connection came from the keep-alive pool
+    connect_race race;          //while CONN_CONNECTING a new upstream connection
+    backend *backend;           //address the upstream connection was opened to, NULL if it was pooled
+    limit_slot *client_limit;   //hold on the limits of the client address while connected, NULL if none
+    limit_slot *host_limit;     //hold on the limits of host while a request is under way, NULL if none
+
+    char *cache_key;            //"host:port/path" of a request the cache may answer or store, else NULL
+    cache_entry *stale;         //entry being revalidated by the request sent upstream
+    cache_entry *hit;           //entry whose body is being sent to the client
+    size_t hit_off;
+    disk_hit disk;              //response being sent from the disk cache, disk.seg is NULL otherwise
+    size_t disk_sent;
+    char *fill;                 //copy of a cacheable response, stored once complete
+    size_t fill_len;
+    size_t fill_cap;
+    size_t fill_head_len;
+    cache_policy fill_policy;
+    struct fetch *fetch;        //fetch this connection leads or follows, NULL if none
+    struct conn *fetch_prev;    //links of a follower in the waiting or reader list of its fetch
+    struct conn *fetch_next;
+    size_t fetch_sent;          //bytes of the body of the fetch sent by a follower
+
+    arena arena;                //small allocations of the request, released when the next one starts
+    http_rewrite *out;          //request head waiting to be sent to the upstream, in the arena
+    http_body upload;           //framing of the request body, done once all of it was read
+    char *up_buf;               //relay buffer of the body streamed to the upstream, NULL when not streaming
+    size_t up_len;              //body bytes in up_buf, the client is read again once they are sent
+    size_t up_off;
+    tunnel tunnel;              //directions of a CONNECT tunnel, in use in CONN_TUNNELING only
+
+    char *head;                 //response head being read, it is parsed before anything is relayed
+    size_t head_len;
+    size_t head_cap;            //IO_BUFFER_LEN while it is an I/O buffer
+    int head_done;              //1 once the head was parsed and the body is relayed
+    http_response response;     //framing of the response, tells when the upstream is free again
+    response_encoder *encoding; //set while the response is sent compressed, else NULL
+
+    char *resp;                 //bytes waiting to be sent to the client
+    size_t resp_len;
+    size_t resp_off;
+    resp_buffer resp_from;
+
+    int pipe_fds[2];            //pipe borrowed from the reactor while spliced bytes are in flight
+    size_t pipe_pending;        //bytes sitting in the pipe
+    int no_splice;              //1 once splice failed on this connection, copy instead
+
+    struct reactor *reactor;
+    struct conn *next;          //link in the completion and dead lists
+    struct conn *live_prev;     //links in the list of the open connections of the reactor
+    struct conn *live_next;
+} conn;
+
+/**
+ * an upstream fetch that other requests for the same cache key follow
+ * instead of fetching the object again. the copy of the response the
+ * leader makes for the cache is what its followers send.
+ */
+typedef struct fetch {
+    char *key;
+    uint32_t hash;
+    conn *leader;               //connection doing the fetch, NULL once its response is complete
+    conn *waiting;              //followers waiting for the head
+    conn *readers;              //followers sending the response to their client
+    char *data;                 //copy of the response, the head without its final empty line then the body
+    size_t head_len;            //0 until the head arrived
+    size_t len;
+    int age;                    //Age of the response, seconds
+    int done;                   //1 once the whole response is in data, the fetch owns data then
+    int linked;                 //1 while requests for the key may join it
+    timer timer;                //armed until the head arrives, the waiting followers give up on it then
+    struct fetch *next;         //bucket chain
+} fetch;
+
+#define STATUS_CODES 600
+
+/**
+ * what a reactor counts. only its thread writes, the admin server reads.
+ * the block starts on its own cache line, the one of another reactor is
+ * never touched by the same writes.
+ */
+typedef struct reactor_metrics {
+    _Alignas(64) counter accepted;      //client connections
+    counter closed;
+    counter requests;
+    counter status[STATUS_CODES];       //responses by status code, 0 for a response without a status line
+    counter client_bytes_in;
+    counter client_bytes_out;
+    counter upstream_bytes_in;
+    counter upstream_bytes_out;
+    counter filter_blocked;             //requests the filter answered with 403
+    counter tunnels;                    //CONNECT tunnels opened
+    counter tunnel_port_refused;        //CONNECT requests to a port not in --connect-ports
+    counter timeouts[DEADLINE_KINDS];   //connections ended by a deadline, by kind
+    counter connect_attempts;           //connects to an address of a host
+    counter connect_failures;           //the ones refused, unreachable or timed out
+    counter connect_fallbacks;          //the ones started while an earlier one was still in flight
+    counter ejections;                  //addresses taken out of rotation
+    counter compressed;                 //responses sent with a content coding of the proxy
+    counter compress_in;                //body bytes given to the encoders
+    counter compress_out;               //bytes they made of them
+    counter client_limited[LIMIT_KINDS];    //connections and requests of a client refused, by the limit reached
+    counter host_limited[LIMIT_KINDS];      //requests to a host refused, by the limit reached
+    histogram dns;                      //name lookups, the ones answered from the cache included
+    histogram connect;                  //new upstream connections, the pooled ones are not counted
+    histogram ttfb;                     //from the request sent to the first byte of the response
+    histogram total;                    //from the request head read to the response sent
+} reactor_metrics;
+
+#define PIPE_POOL_MAX 16
+#define FETCH_BUCKETS 256
+#define IO_BUFFER_LEN 16384         //request buffers, response heads and arenas start with one
+
+typedef struct reactor {
+    int epoll_fd;
+    endpoint listener;
+    endpoint wakeup;            //eventfd signalled when lookups and filter jobs finish
+    threadpool *tp;
+
+    pthread_mutex_t done_lock;  //protects done_head
+    conn *done_head;            //connections whose lookup or filter job finished
+    conn *dead_head;            //connections freed at the end of the batch
+    timer_wheel timers;         //deadlines of the connections and fetches, in ms
+    int64_t now_ms;             //when the current batch of events started
+
+    char *relay_buf;            //buffer shared by the connections that cannot splice, from relay_bufs
+    block_pool conns;           //memory of closed connections, for the next ones
+    block_pool io_bufs;         //IO_BUFFER_LEN buffers
+    block_pool relay_bufs;      //relay buffers, one is lent to a connection whose client is slow
+    block_pool fetch_blocks;    //memory of finished fetches
+    int spare_pipes[PIPE_POOL_MAX][2];  //empty pipes ready to be lent to a connection
+    int num_spare_pipes;
+    upstream_pool *pool;        //idle upstream connections of this reactor
+    balancer *balancer;         //how the addresses of the hosts fared, for the new connections
+    trace_ring *trace;          //where the finished requests are traced, NULL if tracing is off
+    fetch *fetches[FETCH_BUCKETS];  //fetches requests may join, by cache key
+
+    struct reactor_group *group;
+    int id;
+    size_t live;                //connections not yet closed
+    conn *live_head;            //the connections not yet closed, to close them when draining
+    int draining;               //1 once this reactor saw the drain of the group
+    reactor_metrics metrics;
+    mem_stats stats;            //allocation counters of the reactor thread, copied when it stops
+} reactor;
+
+typedef struct reactor_group {
+    reactor **reactors;
+    pthread_t *threads;
+    int num_reactors;
+    const proxy_config *config;
+    threadpool *tp;
+    resolver *res;
+
+    cache *cache;               //responses shared by the reactors, NULL if caching is off
+    disk_cache *disk;           //persistent tier, NULL if there is none
+    limiter *clients;           //limits of each client address, NULL if none is set
+    limiter *hosts;             //limits of each destination host, NULL if none is set
+    tracer *tracer;             //writer of the trace file, NULL if tracing is off
+
+    atomic_size_t requests;     //requests taken on by all the reactors together
+    atomic_int accept_done;     //1 once max_tasks requests were taken on, or the group drains
+    _Atomic int64_t drain_deadline_ms;  //when the connections still open are closed, 0 unless draining
+} reactor_group;
+
+/**
+ * create_reactor_group builds config->num_reactors reactors, one per listening
+ * socket. the sockets are switched to non-blocking mode. returns NULL on failure.
+ */
+reactor_group* create_reactor_group(int *listen_fds, threadpool *tp, resolver *res, const proxy_config *config);
+
+/**
+ * run_reactor_group starts a thread per reactor and returns once max_tasks
+ * requests were taken on, or the group was drained, and all the connections
+ * were closed.
+ */
+void run_reactor_group(reactor_group *g);
+
+/**
+ * drain_reactor_group stops the reactors accepting: idle clients are closed
+ * right away, the others once their request is answered, and whatever is
+ * still open after timeout seconds is closed. callable from any thread,
+ * again to shorten the timeout.
+ */
+void drain_reactor_group(reactor_group *g, int timeout);
+
+/**
+ * destroy_reactor_group closes the epoll sets and wakeup fds and frees the
+ * reactors. the listening sockets stay open, they belong to the caller.
+ */
+void destroy_reactor_group(reactor_group *g);
+
+/**
+ * reactor_group_metrics writes the sum of the metrics of the reactors of g
+ * into out. called by the admin server while the reactors run.
+ */
+void reactor_group_metrics(reactor_group *g, metrics_buf *out);
+
+#endif
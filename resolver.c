@@ -0,0 +1,748 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include "resolver.h"
+#include "util.h"
+
+#define DNS_PORT 53
+#define DNS_PACKET_LEN 1500
+#define DNS_TIMEOUT_MS 1000         //retransmit a query after this long without an answer
+#define DNS_ATTEMPTS 3
+#define DNS_BIND_ATTEMPTS 8         //random ports tried before the kernel picks one
+#define DNS_MIN_PORT 1024
+#define DNS_NEGATIVE_TTL 30         //NXDOMAIN or no address, when the answer has no SOA
+#define DNS_FAILURE_TTL 5           //the server failed or did not answer at all
+#define DNS_MIN_TTL 1
+#define DNS_MAX_TTL 3600
+#define DNS_BUCKETS_PER_SHARD 256
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NXDOMAIN 3
+
+static void* resolver_thread(void *);
+
+// copy name in lower case without a trailing dot, -1 if it does not fit
+static int normalize_name(char *dst, const char *src) {
+    size_t len = strlen(src);
+    if (len > 0 && src[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || len >= DNS_MAX_NAME) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        dst[i] = (char) tolower((unsigned char) src[i]);
+    }
+    dst[len] = '\0';
+    return 0;
+}
+
+static dns_shard* shard_of(resolver *res, uint32_t hash) {
+    return &res->shards[hash % DNS_SHARDS];
+}
+
+static dns_entry** bucket_of(dns_shard *shard, uint32_t hash) {
+    return &shard->buckets[(hash / DNS_SHARDS) % shard->num_buckets];
+}
+
+// caller holds the shard lock
+static dns_entry* find_entry(dns_shard *shard, const char *name, uint32_t hash) {
+    for (dns_entry *e = *bucket_of(shard, hash); e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// the recency list, caller holds the shard lock
+static void lru_unlink(dns_shard *shard, dns_entry *e) {
+    if (e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+    shard->count--;
+}
+
+static void lru_push(dns_shard *shard, dns_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = e;
+    } else {
+        shard->lru_tail = e;
+    }
+    shard->lru_head = e;
+    shard->count++;
+}
+
+static void lru_touch(dns_shard *shard, dns_entry *e) {
+    if (!e->permanent && shard->lru_head != e) {
+        lru_unlink(shard, e);
+        lru_push(shard, e);
+    }
+}
+
+// free the least recently used entry no query is in flight for, 0 if every one has one
+static int evict_entry(dns_shard *shard) {
+    dns_entry *e = shard->lru_tail;
+    while (e != NULL && e->pending) {
+        e = e->lru_prev;
+    }
+    if (e == NULL) {
+        return 0;
+    }
+    dns_entry **link = bucket_of(shard, e->hash);
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    lru_unlink(shard, e);
+    free(e);
+    return 1;
+}
+
+// caller holds the shard lock. NULL if out of memory, or if the shard is full of queries in flight
+static dns_entry* insert_entry(dns_shard *shard, const char *name, uint32_t hash) {
+    if (shard->count >= DNS_SHARD_MAX_ENTRIES && !evict_entry(shard)) {
+        return NULL;
+    }
+    dns_entry *e = (dns_entry *) calloc(1, sizeof(dns_entry));
+    if (e == NULL) {
+        return NULL;
+    }
+    strcpy(e->name, name);
+    e->hash = hash;
+    dns_entry **bucket = bucket_of(shard, hash);
+    e->next = *bucket;
+    *bucket = e;
+    lru_push(shard, e);
+    return e;
+}
+
+// an IPv4 or IPv6 literal, 0 if text is neither
+static int parse_addr(const char *text, dns_addr *addr) {
+    memset(addr, 0, sizeof(dns_addr));
+    if (inet_pton(AF_INET, text, &addr->v4) == 1) {
+        addr->family = AF_INET;
+        return 1;
+    }
+    if (inet_pton(AF_INET6, text, &addr->v6) == 1) {
+        addr->family = AF_INET6;
+        return 1;
+    }
+    return 0;
+}
+
+socklen_t dns_addr_sockaddr(const dns_addr *addr, in_port_t port, struct sockaddr_storage *sa) {
+    memset(sa, 0, sizeof(struct sockaddr_storage));
+    if (addr->family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) sa;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        in6->sin6_addr = addr->v6;
+        return sizeof(struct sockaddr_in6);
+    }
+    struct sockaddr_in *in = (struct sockaddr_in *) sa;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr = addr->v4;
+    return sizeof(struct sockaddr_in);
+}
+
+static int parse_name_server(const char *spec, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(DNS_PORT);
+    char ip[64];
+    ip[0] = '\0';
+    if (spec != NULL) {
+        const char *colon = strchr(spec, ':');
+        size_t len = colon != NULL ? (size_t) (colon - spec) : strlen(spec);
+        if (len >= sizeof(ip)) {
+            return -1;
+        }
+        memcpy(ip, spec, len);
+        ip[len] = '\0';
+        if (colon != NULL) {
+            addr->sin_port = htons((in_port_t) strtoul(colon + 1, NULL, 10));
+        }
+    } else {
+        // the first IPv4 name server of the system configuration
+        FILE *file = fopen("/etc/resolv.conf", "r");
+        char line[256];
+        while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+            struct in_addr probe;
+            if (sscanf(line, "nameserver %63s", ip) == 1 && inet_pton(AF_INET, ip, &probe) == 1) {
+                break;
+            }
+            ip[0] = '\0';
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (ip[0] == '\0') {
+            strcpy(ip, "127.0.0.1");
+        }
+    }
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+// every "address name [aliases...]" line becomes a permanent entry
+static void load_hosts(resolver *res, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *save = NULL;
+        char *token = strtok_r(line, " \t", &save);
+        dns_addr addr;
+        if (token == NULL || !parse_addr(token, &addr)) {
+            continue;
+        }
+        while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+            char name[DNS_MAX_NAME];
+            if (normalize_name(name, token) == -1) {
+                continue;
+            }
+            uint32_t hash = fnv1a32_str(name);
+            dns_shard *shard = shard_of(res, hash);
+            dns_entry *e = find_entry(shard, name, hash);
+            if (e == NULL && (e = insert_entry(shard, name, hash)) == NULL) {
+                continue;
+            }
+            if (!e->permanent) {
+                lru_unlink(shard, e);
+                e->permanent = 1;
+            }
+            if (e->result.naddrs < DNS_MAX_ADDRS) {
+                e->result.addrs[e->result.naddrs++] = addr;
+            }
+        }
+    }
+    fclose(file);
+}
+
+resolver* create_resolver(const char *name_server, const char *hosts_file) {
+    struct sockaddr_in server;
+    if (parse_name_server(name_server, &server) == -1) {
+        fprintf(stderr, "bad name server address\n");
+        return NULL;
+    }
+    resolver *res = (resolver *) calloc(1, sizeof(resolver));
+    if (res == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    res->server = server;
+    for (int i = 0; i < DNS_SHARDS; ++i) {
+        pthread_mutex_init(&res->shards[i].lock, NULL);
+        res->shards[i].num_buckets = DNS_BUCKETS_PER_SHARD;
+        if ((res->shards[i].buckets = (dns_entry **) calloc(DNS_BUCKETS_PER_SHARD, sizeof(dns_entry *))) == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_init(&res->submit_lock, NULL);
+    if (hosts_file != NULL) {
+        load_hosts(res, hosts_file);
+    }
+
+    res->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    res->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (res->wake_fd == -1 || res->epoll_fd == -1) {
+        perror("resolver");
+        destroy_resolver(res);
+        return NULL;
+    }
+    // the wake up is the event without a query
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(res->epoll_fd, EPOLL_CTL_ADD, res->wake_fd, &ev);
+
+    if (pthread_create(&res->thread, NULL, resolver_thread, (void *) res) != 0) {
+        perror("pthread_create");
+        res->thread = 0;
+        destroy_resolver(res);
+        return NULL;
+    }
+    return res;
+}
+
+int resolver_lookup(resolver *res, const char *name, dns_waiter *waiter, dns_result *result) {
+    memset(result, 0, sizeof(dns_result));
+    char key[DNS_MAX_NAME];
+    if (normalize_name(key, name) == -1) {
+        result->status = DNS_NOT_FOUND;
+        return DNS_HIT;
+    }
+    if (parse_addr(key, &result->addrs[0])) {
+        result->naddrs = 1;
+        return DNS_HIT;
+    }
+
+    uint32_t hash = fnv1a32_str(key);
+    dns_shard *shard = shard_of(res, hash);
+    pthread_mutex_lock(&shard->lock);
+    dns_entry *e = find_entry(shard, key, hash);
+    if (e != NULL) {
+        lru_touch(shard, e);
+    }
+    if (e != NULL && !e->pending && (e->permanent || e->expires_ms > now_ms())) {
+        *result = e->result;
+        pthread_mutex_unlock(&shard->lock);
+        return DNS_HIT;
+    }
+    if (e == NULL && (e = insert_entry(shard, key, hash)) == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        result->status = DNS_NOT_FOUND;
+        return DNS_HIT;
+    }
+    // join the query in flight, or start one if we are the first
+    waiter->next = e->waiters;
+    e->waiters = waiter;
+    int submit = !e->pending;
+    e->pending = 1;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (submit) {
+        pthread_mutex_lock(&res->submit_lock);
+        e->submit_next = res->submitted_head;
+        res->submitted_head = e;
+        pthread_mutex_unlock(&res->submit_lock);
+        uint64_t one = 1;
+        if (write(res->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    return DNS_PENDING;
+}
+
+// store the answer and hand it to every coalesced waiter, runs on the resolver thread
+static void complete_entry(resolver *res, dns_entry *e, const dns_result *result, uint32_t ttl) {
+    dns_shard *shard = shard_of(res, e->hash);
+    pthread_mutex_lock(&shard->lock);
+    e->result = *result;
+    e->expires_ms = now_ms() + (int64_t) ttl * 1000;
+    e->pending = 0;
+    dns_waiter *w = e->waiters;
+    e->waiters = NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    while (w != NULL) {
+        dns_waiter *next = w->next; // the callback may hand the waiter's memory back to its owner
+        w->cb(w->ctx, result);
+        w = next;
+    }
+}
+
+// one query of e is over with the addresses it found, none if it failed, valid for ttl. the lookup
+// completes with the addresses of both families once the other query is over too
+static void finish_query(resolver *res, dns_entry *e, const dns_result *found, uint32_t ttl) {
+    dns_result *partial = &e->partial;
+    if (found != NULL && found->naddrs > 0) {
+        for (int i = 0; i < found->naddrs && partial->naddrs < DNS_MAX_ADDRS; ++i) {
+            partial->addrs[partial->naddrs++] = found->addrs[i];
+        }
+        e->found_ttl = ttl < e->found_ttl ? ttl : e->found_ttl;
+    } else {
+        e->missing_ttl = ttl < e->missing_ttl ? ttl : e->missing_ttl;
+    }
+    if (--e->queries > 0) {
+        return;
+    }
+    dns_result result = *partial;
+    result.status = result.naddrs > 0 ? DNS_OK : DNS_NOT_FOUND;
+    complete_entry(res, e, &result, result.naddrs > 0 ? e->found_ttl : e->missing_ttl);
+}
+
+// question for a record of type about name, returns the packet length or -1
+static int build_query(unsigned char *packet, uint16_t id, int type, const char *name) {
+    memset(packet, 0, 12);
+    packet[0] = id >> 8;
+    packet[1] = id & 0xff;
+    packet[2] = 0x01;   //recursion desired
+    packet[5] = 1;      //one question
+    int pos = 12;
+    const char *label = name;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        size_t len = dot != NULL ? (size_t) (dot - label) : strlen(label);
+        if (len == 0 || len > 63 || pos + len + 1 > DNS_PACKET_LEN - 5) {
+            return -1;
+        }
+        packet[pos++] = (unsigned char) len;
+        memcpy(packet + pos, label, len);
+        pos += (int) len;
+        label += len + (dot != NULL ? 1 : 0);
+    }
+    packet[pos++] = 0;
+    packet[pos++] = 0;
+    packet[pos++] = (unsigned char) type;
+    packet[pos++] = 0;
+    packet[pos++] = DNS_CLASS_IN;
+    return pos;
+}
+
+static void send_query(dns_query *q) {
+    unsigned char packet[DNS_PACKET_LEN];
+    int len = build_query(packet, q->id, q->type, q->entry->name);
+    q->attempts++;
+    q->deadline_ms = now_ms() + DNS_TIMEOUT_MS;
+    if (len == -1) {
+        q->attempts = DNS_ATTEMPTS; // a name DNS cannot carry, fail at the next timeout check
+        q->deadline_ms = 0;
+        return;
+    }
+    if (send(q->sock_fd, packet, len, 0) == -1 && errno != EAGAIN) {
+        perror("send");
+    }
+}
+
+static int random_bytes(void *buf, size_t len) {
+    ssize_t n;
+    while ((n = getrandom(buf, len, 0)) == -1 && errno == EINTR) {
+    }
+    return n == (ssize_t) len ? 0 : -1;
+}
+
+// a socket of the query's own, bound to a random port and connected to the server,
+// so only the server can answer it and a spoofer has the port to guess along with the id
+static int open_query_socket(resolver *res, dns_query *q) {
+    if (random_bytes(&q->id, sizeof(q->id)) == -1) {
+        perror("getrandom");
+        return -1;
+    }
+    q->sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (q->sock_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    int bound = 0;
+    for (int i = 0; i < DNS_BIND_ATTEMPTS && !bound; ++i) {
+        uint16_t port;
+        if (random_bytes(&port, sizeof(port)) == -1) {
+            break;
+        }
+        local.sin_port = htons((in_port_t) (DNS_MIN_PORT + port % (65536 - DNS_MIN_PORT)));
+        bound = bind(q->sock_fd, (struct sockaddr *) &local, sizeof(local)) == 0;
+    }
+    // the ports tried were taken: the kernel picks one, at random as well
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = q;
+    if (connect(q->sock_fd, (struct sockaddr *) &res->server, sizeof(res->server)) == -1 ||
+        epoll_ctl(res->epoll_fd, EPOLL_CTL_ADD, q->sock_fd, &ev) == -1) {
+        perror("resolver");
+        close(q->sock_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void free_query(dns_query *q) {
+    close(q->sock_fd);
+    free(q);
+}
+
+static void start_queries(resolver *res) {
+    uint64_t count;
+    if (read(res->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    pthread_mutex_lock(&res->submit_lock);
+    dns_entry *e = res->submitted_head;
+    res->submitted_head = NULL;
+    pthread_mutex_unlock(&res->submit_lock);
+
+    static const int types[] = {DNS_TYPE_AAAA, DNS_TYPE_A};
+    while (e != NULL) {
+        dns_entry *next = e->submit_next;
+        memset(&e->partial, 0, sizeof(dns_result));
+        e->found_ttl = e->missing_ttl = DNS_MAX_TTL;
+        e->queries = 2;
+        for (int i = 0; i < 2; ++i) {
+            dns_query *q = (dns_query *) calloc(1, sizeof(dns_query));
+            if (q == NULL || open_query_socket(res, q) == -1) {
+                free(q);
+                finish_query(res, e, NULL, DNS_FAILURE_TTL);
+                continue;
+            }
+            q->entry = e;
+            q->type = types[i];
+            q->next = res->inflight;
+            res->inflight = q;
+            send_query(q);
+        }
+        e = next;
+    }
+}
+
+// skip a possibly compressed name, returns the offset after it or -1
+static int skip_name(const unsigned char *packet, int len, int pos) {
+    while (pos < len) {
+        unsigned char l = packet[pos];
+        if (l == 0) {
+            return pos + 1;
+        }
+        if ((l & 0xc0) == 0xc0) {
+            return pos + 2 <= len ? pos + 2 : -1;
+        }
+        pos += l + 1;
+    }
+    return -1;
+}
+
+// compare the question of the answer with the name, type and class we asked for
+static int question_matches(const unsigned char *packet, int len, const char *name, int type) {
+    int pos = 12;
+    const char *expect = name;
+    while (pos < len && packet[pos] != 0) {
+        unsigned char l = packet[pos++];
+        if ((l & 0xc0) != 0 || pos + l > len) {
+            return 0;
+        }
+        if (expect != name) {
+            if (*expect != '.') {
+                return 0;
+            }
+            expect++;
+        }
+        for (int i = 0; i < l; ++i) {
+            if (tolower(packet[pos + i]) != (unsigned char) *expect++) {
+                return 0;
+            }
+        }
+        pos += l;
+    }
+    if (*expect != '\0' || pos + 5 > len) {
+        return 0;
+    }
+    pos++;
+    return ((packet[pos] << 8) | packet[pos + 1]) == type && ((packet[pos + 2] << 8) | packet[pos + 3]) == DNS_CLASS_IN;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint32_t clamp_ttl(uint32_t ttl) {
+    return ttl < DNS_MIN_TTL ? DNS_MIN_TTL : (ttl > DNS_MAX_TTL ? DNS_MAX_TTL : ttl);
+}
+
+// returns 1 if the packet answered q, which is then freed
+static int handle_answer(resolver *res, dns_query *q, const unsigned char *packet, int len) {
+    if (len < 12 || !(packet[2] & 0x80) || (uint16_t) ((packet[0] << 8) | packet[1]) != q->id ||
+        ((packet[4] << 8) | packet[5]) != 1 || !question_matches(packet, len, q->entry->name, q->type)) {
+        return 0; // garbage or a spoofing attempt, the query still waits for its answer
+    }
+    dns_query **link = &res->inflight;
+    while (*link != q) {
+        link = &(*link)->next;
+    }
+    *link = q->next;
+    dns_entry *e = q->entry;
+    int qtype = q->type;
+    free_query(q);
+
+    int rcode = packet[3] & 0x0f;
+    int questions = (packet[4] << 8) | packet[5];
+    int answers = (packet[6] << 8) | packet[7];
+    int authorities = (packet[8] << 8) | packet[9];
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+        finish_query(res, e, NULL, DNS_FAILURE_TTL);
+        return 1;
+    }
+
+    dns_result result;
+    memset(&result, 0, sizeof(result));
+    uint32_t ttl = DNS_MAX_TTL;
+    int pos = 12;
+    for (int i = 0; i < questions && pos != -1; ++i) {
+        pos = skip_name(packet, len, pos);
+        pos = pos == -1 || pos + 4 > len ? -1 : pos + 4;
+    }
+    // answers, CNAME records are skipped, the server already followed them
+    for (int i = 0; i < answers && pos != -1; ++i) {
+        if ((pos = skip_name(packet, len, pos)) == -1 || pos + 10 > len) {
+            pos = -1;
+            break;
+        }
+        int type = (packet[pos] << 8) | packet[pos + 1];
+        int klass = (packet[pos + 2] << 8) | packet[pos + 3];
+        uint32_t record_ttl = read32(packet + pos + 4);
+        int rdlength = (packet[pos + 8] << 8) | packet[pos + 9];
+        pos += 10;
+        if (pos + rdlength > len) {
+            pos = -1;
+            break;
+        }
+        // each family gets half of the room, a long list of one does not crowd out the other
+        if (type == qtype && klass == DNS_CLASS_IN && result.naddrs < DNS_MAX_ADDRS / 2 &&
+            rdlength == (qtype == DNS_TYPE_A ? 4 : 16)) {
+            dns_addr *addr = &result.addrs[result.naddrs++];
+            addr->family = qtype == DNS_TYPE_A ? AF_INET : AF_INET6;
+            memcpy(qtype == DNS_TYPE_A ? (void *) &addr->v4 : (void *) &addr->v6, packet + pos, rdlength);
+            ttl = record_ttl < ttl ? record_ttl : ttl;
+        }
+        pos += rdlength;
+    }
+    if (result.naddrs > 0) {
+        finish_query(res, e, &result, clamp_ttl(ttl));
+        return 1;
+    }
+
+    // negative answer, cached for the SOA minimum if the server sent one
+    uint32_t negative_ttl = DNS_NEGATIVE_TTL;
+    for (int i = 0; i < authorities && pos != -1; ++i) {
+        if ((pos = skip_name(packet, len, pos)) == -1 || pos + 10 > len) {
+            break;
+        }
+        int type = (packet[pos] << 8) | packet[pos + 1];
+        uint32_t record_ttl = read32(packet + pos + 4);
+        int rdlength = (packet[pos + 8] << 8) | packet[pos + 9];
+        pos += 10;
+        if (pos + rdlength > len) {
+            break;
+        }
+        if (type == DNS_TYPE_SOA && rdlength >= 4) {
+            uint32_t minimum = read32(packet + pos + rdlength - 4);
+            negative_ttl = minimum < record_ttl ? minimum : record_ttl;
+            break;
+        }
+        pos += rdlength;
+    }
+    finish_query(res, e, NULL, clamp_ttl(negative_ttl));
+    return 1;
+}
+
+static void read_answers(resolver *res, dns_query *q) {
+    unsigned char packet[DNS_PACKET_LEN];
+    while (1) {
+        ssize_t len = recv(q->sock_fd, packet, sizeof(packet), 0);
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // EAGAIN, or ECONNREFUSED from a dead server which the timeouts handle
+        }
+        if (handle_answer(res, q, packet, (int) len)) {
+            return;
+        }
+    }
+}
+
+// retransmit the overdue queries, give up on the ones out of attempts.
+// returns the time until the next deadline, -1 if nothing is in flight
+static int check_timeouts(resolver *res) {
+    int64_t now = now_ms();
+    int64_t next = -1;
+    dns_query **link = &res->inflight;
+    while (*link != NULL) {
+        dns_query *q = *link;
+        if (q->deadline_ms <= now) {
+            if (q->attempts >= DNS_ATTEMPTS) {
+                *link = q->next;
+                finish_query(res, q->entry, NULL, DNS_FAILURE_TTL);
+                free_query(q);
+                continue;
+            }
+            send_query(q);
+        }
+        if (next == -1 || q->deadline_ms < next) {
+            next = q->deadline_ms;
+        }
+        link = &q->next;
+    }
+    return next == -1 ? -1 : (int) (next > now ? next - now : 0);
+}
+
+static void* resolver_thread(void *arg) {
+    resolver *res = (resolver *) arg;
+    struct epoll_event events[64];
+    int timeout = -1;
+    while (!atomic_load(&res->stop)) {
+        int n = epoll_wait(res->epoll_fd, events, 64, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            // a query is only freed by its own event or after the batch, a later event never sees it freed
+            if (events[i].data.ptr == NULL) {
+                start_queries(res);
+            } else {
+                read_answers(res, (dns_query *) events[i].data.ptr);
+            }
+        }
+        timeout = check_timeouts(res);
+    }
+    return NULL;
+}
+
+void destroy_resolver(resolver *res) {
+    if (res->thread != 0) {
+        atomic_store(&res->stop, 1);
+        uint64_t one = 1;
+        if (write(res->wake_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+        pthread_join(res->thread, NULL);
+    }
+    while (res->inflight != NULL) {
+        dns_query *next = res->inflight->next;
+        free_query(res->inflight);
+        res->inflight = next;
+    }
+    for (int i = 0; i < DNS_SHARDS; ++i) {
+        dns_shard *shard = &res->shards[i];
+        for (size_t b = 0; shard->buckets != NULL && b < shard->num_buckets; ++b) {
+            dns_entry *e = shard->buckets[b];
+            while (e != NULL) {
+                dns_entry *next = e->next;
+                free(e);
+                e = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    pthread_mutex_destroy(&res->submit_lock);
+    if (res->wake_fd > 0) {
+        close(res->wake_fd);
+    }
+    if (res->epoll_fd > 0) {
+        close(res->epoll_fd);
+    }
+    free(res);
+}
@@ -0,0 +1,150 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/**
+ * resolver.h
+ *
+ * Asynchronous name resolution with an in-process cache.
+ *
+ * a resolver thread speaks DNS to the name server itself, so no caller
+ * ever blocks on a lookup and the answers come with their real TTLs. every
+ * query goes out on a UDP socket of its own, bound to a random port, with a
+ * random id: an off-path spoofer has to guess both. A and AAAA records are
+ * asked for together and a lookup completes with the addresses of both
+ * families. results, positive and negative, are cached in a sharded hash
+ * map, each shard holds at most DNS_SHARD_MAX_ENTRIES of them and evicts
+ * the least recently used: the names come from the clients, they must not
+ * grow it without bound. concurrent lookups of the same name wait on one
+ * pair of queries.
+ * names found in the hosts file (and IP literals) never leave the process.
+ */
+
+#define DNS_MAX_NAME 256
+#define DNS_MAX_ADDRS 16            //half of them for each family
+#define DNS_SHARDS 64
+#define DNS_SHARD_MAX_ENTRIES 1024  //cached names per shard, hosts file entries not counted
+
+// resolver_lookup return values
+#define DNS_HIT 0               //the result was filled in, no callback will come
+#define DNS_PENDING 1           //the callback will be called once the answer arrives
+
+// dns_result status values
+#define DNS_OK 0
+#define DNS_NOT_FOUND 1         //NXDOMAIN, no address, or the server did not answer
+
+typedef struct dns_addr {
+    sa_family_t family;         //AF_INET or AF_INET6
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    };
+} dns_addr;
+
+typedef struct dns_result {
+    int status;
+    int naddrs;
+    dns_addr addrs[DNS_MAX_ADDRS];
+} dns_result;
+
+/**
+ * called on the resolver thread when a pending lookup completes. ctx is the
+ * pointer given to resolver_lookup, result is only valid during the call.
+ */
+typedef void (*dns_callback)(void *ctx, const dns_result *result);
+
+/**
+ * a lookup waiting for its answer. the caller owns the memory (typically
+ * embedded in the connection) and must keep it alive until the callback.
+ */
+typedef struct dns_waiter {
+    dns_callback cb;
+    void *ctx;
+    struct dns_waiter *next;
+} dns_waiter;
+
+typedef struct dns_entry {
+    char name[DNS_MAX_NAME];    //lower case
+    uint32_t hash;
+    int pending;                //1 while a query for the name is in flight
+    int permanent;              //1 for hosts file entries, they never expire
+    int64_t expires_ms;         //monotonic time the result stops being valid
+    dns_result result;
+    dns_waiter *waiters;        //lookups coalesced on the in-flight queries
+    int queries;                //queries of the lookup not answered yet, resolver thread only
+    dns_result partial;         //addresses the answered ones found, resolver thread only
+    uint32_t found_ttl;         //smallest TTL of the addresses found
+    uint32_t missing_ttl;       //smallest TTL of the negative or failed answers
+    struct dns_entry *next;     //bucket chain
+    struct dns_entry *lru_prev; //recency list of the shard, hosts file entries are not on it
+    struct dns_entry *lru_next;
+    struct dns_entry *submit_next;  //link in the list of entries to query
+} dns_entry;
+
+typedef struct dns_shard {
+    pthread_mutex_t lock;
+    dns_entry **buckets;
+    size_t num_buckets;
+    dns_entry *lru_head;        //most recently used
+    dns_entry *lru_tail;
+    size_t count;               //entries on the recency list
+} dns_shard;
+
+typedef struct dns_query {
+    uint16_t id;
+    int sock_fd;                //bound to a random port and connected to the name server
+    int type;                   //DNS_TYPE_A or DNS_TYPE_AAAA
+    int attempts;
+    int64_t deadline_ms;        //when to retransmit or give up
+    dns_entry *entry;
+    struct dns_query *next;
+} dns_query;
+
+typedef struct resolver {
+    dns_shard shards[DNS_SHARDS];
+
+    struct sockaddr_in server;  //the name server
+    int wake_fd;                //eventfd signalled when queries are submitted
+    int epoll_fd;
+    pthread_t thread;
+    atomic_int stop;
+
+    pthread_mutex_t submit_lock;    //protects submitted
+    dns_entry *submitted_head;      //entries waiting for the resolver thread to query them
+    dns_query *inflight;            //queries sent and not answered yet, resolver thread only
+} resolver;
+
+/**
+ * dns_addr_sockaddr fills sa with addr and port, returns the length of the
+ * address to pass to connect().
+ */
+socklen_t dns_addr_sockaddr(const dns_addr *addr, in_port_t port, struct sockaddr_storage *sa);
+
+/**
+ * create_resolver starts the resolver thread. name_server is "ip" or
+ * "ip:port", NULL to use the first IPv4 name server of /etc/resolv.conf.
+ * hosts_file is loaded into the cache as permanent entries, NULL to skip it.
+ * returns NULL on failure.
+ */
+resolver* create_resolver(const char *name_server, const char *hosts_file);
+
+/**
+ * resolver_lookup resolves name. on a cache hit (or an IP literal) the
+ * result is filled in and DNS_HIT is returned. otherwise the waiter is
+ * queued, DNS_PENDING is returned and waiter->cb is called later, from the
+ * resolver thread, possibly before resolver_lookup itself returns.
+ */
+int resolver_lookup(resolver *res, const char *name, dns_waiter *waiter, dns_result *result);
+
+/**
+ * destroy_resolver stops the thread and frees the cache. no lookup may be
+ * pending.
+ */
+void destroy_resolver(resolver *res);
+
+#endif
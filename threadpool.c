@@ -1,13 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include "threadpool.h"
 
-struct work_st *dequeue(struct _threadpool_st *tp);
-void enqueue(struct _threadpool_st *, struct work_st *);
-void free_queue(struct _threadpool_st *);
+// empty polls of the rings, each followed by sched_yield, before a worker
+// parks on the condition variable. bench/threadpool_bench on one cpu: 4
+// rounds keep the saturated throughput of 64 (about 4M jobs/s), and a job
+// every 50 µs costs 12-14 µs of cpu instead of 51-54 (8-9 with the mutex
+// queue); 0 or 1 round halves the saturated throughput.
+#ifndef PARK_AFTER_ROUNDS
+#define PARK_AFTER_ROUNDS 4
+#endif
+
+int ring_init(tp_ring *, size_t);
+int ring_push(tp_ring *, const work_t *);
+int ring_pop(tp_ring *, work_t *);
+int take_work(threadpool *, int, work_t *);
 
 // Corrected locking order
 void lock(pthread_mutex_t *mutex) {
@@ -25,6 +37,13 @@ void unlock(pthread_mutex_t *mutex) {
 }
 
 threadpool *create_threadpool(int num_threads_in_pool) {
+    return create_bounded_threadpool(num_threads_in_pool, DEFAULT_QUEUE_CAPACITY, TP_BLOCK);
+}
+
+threadpool *create_bounded_threadpool(int num_threads_in_pool, int queue_capacity, overflow_policy policy) {
+    if (num_threads_in_pool < 1 || num_threads_in_pool > MAXT_IN_POOL || queue_capacity < 1) {
+        return NULL;
+    }
     threadpool *t_pool = (threadpool *)malloc(sizeof(threadpool));
     if (t_pool == NULL) {
         perror("malloc");
@@ -32,25 +51,43 @@ threadpool *create_threadpool(int num_threads_in_pool) {
     }
 
     t_pool->num_threads = num_threads_in_pool;
-    t_pool->qsize = 0;
+    t_pool->policy = policy;
+    atomic_init(&t_pool->qsize, 0);
+    atomic_init(&t_pool->next_ring, 0);
+    atomic_init(&t_pool->sleepers, 0);
+    atomic_init(&t_pool->blocked, 0);
+    atomic_init(&t_pool->shutdown, 0);
+    atomic_init(&t_pool->dont_accept, 0);
     t_pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * t_pool->num_threads);
-    if (t_pool->threads == NULL) {
+    t_pool->workers = (tp_worker *)aligned_alloc(64, sizeof(tp_worker) * t_pool->num_threads);
+    if (t_pool->threads == NULL || t_pool->workers == NULL) {
         perror("malloc");
+        free(t_pool->threads);
+        free(t_pool->workers);
         free(t_pool);
         exit(EXIT_FAILURE);
     }
 
-    t_pool->qtail = t_pool->qhead = NULL;
+    // split the capacity between the rings
+    size_t per_ring = ((size_t)queue_capacity + num_threads_in_pool - 1) / num_threads_in_pool;
+    for (int i = 0; i < t_pool->num_threads; ++i) {
+        memset(&t_pool->workers[i], 0, sizeof(tp_worker));
+        t_pool->workers[i].pool = t_pool;
+        t_pool->workers[i].id = i;
+        if (ring_init(&t_pool->workers[i].ring, per_ring) == -1) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     pthread_cond_init(&t_pool->q_empty, NULL);
     pthread_cond_init(&t_pool->q_not_empty, NULL);
+    pthread_cond_init(&t_pool->q_not_full, NULL);
     pthread_mutex_init(&t_pool->qlock, NULL);
-    t_pool->shutdown = t_pool->dont_accept = 0;
 
     for (int i = 0; i < t_pool->num_threads; ++i) {
-        if (pthread_create(t_pool->threads + i, NULL, do_work, (void *)t_pool) != 0) {
+        if (pthread_create(t_pool->threads + i, NULL, do_work, (void *)(t_pool->workers + i)) != 0) {
             perror("pthread_create");
-            free(t_pool->threads);
-            free(t_pool);
             exit(EXIT_FAILURE);
         }
     }
@@ -58,51 +95,124 @@ threadpool *create_threadpool(int num_threads_in_pool) {
     return t_pool;
 }
 
-void dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
-    lock(&from_me->qlock); // Acquire lock
-    if (from_me->dont_accept) {
-        unlock(&from_me->qlock); // Release lock
-        return;
+// put the job in the first ring with room, starting from the round robin cursor
+static int try_enqueue(threadpool *tp, const work_t *work) {
+    unsigned int start = atomic_fetch_add_explicit(&tp->next_ring, 1, memory_order_relaxed);
+    for (int i = 0; i < tp->num_threads; ++i) {
+        if (ring_push(&tp->workers[(start + i) % tp->num_threads].ring, work) == 0) {
+            return 0;
+        }
     }
-    struct work_st *work = (struct work_st *)malloc(sizeof(struct work_st));
-    if (work == NULL) {
-        perror("malloc");
-        free_queue(from_me);
-        free(from_me);
-        exit(EXIT_FAILURE);
+    return -1;
+}
+
+static int enqueue_work(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg, int borrowed, int may_wait) {
+    if (atomic_load(&from_me->dont_accept)) {
+        return TP_DROPPED;
+    }
+    work_t work;
+    work.routine = dispatch_to_here;
+    work.arg = arg;
+    work.borrowed = borrowed;
+    work.queued_us = monotonic_us();
+
+    if (try_enqueue(from_me, &work) == -1) {
+        if (from_me->policy == TP_REJECT) {
+            return TP_REJECTED;
+        }
+        if (from_me->policy == TP_DROP) {
+            return TP_DROPPED;
+        }
+        if (!may_wait) {
+            return TP_REJECTED;
+        }
+        // TP_BLOCK: park until a worker took a job out of a ring
+        lock(&from_me->qlock);
+        atomic_fetch_add(&from_me->blocked, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (try_enqueue(from_me, &work) == -1) {
+            pthread_cond_wait(&from_me->q_not_full, &from_me->qlock);
+        }
+        atomic_fetch_sub(&from_me->blocked, 1);
+        unlock(&from_me->qlock);
     }
-    work->routine = dispatch_to_here;
-    work->arg = arg;
+    atomic_fetch_add(&from_me->qsize, 1);
+
+    // the fence pairs with the one of a parking worker: either it sees the
+    // new job or we see it parked and wake it up
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&from_me->sleepers, memory_order_relaxed) > 0) {
+        lock(&from_me->qlock);
+        pthread_cond_signal(&from_me->q_not_empty);
+        unlock(&from_me->qlock);
+    }
+    return TP_QUEUED;
+}
+
+int dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
+    return enqueue_work(from_me, dispatch_to_here, arg, 0, 1);
+}
+
+int dispatch_borrowed(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
+    return enqueue_work(from_me, dispatch_to_here, arg, 1, 1);
+}
 
-    enqueue(from_me, work);
-    pthread_cond_signal(&from_me->q_not_empty);
-    unlock(&from_me->qlock); // Release lock
+int try_dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
+    return enqueue_work(from_me, dispatch_to_here, arg, 0, 0);
+}
+
+int try_dispatch_borrowed(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
+    return enqueue_work(from_me, dispatch_to_here, arg, 1, 0);
 }
 
 void *do_work(void *p) {
-    struct _threadpool_st *t_pool = (struct _threadpool_st *)p;
+    tp_worker *worker = (tp_worker *)p;
+    threadpool *t_pool = worker->pool;
+    int idle_rounds = 0;
     while (1) {
+        work_t work;
+        if (take_work(t_pool, worker->id, &work)) {
+            idle_rounds = 0;
+            atomic_fetch_sub(&t_pool->qsize, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&t_pool->blocked, memory_order_relaxed) > 0) {
+                lock(&t_pool->qlock);
+                pthread_cond_signal(&t_pool->q_not_full);
+                unlock(&t_pool->qlock);
+            }
+
+            counter_add(&worker->jobs, 1);
+            histogram_record(&worker->wait, monotonic_us() - work.queued_us);
+            work.routine(work.arg);
+            if (!work.borrowed) {
+                free(work.arg);
+            }
+
+            if (atomic_load(&t_pool->dont_accept) && atomic_load(&t_pool->qsize) == 0) {
+                lock(&t_pool->qlock); // Acquire lock
+                pthread_cond_signal(&t_pool->q_empty);
+                unlock(&t_pool->qlock); // Release lock
+            }
+            continue;
+        }
+
+        // nothing to run or steal, give the producers a few chances before parking
+        if (++idle_rounds < PARK_AFTER_ROUNDS) {
+            sched_yield();
+            continue;
+        }
+        idle_rounds = 0;
         lock(&t_pool->qlock); // Acquire lock
-        while (t_pool->qsize == 0 && !t_pool->shutdown) {
+        atomic_fetch_add(&t_pool->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (atomic_load(&t_pool->qsize) == 0 && !atomic_load(&t_pool->shutdown)) {
             pthread_cond_wait(&t_pool->q_not_empty, &t_pool->qlock);
         }
-        if (t_pool->shutdown) {
+        atomic_fetch_sub(&t_pool->sleepers, 1);
+        if (atomic_load(&t_pool->shutdown)) {
             unlock(&t_pool->qlock); // Release lock
             pthread_exit(NULL);
         }
-        struct work_st *work = dequeue(t_pool);
-        unlock(&t_pool->qlock); // Release lock
-
-        if (work != NULL) {
-            work->routine(work->arg);
-            free(work->arg);
-            free(work);
-        }
-
-        lock(&t_pool->qlock); // Acquire lock
-        if (t_pool->dont_accept && t_pool->qsize == 0) {
-            pthread_cond_signal(&t_pool->q_empty);
-        }
         unlock(&t_pool->qlock); // Release lock
     }
 }
@@ -110,53 +220,100 @@ void *do_work(void *p) {
 void destroy_threadpool(threadpool *destroyme) {
     lock(&destroyme->qlock); // Acquire lock
 
-    destroyme->dont_accept = 1;
-    while (destroyme->qsize > 0) {
+    atomic_store(&destroyme->dont_accept, 1);
+    while (atomic_load(&destroyme->qsize) > 0) {
         pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
     }
-    destroyme->shutdown = 1;
-    unlock(&destroyme->qlock); // Release lock
+    atomic_store(&destroyme->shutdown, 1);
     pthread_cond_broadcast(&destroyme->q_not_empty);
+    unlock(&destroyme->qlock); // Release lock
 
     for (int i = 0; i < destroyme->num_threads; ++i) {
         pthread_join(destroyme->threads[i], NULL);
     }
+    for (int i = 0; i < destroyme->num_threads; ++i) {
+        free(destroyme->workers[i].ring.cells);
+    }
+    pthread_cond_destroy(&destroyme->q_empty);
+    pthread_cond_destroy(&destroyme->q_not_empty);
+    pthread_cond_destroy(&destroyme->q_not_full);
+    pthread_mutex_destroy(&destroyme->qlock);
+    free(destroyme->workers);
     free(destroyme->threads);
     free(destroyme);
 }
 
-struct work_st *dequeue(struct _threadpool_st *tp) {
-    if (tp == NULL || tp->qhead == NULL) {
-        return NULL;
+// own ring first, then steal from the others starting with the next worker
+int take_work(threadpool *tp, int id, work_t *work) {
+    for (int i = 0; i < tp->num_threads; ++i) {
+        if (ring_pop(&tp->workers[(id + i) % tp->num_threads].ring, work) == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    struct work_st *ret = tp->qhead;
-    struct work_st *new_head = ret->next;
-    tp->qhead = new_head;
-    tp->qsize--;
-    if (tp->qsize == 0) {
-        tp->qtail = NULL;
+int ring_init(tp_ring *ring, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    if ((ring->cells = (tp_cell *)malloc(sizeof(tp_cell) * size)) == NULL) {
+        return -1;
     }
-    return ret;
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
 }
 
-void enqueue(struct _threadpool_st *tp, struct work_st *work) {
-    if (tp->qtail == NULL) {
-        tp->qsize++;
-        tp->qhead = tp->qtail = work;
-    } else {
-        tp->qtail->next = work;
-        tp->qtail = work;
-        tp->qsize++;
+// a cell whose seq equals the tail position is free for the producer that claims that position
+int ring_push(tp_ring *ring, const work_t *work) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    tp_cell *cell;
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // full
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
     }
+    cell->work = *work;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
 }
 
-void free_queue(struct _threadpool_st *tp) {
-    struct work_st *head = tp->qhead;
-    while (head != NULL) {
-        struct work_st *next = head->next;
-        free(head);
-        head = next;
+// a cell whose seq is one past the head position holds a published job
+int ring_pop(tp_ring *ring, work_t *work) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tp_cell *cell;
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // empty
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
     }
+    *work = cell->work;
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+    return 0;
 }
-
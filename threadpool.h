@@ -1,48 +1,112 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
 #include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "metrics.h"
 
 /**
  * threadpool.h
  *
  * This file declares the functionality associated with
  * your implementation of a threadpool.
+ *
+ * every worker owns a bounded ring of jobs, dispatch spreads the jobs over
+ * the rings and a worker whose ring is empty steals from the others. the
+ * rings are lock-free, the pool mutex is only taken to park and wake up
+ * idle workers (or producers waiting for room).
  */
 
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 #define MAX_IN_POOL MAXT_IN_POOL
 
+// number of queued jobs the pool holds when no capacity is given
+#define DEFAULT_QUEUE_CAPACITY 4096
+
+/**
+ * what dispatch does when every ring is full
+ */
+typedef enum overflow_policy {
+    TP_BLOCK,       //wait until a worker makes room
+    TP_REJECT,      //return TP_REJECTED, the caller answers the client (503)
+    TP_DROP         //return TP_DROPPED, the caller silently gives up on the job
+} overflow_policy;
+
+// return values of dispatch
+#define TP_QUEUED 0
+#define TP_REJECTED (-1)
+#define TP_DROPPED (-2)
+
 
 /**
- * the pool holds a queue of this structure
+ * the pool holds its queued jobs as this structure
  */
 typedef struct work_st{
       int (*routine) (void*);  //the threads process function
       void * arg;  //argument to the function
-      struct work_st* next;  
+      int borrowed;  //1 if arg still belongs to the caller, it is not freed after the routine
+      uint64_t queued_us;  //when it was dispatched, monotonic
 } work_t;
 
+/**
+ * a slot of a ring, seq tells producers and consumers whose turn it is
+ */
+typedef struct tp_cell {
+    atomic_size_t seq;
+    work_t work;
+} tp_cell;
+
+/**
+ * bounded multi producer / multi consumer ring of one worker. head and
+ * tail live on their own cache lines so producers and consumers do not
+ * bounce a shared line.
+ */
+typedef struct tp_ring {
+    _Alignas(64) atomic_size_t head;    //next slot to take a job from
+    _Alignas(64) atomic_size_t tail;    //next slot to put a job in
+    _Alignas(64) tp_cell *cells;        //preallocated slab of jobs, never freed while the pool lives
+    size_t mask;                        //capacity - 1, the capacity is a power of two
+} tp_ring;
+
+/**
+ * per thread state, the argument of do_work
+ */
+typedef struct tp_worker {
+    struct _threadpool_st *pool;
+    int id;
+    tp_ring ring;
+    _Alignas(64) counter jobs;          //jobs this worker ran, written by it alone
+    histogram wait;                     //how long they were queued
+} tp_worker;
+
 
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
  	int num_threads;	//number of active threads
-	int qsize;	        //number in the queue
+	atomic_int qsize;	        //number in the queues
 	pthread_t *threads;	//pointer to threads
-	work_t* qhead;		//queue head pointer
-	work_t* qtail;		//queue tail pointer
-	pthread_mutex_t qlock;		//lock on the queue list
-	pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
+	tp_worker *workers;	//a ring per thread
+	overflow_policy policy;	//what dispatch does when every ring is full
+	atomic_uint next_ring;	//round robin cursor of dispatch
+	atomic_int sleepers;	//workers parked on q_not_empty
+	atomic_int blocked;	//producers parked on q_not_full
+	pthread_mutex_t qlock;		//only protects parking, never taken to move a job
+	pthread_cond_t q_not_empty;	//non empty, non full and empty condidtion vairiables
+	pthread_cond_t q_not_full;
 	pthread_cond_t q_empty;
-    int shutdown;            //1 if the pool is in distruction process     
-    int dont_accept;       //1 if destroy function has begun
+    atomic_int shutdown;            //1 if the pool is in distruction process
+    atomic_int dont_accept;       //1 if destroy function has begun
 } threadpool;
 
 
 // "dispatch_fn" declares a typed function pointer.  A
 // variable of type "dispatch_fn" points to a function
 // with the following signature:
-// 
+//
 //     int dispatch_function(void *arg);
 
 typedef int (*dispatch_fn)(void *);
@@ -51,13 +115,22 @@ typedef int (*dispatch_fn)(void *);
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
  * "threadpool", else it returns NULL.
+ * the pool holds up to DEFAULT_QUEUE_CAPACITY queued jobs and dispatch
+ * blocks when they are all taken.
+ */
+threadpool* create_threadpool(int num_threads_in_pool);
+
+/**
+ * create_bounded_threadpool is create_threadpool with an explicit queue
+ * capacity (split between the worker rings, each rounded up to a power of
+ * two) and overflow policy.
  * this function should:
- * 1. input sanity check 
- * 2. initialize the threadpool structure
+ * 1. input sanity check
+ * 2. initialize the threadpool structure and preallocate the rings
  * 3. initialized mutex and conditional variables
- * 4. create the threads, the thread init function is do_work and its argument is the initialized threadpool. 
+ * 4. create the threads, the thread init function is do_work and its argument is the worker of the thread.
  */
-threadpool* create_threadpool(int num_threads_in_pool);
+threadpool* create_bounded_threadpool(int num_threads_in_pool, int queue_capacity, overflow_policy policy);
 
 
 /**
@@ -65,22 +138,36 @@ threadpool* create_threadpool(int num_threads_in_pool);
  * when an available thread takes a job from the queue, it will
  * call the function "dispatch_to_here" with argument "arg".
  * this function should:
- * 1. create and init work_t element
- * 2. lock the mutex
- * 3. add the work_t element to the queue
- * 4. unlock mutex
+ * 1. pick a ring, round robin, and try to put the job in it (or in any other ring)
+ * 2. if every ring is full, apply the overflow policy
+ * 3. wake a parked worker if there is one
  *
+ * returns TP_QUEUED, or TP_REJECTED / TP_DROPPED when the job was not
+ * queued, in which case arg still belongs to the caller.
  */
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+int dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_borrowed is dispatch for an argument the pool does not free
+ * after the routine ran, it stays the caller's. a job on memory the caller
+ * owns anyway costs no allocation.
+ */
+int dispatch_borrowed(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * try_dispatch and try_dispatch_borrowed never wait for room: under
+ * TP_BLOCK a full pool returns TP_REJECTED, the other policies apply as
+ * usual. they are for event loop threads, which must not park.
+ */
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+int try_dispatch_borrowed(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
 /**
  * The work function of the thread
  * this function should:
- * 1. lock mutex
- * 2. if the queue is empty, wait
- * 3. take the first element from the queue (work_t)
- * 4. unlock mutex
- * 5. call the thread routine
+ * 1. take a job from the own ring, or steal one from another ring
+ * 2. if there is none, park until dispatch wakes it up
+ * 3. call the thread routine and free its argument, unless it was borrowed
  *
  */
 void* do_work(void* p);
@@ -93,4 +180,4 @@ void* do_work(void* p);
  */
 void destroy_threadpool(threadpool* destroyme);
 
-
+#endif
@@ -0,0 +1,175 @@
+#include <string.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define EXPIRED_LIST (TIMER_LEVELS * TIMER_SLOTS)
+#define WHEEL_SPAN (1ULL << (TIMER_LEVELS * TIMER_LEVEL_BITS))
+
+void timer_wheel_init(timer_wheel *w, uint64_t now) {
+    memset(w, 0, sizeof(timer_wheel));
+    w->now = now;
+}
+
+void timer_init(timer *t, int kind, void *owner) {
+    memset(t, 0, sizeof(timer));
+    t->kind = kind;
+    t->owner = owner;
+    t->where = -1;
+}
+
+static timer** list_of(timer_wheel *w, int where) {
+    return where == EXPIRED_LIST ? &w->expired : &w->slots[where / TIMER_SLOTS][where % TIMER_SLOTS];
+}
+
+static void push(timer_wheel *w, timer *t, int where) {
+    timer **head = list_of(w, where);
+    t->where = where;
+    t->prev = NULL;
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = t;
+    }
+    *head = t;
+    if (where != EXPIRED_LIST) {
+        w->occupied[where / TIMER_SLOTS] |= 1ULL << (where % TIMER_SLOTS);
+    }
+}
+
+static void unlink_timer(timer_wheel *w, timer *t) {
+    timer **head = list_of(w, t->where);
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        *head = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    if (*head == NULL && t->where != EXPIRED_LIST) {
+        w->occupied[t->where / TIMER_SLOTS] &= ~(1ULL << (t->where % TIMER_SLOTS));
+    }
+    t->where = -1;
+}
+
+// the level is picked by how far ahead the timer is, the slot by the bits of its tick at that level:
+// the slot comes around again, and the timer moves down, no later than the tick itself
+static void place(timer_wheel *w, timer *t) {
+    if (t->expires < w->now) { // its tick was run already
+        push(w, t, EXPIRED_LIST);
+        return;
+    }
+    uint64_t expires = t->expires;
+    uint64_t delta = expires - w->now;
+    if (delta >= WHEEL_SPAN) {
+        // out of reach, it waits in the farthest slot and is placed again from there
+        delta = WHEEL_SPAN - 1;
+        expires = w->now + delta;
+    }
+    int level = delta < TIMER_SLOTS ? 0 : (63 - __builtin_clzll(delta)) / TIMER_LEVEL_BITS;
+    int slot = (int) (expires >> (level * TIMER_LEVEL_BITS)) & SLOT_MASK;
+    push(w, t, level * TIMER_SLOTS + slot);
+}
+
+void timer_arm(timer_wheel *w, timer *t, uint64_t expires) {
+    if (timer_armed(t)) {
+        unlink_timer(w, t);
+    } else {
+        w->armed++;
+    }
+    t->expires = expires;
+    place(w, t);
+}
+
+void timer_cancel(timer_wheel *w, timer *t) {
+    if (!timer_armed(t)) {
+        return;
+    }
+    unlink_timer(w, t);
+    w->armed--;
+}
+
+// level 0 wrapped around: the slot of every level above that came around is spread over the levels below
+static void cascade(timer_wheel *w) {
+    for (int level = 1; level < TIMER_LEVELS; ++level) {
+        int slot = (int) (w->now >> (level * TIMER_LEVEL_BITS)) & SLOT_MASK;
+        timer *t = w->slots[level][slot];
+        w->slots[level][slot] = NULL;
+        w->occupied[level] &= ~(1ULL << slot);
+        while (t != NULL) {
+            timer *next = t->next;
+            place(w, t);
+            t = next;
+        }
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+timer* timer_wheel_expire(timer_wheel *w, uint64_t now) {
+    while (w->expired == NULL && w->now <= now) {
+        int index = (int) (w->now & SLOT_MASK);
+        if (index == 0) {
+            cascade(w);
+        }
+        uint64_t pending = w->occupied[0] >> index;
+        uint64_t rotation_end = (w->now | SLOT_MASK) + 1;
+        if (pending == 0) {
+            // nothing left in this turn of level 0, go to the next one or stop at now
+            w->now = rotation_end <= now + 1 ? rotation_end : now + 1;
+            continue;
+        }
+        uint64_t due = w->now + (uint64_t) __builtin_ctzll(pending);
+        if (due > now) {
+            w->now = now + 1;
+            break;
+        }
+        int slot = (int) (due & SLOT_MASK);
+        timer *t = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        w->occupied[0] &= ~(1ULL << slot);
+        while (t != NULL) {
+            timer *next = t->next;
+            push(w, t, EXPIRED_LIST);
+            t = next;
+        }
+        w->now = due + 1;
+    }
+    timer *t = w->expired;
+    if (t != NULL) {
+        unlink_timer(w, t);
+        w->armed--;
+    }
+    return t;
+}
+
+int64_t timer_wheel_next(const timer_wheel *w, uint64_t now) {
+    if (w->expired != NULL) {
+        return 0;
+    }
+    if (w->armed == 0) {
+        return -1;
+    }
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; ++level) {
+        uint64_t occupied = w->occupied[level];
+        if (occupied == 0) {
+            continue;
+        }
+        int shift = level * TIMER_LEVEL_BITS;
+        int current = (int) (w->now >> shift) & SLOT_MASK;
+        uint64_t rotated = current == 0 ? occupied : (occupied >> current) | (occupied << (TIMER_SLOTS - current));
+        if (level > 0 && (w->now & ((1ULL << shift) - 1)) != 0) {
+            // the current slot was spread over the levels below already, what it holds is a turn ahead
+            rotated = (rotated & ~1ULL) | ((rotated & 1) << SLOT_MASK);
+        }
+        uint64_t start = ((w->now >> shift) + (uint64_t) __builtin_ctzll(rotated)) << shift;
+        if (start < w->now) {
+            start = w->now;
+        }
+        if (start < next) {
+            next = start;
+        }
+    }
+    return next <= now ? 0 : (int64_t) (next - now);
+}
@@ -0,0 +1,87 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * timer_wheel.h
+ *
+ * A hierarchical timing wheel: arming, re-arming and cancelling a timer
+ * cost the same whatever the number of timers, so every connection can
+ * carry a deadline of its own.
+ *
+ * time is counted in ticks (milliseconds for the reactors). level 0 has a
+ * slot per tick for the next 64 ticks, each level above a slot per 64
+ * slots of the level below, so 5 levels reach 2^30 ticks ahead; a later
+ * deadline waits in the last level until it comes within reach. a timer
+ * is moved down a level when the level below wraps around to its slot,
+ * at most 4 times before it fires. a bitmap per level tells which slots
+ * hold timers, so the wheel jumps over empty ones instead of stepping tick
+ * by tick.
+ *
+ * a wheel belongs to one thread and is not locked.
+ */
+
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 5
+
+typedef struct timer {
+    uint64_t expires;           //tick it fires at
+    int kind;                   //what owner is, when the timers of a wheel belong to different things
+    void *owner;
+    int where;                  //slot of the wheel it is in, -1 while not armed
+    struct timer *prev;
+    struct timer *next;
+} timer;
+
+typedef struct timer_wheel {
+    uint64_t now;                               //next tick to run, every timer before it fired
+    uint64_t occupied[TIMER_LEVELS];            //bit i is set while slot i of the level holds timers
+    timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    timer *expired;                             //due timers not handed out yet
+    size_t armed;
+} timer_wheel;
+
+/**
+ * timer_wheel_init prepares an empty wheel whose time starts at now.
+ */
+void timer_wheel_init(timer_wheel *w, uint64_t now);
+
+/**
+ * timer_init prepares a disarmed timer of owner, of the given kind.
+ */
+void timer_init(timer *t, int kind, void *owner);
+
+/**
+ * timer_arm makes t fire at tick expires, moving it if it was armed
+ * already. a tick in the past fires at the next timer_wheel_expire.
+ */
+void timer_arm(timer_wheel *w, timer *t, uint64_t expires);
+
+/**
+ * timer_cancel disarms t, nothing happens if it was not armed.
+ */
+void timer_cancel(timer_wheel *w, timer *t);
+
+static inline int timer_armed(const timer *t) {
+    return t->where != -1;
+}
+
+/**
+ * timer_wheel_expire runs the wheel up to tick now and returns a due
+ * timer, disarmed, or NULL once there is none. the caller handles it
+ * before asking for the next one, and may arm or cancel any timer
+ * meanwhile, the due ones not handed out yet included.
+ */
+timer* timer_wheel_expire(timer_wheel *w, uint64_t now);
+
+/**
+ * timer_wheel_next returns the ticks from now until the next timer may be
+ * due, -1 if none is armed. never later than the timer, earlier when it
+ * still sits on a higher level. meant as the timeout of epoll_wait.
+ */
+int64_t timer_wheel_next(const timer_wheel *w, uint64_t now);
+
+#endif
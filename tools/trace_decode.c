@@ -0,0 +1,197 @@
+/**
+ * trace_decode.c
+ *
+ * reads a trace file written by proxyServer --trace and reports, for each
+ * phase of a request, how long the requests that went through it spent
+ * there: count, p50, p90, p99, p999 and max. a phase is timed from the one
+ * before it, so the cached answers, which skip the lookup and the
+ * upstream, only show in wait and total.
+ *
+ *     make tools
+ *     tools/trace_decode [-l] <trace-file>
+ *
+ * a file the proxy appended to across handoffs holds a header per process,
+ * the records of all of them are counted together.
+ *
+ * -l also prints every record, one per line: the time the request started,
+ * its reactor, client, status, bytes sent, flags and the µs from its start
+ * to each phase it reached.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "trace.h"
+
+typedef struct segment {
+    const char *name;
+    int from;                   //trace_phase, -1 for the start of the request
+    int to;
+} segment;
+
+static const segment segments[] = {
+        {"wait",     -1,               TRACE_HEAD},         //client connect or keep-alive idle, then the head
+        {"cache",    TRACE_HEAD,       TRACE_LOOKUP},       //cache lookup, wait on the fetch of another request
+        {"dns",      TRACE_LOOKUP,     TRACE_DNS},
+        {"queue",    TRACE_DNS,        TRACE_DEQUEUE},      //filter job waiting for a pool thread
+        {"filter",   TRACE_DEQUEUE,    TRACE_FILTER},
+        {"connect",  TRACE_FILTER,     TRACE_CONNECT},      //back on the reactor, then connected or pooled
+        {"ttfb",     TRACE_CONNECT,    TRACE_FIRST_BYTE},
+        {"transfer", TRACE_FIRST_BYTE, TRACE_END},
+        {"total",    TRACE_HEAD,       TRACE_END},
+};
+
+#define NUM_SEGMENTS (sizeof(segments) / sizeof(segments[0]))
+
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint32_t *sorted, size_t num, double p) {
+    if (num == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) (p * num + 0.999999);
+    return sorted[rank == 0 ? 0 : rank - 1] / 1000.0;
+}
+
+// the µs from the start of a record to phase, 0 for the start itself
+static uint32_t phase_at(const trace_record *t, int phase) {
+    return phase == -1 ? 0 : t->at[phase];
+}
+
+static void print_record(const trace_record *t, const trace_file_header *h) {
+    static const char *const phase_names[TRACE_PHASES] = {
+            "head", "lookup", "dns", "dequeue", "filter", "connect", "first_byte", "end"
+    };
+    uint64_t wall_us = h->wall_us + (t->start_us - h->monotonic_us);
+    time_t secs = (time_t) (wall_us / 1000000);
+    struct tm tm;
+    char when[32];
+    strftime(when, sizeof(when), "%H:%M:%S", localtime_r(&secs, &tm));
+    char client[INET_ADDRSTRLEN];
+    struct in_addr addr = {t->client};
+    inet_ntop(AF_INET, &addr, client, sizeof(client));
+    printf("%s.%06u r%u %s %u %u%s%s%s%s", when, (unsigned) (wall_us % 1000000), t->reactor, client, t->status,
+           t->bytes, t->flags & TRACE_CACHED ? " cached" : "", t->flags & TRACE_REUSED ? " reused" : "",
+           t->flags & TRACE_TUNNEL ? " tunnel" : "", t->flags & TRACE_COMPRESSED ? " compressed" : "");
+    for (int i = 0; i < TRACE_PHASES; ++i) {
+        if (t->at[i] != TRACE_NONE) {
+            printf(" %s=%u", phase_names[i], t->at[i]);
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int list = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "l")) != -1) {
+        if (opt != 'l') {
+            fprintf(stderr, "usage: trace_decode [-l] <trace-file>\n");
+            return EXIT_FAILURE;
+        }
+        list = 1;
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: trace_decode [-l] <trace-file>\n");
+        return EXIT_FAILURE;
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    size_t len = 0;
+    size_t cap = 1 << 20;
+    char *data = (char *) malloc(cap);
+    while (data != NULL) {
+        len += fread(data + len, 1, cap - len, f);
+        if (len < cap) {
+            break;
+        }
+        cap *= 2;
+        char *temp = (char *) realloc(data, cap);
+        if (temp == NULL) {
+            free(data);
+        }
+        data = temp;
+    }
+    fclose(f);
+    trace_record *records = (trace_record *) malloc((len / sizeof(trace_record) + 1) * sizeof(trace_record));
+    if (data == NULL || records == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    // the records of a process follow its header, the header of its successor may come in between
+    size_t num = 0;
+    size_t traces = 0;
+    trace_file_header header;
+    for (size_t off = 0; off < len;) {
+        if (len - off >= sizeof(header) && memcmp(data + off, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0) {
+            memcpy(&header, data + off, sizeof(header));
+            if (header.version != TRACE_VERSION || header.record_size != sizeof(trace_record)) {
+                break;
+            }
+            traces++;
+            off += sizeof(header);
+            continue;
+        }
+        if (traces == 0 || len - off < sizeof(trace_record)) {
+            break;
+        }
+        memcpy(&records[num], data + off, sizeof(trace_record));
+        if (list) {
+            print_record(&records[num], &header);
+        }
+        num++;
+        off += sizeof(trace_record);
+    }
+    free(data);
+    if (traces == 0) {
+        fprintf(stderr, "%s: not a trace of this version of the proxy\n", argv[optind]);
+        free(records);
+        return EXIT_FAILURE;
+    }
+    uint32_t *samples = (uint32_t *) malloc((num + 1) * sizeof(uint32_t));
+    if (samples == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t flagged[4] = {0, 0, 0, 0};
+    size_t errors = 0;
+    for (size_t i = 0; i < num; ++i) {
+        for (int bit = 0; bit < 4; ++bit) {
+            flagged[bit] += (records[i].flags >> bit) & 1;
+        }
+        errors += records[i].status == 0 || records[i].status >= 500;
+    }
+    if (traces > 1) {
+        printf("processes  %zu, each handed the listening sockets over to the next\n", traces);
+    }
+    printf("requests   %zu, cached %zu, reused upstream %zu, tunnels %zu, compressed %zu, "
+           "status >= 500 or none %zu\n", num, flagged[0], flagged[1], flagged[2], flagged[3], errors);
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "phase (ms)", "count", "p50", "p90", "p99", "p999", "max");
+    for (size_t s = 0; s < NUM_SEGMENTS; ++s) {
+        size_t n = 0;
+        for (size_t i = 0; i < num; ++i) {
+            uint32_t from = phase_at(&records[i], segments[s].from);
+            uint32_t to = phase_at(&records[i], segments[s].to);
+            if (from != TRACE_NONE && to != TRACE_NONE && to >= from) {
+                samples[n++] = to - from;
+            }
+        }
+        qsort(samples, n, sizeof(uint32_t), compare_samples);
+        printf("%-10s %10zu %10.3f %10.3f %10.3f %10.3f %10.3f\n", segments[s].name, n,
+               percentile_ms(samples, n, 0.5), percentile_ms(samples, n, 0.9), percentile_ms(samples, n, 0.99),
+               percentile_ms(samples, n, 0.999), n > 0 ? samples[n - 1] / 1000.0 : 0);
+    }
+    free(samples);
+    free(records);
+    return 0;
+}
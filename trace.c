@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "trace.h"
+#include "mempool.h"
+
+#define TRACE_BATCH 1024            //records written at once
+
+void trace_push(trace_ring *ring, const trace_record *record) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_LEN) {
+        counter_add(&ring->dropped, 1);
+        return;
+    }
+    ring->records[head & (TRACE_RING_LEN - 1)] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t wrote = write(fd, p, len);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+// move what the rings hold to the file
+static void drain(tracer *t, trace_record *batch) {
+    for (int i = 0; i < t->num_rings; ++i) {
+        trace_ring *ring = &t->rings[i];
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            size_t n = 0;
+            for (; tail != head && n < TRACE_BATCH; ++tail, ++n) {
+                batch[n] = ring->records[tail & (TRACE_RING_LEN - 1)];
+            }
+            // the slots are free again once copied, the file write does not hold the reactor back
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            if (write_all(t->fd, batch, n * sizeof(trace_record)) == -1) {
+                perror("write trace");
+            }
+        }
+    }
+}
+
+static void* run_tracer(void *arg) {
+    tracer *t = (tracer *) arg;
+    trace_record *batch = (trace_record *) malloc(TRACE_BATCH * sizeof(trace_record));
+    if (batch == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    struct timespec pause = {0, TRACE_FLUSH_MS * 1000000L};
+    while (!atomic_load(&t->stop)) {
+        drain(t, batch);
+        nanosleep(&pause, NULL);
+    }
+    drain(t, batch);
+    free(batch);
+    return NULL;
+}
+
+tracer* start_tracer(const char *path, int num_rings, int append) {
+    tracer *t = (tracer *) mem_calloc(1, sizeof(tracer));
+    if (t == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    t->num_rings = num_rings;
+    if ((t->rings = (trace_ring *) aligned_alloc(64, sizeof(trace_ring) * num_rings)) == NULL) {
+        perror("aligned_alloc");
+        free(t);
+        return NULL;
+    }
+    memset(t->rings, 0, sizeof(trace_ring) * num_rings);
+    // every write appends, those of a predecessor still draining included
+    if ((t->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (append ? 0 : O_TRUNC) | O_CLOEXEC, 0644)) == -1) {
+        perror(path);
+        free(t->rings);
+        free(t);
+        return NULL;
+    }
+    trace_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    header.wall_us = (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+    header.monotonic_us = monotonic_us();
+    atomic_init(&t->stop, 0);
+    if (write_all(t->fd, &header, sizeof(header)) == -1 ||
+        pthread_create(&t->thread, NULL, run_tracer, t) != 0) {
+        perror("trace");
+        close(t->fd);
+        free(t->rings);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void stop_tracer(tracer *t) {
+    atomic_store(&t->stop, 1);
+    pthread_join(t->thread, NULL);
+    close(t->fd);
+    free(t->rings);
+    free(t);
+}
@@ -0,0 +1,106 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "metrics.h"
+
+/**
+ * trace.h
+ *
+ * Per-request phase timings, written to a binary trace file for offline
+ * analysis (tools/trace_decode.c).
+ *
+ * a request fills a fixed-size record as it goes through its phases: the
+ * microseconds from its start to each of them. its start is the accept of
+ * the connection for the first request, the end of the previous request
+ * for the next ones. once the request ends the record is copied into the
+ * ring of its reactor: one producer, one consumer, two atomic indexes and
+ * no lock, a full ring drops the record and counts it rather than make the
+ * reactor wait. a writer thread drains the rings every TRACE_FLUSH_MS and
+ * appends the records to the file with one write per batch.
+ *
+ * the file is a trace_file_header then the records, in the byte order of
+ * the machine that wrote it. a process that took the listening sockets
+ * over from another one appends its own header and records to the file of
+ * its predecessor, the batches of the two may alternate while it drains.
+ */
+
+#define TRACE_RING_LEN 8192         //records per reactor, a power of two
+#define TRACE_FLUSH_MS 100
+#define TRACE_MAGIC "PXTRACE"
+#define TRACE_VERSION 1
+#define TRACE_NONE UINT32_MAX       //a phase the request did not go through
+
+typedef enum trace_phase {
+    TRACE_HEAD,                 //request head read
+    TRACE_LOOKUP,               //not answered from the cache, name lookup started
+    TRACE_DNS,                  //name resolved
+    TRACE_DEQUEUE,              //filter job taken by a pool thread
+    TRACE_FILTER,               //filter answered
+    TRACE_CONNECT,              //upstream connected, or taken from the pool
+    TRACE_FIRST_BYTE,           //first byte of the response read from the upstream
+    TRACE_END,                  //response sent, tunnel opened or connection closed
+    TRACE_PHASES
+} trace_phase;
+
+// trace_record flags
+#define TRACE_CACHED 1              //answered from the cache or from the fetch of another request
+#define TRACE_REUSED 2              //on a pooled upstream connection
+#define TRACE_TUNNEL 4              //a CONNECT tunnel
+#define TRACE_COMPRESSED 8          //compressed by the proxy
+
+typedef struct trace_record {
+    uint64_t start_us;          //CLOCK_MONOTONIC
+    uint32_t at[TRACE_PHASES];  //µs from start to each phase, TRACE_NONE if it was not reached
+    uint32_t client;            //IPv4 address, network order
+    uint32_t bytes;             //sent to the client, saturated
+    uint16_t status;            //0 if no response was sent
+    uint8_t reactor;
+    uint8_t flags;
+} trace_record;
+
+typedef struct trace_file_header {
+    char magic[8];              //TRACE_MAGIC
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t wall_us;           //the time of day when the trace started
+    uint64_t monotonic_us;      //CLOCK_MONOTONIC then, to date the records
+} trace_file_header;
+
+typedef struct trace_ring {
+    _Alignas(64) _Atomic uint64_t head;     //records pushed, written by the reactor
+    _Alignas(64) _Atomic uint64_t tail;     //records taken, written by the writer thread
+    counter dropped;                        //records lost to a full ring
+    trace_record records[TRACE_RING_LEN];
+} trace_ring;
+
+typedef struct tracer {
+    int fd;
+    int num_rings;
+    trace_ring *rings;
+    pthread_t thread;
+    atomic_int stop;
+} tracer;
+
+/**
+ * start_tracer creates the trace file at path, or appends to it if append
+ * is 1, a ring for each of num_rings reactors and the writer thread.
+ * returns NULL on failure.
+ */
+tracer* start_tracer(const char *path, int num_rings, int append);
+
+/**
+ * trace_push copies a finished record into ring. only the reactor that
+ * owns the ring calls it.
+ */
+void trace_push(trace_ring *ring, const trace_record *record);
+
+/**
+ * stop_tracer writes what the rings still hold, stops the writer and
+ * closes the file. the reactors must have stopped.
+ */
+void stop_tracer(tracer *t);
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "upstream_pool.h"
+#include "mempool.h"
+#include "util.h"
+
+static void make_key(char *key, const char *host, in_port_t port) {
+    size_t i = 0;
+    for (; host[i] != '\0' && i < POOL_KEY_LEN - 7; ++i) {
+        key[i] = (char) tolower((unsigned char) host[i]);
+    }
+    snprintf(key + i, POOL_KEY_LEN - i, ":%u", (unsigned int) port);
+}
+
+static pool_host* find_host(upstream_pool *pool, const char *key, int create) {
+    pool_host **link = &pool->buckets[fnv1a32_str(key) % POOL_BUCKETS];
+    for (pool_host *h = *link; h != NULL; h = h->next) {
+        if (strcmp(h->key, key) == 0) {
+            return h;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    pool_host *h = pool->spare_hosts;
+    if (h != NULL) {
+        pool->spare_hosts = h->next;
+        pool->num_spare_hosts--;
+        memset(h, 0, sizeof(pool_host));
+    } else if ((h = (pool_host *) mem_calloc(1, sizeof(pool_host))) == NULL) {
+        return NULL;
+    }
+    strcpy(h->key, key);
+    h->next = *link;
+    *link = h;
+    return h;
+}
+
+static void free_host(upstream_pool *pool, pool_host *host) {
+    pool_host **link = &pool->buckets[fnv1a32_str(host->key) % POOL_BUCKETS];
+    while (*link != host) {
+        link = &(*link)->next;
+    }
+    *link = host->next;
+    // a host whose last connection was taken usually parks one again right after the response
+    if (pool->num_spare_hosts < pool->max_idle) {
+        host->next = pool->spare_hosts;
+        pool->spare_hosts = host;
+        pool->num_spare_hosts++;
+        return;
+    }
+    free(host);
+}
+
+static idle_upstream* new_idle(upstream_pool *pool) {
+    idle_upstream *idle = pool->spare;
+    if (idle == NULL) {
+        return (idle_upstream *) mem_calloc(1, sizeof(idle_upstream));
+    }
+    pool->spare = idle->lru_next;
+    pool->num_spare--;
+    memset(idle, 0, sizeof(idle_upstream));
+    return idle;
+}
+
+static void free_idle(upstream_pool *pool, idle_upstream *idle) {
+    if (idle == NULL) {
+        return;
+    }
+    if (pool->num_spare < pool->max_idle) {
+        idle->lru_next = pool->spare;
+        pool->spare = idle;
+        pool->num_spare++;
+        return;
+    }
+    free(idle);
+}
+
+// unlink the entry from both lists, the fd is left alone
+static void detach(upstream_pool *pool, idle_upstream *idle) {
+    pool_host *host = idle->host;
+    if (idle->host_prev != NULL) {
+        idle->host_prev->host_next = idle->host_next;
+    } else {
+        host->head = idle->host_next;
+    }
+    if (idle->host_next != NULL) {
+        idle->host_next->host_prev = idle->host_prev;
+    }
+    if (--host->count == 0) {
+        free_host(pool, host);
+    }
+    if (idle->lru_prev != NULL) {
+        idle->lru_prev->lru_next = idle->lru_next;
+    } else {
+        pool->lru_head = idle->lru_next;
+    }
+    if (idle->lru_next != NULL) {
+        idle->lru_next->lru_prev = idle->lru_prev;
+    } else {
+        pool->lru_tail = idle->lru_prev;
+    }
+    pool->count--;
+    // the memory goes away after the batch, a pending event finds fd == -1 and is ignored
+    idle->ep.fd = -1;
+    idle->lru_next = pool->dead_head;
+    pool->dead_head = idle;
+}
+
+// closing the fd also takes it out of the epoll set
+static void discard(upstream_pool *pool, idle_upstream *idle) {
+    int fd = idle->ep.fd;
+    detach(pool, idle);
+    close(fd);
+}
+
+upstream_pool* create_upstream_pool(int epoll_fd, int max_idle, int max_idle_per_host, int idle_timeout_ms) {
+    upstream_pool *pool = (upstream_pool *) calloc(1, sizeof(upstream_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->epoll_fd = epoll_fd;
+    pool->max_idle = max_idle;
+    pool->max_idle_per_host = max_idle_per_host;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    return pool;
+}
+
+int upstream_pool_take(upstream_pool *pool, const char *host, in_port_t port) {
+    char key[POOL_KEY_LEN];
+    make_key(key, host, port);
+    pool_host *h = find_host(pool, key, 0);
+    if (h == NULL) {
+        return -1;
+    }
+    idle_upstream *idle = h->head;
+    int fd = idle->ep.fd;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    detach(pool, idle);
+    return fd;
+}
+
+void upstream_pool_put(upstream_pool *pool, const char *host, in_port_t port, int fd) {
+    if (pool->max_idle <= 0 || pool->max_idle_per_host <= 0) {
+        close(fd);
+        return;
+    }
+    char key[POOL_KEY_LEN];
+    make_key(key, host, port);
+    pool_host *h = find_host(pool, key, 1);
+    idle_upstream *idle = new_idle(pool);
+    if (h == NULL || idle == NULL) {
+        if (h != NULL && h->count == 0) {
+            free_host(pool, h);
+        }
+        free_idle(pool, idle);
+        close(fd);
+        return;
+    }
+    // make room: the oldest connection of the host, else the oldest of the pool
+    if (h->count >= pool->max_idle_per_host) {
+        idle_upstream *oldest = h->head;
+        while (oldest->host_next != NULL) {
+            oldest = oldest->host_next;
+        }
+        discard(pool, oldest);
+    } else if (pool->count >= pool->max_idle) {
+        discard(pool, pool->lru_tail);
+    }
+    // discarding the last connection of the host freed it
+    if ((h = find_host(pool, key, 1)) == NULL) {
+        free_idle(pool, idle);
+        close(fd);
+        return;
+    }
+
+    idle->ep.fd = fd;
+    idle->ep.kind = EP_IDLE;
+    idle->ep.events = EPOLLIN | EPOLLRDHUP;
+    idle->idle_since_ms = now_ms();
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = idle->ep.events;
+    ev.data.ptr = &idle->ep;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        if (h->count == 0) {
+            free_host(pool, h);
+        }
+        free_idle(pool, idle);
+        close(fd);
+        return;
+    }
+
+    idle->host = h;
+    idle->host_next = h->head;
+    if (h->head != NULL) {
+        h->head->host_prev = idle;
+    }
+    h->head = idle;
+    h->count++;
+    idle->lru_next = pool->lru_head;
+    if (pool->lru_head != NULL) {
+        pool->lru_head->lru_prev = idle;
+    } else {
+        pool->lru_tail = idle;
+    }
+    pool->lru_head = idle;
+    pool->count++;
+}
+
+void upstream_pool_on_event(upstream_pool *pool, endpoint *ep) {
+    if (ep->fd == -1) { // taken or closed earlier in the same batch
+        return;
+    }
+    // data or a hang up on an idle connection, either way it cannot carry a request anymore
+    discard(pool, (idle_upstream *) ep);
+}
+
+int upstream_pool_expire(upstream_pool *pool) {
+    int64_t now = now_ms();
+    while (pool->lru_tail != NULL) {
+        int64_t expires = pool->lru_tail->idle_since_ms + pool->idle_timeout_ms;
+        if (expires > now) {
+            return (int) (expires - now);
+        }
+        discard(pool, pool->lru_tail);
+    }
+    return -1;
+}
+
+void upstream_pool_free_dead(upstream_pool *pool) {
+    while (pool->dead_head != NULL) {
+        idle_upstream *idle = pool->dead_head;
+        pool->dead_head = idle->lru_next;
+        free_idle(pool, idle);
+    }
+}
+
+void destroy_upstream_pool(upstream_pool *pool) {
+    while (pool->lru_head != NULL) {
+        discard(pool, pool->lru_head);
+    }
+    upstream_pool_free_dead(pool);
+    while (pool->spare != NULL) {
+        idle_upstream *next = pool->spare->lru_next;
+        free(pool->spare);
+        pool->spare = next;
+    }
+    while (pool->spare_hosts != NULL) {
+        pool_host *next = pool->spare_hosts->next;
+        free(pool->spare_hosts);
+        pool->spare_hosts = next;
+    }
+    free(pool);
+}
@@ -0,0 +1,103 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "endpoint.h"
+
+/**
+ * upstream_pool.h
+ *
+ * Idle upstream connections kept open for the next request to the same
+ * host and port.
+ *
+ * each reactor owns one pool and is the only thread touching it, so there
+ * is no locking. idle connections stay registered in the reactor's epoll
+ * set: the server is not supposed to send anything on them, so any event
+ * means it closed the connection (or misbehaves) and it is dropped.
+ *
+ * the entries and hosts that leave the pool are kept for the next put, so
+ * parking and taking connections does not reach the allocator.
+ */
+
+#define POOL_KEY_LEN 264
+
+typedef struct idle_upstream {
+    endpoint ep;                    //first member, the event loop hands back a pointer to it
+    int64_t idle_since_ms;
+    struct pool_host *host;
+    struct idle_upstream *host_prev;    //connections of the same host, most recently parked first
+    struct idle_upstream *host_next;
+    struct idle_upstream *lru_prev;     //every idle connection, most recently parked first
+    struct idle_upstream *lru_next;
+} idle_upstream;
+
+typedef struct pool_host {
+    char key[POOL_KEY_LEN];         //"host:port", host lower cased
+    idle_upstream *head;
+    int count;
+    struct pool_host *next;         //bucket chain
+} pool_host;
+
+#define POOL_BUCKETS 256
+
+typedef struct upstream_pool {
+    int epoll_fd;
+    int max_idle;                   //idle connections in the whole pool
+    int max_idle_per_host;
+    int idle_timeout_ms;
+
+    pool_host *buckets[POOL_BUCKETS];
+    idle_upstream *lru_head;
+    idle_upstream *lru_tail;        //the next one to expire or be evicted
+    int count;
+    idle_upstream *dead_head;       //closed entries, freed after the current epoll batch (chained by lru_next)
+    idle_upstream *spare;           //entries ready for reuse, chained by lru_next
+    int num_spare;
+    pool_host *spare_hosts;         //hosts ready for reuse, chained by next
+    int num_spare_hosts;
+} upstream_pool;
+
+/**
+ * create_upstream_pool returns an empty pool whose idle connections are
+ * watched in epoll_fd, NULL on failure. a max_idle of 0 disables pooling.
+ */
+upstream_pool* create_upstream_pool(int epoll_fd, int max_idle, int max_idle_per_host, int idle_timeout_ms);
+
+/**
+ * upstream_pool_take returns the most recently parked connection to
+ * host:port, already removed from the epoll set, or -1 if there is none.
+ */
+int upstream_pool_take(upstream_pool *pool, const char *host, in_port_t port);
+
+/**
+ * upstream_pool_put parks fd, which must not be registered in epoll.
+ * the pool owns the fd from now on: when a limit is reached the oldest
+ * connection of the host (or of the pool) is closed to make room.
+ */
+void upstream_pool_put(upstream_pool *pool, const char *host, in_port_t port, int fd);
+
+/**
+ * upstream_pool_on_event handles an event on an idle connection.
+ */
+void upstream_pool_on_event(upstream_pool *pool, endpoint *ep);
+
+/**
+ * upstream_pool_expire closes the connections idle for longer than the
+ * timeout and returns the milliseconds until the next one expires, -1 if
+ * the pool is empty. meant as the timeout of epoll_wait.
+ */
+int upstream_pool_expire(upstream_pool *pool);
+
+/**
+ * upstream_pool_free_dead releases the entries closed during the current
+ * epoll batch, later events of the batch may still point at them.
+ */
+void upstream_pool_free_dead(upstream_pool *pool);
+
+/**
+ * destroy_upstream_pool closes every idle connection and frees the pool.
+ */
+void destroy_upstream_pool(upstream_pool *pool);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * util.h
+ *
+ * The clocks and the hash the modules share.
+ *
+ * the clocks are monotonic: timeouts, ages kept in memory and latencies.
+ * what has to make sense after a restart reads the wall clock itself.
+ *
+ * the hash is FNV-1a, of the hash tables and of the checksums of the disk
+ * cache. a 32-bit hash starts from FNV1A_INIT and takes the bytes one at a
+ * time or a run of them, the 64-bit one from FNV1A64_INIT, for the tables
+ * that keep only the hash of their keys.
+ */
+
+static inline uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static inline int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define FNV1A_INIT 2166136261u
+#define FNV1A64_INIT 14695981039346656037ull
+
+static inline uint32_t fnv1a32_byte(uint32_t h, unsigned char byte) {
+    return (h ^ byte) * 16777619u;
+}
+
+static inline uint32_t fnv1a32(uint32_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < len; ++i) {
+        h = fnv1a32_byte(h, p[i]);
+    }
+    return h;
+}
+
+static inline uint32_t fnv1a32_str(const char *s) {
+    uint32_t h = FNV1A_INIT;
+    for (; *s != '\0'; ++s) {
+        h = fnv1a32_byte(h, (unsigned char) *s);
+    }
+    return h;
+}
+
+static inline uint64_t fnv1a64_byte(uint64_t h, unsigned char byte) {
+    return (h ^ byte) * 1099511628211ull;
+}
+
+#endif